@@ -169,6 +169,9 @@ class MacroBenchmark:
               .format(filesys_name, iteration_cnt, block_size, latency))
         print('throughput: {}'
               .format(get_throughput(latency, block_size, Unit.MB)))
+        file_cnt = self._count_tar_members(mount_point, read_file_name)
+        print('files created per second: {}'
+              .format(round(file_cnt / (latency / 1000), ndigits=3)))
         print('=' * 60)
 
 
@@ -294,6 +297,15 @@ class MacroBenchmark:
         return latencies / iteration_cnt
 
 
+    def _count_tar_members(self, mount_point, filename):
+        """
+        Number of files and directories untarring filename creates
+        """
+        filepath = '{}/{}'.format(mount_point, filename)
+        with tarfile.open(filepath) as tar:
+            return len(tar.getmembers())
+
+
     def _clean(self):
         for filepath in self.file_path_created:
             if os.path.isfile(filepath):
@@ -29,6 +29,9 @@
 
 #include "capfs.h"
 
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include <sysexits.h>
 
@@ -43,16 +46,169 @@
 
 #include "capfs_file.h"
 #include "capfs_dir.h"
+#include "capfs_cache.h"
+#include "capfs_client.h"
+#include "capfs_ll.h"
+#include "capfs_raft.h"
+#include "capfs_server.h"
+#include "capfs_shard.h"
+#include "capfs_store.h"
 #include "capfs_util.h"
 
+static const struct fuse_opt capfs_opts[] = {
+    { "lowlevel", offsetof(capfs_options_t, lowlevel), 1 },
+    { "writeback", offsetof(capfs_options_t, writeback), 1 },
+    { "watch", offsetof(capfs_options_t, watch), 1 },
+    { "store=%s", offsetof(capfs_options_t, store), 0 },
+    { "store_path=%s", offsetof(capfs_options_t, store_path), 0 },
+    { "shape=%s", offsetof(capfs_options_t, shape), 0 },
+    { "shape_seed=%lu", offsetof(capfs_options_t, shape_seed), 0 },
+    { "server=%s", offsetof(capfs_options_t, server), 0 },
+    { "replicas=%s", offsetof(capfs_options_t, replicas), 0 },
+    { "raft_state=%s", offsetof(capfs_options_t, raft_state), 0 },
+    { "shards=%s", offsetof(capfs_options_t, shards), 0 },
+    { "shard_state=%s", offsetof(capfs_options_t, shard_state), 0 },
+    { "lease", offsetof(capfs_options_t, lease), 1 },
+    { "cache=%s", offsetof(capfs_options_t, cache), 0 },
+    { "cache_size=%lu", offsetof(capfs_options_t, cache_size), 0 },
+    FUSE_OPT_END
+};
+
+static capfs_options_t capfs_options = {
+    .shape_seed = 1,
+    .cache_size = CACHE_SIZE_DEFAULT,
+};
+
+// Refreshes the size and mtime hints in the parent directory entry
+static EP_STAT
+capfs_update_hints(const char *path, size_t length, time_t mtime) {
+    EP_STAT estat;
+
+    const char *name = path_basename(path);
+
+    capfs_dir_t *dir;
+    estat = capfs_dir_opendir_path(path, &dir);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    estat = capfs_dir_set_attr(dir, name, length, mtime, 0);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    capfs_dir_closedir(dir);
+    attr_cache_invalidate(path);
+    return EP_STAT_OK;
+
+fail1:
+    capfs_dir_closedir(dir);
+fail0:
+    return estat;
+}
+
+// Drops a reference on a file handle, closing it if it was the last one
+static void
+capfs_fh_put(fh_entry_t *fh, const char *path) {
+    // Only close and free if unreferenced
+    if (fh_unref(fh) > 0) {
+        return;
+    }
+    // Written to, so the hints readdir hands out are stale. Flushed first so
+    //   the mtime is that of the last append
+    size_t length;
+    if (fh->modified && path != NULL
+        && EP_STAT_ISOK(capfs_file_flush(fh->file))
+        && EP_STAT_ISOK(capfs_file_get_length(fh->file, &length))) {
+        capfs_update_hints(path, length, fh->file->mtime.tv_sec);
+    }
+    // Out of the table first, a gob scan may still be looking at it
+    capfs_file_t *file = fh->file;
+    fh_free(fh->fh);
+    capfs_file_close(file);
+    capfs_file_free(file);
+}
+
+// Same for a directory handle
+static void
+capfs_fh_put_dir(fh_entry_t *fh) {
+    // Only close and free if unreferenced
+    if (fh_unref(fh) > 0) {
+        return;
+    }
+    capfs_dir_t *dir = fh->dir;
+    fh_free(fh->fh);
+    capfs_dir_closedir(dir);
+    capfs_dir_free(dir);
+}
+
 static int
 capfs_access(const char *path, int mode) {
     return 0;
 }
 
+// Stores new permission bits and/or mtime in the inode of a file and in the
+//   hints of its parent entry. Directories only have the hints. mode is -1 to
+//   leave it alone
 static int
-capfs_chmod(const char *filepath, mode_t mode) {
+capfs_set_attr(const char *path, mode_t mode, const struct timespec *mtime) {
+    // Root has no entry to keep them in
+    if (strcmp(path, "/") == 0) {
+        return 0;
+    }
+    EP_STAT estat;
+
+    const char *name = path_basename(path);
+
+    // Open directory
+    capfs_dir_t *dir;
+    estat = capfs_dir_opendir_path(path, &dir);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    capfs_dir_entry_t entry;
+    estat = capfs_dir_lookup(dir, name, &entry);
+    EP_STAT_CHECK(estat, goto fail1);
+    size_t size = entry.size;
+    time_t mtime_hint = mtime != NULL ? mtime->tv_sec : entry.mtime;
+    if (mode != (mode_t) -1) {
+        mode |= entry.is_dir ? S_IFDIR : S_IFREG;
+    } else {
+        mode = 0;
+    }
+
+    // Through an open handle if there is one, it may hold gathered writes
+    if (!entry.is_dir) {
+        fh_entry_t *fh;
+        capfs_file_t *file;
+        if (EP_STAT_ISOK(fh_ref_by_gob(entry.gob, &fh))) {
+            estat = capfs_file_set_attr(fh->file, mode, mtime);
+            size = fh->file->length;
+            capfs_fh_put(fh, NULL);
+        } else {
+            file = capfs_file_new(entry.gob);
+            estat = capfs_file_set_attr(file, mode, mtime);
+            size = file->length;
+            capfs_file_close(file);
+            capfs_file_free(file);
+        }
+        EP_STAT_CHECK(estat, goto fail2);
+    }
+    estat = capfs_dir_set_attr(dir, name, size, mtime_hint, mode);
+    EP_STAT_CHECK(estat, goto fail2);
+    attr_cache_invalidate(path);
+
+    // Cleanup
+    capfs_dir_closedir(dir);
     return 0;
+
+fail2:
+    capfs_dir_closedir(dir);
+    return -EIO;
+fail1:
+    capfs_dir_closedir(dir);
+fail0:
+    return -ENOENT;
+}
+
+static int
+capfs_chmod(const char *filepath, mode_t mode) {
+    return capfs_set_attr(filepath, mode & 07777, NULL);
 }
 
 static int
@@ -62,8 +218,6 @@ capfs_chown(const char *filepath, uid_t uid, gid_t gid) {
 
 static int
 capfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    (void) mode;
-
     // Error handling
     if (strlen(path) == 0) {
         return -ENOENT;
@@ -73,13 +227,11 @@ capfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     }
     EP_STAT estat;
 
-    char **path_tokens;
-    size_t num_tokens = split_path(path, &path_tokens);
-    char *file_name = path_tokens[num_tokens - 1];
+    const char *file_name = path_basename(path);
 
     // Open directory
     capfs_dir_t *dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &dir);
+    estat = capfs_dir_opendir_path(path, &dir);
     EP_STAT_CHECK(estat, goto fail0);
 
     // Check file does not exist
@@ -87,114 +239,232 @@ capfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
         goto fail1;
     }
 
+    // Create the file in the directory
+    capfs_file_t *file;
+    estat = capfs_dir_make_file(dir, file_name,
+                                S_IFREG | (mode & 07777), &file);
+    EP_STAT_CHECK(estat, goto fail1);
+
     // Get a new file handler
     fh_entry_t *fh;
-    estat = fh_new(&fh);
+    estat = fh_new(file->gob, &fh);
     EP_STAT_CHECK(estat, goto fail2);
     fi->fh = fh->fh;
 
-    // Create the file in the directory
-    capfs_file_t *file;
-    estat = capfs_dir_make_file(dir, file_name, &file);
-    EP_STAT_CHECK(estat, goto fail2);
     // Store data in file handler
     fh->is_dir = false;
     fh->file = file;
-    fh->ref++;
+    fh_ref(fh);
 
     // Cleanup
     capfs_dir_closedir(dir);
-    free_tokens(path_tokens);
     return 0;
 
 fail2:
-    fh_free(fh->fh);
+    capfs_file_close(file);
+    capfs_file_free(file);
 fail1:
     capfs_dir_closedir(dir);
 fail0:
-    free_tokens(path_tokens);
     return -ENOENT;
 }
 
+static void
+capfs_destroy(void *private_data) {
+    (void) private_data;
+
+    // Write back any batched directory mutations and drop unused pooled logs
+    //   before unmounting
+    capfs_dir_flush_stop();
+    capfs_dir_flush_all();
+    capfs_file_pool_drain();
+}
+
+// Called on every close() of a descriptor, so gathered writes fail there
 static int
-capfs_getattr(const char *path, struct stat *st) {
+capfs_flush(const char *path, struct fuse_file_info *fi) {
+    (void) path;
     EP_STAT estat;
-    memset(st, 0, sizeof(struct stat));
 
-    st->st_uid = getuid();
-    st->st_gid = getgid();
-    st->st_atime = time(NULL);
-    st->st_mtime = time(NULL);
+    fh_entry_t *fh;
+    estat = fh_get(fi->fh, &fh);
+    EP_STAT_CHECK(estat, goto fail0);
 
-    capfs_file_t *file;
+    // Sanity checks
+    if (!fh->valid || fh->is_dir) {
+        goto fail0;
+    }
 
-    char **path_tokens;
-    size_t num_tokens = split_path(path, &path_tokens);
-    char *name = path_tokens[num_tokens - 1];
+    estat = capfs_file_flush(fh->file);
+    EP_STAT_CHECK(estat, goto fail1);
+    return 0;
 
-    // Open directory
-    capfs_dir_t *dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &dir);
+fail1:
+    return -EIO;
+fail0:
+    return -ENOENT;
+}
+
+static int
+capfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    EP_STAT estat;
+
+    fh_entry_t *fh;
+    estat = fh_get(fi->fh, &fh);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Check if it's a directory first
-    capfs_dir_t *child;
-    estat = capfs_dir_opendir(dir, name, &child);
-    EP_STAT_CHECK(estat, goto not_dir);
+    // Sanity checks
+    if (!fh->valid || fh->is_dir) {
+        goto fail0;
+    }
 
-    // Valid directory
-    st->st_mode = S_IFDIR | 0755;
-    st->st_nlink = 2;
+    estat = capfs_file_flush(fh->file);
+    EP_STAT_CHECK(estat, goto fail1);
 
-    // Cleanup
-    capfs_dir_closedir(child);
-    capfs_dir_closedir(dir);
-    free_tokens(path_tokens);
+    // Size and mtime hints are metadata, only fsync proper waits for them
+    size_t length;
+    if (!datasync && fh->modified) {
+        estat = capfs_file_get_length(fh->file, &length);
+        EP_STAT_CHECK(estat, goto fail1);
+        estat = capfs_update_hints(path, length, fh->file->mtime.tv_sec);
+        EP_STAT_CHECK(estat, goto fail1);
+    }
     return 0;
 
-not_dir:
-    // Check if it's a file
-    estat = capfs_dir_open_file(dir, name, &file);
+fail1:
+    return -EIO;
+fail0:
+    return -ENOENT;
+}
+
+static int
+capfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) path;
+    (void) datasync;
+    EP_STAT estat;
+
+    fh_entry_t *fh;
+    estat = fh_get(fi->fh, &fh);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // Sanity checks
+    if (!fh->valid || !fh->is_dir) {
+        goto fail0;
+    }
+
+    estat = capfs_dir_flush(fh->dir);
     EP_STAT_CHECK(estat, goto fail1);
+    return 0;
 
-    // Valid file
-    st->st_mode = S_IFREG | 0777;
-    st->st_nlink = 1;
-    estat = capfs_file_get_length(file, (size_t *) &(st->st_size));
-    EP_STAT_CHECK(estat, goto fail2);
+fail1:
+    return -EIO;
+fail0:
+    return -ENOENT;
+}
+
+static int
+capfs_ftruncate(const char *path, off_t file_size, struct fuse_file_info *fi) {
+    EP_STAT estat;
+
+    fh_entry_t *fh;
+    estat = fh_get(fi->fh, &fh);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // Sanity checks
+    if (!fh->valid || fh->is_dir) {
+        goto fail0;
+    }
+
+    estat = capfs_file_truncate(fh->file, file_size);
+    EP_STAT_CHECK(estat, goto fail1);
+    fh->modified = true;
+    attr_cache_invalidate(path);
+    return 0;
+
+fail1:
+    return -EIO;
+fail0:
+    return -ENOENT;
+}
+
+static int
+capfs_getattr(const char *path, struct stat *st) {
+    EP_STAT estat;
+
+    // Usually filled in by a readdir just before
+    if (attr_cache_get(path, st)) {
+        return 0;
+    }
+
+    // Root has no entry of its own
+    if (strcmp(path, "/") == 0) {
+        memset(st, 0, sizeof(struct stat));
+        st->st_ino = 1;
+        st->st_uid = getuid();
+        st->st_gid = getgid();
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 1;
+        return 0;
+    }
+
+    const char *name = path_basename(path);
+
+    // Open directory
+    capfs_dir_t *dir;
+    estat = capfs_dir_opendir_path(path, &dir);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // One lookup gives the type and the attribute hints, the child itself is
+    //   never opened
+    capfs_dir_entry_t entry;
+    estat = capfs_dir_lookup(dir, name, &entry);
+    EP_STAT_CHECK(estat, goto fail1);
+    capfs_entry_stat(&entry, st);
+
+    // The size hint lags behind until release, but an open handle that was
+    //   written to knows the current length. The reference keeps a concurrent
+    //   release from closing it underneath us
+    fh_entry_t *fh;
+    if (!entry.is_dir && EP_STAT_ISOK(fh_ref_by_gob(entry.gob, &fh))) {
+        if (fh->modified) {
+            st->st_size = fh->file->length;
+            st->st_blocks = (st->st_size + 511) / 512;
+            st->st_mtim = fh->file->mtime;
+            st->st_ctim = fh->file->ctime;
+        }
+        capfs_fh_put(fh, path);
+    }
+    attr_cache_put(path, st);
 
     // Cleanup
-    capfs_file_close(file);
     capfs_dir_closedir(dir);
-    free_tokens(path_tokens);
     return 0;
 
-fail2:
-    capfs_file_close(file);
 fail1:
     capfs_dir_closedir(dir);
 fail0:
-    free_tokens(path_tokens);
     return -ENOENT;
 }
 
+static void *
+capfs_init(struct fuse_conn_info *conn) {
+    capfs_conn_init(conn, &capfs_options);
+    return NULL;
+}
+
 static int
 capfs_mkdir(const char *path, mode_t mode) {
-    (void) mode;
-
     // Error handling
     if (strlen(path) == 0) {
         return -ENOENT;
     }
     EP_STAT estat;
 
-    char **path_tokens;
-    size_t num_tokens = split_path(path, &path_tokens);
-    char *dir_name = path_tokens[num_tokens - 1];
+    const char *dir_name = path_basename(path);
 
     // Open directory
     capfs_dir_t *dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &dir);
+    estat = capfs_dir_opendir_path(path, &dir);
     EP_STAT_CHECK(estat, goto fail0);
 
     // Child does not exist
@@ -204,19 +474,18 @@ capfs_mkdir(const char *path, mode_t mode) {
 
     // Create the child in the directory
     capfs_dir_t *child;
-    estat = capfs_dir_mkdir(dir, dir_name, &child);
+    estat = capfs_dir_mkdir(dir, dir_name, S_IFDIR | (mode & 07777),
+                            &child);
     EP_STAT_CHECK(estat, goto fail1);
 
     // Cleanup
     capfs_dir_closedir(child);
     capfs_dir_closedir(dir);
-    free_tokens(path_tokens);
     return 0;
 
 fail1:
     capfs_dir_closedir(dir);
 fail0:
-    free_tokens(path_tokens);
     return -ENOENT;
 }
 
@@ -231,47 +500,55 @@ capfs_open(const char *path, struct fuse_file_info *fi) {
     }
     EP_STAT estat;
 
-    char **path_tokens;
-    size_t num_tokens = split_path(path, &path_tokens);
-    char *file_name = path_tokens[num_tokens - 1];
+    const char *file_name = path_basename(path);
 
     // Open directory
     capfs_dir_t *dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &dir);
+    estat = capfs_dir_opendir_path(path, &dir);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Open file
-    capfs_file_t *file;
-    estat = capfs_dir_open_file(dir, file_name, &file);
+    // The entry has the gob, the log itself is opened on first access
+    capfs_dir_entry_t entry;
+    estat = capfs_dir_lookup(dir, file_name, &entry);
     EP_STAT_CHECK(estat, goto fail1);
+    if (entry.is_dir) {
+        goto fail2;
+    }
 
     fh_entry_t *fh;
-    estat = fh_get_by_gob(file->gob, &fh);
-    // File already exists
-    if (EP_STAT_ISOK(estat)) {
-        fh->ref++;
-        capfs_file_close(file);
-    } else {    // doesn't exist
+    estat = fh_ref_by_gob(entry.gob, &fh);
+    // Handle already exists
+    if (!EP_STAT_ISOK(estat)) {
         // Get a new file handler
-        estat = fh_new(&fh);
+        estat = fh_new(entry.gob, &fh);
         EP_STAT_CHECK(estat, goto fail1);
-        fi->fh = fh->fh;
 
         // Store data in file handler
         fh->is_dir = false;
-        fh->file = file;
-        fh->ref++;
+        fh->file = capfs_file_new(entry.gob);
+        fh_ref(fh);
     }
+    fi->fh = fh->fh;
+
+    // Close-to-open: the kernel keeps the pages it read as long as nobody
+    //   appended since. Nothing cached yet means nothing to check, and the
+    //   log stays unopened
+    unsigned int cached;
+    size_t length;
+    fi->keep_cache = page_recno_get(entry.gob, &cached)
+                     && EP_STAT_ISOK(capfs_file_get_length(fh->file, &length))
+                     && fh->file->recno == cached;
 
     // Cleanup
     capfs_dir_closedir(dir);
-    free_tokens(path_tokens);
     return 0;
 
+fail2:
+    capfs_dir_closedir(dir);
+    return -EISDIR;
 fail1:
     capfs_dir_closedir(dir);
 fail0:
-    free_tokens(path_tokens);
     return -ENOENT;
 }
 
@@ -283,55 +560,59 @@ capfs_opendir(const char *path, struct fuse_file_info *fi) {
     }
     EP_STAT estat;
 
-    char **path_tokens;
-    size_t num_tokens = split_path(path, &path_tokens);
-    char *file_name = path_tokens[num_tokens - 1];
+    const char *file_name = path_basename(path);
 
     // Open directory
     capfs_dir_t *dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &dir);
+    estat = capfs_dir_opendir_path(path, &dir);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Open child
+    // Open child. The root has no name of its own, it is dir itself
     capfs_dir_t *child;
-    estat = capfs_dir_opendir(dir, file_name, &child);
-    EP_STAT_CHECK(estat, goto fail1);
+    if (file_name[0] == '\0') {
+        child = dir;
+        dir = NULL;
+    } else {
+        estat = capfs_dir_opendir(dir, file_name, &child);
+        EP_STAT_CHECK(estat, goto fail1);
+    }
 
     fh_entry_t *fh;
-    estat = fh_get_by_gob(child->file->gob, &fh);
+    estat = fh_ref_by_gob(child->file->gob, &fh);
     // File already exists
     if (EP_STAT_ISOK(estat)) {
-        fh->ref++;
         capfs_dir_closedir(child);
+        capfs_dir_free(child);
     } else {    // doesn't exist
         // Get a new file handler
-        estat = fh_new(&fh);
+        estat = fh_new(child->file->gob, &fh);
         EP_STAT_CHECK(estat, goto fail1);
-        fi->fh = fh->fh;
 
         // Store data in file handler
         fh->is_dir = true;
         fh->dir = child;
-        fh->ref++;
+        fh_ref(fh);
     }
+    fi->fh = fh->fh;
 
     // Cleanup
     capfs_dir_closedir(dir);
-    free_tokens(path_tokens);
     return 0;
 
 fail1:
     capfs_dir_closedir(dir);
 fail0:
-    free_tokens(path_tokens);
     return -ENOENT;
 }
 
+// libfuse frees the buffers it is handed, so the cached blocks are copied
+//   once into a single one
 static int
-capfs_read(const char *path, char *buf, size_t size, off_t offset,
-           struct fuse_file_info *fi) {
+capfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+               off_t offset, struct fuse_file_info *fi) {
     (void) path;
     EP_STAT estat;
+    capfs_block_ref_t refs[FILE_BLOCKS_SPANNED(size, offset)];
 
     fh_entry_t *fh;
     estat = fh_get(fi->fh, &fh);
@@ -342,19 +623,56 @@ capfs_read(const char *path, char *buf, size_t size, off_t offset,
         goto fail0;
     }
 
-    estat = capfs_file_read(fh->file, buf, size, offset);
-    EP_STAT_CHECK(estat, goto fail0);
+    size_t count;
+    estat = capfs_file_read_blocks(fh->file, size, offset, refs, &count);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->buf[0].mem = malloc(size);
+    for (size_t i = 0; i < count; i++) {
+        memcpy((char *) bufv->buf[0].mem + bufv->buf[0].size, refs[i].data,
+               refs[i].size);
+        bufv->buf[0].size += refs[i].size;
+    }
+    capfs_file_put_blocks(refs, count);
+    page_recno_put(fh->file->gob, fh->file->recno);
+    *bufp = bufv;
     return 0;
 
+fail1:
+    return -EIO;
 fail0:
     return -ENOENT;
 }
 
+typedef struct capfs_readdir_ctx {
+    const char *path;
+    void *buf;
+    fuse_fill_dir_t filler;
+} capfs_readdir_ctx_t;
+
+static bool
+capfs_readdir_fill(void *arg, capfs_dir_entry_t *entry, off_t next) {
+    capfs_readdir_ctx_t *ctx = arg;
+
+    // Push name and attributes through filler. The attributes are also
+    //   cached so the getattr for each entry that follows (ls -l, find) does
+    //   not have to go back to the GDP
+    struct stat st;
+    capfs_entry_stat(entry, &st);
+    if (strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0) {
+        char child[PATH_MAX];
+        path_child(ctx->path, entry->name, child);
+        attr_cache_put(child, &st);
+    }
+    // Non-zero means the kernel buffer is full
+    return ctx->filler(ctx->buf, entry->name, &st, next) == 0;
+}
+
 static int
 capfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
               off_t offset, struct fuse_file_info *fi) {
-    (void) path;
-    (void) offset;
     EP_STAT estat;
 
     fh_entry_t *fh;
@@ -366,16 +684,11 @@ capfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         goto fail0;
     }
 
-    // Read in names
-    capfs_dir_table_t table;
-    char names[DIR_ENTRIES][FILE_NAME_MAX_LEN + 1];
-    estat = capfs_dir_readdir(fh->dir, &table, names, NULL);
+    // Resume where the previous call stopped
+    capfs_readdir_ctx_t ctx = { path, buf, filler };
+    off_t cursor = offset;
+    estat = capfs_dir_readdir(fh->dir, &cursor, capfs_readdir_fill, &ctx);
     EP_STAT_CHECK(estat, goto fail0);
-
-    // Push names through filler
-    for (size_t i = 0; i < table.length; i++) {
-        filler(buf, names[i], NULL, 0);
-    }
     return 0;
 
 fail0:
@@ -385,7 +698,6 @@ fail0:
 // Equivalent to file_close
 static int
 capfs_release(const char *path, struct fuse_file_info *fi) {
-    (void) path;
     EP_STAT estat;
 
     fh_entry_t *fh;
@@ -397,12 +709,7 @@ capfs_release(const char *path, struct fuse_file_info *fi) {
         goto fail0;
     }
 
-    // Only close and free if unreferenced
-    fh->ref--;
-    if (fh->ref == 0) {
-        capfs_file_close(fh->file);
-        fh_free(fh->fh);
-    }
+    capfs_fh_put(fh, path);
     return 0;
 
 fail0:
@@ -423,12 +730,7 @@ capfs_releasedir(const char *path, struct fuse_file_info *fi) {
         goto fail0;
     }
 
-    // Only close and free if unreferenced
-    fh->ref--;
-    if (fh->ref == 0) {
-        capfs_dir_closedir(fh->dir);
-        fh_free(fh->fh);
-    }
+    capfs_fh_put_dir(fh);
     return 0;
 
 fail0:
@@ -443,33 +745,25 @@ capfs_rename(const char *from, const char *to) {
     EP_STAT estat;
 
     // Open from directory
-    char **path_tokens;
-    size_t num_tokens = split_path(from, &path_tokens);
-    char from_name[FILE_NAME_MAX_LEN + 1];
-    strcpy(from_name, path_tokens[num_tokens - 1]);
-
+    const char *from_name = path_basename(from);
     capfs_dir_t *from_dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &from_dir);
+    estat = capfs_dir_opendir_path(from, &from_dir);
     EP_STAT_CHECK(estat, goto fail0);
-    free_tokens(path_tokens);
 
     // Open to directory
-    num_tokens = split_path(to, &path_tokens);
-    char to_name[FILE_NAME_MAX_LEN + 1];
-    strcpy(to_name, path_tokens[num_tokens - 1]);
-
+    const char *to_name = path_basename(to);
     capfs_dir_t *to_dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &to_dir);
+    estat = capfs_dir_opendir_path(to, &to_dir);
     EP_STAT_CHECK(estat, goto fail1);
 
     // Rename
     estat = capfs_dir_rename(from_dir, to_dir, from_name, to_name);
     EP_STAT_CHECK(estat, goto fail2);
+    attr_cache_clear();
 
     // Cleanup
     capfs_dir_closedir(to_dir);
     capfs_dir_closedir(from_dir);
-    free_tokens(path_tokens);
     return 0;
 
 fail2:
@@ -477,7 +771,6 @@ fail2:
 fail1:
     capfs_dir_closedir(from_dir);
 fail0:
-    free_tokens(path_tokens);
     return -ENOENT;
 }
 
@@ -489,30 +782,34 @@ capfs_rmdir(const char *path) {
     }
     EP_STAT estat;
 
-    char **path_tokens;
-    size_t num_tokens = split_path(path, &path_tokens);
-    char *dir_name = path_tokens[num_tokens - 1];
+    const char *dir_name = path_basename(path);
 
     // Open directory
     capfs_dir_t *dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &dir);
+    estat = capfs_dir_opendir_path(path, &dir);
     EP_STAT_CHECK(estat, goto fail0);
 
     estat = capfs_dir_rmdir(dir, dir_name);
     EP_STAT_CHECK(estat, goto fail1);
+    attr_cache_clear();
 
     // Cleanup
     capfs_dir_closedir(dir);
-    free_tokens(path_tokens);
     return 0;
 
 fail1:
     capfs_dir_closedir(dir);
 fail0:
-    free_tokens(path_tokens);
     return -ENOENT;
 }
 
+static int
+capfs_statfs(const char *path, struct statvfs *st) {
+    (void) path;
+    capfs_statvfs(st);
+    return 0;
+}
+
 static int
 capfs_truncate(const char *path, off_t file_size) {
     // Error handling
@@ -524,36 +821,44 @@ capfs_truncate(const char *path, off_t file_size) {
     }
     EP_STAT estat;
 
-    char **path_tokens;
-    size_t num_tokens = split_path(path, &path_tokens);
-    char *file_name = path_tokens[num_tokens - 1];
+    const char *file_name = path_basename(path);
 
     // Open directory
     capfs_dir_t *dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &dir);
+    estat = capfs_dir_opendir_path(path, &dir);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Open file
-    capfs_file_t *file;
-    estat = capfs_dir_open_file(dir, file_name, &file);
+    // An open handle may hold gathered writes, truncate through it
+    capfs_dir_entry_t entry;
+    estat = capfs_dir_lookup(dir, file_name, &entry);
     EP_STAT_CHECK(estat, goto fail1);
+    fh_entry_t *fh;
+    if (!entry.is_dir && EP_STAT_ISOK(fh_ref_by_gob(entry.gob, &fh))) {
+        estat = capfs_file_truncate(fh->file, file_size);
+        capfs_fh_put(fh, NULL);
+        EP_STAT_CHECK(estat, goto fail1);
+    } else {
+        // Open file
+        capfs_file_t *file;
+        estat = capfs_dir_open_file(dir, file_name, &file);
+        EP_STAT_CHECK(estat, goto fail1);
 
-    // Truncate
-    estat = capfs_file_truncate(file, file_size);
-    EP_STAT_CHECK(estat, goto fail2);
+        // Truncate
+        estat = capfs_file_truncate(file, file_size);
+        capfs_file_close(file);
+        capfs_file_free(file);
+        EP_STAT_CHECK(estat, goto fail1);
+    }
+    capfs_dir_set_attr(dir, file_name, file_size, time(NULL), 0);
+    attr_cache_invalidate(path);
 
     // Cleanup
-    capfs_file_close(file);
     capfs_dir_closedir(dir);
-    free_tokens(path_tokens);
     return 0;
 
-fail2:
-    capfs_file_close(file);
 fail1:
     capfs_dir_closedir(dir);
 fail0:
-    free_tokens(path_tokens);
     return -ENOENT;
 }
 
@@ -565,39 +870,44 @@ capfs_unlink(const char *path) {
     }
     EP_STAT estat;
 
-    char **path_tokens;
-    size_t num_tokens = split_path(path, &path_tokens);
-    char *file_name = path_tokens[num_tokens - 1];
+    const char *file_name = path_basename(path);
 
     // Open directory
     capfs_dir_t *dir;
-    estat = capfs_dir_opendir_path(path_tokens, num_tokens, &dir);
+    estat = capfs_dir_opendir_path(path, &dir);
     EP_STAT_CHECK(estat, goto fail0);
 
     estat = capfs_dir_remove_file(dir, file_name);
     EP_STAT_CHECK(estat, goto fail1);
+    attr_cache_invalidate(path);
 
     // Cleanup
     capfs_dir_closedir(dir);
-    free_tokens(path_tokens);
     return 0;
 
 fail1:
     capfs_dir_closedir(dir);
 fail0:
-    free_tokens(path_tokens);
     return -ENOENT;
 }
 
 static int
 capfs_utimens(const char *path, const struct timespec ts[2]) {
-    return 0;
+    // atime is not kept, it always reads as the mtime
+    struct timespec mtime;
+    if (ts == NULL || ts[1].tv_nsec == UTIME_NOW) {
+        clock_gettime(CLOCK_REALTIME, &mtime);
+    } else if (ts[1].tv_nsec == UTIME_OMIT) {
+        return 0;
+    } else {
+        mtime = ts[1];
+    }
+    return capfs_set_attr(path, (mode_t) -1, &mtime);
 }
 
 static int
-capfs_write(const char *path, const char *buf, size_t size, off_t offset,
-            struct fuse_file_info *fi) {
-    (void) path;
+capfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                struct fuse_file_info *fi) {
     EP_STAT estat;
 
     fh_entry_t *fh;
@@ -609,49 +919,215 @@ capfs_write(const char *path, const char *buf, size_t size, off_t offset,
         goto fail0;
     }
 
-    estat = capfs_file_write(fh->file, buf, size, offset);
-    EP_STAT_CHECK(estat, goto fail0);
-    return 0;
+    size_t size = fuse_buf_size(buf);
+    estat = capfs_write_bufvec(fh->file, buf, offset);
+    EP_STAT_CHECK(estat, goto fail1);
+    fh->modified = true;
+    attr_cache_invalidate(path);
+    return size;
 
+fail1:
+    return -EIO;
 fail0:
     return -ENOENT;
 }
 
-static struct fuse_operations capfs_operations = {
+int
+capfs_read_gob(const gdp_name_t gob, char *buf, size_t size, off_t offset) {
+    EP_STAT estat;
+    if (size == 0) {
+        return 0;
+    }
+    capfs_block_ref_t refs[FILE_BLOCKS_SPANNED(size, offset)];
+
+    // Through an open handle if there is one, it may hold gathered writes
+    fh_entry_t *fh;
+    capfs_file_t *file;
+    if (EP_STAT_ISOK(fh_ref_by_gob((unsigned char *) gob, &fh))) {
+        if (fh->is_dir) {
+            capfs_fh_put_dir(fh);
+            return -EISDIR;
+        }
+        file = fh->file;
+    } else {
+        fh = NULL;
+        file = capfs_file_new(gob);
+    }
+
+    size_t count;
+    int ret = 0;
+    estat = capfs_file_read_blocks(file, size, offset, refs, &count);
+    if (EP_STAT_ISOK(estat)) {
+        for (size_t i = 0; i < count; i++) {
+            memcpy(buf + ret, refs[i].data, refs[i].size);
+            ret += refs[i].size;
+        }
+        capfs_file_put_blocks(refs, count);
+    } else {
+        ret = -EIO;
+    }
+
+    if (fh != NULL) {
+        capfs_fh_put(fh, NULL);
+    } else {
+        capfs_file_close(file);
+        capfs_file_free(file);
+    }
+    return ret;
+}
+
+struct fuse_operations capfs_operations = {
     .access = capfs_access,
     .chmod = capfs_chmod,
     .chown = capfs_chown,
     .create = capfs_create,
+    .destroy = capfs_destroy,
+    .flush = capfs_flush,
+    .fsync = capfs_fsync,
+    .fsyncdir = capfs_fsyncdir,
+    .ftruncate = capfs_ftruncate,
     .getattr = capfs_getattr,
+    .init = capfs_init,
     .mkdir = capfs_mkdir,
     .open = capfs_open,
     .opendir = capfs_opendir,
-    .read = capfs_read,
+    .read_buf = capfs_read_buf,
     .readdir = capfs_readdir,
     .release = capfs_release,
     .releasedir = capfs_releasedir,
     .rename = capfs_rename,
     .rmdir = capfs_rmdir,
+    .statfs = capfs_statfs,
     .truncate = capfs_truncate,
     .unlink = capfs_unlink,
     .utimens = capfs_utimens,
-    .write = capfs_write,
+    .write_buf = capfs_write_buf,
 };
 
-void
-init(void) {
+static void
+init_store(void) {
     fh_init();
 
-    EP_STAT estat = gdp_init(NULL);
+    EP_STAT estat = capfs_store_init();
     if (!EP_STAT_ISOK(estat)) {
         exit(EX_UNAVAILABLE);
     }
-    // Just in case this is a fresh file system
-    capfs_dir_make_root();
+}
+
+void
+init(void) {
+    init_store();
+    // Just in case this is a fresh file system, unless an earlier mount
+    //   found the root already
+    gdp_name_t root;
+    if (!capfs_cache_root(root)) {
+        capfs_dir_make_root();
+    }
+}
+
+// Where the logs live, for whoever opens them: a mount, or a server
+static int
+capfs_store_options(void) {
+    if (capfs_options.store != NULL
+        && !EP_STAT_ISOK(capfs_store_select(capfs_options.store,
+                                            capfs_options.store_path))) {
+        return EX_USAGE;
+    }
+    if (capfs_options.shape != NULL) {
+        capfs_store_shape(capfs_options.shape, capfs_options.shape_seed);
+    }
+    if (capfs_options.cache != NULL
+        && !EP_STAT_ISOK(capfs_cache_open(capfs_options.cache,
+                                          capfs_options.cache_size))) {
+        fprintf(stderr, "cannot open cache %s\n", capfs_options.cache);
+        return EX_CANTCREAT;
+    }
+    return EX_OK;
 }
 
 int
 run(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &capfs_options, capfs_opts, NULL) == -1) {
+        return EX_USAGE;
+    }
+
+    // The server opens the logs, this side only forwards
+    int ret;
+    if (capfs_options.server != NULL || capfs_options.shards != NULL) {
+        if (capfs_options.lowlevel || capfs_options.cache != NULL) {
+            return EX_USAGE;
+        }
+        fuse_opt_add_arg(&args, "-ouse_ino");
+        ret = capfs_client_main(args.argc, args.argv, &capfs_options);
+        fuse_opt_free_args(&args);
+        return ret;
+    }
+
+    // Only the inode based frontend can tell the kernel what changed, and
+    //   only a server grants leases
+    if ((capfs_options.watch && !capfs_options.lowlevel)
+        || capfs_options.lease) {
+        return EX_USAGE;
+    }
+    ret = capfs_store_options();
+    if (ret != EX_OK) {
+        return ret;
+    }
     init();
-    return fuse_main(argc, argv, &capfs_operations, NULL);
+
+    if (capfs_options.lowlevel) {
+        ret = capfs_ll_main(args.argc, args.argv, &capfs_options);
+    } else {
+        // st_ino comes from the gob (see capfs_ino), have the kernel report it
+        fuse_opt_add_arg(&args, "-ouse_ino");
+        ret = fuse_main(args.argc, args.argv, &capfs_operations, NULL);
+    }
+    capfs_cache_close();
+    fuse_opt_free_args(&args);
+    return ret;
+}
+
+int
+run_server(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &capfs_options, capfs_opts, NULL) == -1
+        || args.argc != 2
+        || (capfs_options.replicas != NULL && capfs_options.shards != NULL)) {
+        fprintf(stderr,
+                "usage: %s [-o store=...,replicas=...|shards=...] ADDRESS\n",
+                argv[0]);
+        return EX_USAGE;
+    }
+    int ret = capfs_store_options();
+    if (ret != EX_OK) {
+        return ret;
+    }
+    // Replicas and shards leave making the root to the first of them
+    if (capfs_options.replicas != NULL) {
+        init_store();
+        if (!EP_STAT_ISOK(capfs_raft_start(capfs_options.replicas,
+                                           args.argv[1],
+                                           capfs_options.raft_state))) {
+            fprintf(stderr, "%s: cannot start %s as one of %s\n", argv[0],
+                    args.argv[1], capfs_options.replicas);
+            return EX_USAGE;
+        }
+    } else if (capfs_options.shards != NULL) {
+        init_store();
+        if (!EP_STAT_ISOK(capfs_shard_start(capfs_options.shards,
+                                            args.argv[1],
+                                            capfs_options.shard_state))) {
+            fprintf(stderr, "%s: cannot start %s as one of %s\n", argv[0],
+                    args.argv[1], capfs_options.shards);
+            return EX_USAGE;
+        }
+    } else {
+        init();
+    }
+
+    ret = capfs_server_main(args.argv[1]);
+    capfs_cache_close();
+    fuse_opt_free_args(&args);
+    return ret;
 }
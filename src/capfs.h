@@ -30,7 +30,61 @@
 #ifndef _CAPFS_H_
 #define _CAPFS_H_
 
+// Largest request the kernel is asked to send, the most it allows (128KB)
+#define CAPFS_MAX_IO (128 * 1024)
+
+// Size statfs reports. GDP has no quota, these only keep df and free space
+//   checks before large copies meaningful
+#define CAPFS_CAPACITY (1UL << 40)
+#define CAPFS_MAX_FILES (1UL << 32)
+
+#include <sys/types.h>
+
+#include <gdp/gdp.h>
+
+// Mount options of our own, parsed out before FUSE sees the rest
+typedef struct capfs_options {
+    int lowlevel;   // -o lowlevel: inode based frontend (capfs_ll.c)
+    int writeback;  // -o writeback: kernel write-back cache, if supported
+    int watch;      // -o watch: with lowlevel, hear of appends by other
+                    //   mounts as they happen instead of at the next open
+    char *store;    // -o store=gdp|local: where the logs live, see
+                    //   capfs_store.h
+    char *store_path;   // -o store_path=DIR: local segment directory
+    char *shape;    // -o shape=PROFILE: simulated network in front of the
+                    //   store, see capfs_store_shaped.c
+    unsigned long shape_seed;   // -o shape_seed=N: its random stream
+    char *server;   // -o server=ADDRESS: mount a capfs_server's file system,
+                    //   see capfs_rpc.h for addresses. Replicas as A+B+C,
+                    //   in the order of their -o replicas
+    char *replicas; // -o replicas=A+B+C: servers sharing the store, this
+                    //   one among them, see capfs_raft.h
+    char *raft_state;   // -o raft_state=DIR: where a replica keeps its vote
+    char *shards;   // -o shards=A+B+C: servers splitting the directories
+                    //   between them, see capfs_shard.h. A server is one of
+                    //   them, a mount sends each request to the right one
+    char *shard_state;  // -o shard_state=DIR: where a shard keeps the
+                        //   renames it decided
+    int lease;      // -o lease: with server, cache files and keep their
+                    //   writes under leases, see capfs_lease.h
+    char *cache;    // -o cache=FILE: keep what was read from the logs for
+                    //   the next mount or server, see capfs_cache.h
+    unsigned long cache_size;   // -o cache_size=MB: how big FILE may grow
+} capfs_options_t;
+
+struct fuse_operations;
+
+// The path based operations, run by the high-level frontend and the server
+extern struct fuse_operations capfs_operations;
+
+// Reads from the file with this gob, no path or handle needed. Returns the
+//   bytes read or -errno, like the read operation
+int capfs_read_gob(const gdp_name_t gob, char *buf, size_t size,
+                   off_t offset);
+
 void init(void);
 int run(int argc, char *argv[]);
+// capfs_server [-o store=...,replicas=...|shards=...] ADDRESS
+int run_server(int argc, char *argv[]);
 
 #endif // _CAPFS_H_
@@ -0,0 +1,443 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capfs_dir.h"
+#include "capfs_file.h"
+
+#define CACHE_MAGIC 0x4341504653434348ULL    // "CAPFSCCH"
+#define CACHE_VERSION 1
+// The header has a page of its own, the descriptors start on the next
+#define CACHE_PAGE 4096
+#define CACHE_NONE UINT32_MAX
+
+_Static_assert(CACHE_SLOT_SIZE >= BLOCK_SIZE
+               && CACHE_SLOT_SIZE >= INDIRECT_SIZE
+               && CACHE_SLOT_SIZE >= DIR_TABLE_SIZE,
+               "everything cached must fit a slot");
+
+// What the file was made for. The magic is stored last, a header without it
+//   was never finished
+typedef struct cache_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t slots;
+    uint32_t block_size;
+    uint32_t indirect_size;
+    uint32_t table_size;
+    uint32_t has_root;
+    char prefix[64];        // FILE_PREFIX, which changes with the file system
+    gdp_name_t root;
+} cache_header_t;
+
+// Names what a slot holds. kind is 0 while the slot is free or being
+//   rewritten, and stored last
+typedef struct cache_slot {
+    gdp_name_t gob;
+    uint32_t recno;
+    uint32_t size;
+    uint64_t tag;
+    uint32_t kind;
+    uint32_t padding;
+    uint64_t check;         // Of the fields before kind and the contents
+} cache_slot_t;
+
+static char *cache_map;     // NULL unless capfs_cache_open succeeded
+static size_t cache_map_size;
+static int cache_fd = -1;
+static cache_header_t *cache_header;
+static cache_slot_t *cache_slots;
+static char *cache_data;
+static size_t cache_count;
+// gob + recno -> slot chains, one bucket per slot. Rebuilt on open
+static uint32_t *cache_buckets;
+static uint32_t *cache_next;
+// Clock: slots used since the hand last passed get a second chance
+static bool *cache_used;
+static size_t cache_hand;
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t
+capfs_cache_hash(const void *data, size_t size) {
+    // FNV-1a, a word at a time
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(uint64_t));
+        hash ^= word;
+        hash *= 0x100000001b3ULL;
+    }
+    for (; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t
+cache_check(const cache_slot_t *slot, const char *data) {
+    return capfs_cache_hash(slot, offsetof(cache_slot_t, kind))
+           ^ capfs_cache_hash(data, slot->size);
+}
+
+static size_t
+cache_bucket(int kind, const gdp_name_t gob, uint32_t recno) {
+    uint64_t hash;
+    memcpy(&hash, gob, sizeof(uint64_t));
+    return (hash ^ (recno * 2654435761u) ^ kind) % cache_count;
+}
+
+static bool
+cache_header_valid(const cache_header_t *header, size_t count) {
+    return header->magic == CACHE_MAGIC
+           && header->version == CACHE_VERSION
+           && header->slot_size == CACHE_SLOT_SIZE
+           && header->slots == count
+           && header->block_size == BLOCK_SIZE
+           && header->indirect_size == INDIRECT_SIZE
+           && header->table_size == DIR_TABLE_SIZE
+           && strncmp(header->prefix, FILE_PREFIX,
+                      sizeof(header->prefix)) == 0;
+}
+
+static void
+cache_header_init(cache_header_t *header, size_t count) {
+    header->version = CACHE_VERSION;
+    header->slot_size = CACHE_SLOT_SIZE;
+    header->slots = count;
+    header->block_size = BLOCK_SIZE;
+    header->indirect_size = INDIRECT_SIZE;
+    header->table_size = DIR_TABLE_SIZE;
+    strncpy(header->prefix, FILE_PREFIX, sizeof(header->prefix));
+    __atomic_store_n(&header->magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void
+cache_link_locked(uint32_t index) {
+    cache_slot_t *slot = cache_slots + index;
+    size_t bucket = cache_bucket(slot->kind, slot->gob, slot->recno);
+    cache_next[index] = cache_buckets[bucket];
+    cache_buckets[bucket] = index;
+}
+
+// Caller holds cache_lock
+static void
+cache_unlink_locked(uint32_t index) {
+    cache_slot_t *slot = cache_slots + index;
+    uint32_t *link = cache_buckets + cache_bucket(slot->kind, slot->gob,
+                                                  slot->recno);
+    while (*link != index) {
+        link = cache_next + *link;
+    }
+    *link = cache_next[index];
+}
+
+// Caller holds cache_lock
+static uint32_t
+cache_find_locked(int kind, const gdp_name_t gob, uint32_t recno) {
+    uint32_t index = cache_buckets[cache_bucket(kind, gob, recno)];
+    while (index != CACHE_NONE
+           && (cache_slots[index].kind != (uint32_t) kind
+               || cache_slots[index].recno != recno
+               || memcmp(cache_slots[index].gob, gob, sizeof(gdp_name_t)))) {
+        index = cache_next[index];
+    }
+    return index;
+}
+
+// Caller holds cache_lock
+static void
+cache_drop_locked(uint32_t index) {
+    cache_unlink_locked(index);
+    __atomic_store_n(&cache_slots[index].kind, 0, __ATOMIC_RELEASE);
+    cache_used[index] = false;
+}
+
+// Takes the first slot the hand finds unused since it last passed. Caller
+//   holds cache_lock
+static uint32_t
+cache_claim_locked(void) {
+    while (true) {
+        uint32_t index = cache_hand;
+        cache_hand = (cache_hand + 1) % cache_count;
+        if (cache_used[index]) {
+            cache_used[index] = false;
+            continue;
+        }
+        if (cache_slots[index].kind != 0) {
+            cache_drop_locked(index);
+        }
+        return index;
+    }
+}
+
+EP_STAT
+capfs_cache_open(const char *path, size_t size_mb) {
+    EP_STAT estat;
+
+    size_t size = size_mb << 20;
+    size_t count = size > CACHE_PAGE
+                   ? (size - CACHE_PAGE)
+                     / (CACHE_SLOT_SIZE + sizeof(cache_slot_t))
+                   : 0;
+    if (count < CACHE_SLOTS_MIN || count >= CACHE_NONE) {
+        return EP_STAT_INVALID_ARG;
+    }
+    size_t slots_size = count * sizeof(cache_slot_t);
+    slots_size += CACHE_PAGE - slots_size % CACHE_PAGE;
+    size_t map_size = CACHE_PAGE + slots_size + count * CACHE_SLOT_SIZE;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        estat = ep_stat_from_errno(errno);
+        goto fail0;
+    }
+    // The index is not shared, so neither is the file
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        estat = ep_stat_from_errno(errno);
+        goto fail1;
+    }
+
+    // Made for another size or layout, or never finished: start over. The
+    //   file is sparse until slots are used
+    struct stat st;
+    cache_header_t header;
+    bool fresh = fstat(fd, &st) < 0 || (size_t) st.st_size != map_size
+                 || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+                 || !cache_header_valid(&header, count);
+    if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, map_size) < 0)) {
+        estat = ep_stat_from_errno(errno);
+        goto fail1;
+    }
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                     0);
+    if (map == MAP_FAILED) {
+        estat = ep_stat_from_errno(errno);
+        goto fail1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    cache_map = map;
+    cache_map_size = map_size;
+    cache_fd = fd;
+    cache_header = (cache_header_t *) map;
+    cache_slots = (cache_slot_t *) (map + CACHE_PAGE);
+    cache_data = map + CACHE_PAGE + slots_size;
+    cache_count = count;
+    cache_hand = 0;
+    cache_hits = 0;
+    cache_misses = 0;
+    if (fresh) {
+        cache_header_init(cache_header, count);
+    }
+
+    // Rebuild the index from the descriptors, contents are checked on hits
+    cache_buckets = malloc(count * sizeof(uint32_t));
+    memset(cache_buckets, 0xff, count * sizeof(uint32_t));
+    cache_next = malloc(count * sizeof(uint32_t));
+    cache_used = calloc(count, sizeof(bool));
+    for (uint32_t i = 0; i < count; i++) {
+        cache_slot_t *slot = cache_slots + i;
+        if (slot->kind == 0) {
+            continue;
+        }
+        if (slot->kind > CACHE_DIR || slot->size > CACHE_SLOT_SIZE
+            || cache_find_locked(slot->kind, slot->gob, slot->recno)
+               != CACHE_NONE) {
+            slot->kind = 0;
+            continue;
+        }
+        cache_link_locked(i);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return EP_STAT_OK;
+
+fail1:
+    close(fd);
+fail0:
+    return estat;
+}
+
+void
+capfs_cache_close(void) {
+    pthread_mutex_lock(&cache_lock);
+    if (cache_map != NULL) {
+        munmap(cache_map, cache_map_size);
+        close(cache_fd);
+        free(cache_buckets);
+        free(cache_next);
+        free(cache_used);
+        cache_map = NULL;
+        cache_fd = -1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+bool
+capfs_cache_get(int kind, const gdp_name_t gob, uint32_t recno,
+                uint64_t tag, void *buf, size_t size) {
+    bool hit = false;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_map == NULL) {
+        goto done;
+    }
+    uint32_t index = cache_find_locked(kind, gob, recno);
+    if (index == CACHE_NONE) {
+        goto done;
+    }
+    cache_slot_t *slot = cache_slots + index;
+    const char *data = cache_data + (size_t) index * CACHE_SLOT_SIZE;
+    if (slot->size != size || slot->tag != tag
+        || slot->check != cache_check(slot, data)) {
+        // Torn by a crash, or not the record the log now ends with
+        cache_drop_locked(index);
+        goto done;
+    }
+    memcpy(buf, data, size);
+    cache_used[index] = true;
+    hit = true;
+
+done:
+    if (cache_map != NULL) {
+        if (hit) {
+            cache_hits++;
+        } else {
+            cache_misses++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return hit;
+}
+
+void
+capfs_cache_put(int kind, const gdp_name_t gob, uint32_t recno,
+                uint64_t tag, const void *buf, size_t size) {
+    if (size > CACHE_SLOT_SIZE) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_map == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    uint32_t index = cache_find_locked(kind, gob, recno);
+    if (index != CACHE_NONE) {
+        cache_unlink_locked(index);
+    } else {
+        index = cache_claim_locked();
+    }
+
+    // Free while it is rewritten, a crash in between leaves a miss
+    cache_slot_t *slot = cache_slots + index;
+    char *data = cache_data + (size_t) index * CACHE_SLOT_SIZE;
+    __atomic_store_n(&slot->kind, 0, __ATOMIC_RELEASE);
+    memcpy(data, buf, size);
+    memcpy(slot->gob, gob, sizeof(gdp_name_t));
+    slot->recno = recno;
+    slot->size = size;
+    slot->tag = tag;
+    slot->padding = 0;
+    slot->check = cache_check(slot, data);
+    __atomic_store_n(&slot->kind, kind, __ATOMIC_RELEASE);
+    cache_link_locked(index);
+    cache_used[index] = true;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+bool
+capfs_cache_root(gdp_name_t gob) {
+    bool has_root = false;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_map != NULL && cache_header->has_root) {
+        memcpy(gob, cache_header->root, sizeof(gdp_name_t));
+        has_root = true;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return has_root;
+}
+
+void
+capfs_cache_set_root(const gdp_name_t gob) {
+    pthread_mutex_lock(&cache_lock);
+    // Every path walk comes through here, the page is only dirtied once
+    if (cache_map != NULL
+        && (!cache_header->has_root
+            || memcmp(cache_header->root, gob, sizeof(gdp_name_t)))) {
+        cache_header->has_root = 0;
+        memcpy(cache_header->root, gob, sizeof(gdp_name_t));
+        __atomic_store_n(&cache_header->has_root, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void
+capfs_cache_forget_root(void) {
+    pthread_mutex_lock(&cache_lock);
+    if (cache_map != NULL) {
+        cache_header->has_root = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void
+capfs_cache_stats(capfs_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(capfs_cache_stats_t));
+    pthread_mutex_lock(&cache_lock);
+    if (cache_map != NULL) {
+        stats->hits = cache_hits;
+        stats->misses = cache_misses;
+        stats->slots = cache_count;
+        for (size_t i = 0; i < cache_count; i++) {
+            if (cache_slots[i].kind != 0) {
+                stats->used++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,93 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#ifndef _CAPFS_CACHE_H_
+#define _CAPFS_CACHE_H_
+
+// What is kept, each under the gob and recno of the record it came from
+#define CACHE_BLOCK 1       // The data block of a file record
+#define CACHE_INDIRECT 2    // The indirect block of a file record
+#define CACHE_DIR 3         // A directory table replayed up to the record
+// Every slot holds one of them, the largest being a block
+#define CACHE_SLOT_SIZE (32 * 1024)
+// Size of the cache file unless -o cache_size says otherwise, in MB
+#define CACHE_SIZE_DEFAULT 1024
+// Fewer slots than this make no sense
+#define CACHE_SLOTS_MIN 16
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ep/ep.h>
+#include <gdp/gdp.h>
+
+// Since the cache was opened, for benchmarks
+typedef struct capfs_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    size_t used;            // Slots holding something, of slots
+    size_t slots;
+} capfs_cache_stats_t;
+
+// A cache of what this process read from the logs, in one file (-o cache)
+//   that outlives it, so the next mount starts warm. Records never change
+//   once appended, so nothing in it goes stale: a block stays the block of
+//   its gob and recno. Directory tables are only good while the record they
+//   were replayed to is still the last one. They carry a hash of that
+//   record, which is read anyway to find out. The cache also remembers the
+//   root directory's gob, so a mount neither probes for the root nor looks
+//   it up by name. Without capfs_cache_open nothing is cached
+//
+// The file is mapped into memory: a header, the slot descriptors, then the
+//   slots of CACHE_SLOT_SIZE bytes. A slot is claimed with a clock sweep. A
+//   descriptor names its slot's contents and carries a hash of them, checked
+//   on every hit, so a slot torn by a crash is a miss. The index of slots is
+//   rebuilt from the descriptors when the file is opened. A file made for
+//   another size or another file system layout starts over
+EP_STAT capfs_cache_open(const char *path, size_t size_mb);
+void capfs_cache_close(void);
+// Hash of size bytes, e.g. for the tag of a directory table
+uint64_t capfs_cache_hash(const void *data, size_t size);
+// Copies what is kept of this kind for gob and recno into buf if its size
+//   and tag match. Returns whether it did
+bool capfs_cache_get(int kind, const gdp_name_t gob, uint32_t recno,
+                     uint64_t tag, void *buf, size_t size);
+// size is at most CACHE_SLOT_SIZE
+void capfs_cache_put(int kind, const gdp_name_t gob, uint32_t recno,
+                     uint64_t tag, const void *buf, size_t size);
+// Whether an earlier mount found the root directory, and its gob
+bool capfs_cache_root(gdp_name_t gob);
+void capfs_cache_set_root(const gdp_name_t gob);
+// The root directory could not be opened after all
+void capfs_cache_forget_root(void);
+void capfs_cache_stats(capfs_cache_stats_t *stats);
+
+#endif // _CAPFS_CACHE_H_
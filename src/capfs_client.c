@@ -0,0 +1,1443 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+
+#include <fuse.h>
+
+#include "capfs_lease.h"
+#include "capfs_rpc.h"
+#include "capfs_util.h"
+
+// Every op says which mount it is from, so the server never revokes a lease
+//   this mount holds on its own account
+#define CLIENT_OP(op_type) \
+    ({ Capfs__Op _op = CAPFS__OP__INIT; _op.type = (op_type); \
+       _op.has_owner = client_owner != 0; _op.owner = client_owner; _op; })
+
+// A request waiting for its response
+typedef struct client_call {
+    uint64_t id;
+    Capfs__Response *response;      // NULL if the connection broke first
+    bool done;
+    pthread_cond_t cond;
+    struct client_call *next;
+} client_call_t;
+
+// FUSE threads share CLIENT_CONNECTIONS connections to each server, taking
+//   them in turn, and each has up to RPC_MAX_IN_FLIGHT requests
+//   outstanding. A thread per connection reads the responses, in whatever
+//   order the server finishes them, and hands each to the call with its id.
+//   Connected on first use and again after breaking; handles from before
+//   that are gone with it
+typedef struct client_conn {
+    const char *address;
+    int server;                     // Which of the replicas
+    pthread_mutex_t send_lock;      // One request on the socket at a time
+    pthread_mutex_t lock;           // All the rest
+    pthread_cond_t cond;            // in_flight went down
+    int fd;
+    uint64_t next_id;
+    unsigned in_flight;
+    client_call_t *calls;
+} client_conn_t;
+
+// The servers of -o server, in the order the replicas number themselves, or
+//   of -o shards
+static char **client_servers;
+static int client_n_servers;
+static bool client_sharded;
+static client_conn_t *client_conns;
+static unsigned client_next;
+static unsigned client_next_server;
+// Where writes go, the last replica known to be the leader
+static int client_leader;
+
+// A write kept under a write lease
+typedef struct client_extent {
+    off_t offset;
+    size_t size;
+    char *data;
+    struct client_extent *next;
+} client_extent_t;
+
+// What fi->fh points at for an open file: the server's handle, the
+//   connection it belongs to, and the capsule behind it so reads need not
+//   go through that handle at all. Opened under a lease, also the writes it
+//   kept, oldest first, under the lease's lock
+typedef struct client_file {
+    client_conn_t *conn;
+    uint64_t fh;
+    bool has_gob;
+    gdp_name_t gob;
+    bool writable;                  // Its server may hold gathered writes
+    char *path;
+    struct client_lease *lease;
+    struct client_file *lease_next;
+    client_extent_t *dirty;
+    client_extent_t *dirty_tail;
+    size_t dirty_bytes;
+    int err;                        // Of a write-back, for fsync or release
+} client_file_t;
+
+#define CLIENT_FILE(fi) ((client_file_t *) (uintptr_t) (fi)->fh)
+
+// A lease the server granted this mount on a file (-o lease), see
+//   capfs_lease.h. Until it is revoked, the kernel keeps the file's pages
+//   across opens, getattr is answered from st, and with a write lease
+//   writes are kept on the open files until fsync, release or the revoke.
+//   In the table until revoked, and until then also reachable by path
+typedef struct client_lease {
+    gdp_name_t gob;
+    uint32_t mode;
+    client_conn_t *conn;            // Where it was granted, revokes come there
+    char *path;                     // NULL once unknown. Under leases_lock
+    unsigned opens;                 // Under leases_lock
+    unsigned ref;                   // The table's and the files', same
+    bool release;                   // Revoked: whether the server asked
+    pthread_mutex_t lock;           // The rest
+    client_file_t *files;
+    bool cached;                    // Pages the kernel has are from under it
+    bool has_st;
+    struct stat st;
+    bool revoked;
+    struct client_lease *next;
+} client_lease_t;
+
+// A revoke that may have come before the grant it was for, in the answer to
+//   one of the opens sent up to ticket, see client_lease_grant
+typedef struct client_early_revoke {
+    gdp_name_t gob;
+    uint64_t ticket;
+    uint64_t at;
+    struct client_early_revoke *next;
+} client_early_revoke_t;
+
+static const capfs_options_t *client_options;
+
+// Who this mount is to the server, 0 without -o lease
+static uint64_t client_owner;
+static client_lease_t *client_leases;
+static size_t client_n_leases;
+// Out of the table, for the revoke thread to write back and give back
+static client_lease_t *client_revoked;
+static client_early_revoke_t *client_early_revokes;
+// Opens asking for a lease, numbered as they are sent
+static uint64_t client_open_tickets;
+static pthread_mutex_t client_leases_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_revoked_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t
+client_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Caller holds client_leases_lock. Hands the lease at link to the revoke
+//   thread, release if the server still counts it as held
+static void
+client_lease_unlink(client_lease_t **link, bool release) {
+    client_lease_t *lease = *link;
+    *link = lease->next;
+    client_n_leases--;
+    lease->release = release;
+    lease->next = client_revoked;
+    client_revoked = lease;
+    pthread_cond_signal(&client_revoked_cond);
+}
+
+// Caller holds client_leases_lock
+static client_lease_t **
+client_lease_find(const gdp_name_t gob) {
+    client_lease_t **link = &client_leases;
+    while (*link != NULL
+           && memcmp((*link)->gob, gob, sizeof(gdp_name_t)) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Caller holds client_leases_lock. Whether a revoke of gob may have been
+//   for what the open with ticket was granted, forgetting those that are too
+//   old to matter
+static bool
+client_early_revoked(const gdp_name_t gob, uint64_t ticket) {
+    uint64_t now = client_now();
+    bool found = false;
+    client_early_revoke_t **link = &client_early_revokes;
+    while (*link != NULL) {
+        client_early_revoke_t *early = *link;
+        if (early->at + LEASE_REVOKE_MS <= now) {
+            *link = early->next;
+            free(early);
+            continue;
+        }
+        found |= ticket <= early->ticket
+                 && memcmp(early->gob, gob, sizeof(gdp_name_t)) == 0;
+        link = &early->next;
+    }
+    return found;
+}
+
+// The server wants the lease on gob back. It may also be for a grant still
+//   on its way, in the answer to an open sent before now, which is then
+//   given back as soon as it arrives. The server grants nothing more until
+//   it has the lease back, so later opens are not affected
+static void
+client_lease_revoke(const gdp_name_t gob) {
+    pthread_mutex_lock(&client_leases_lock);
+    client_early_revoked(gob, 0);
+    client_early_revoke_t *early = malloc(sizeof(client_early_revoke_t));
+    memcpy(early->gob, gob, sizeof(gdp_name_t));
+    early->ticket = __atomic_load_n(&client_open_tickets, __ATOMIC_SEQ_CST);
+    early->at = client_now();
+    early->next = client_early_revokes;
+    client_early_revokes = early;
+    client_lease_t **link = client_lease_find(gob);
+    if (*link != NULL) {
+        client_lease_unlink(link, true);
+    }
+    pthread_mutex_unlock(&client_leases_lock);
+}
+
+// conn broke, and the server dropped the leases granted on it. What the
+//   files kept is still written back where their handles survived
+static void
+client_lease_lost(client_conn_t *conn) {
+    pthread_mutex_lock(&client_leases_lock);
+    client_lease_t **link = &client_leases;
+    while (*link != NULL) {
+        if ((*link)->conn == conn) {
+            client_lease_unlink(link, false);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+    pthread_mutex_unlock(&client_leases_lock);
+}
+
+static void
+client_lease_put(client_lease_t *lease) {
+    pthread_mutex_lock(&client_leases_lock);
+    bool last = --lease->ref == 0;
+    pthread_mutex_unlock(&client_leases_lock);
+    if (last) {
+        free(lease->path);
+        pthread_mutex_destroy(&lease->lock);
+        free(lease);
+    }
+}
+
+// Holding a reference, the lease on the open file at path, NULL if none
+static client_lease_t *
+client_lease_by_path(const char *path) {
+    if (client_owner == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&client_leases_lock);
+    client_lease_t *lease = client_leases;
+    while (lease != NULL && (lease->opens == 0 || lease->path == NULL
+                             || strcmp(lease->path, path) != 0)) {
+        lease = lease->next;
+    }
+    if (lease != NULL) {
+        lease->ref++;
+    }
+    pthread_mutex_unlock(&client_leases_lock);
+    return lease;
+}
+
+static client_conn_t *
+client_conn_next(int server) {
+    unsigned i = __atomic_fetch_add(&client_next, 1, __ATOMIC_RELAXED);
+    return &client_conns[server * CLIENT_CONNECTIONS
+                         + i % CLIENT_CONNECTIONS];
+}
+
+static void *
+client_reader_thread(void *arg) {
+    client_conn_t *conn = arg;
+
+    pthread_mutex_lock(&conn->lock);
+    int fd = conn->fd;
+    pthread_mutex_unlock(&conn->lock);
+
+    for (;;) {
+        Capfs__Response *response;
+        if (!EP_STAT_ISOK(capfs_rpc_recv(fd, &capfs__response__descriptor,
+                                         (ProtobufCMessage **) &response))) {
+            break;
+        }
+        // Not an answer, the server wants a lease back
+        if (response->has_revoke) {
+            if (response->revoke.len == sizeof(gdp_name_t)) {
+                client_lease_revoke(response->revoke.data);
+            }
+            protobuf_c_message_free_unpacked(&response->base, NULL);
+            continue;
+        }
+        pthread_mutex_lock(&conn->lock);
+        client_call_t **link = &conn->calls;
+        while (*link != NULL && (*link)->id != response->id) {
+            link = &(*link)->next;
+        }
+        client_call_t *call = *link;
+        if (call != NULL) {
+            *link = call->next;
+            call->response = response;
+            call->done = true;
+            pthread_cond_signal(&call->cond);
+        }
+        pthread_mutex_unlock(&conn->lock);
+        if (call == NULL) {
+            protobuf_c_message_free_unpacked(&response->base, NULL);
+        }
+    }
+
+    // Everyone still waiting on this connection fails, nobody sends on it
+    //   any more
+    pthread_mutex_lock(&conn->send_lock);
+    pthread_mutex_lock(&conn->lock);
+    close(fd);
+    conn->fd = -1;
+    for (client_call_t *call = conn->calls; call != NULL; call = call->next) {
+        call->done = true;
+        pthread_cond_signal(&call->cond);
+    }
+    conn->calls = NULL;
+    pthread_mutex_unlock(&conn->lock);
+    pthread_mutex_unlock(&conn->send_lock);
+    // The server dropped the leases granted on it, and the handles
+    client_lease_lost(conn);
+    return NULL;
+}
+
+// Sends ops as one request on conn. The response has a result for each of
+//   them, or says to ask another replica. -ENOTCONN if it never got sent
+static int
+client_send(client_conn_t *conn, Capfs__Op **ops, size_t n_ops,
+            Capfs__Response **response) {
+    EP_STAT estat;
+
+    client_call_t call = { .response = NULL, .done = false };
+    pthread_cond_init(&call.cond, NULL);
+
+    pthread_mutex_lock(&conn->lock);
+    while (conn->in_flight >= RPC_MAX_IN_FLIGHT) {
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    }
+    if (conn->fd < 0) {
+        estat = capfs_rpc_connect(conn->address, &conn->fd);
+        EP_STAT_CHECK(estat, goto fail0);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_reader_thread, conn) != 0) {
+            close(conn->fd);
+            goto fail0;
+        }
+        pthread_detach(thread);
+    }
+    int fd = conn->fd;
+    conn->in_flight++;
+    call.id = conn->next_id++;
+    call.next = conn->calls;
+    conn->calls = &call;
+    pthread_mutex_unlock(&conn->lock);
+
+    Capfs__Request request = CAPFS__REQUEST__INIT;
+    request.id = call.id;
+    request.n_ops = n_ops;
+    request.ops = ops;
+    pthread_mutex_lock(&conn->send_lock);
+    // Broken since, the reader already failed this call
+    if (conn->fd == fd) {
+        estat = capfs_rpc_send(fd, &request.base);
+        if (!EP_STAT_ISOK(estat)) {
+            // Half sent or not at all, the stream is lost. Wakes the reader
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+
+    pthread_mutex_lock(&conn->lock);
+    while (!call.done) {
+        pthread_cond_wait(&call.cond, &conn->lock);
+    }
+    conn->in_flight--;
+    pthread_cond_signal(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+    pthread_cond_destroy(&call.cond);
+
+    *response = call.response;
+    if (*response == NULL) {
+        return -EIO;
+    }
+    if (!(*response)->redirect && (*response)->n_results != n_ops) {
+        protobuf_c_message_free_unpacked(&(*response)->base, NULL);
+        return -EIO;
+    }
+    return 0;
+
+fail0:
+    conn->fd = -1;
+    pthread_mutex_unlock(&conn->lock);
+    pthread_cond_destroy(&call.cond);
+    return -ENOTCONN;
+}
+
+static void
+client_retry_wait(void) {
+    struct timespec ts = { 0, CLIENT_RETRY_MS * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+// Sends ops to the shard of their paths, to the leader, or to any replica
+//   if they only read, and on to wherever the one that got them says. used,
+//   if not NULL, is where they ran
+static int
+client_route(Capfs__Op **ops, size_t n_ops, Capfs__Response **response,
+             client_conn_t **used) {
+    bool read_only = capfs_rpc_read_only(ops, n_ops);
+    int server = client_sharded
+                 ? capfs_rpc_shard(ops, n_ops, client_n_servers) : -1;
+    if (server < 0) {
+        server = read_only || client_sharded
+                 ? __atomic_fetch_add(&client_next_server, 1,
+                                      __ATOMIC_RELAXED) % client_n_servers
+                 : __atomic_load_n(&client_leader, __ATOMIC_RELAXED);
+    }
+
+    for (int tries = 0;; tries++) {
+        client_conn_t *conn = client_conn_next(server);
+        int ret = client_send(conn, ops, n_ops, response);
+        if (ret == 0 && !(*response)->redirect) {
+            if (!read_only && !client_sharded) {
+                __atomic_store_n(&client_leader, server, __ATOMIC_RELAXED);
+            }
+            if (used != NULL) {
+                *used = conn;
+            }
+            return 0;
+        }
+        // Sent and maybe run: only reads are safe to run again
+        if (ret != 0 && ret != -ENOTCONN && !read_only) {
+            return ret;
+        }
+        int leader = -1;
+        if (ret == 0) {
+            if ((*response)->has_leader) {
+                leader = (*response)->leader;
+            }
+            protobuf_c_message_free_unpacked(&(*response)->base, NULL);
+        }
+        if (tries == CLIENT_RETRIES) {
+            return -EIO;
+        }
+
+        if (leader >= 0 && leader < client_n_servers) {
+            // Elected, and settling what the last leader left
+            if (leader == server) {
+                client_retry_wait();
+            }
+            server = leader;
+        } else {
+            // Between leaders, or this replica is gone
+            client_retry_wait();
+            server = (server + 1) % client_n_servers;
+        }
+    }
+}
+
+// Sends ops on conn, or routes them if NULL. A handle lives on the server
+//   of its connection only, so there is nowhere else to go with it
+static int
+client_call(client_conn_t *conn, Capfs__Op **ops, size_t n_ops,
+            Capfs__Response **response) {
+    if (conn == NULL) {
+        return client_route(ops, n_ops, response, NULL);
+    }
+    int ret = client_send(conn, ops, n_ops, response);
+    if (ret == 0 && (*response)->redirect) {
+        protobuf_c_message_free_unpacked(&(*response)->base, NULL);
+        return -EIO;
+    }
+    return ret == -ENOTCONN ? -EIO : ret;
+}
+
+// For the calls that need nothing back but whether it worked
+static int
+client_call_one(client_conn_t *conn, Capfs__Op *op) {
+    Capfs__Response *response;
+    int ret = client_call(conn, &op, 1, &response);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = response->results[0]->err;
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return ret;
+}
+
+// Caller holds the lease's lock. Sends what file kept, in order, as one
+//   request on its handle. 0 or the first error, which fsync and release
+//   also report
+static int
+client_file_writeback(client_file_t *file) {
+    if (file->dirty == NULL) {
+        return 0;
+    }
+    size_t n_ops = 0;
+    for (client_extent_t *extent = file->dirty; extent != NULL;
+         extent = extent->next) {
+        n_ops++;
+    }
+    Capfs__Op *ops = malloc(n_ops * sizeof(Capfs__Op));
+    Capfs__Op **op_ptrs = malloc(n_ops * sizeof(Capfs__Op *));
+    size_t i = 0;
+    for (client_extent_t *extent = file->dirty; extent != NULL;
+         extent = extent->next, i++) {
+        ops[i] = CLIENT_OP(CAPFS__OP_TYPE__WRITE);
+        ops[i].path = file->path;
+        ops[i].has_fh = true;
+        ops[i].fh = file->fh;
+        ops[i].has_offset = true;
+        ops[i].offset = extent->offset;
+        ops[i].has_data = true;
+        ops[i].data.data = (uint8_t *) extent->data;
+        ops[i].data.len = extent->size;
+        op_ptrs[i] = &ops[i];
+    }
+
+    Capfs__Response *response;
+    int ret = client_call(file->conn, op_ptrs, n_ops, &response);
+    if (ret == 0) {
+        for (i = 0; ret == 0 && i < n_ops; i++) {
+            ret = response->results[i]->err;
+            if (ret == 0 && response->results[i]->size != ops[i].data.len) {
+                ret = -EIO;
+            }
+        }
+        protobuf_c_message_free_unpacked(&response->base, NULL);
+    }
+    free(op_ptrs);
+    free(ops);
+
+    while (file->dirty != NULL) {
+        client_extent_t *extent = file->dirty;
+        file->dirty = extent->next;
+        free(extent->data);
+        free(extent);
+    }
+    file->dirty_tail = NULL;
+    file->dirty_bytes = 0;
+    if (ret != 0 && file->err == 0) {
+        file->err = ret;
+    }
+    return ret;
+}
+
+// Caller holds the lease's lock
+static void
+client_lease_writeback(client_lease_t *lease) {
+    for (client_file_t *file = lease->files; file != NULL;
+         file = file->lease_next) {
+        client_file_writeback(file);
+    }
+}
+
+// Caller holds the lease's lock
+static bool
+client_lease_dirty(client_lease_t *lease) {
+    for (client_file_t *file = lease->files; file != NULL;
+         file = file->lease_next) {
+        if (file->dirty != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes back what the revoked leases kept and gives them back, off the
+//   reader threads, which the answers to those writes come through
+static void *
+client_revoke_thread(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&client_leases_lock);
+        while (client_revoked == NULL) {
+            pthread_cond_wait(&client_revoked_cond, &client_leases_lock);
+        }
+        client_lease_t *lease = client_revoked;
+        client_revoked = lease->next;
+        char *path = lease->path;
+        lease->path = NULL;
+        pthread_mutex_unlock(&client_leases_lock);
+
+        // Files still open write through from here on
+        pthread_mutex_lock(&lease->lock);
+        lease->revoked = true;
+        client_lease_writeback(lease);
+        pthread_mutex_unlock(&lease->lock);
+
+        if (lease->release) {
+            Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__LEASE_RELEASE);
+            op.has_gob = true;
+            op.gob.data = lease->gob;
+            op.gob.len = sizeof(gdp_name_t);
+            client_call_one(lease->conn, &op);
+        }
+        if (path != NULL) {
+            attr_cache_invalidate(path);
+            free(path);
+        }
+        client_lease_put(lease);
+    }
+    return NULL;
+}
+
+// Puts the lease an open of path on conn was granted in the table, holding
+//   a reference for the file. NULL if it was revoked before it got here:
+//   the server still counts it as held, so it is given back at once
+static client_lease_t *
+client_lease_grant(client_conn_t *conn, const gdp_name_t gob, uint32_t mode,
+                   const char *path, uint64_t ticket) {
+    pthread_mutex_lock(&client_leases_lock);
+    client_lease_t **link = client_lease_find(gob);
+    client_lease_t *lease = *link;
+    if (lease == NULL) {
+        lease = calloc(1, sizeof(client_lease_t));
+        memcpy(lease->gob, gob, sizeof(gdp_name_t));
+        pthread_mutex_init(&lease->lock, NULL);
+        lease->ref = 1;
+        lease->next = client_leases;
+        client_leases = lease;
+        client_n_leases++;
+        link = &client_leases;
+    }
+    lease->mode = mode;
+    lease->conn = conn;
+    if (client_early_revoked(gob, ticket)) {
+        client_lease_unlink(link, true);
+        lease = NULL;
+    } else {
+        free(lease->path);
+        lease->path = strdup(path);
+        lease->opens++;
+        lease->ref++;
+    }
+
+    // Too many, one nothing has open goes back
+    if (client_n_leases > CLIENT_LEASES_MAX) {
+        for (link = &client_leases; *link != NULL; link = &(*link)->next) {
+            if ((*link)->opens == 0) {
+                client_lease_unlink(link, true);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&client_leases_lock);
+    return lease;
+}
+
+// Puts file under lease. The kernel keeps the pages it has if they were
+//   read under the same lease, nobody else can have changed them since
+static void
+client_lease_attach(client_lease_t *lease, client_file_t *file,
+                    const struct stat *st, struct fuse_file_info *fi) {
+    pthread_mutex_lock(&lease->lock);
+    file->lease = lease;
+    file->lease_next = lease->files;
+    lease->files = file;
+    if (!lease->revoked) {
+        fi->keep_cache = lease->cached;
+        lease->cached = true;
+        // Kept writes are newer than what the server has
+        if (st != NULL && !lease->has_st && !client_lease_dirty(lease)) {
+            lease->st = *st;
+            lease->has_st = true;
+        }
+    }
+    pthread_mutex_unlock(&lease->lock);
+}
+
+// Takes file out from under its lease, writing back what it kept first
+static int
+client_lease_detach(client_file_t *file) {
+    client_lease_t *lease = file->lease;
+    pthread_mutex_lock(&lease->lock);
+    client_file_writeback(file);
+    client_file_t **link = &lease->files;
+    while (*link != file) {
+        link = &(*link)->lease_next;
+    }
+    *link = file->lease_next;
+    int err = file->err;
+    pthread_mutex_unlock(&lease->lock);
+
+    pthread_mutex_lock(&client_leases_lock);
+    lease->opens--;
+    pthread_mutex_unlock(&client_leases_lock);
+    client_lease_put(lease);
+    return err;
+}
+
+// Keeps a write on file while it is under a write lease. size, or 0 to
+//   write it through
+static int
+client_lease_write(client_file_t *file, const char *buf, size_t size,
+                   off_t offset) {
+    client_lease_t *lease = file->lease;
+    pthread_mutex_lock(&lease->lock);
+    if (lease->revoked || lease->mode != LEASE_WRITE) {
+        // Asked for again once written
+        lease->has_st = false;
+        pthread_mutex_unlock(&lease->lock);
+        return 0;
+    }
+
+    // Sequential writes make one op
+    client_extent_t *tail = file->dirty_tail;
+    if (tail != NULL && tail->offset + (off_t) tail->size == offset
+        && tail->size + size <= CAPFS_MAX_IO) {
+        tail->data = realloc(tail->data, tail->size + size);
+        memcpy(tail->data + tail->size, buf, size);
+        tail->size += size;
+    } else {
+        client_extent_t *extent = malloc(sizeof(client_extent_t));
+        extent->offset = offset;
+        extent->size = size;
+        extent->data = malloc(size);
+        memcpy(extent->data, buf, size);
+        extent->next = NULL;
+        if (tail != NULL) {
+            tail->next = extent;
+        } else {
+            file->dirty = extent;
+        }
+        file->dirty_tail = extent;
+    }
+    file->dirty_bytes += size;
+    if (lease->has_st) {
+        if (offset + (off_t) size > lease->st.st_size) {
+            lease->st.st_size = offset + size;
+            lease->st.st_blocks = (lease->st.st_size + 511) / 512;
+        }
+        clock_gettime(CLOCK_REALTIME, &lease->st.st_mtim);
+        lease->st.st_ctim = lease->st.st_mtim;
+    }
+
+    int ret = size;
+    if (file->dirty_bytes >= CLIENT_LEASE_BUFFER_MAX) {
+        int err = client_file_writeback(file);
+        if (err != 0) {
+            ret = err;
+        }
+    }
+    pthread_mutex_unlock(&lease->lock);
+    return ret;
+}
+
+// Before this mount changes the file at path by name, what it kept is
+//   written back and its attributes are asked for again
+static void
+client_lease_changing(const char *path) {
+    client_lease_t *lease = client_lease_by_path(path);
+    if (lease == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&lease->lock);
+    client_lease_writeback(lease);
+    lease->has_st = false;
+    pthread_mutex_unlock(&lease->lock);
+    client_lease_put(lease);
+}
+
+// The file at from is now at to, or gone if NULL. Whatever was below from
+//   is no longer known by path
+static void
+client_lease_moved(const char *from, const char *to) {
+    if (client_owner == 0) {
+        return;
+    }
+    size_t length = strlen(from);
+    pthread_mutex_lock(&client_leases_lock);
+    for (client_lease_t *lease = client_leases; lease != NULL;
+         lease = lease->next) {
+        if (lease->path == NULL) {
+            continue;
+        }
+        if (strcmp(lease->path, from) == 0) {
+            free(lease->path);
+            lease->path = to != NULL ? strdup(to) : NULL;
+        } else if ((to != NULL && strcmp(lease->path, to) == 0)
+                   || (strncmp(lease->path, from, length) == 0
+                       && lease->path[length] == '/')) {
+            free(lease->path);
+            lease->path = NULL;
+        }
+    }
+    pthread_mutex_unlock(&client_leases_lock);
+}
+
+// Answered from the lease while the file is open under one
+static bool
+client_lease_getattr(const char *path, struct stat *st) {
+    client_lease_t *lease = client_lease_by_path(path);
+    if (lease == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&lease->lock);
+    bool found = lease->has_st && !lease->revoked;
+    if (found) {
+        *st = lease->st;
+    } else {
+        // Otherwise the server would answer without the kept writes
+        client_lease_writeback(lease);
+    }
+    pthread_mutex_unlock(&lease->lock);
+    client_lease_put(lease);
+    return found;
+}
+
+// Keeps the handle from a CREATE or OPEN result on conn in fi, and the
+//   lease it came with. attr is the GETATTR after it, if any, and ticket
+//   the one the open took before it was sent
+static void
+client_file_open(client_conn_t *conn, const char *path,
+                 const Capfs__Result *result, const Capfs__Result *attr,
+                 uint64_t ticket, struct fuse_file_info *fi) {
+    client_file_t *file = calloc(1, sizeof(client_file_t));
+    file->conn = conn;
+    file->fh = result->fh;
+    file->has_gob = result->has_gob && result->gob.len == sizeof(gdp_name_t);
+    if (file->has_gob) {
+        memcpy(file->gob, result->gob.data, sizeof(gdp_name_t));
+    }
+    file->writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+    file->path = strdup(path);
+    fi->fh = (uintptr_t) file;
+
+    if (!file->has_gob || !result->has_lease || result->lease == 0) {
+        return;
+    }
+    client_lease_t *lease = client_lease_grant(conn, file->gob, result->lease,
+                                               path, ticket);
+    if (lease != NULL) {
+        struct stat st;
+        bool has_st = attr != NULL && attr->err == 0 && attr->attr != NULL;
+        if (has_st) {
+            capfs_rpc_attr_to_stat(attr->attr, &st);
+        }
+        client_lease_attach(lease, file, has_st ? &st : NULL, fi);
+    }
+}
+
+static int
+capfs_client_access(const char *path, int mode) {
+    return 0;
+}
+
+static int
+capfs_client_chmod(const char *path, mode_t mode) {
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__CHMOD);
+    op.path = (char *) path;
+    op.has_mode = true;
+    op.mode = mode;
+    client_lease_changing(path);
+    int ret = client_call_one(NULL, &op);
+    attr_cache_invalidate(path);
+    return ret;
+}
+
+static int
+capfs_client_chown(const char *path, uid_t uid, gid_t gid) {
+    return 0;
+}
+
+// The kernel looks up what it created right after, the attributes come back
+//   with it
+static int
+capfs_client_create(const char *path, mode_t mode,
+                    struct fuse_file_info *fi) {
+    Capfs__Op create = CLIENT_OP(CAPFS__OP_TYPE__CREATE);
+    create.path = (char *) path;
+    create.has_mode = true;
+    create.mode = mode;
+    create.has_flags = true;
+    create.flags = fi->flags;
+    create.has_lease = client_owner != 0;
+    create.lease = LEASE_WRITE;
+    Capfs__Op getattr = CLIENT_OP(CAPFS__OP_TYPE__GETATTR);
+    getattr.path = (char *) path;
+    Capfs__Op *ops[] = { &create, &getattr };
+
+    client_conn_t *conn;
+    Capfs__Response *response;
+    uint64_t ticket = __atomic_add_fetch(&client_open_tickets, 1,
+                                         __ATOMIC_SEQ_CST);
+    int ret = client_route(ops, 2, &response, &conn);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = response->results[0]->err;
+    if (ret == 0) {
+        client_file_open(conn, path, response->results[0],
+                         response->results[1], ticket, fi);
+        if (response->results[1]->err == 0) {
+            struct stat st;
+            capfs_rpc_attr_to_stat(response->results[1]->attr, &st);
+            attr_cache_put(path, &st);
+        }
+    }
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return ret;
+}
+
+static int
+capfs_client_flush(const char *path, struct fuse_file_info *fi) {
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__FLUSH);
+    op.path = (char *) path;
+    op.has_fh = true;
+    op.fh = CLIENT_FILE(fi)->fh;
+    return client_call_one(CLIENT_FILE(fi)->conn, &op);
+}
+
+static int
+capfs_client_fsync(const char *path, int datasync,
+                   struct fuse_file_info *fi) {
+    // What was kept goes first, and how writing it back went
+    client_file_t *file = CLIENT_FILE(fi);
+    if (file->lease != NULL) {
+        pthread_mutex_lock(&file->lease->lock);
+        client_file_writeback(file);
+        int err = file->err;
+        file->err = 0;
+        pthread_mutex_unlock(&file->lease->lock);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__FSYNC);
+    op.path = (char *) path;
+    op.has_fh = true;
+    op.fh = CLIENT_FILE(fi)->fh;
+    op.has_flags = true;
+    op.flags = datasync;
+    return client_call_one(CLIENT_FILE(fi)->conn, &op);
+}
+
+// Directories are only opened on the server for as long as one request
+static int
+capfs_client_fsyncdir(const char *path, int datasync,
+                      struct fuse_file_info *fi) {
+    Capfs__Op opendir = CLIENT_OP(CAPFS__OP_TYPE__OPENDIR);
+    opendir.path = (char *) path;
+    Capfs__Op fsyncdir = CLIENT_OP(CAPFS__OP_TYPE__FSYNCDIR);
+    fsyncdir.has_flags = true;
+    fsyncdir.flags = datasync;
+    Capfs__Op releasedir = CLIENT_OP(CAPFS__OP_TYPE__RELEASEDIR);
+    Capfs__Op *ops[] = { &opendir, &fsyncdir, &releasedir };
+
+    Capfs__Response *response;
+    int ret = client_call(NULL, ops, 3, &response);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = response->results[1]->err;
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return ret;
+}
+
+static int
+capfs_client_ftruncate(const char *path, off_t file_size,
+                       struct fuse_file_info *fi) {
+    client_file_t *file = CLIENT_FILE(fi);
+    if (file->lease != NULL) {
+        pthread_mutex_lock(&file->lease->lock);
+        client_lease_writeback(file->lease);
+        file->lease->has_st = false;
+        pthread_mutex_unlock(&file->lease->lock);
+    }
+
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__FTRUNCATE);
+    op.path = (char *) path;
+    op.has_fh = true;
+    op.fh = CLIENT_FILE(fi)->fh;
+    op.has_size = true;
+    op.size = file_size;
+    int ret = client_call_one(CLIENT_FILE(fi)->conn, &op);
+    attr_cache_invalidate(path);
+    return ret;
+}
+
+static int
+capfs_client_getattr(const char *path, struct stat *st) {
+    // Nobody else can have changed it, or usually filled in by a readdir
+    //   just before
+    if (client_lease_getattr(path, st) || attr_cache_get(path, st)) {
+        return 0;
+    }
+
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__GETATTR);
+    op.path = (char *) path;
+    Capfs__Op *ops[] = { &op };
+
+    Capfs__Response *response;
+    int ret = client_call(NULL, ops, 1, &response);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = response->results[0]->err;
+    if (ret == 0) {
+        capfs_rpc_attr_to_stat(response->results[0]->attr, st);
+        attr_cache_put(path, st);
+    }
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return ret;
+}
+
+static void *
+capfs_client_init(struct fuse_conn_info *conn) {
+    capfs_conn_init(conn, client_options);
+    return NULL;
+}
+
+static int
+capfs_client_mkdir(const char *path, mode_t mode) {
+    Capfs__Op mkdir = CLIENT_OP(CAPFS__OP_TYPE__MKDIR);
+    mkdir.path = (char *) path;
+    mkdir.has_mode = true;
+    mkdir.mode = mode;
+    Capfs__Op getattr = CLIENT_OP(CAPFS__OP_TYPE__GETATTR);
+    getattr.path = (char *) path;
+    Capfs__Op *ops[] = { &mkdir, &getattr };
+
+    Capfs__Response *response;
+    int ret = client_call(NULL, ops, 2, &response);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = response->results[0]->err;
+    if (ret == 0 && response->results[1]->err == 0) {
+        struct stat st;
+        capfs_rpc_attr_to_stat(response->results[1]->attr, &st);
+        attr_cache_put(path, &st);
+    }
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return ret;
+}
+
+// Asks for a lease with -o lease, and for the attributes it then keeps
+static int
+capfs_client_open(const char *path, struct fuse_file_info *fi) {
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__OPEN);
+    op.path = (char *) path;
+    op.has_flags = true;
+    op.flags = fi->flags;
+    op.has_lease = client_owner != 0;
+    op.lease = (fi->flags & O_ACCMODE) != O_RDONLY ? LEASE_WRITE : LEASE_READ;
+    Capfs__Op getattr = CLIENT_OP(CAPFS__OP_TYPE__GETATTR);
+    getattr.path = (char *) path;
+    Capfs__Op *ops[] = { &op, &getattr };
+    size_t n_ops = client_owner != 0 ? 2 : 1;
+
+    client_conn_t *conn;
+    Capfs__Response *response;
+    uint64_t ticket = __atomic_add_fetch(&client_open_tickets, 1,
+                                         __ATOMIC_SEQ_CST);
+    int ret = client_route(ops, n_ops, &response, &conn);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = response->results[0]->err;
+    if (ret == 0) {
+        client_file_open(conn, path, response->results[0],
+                         n_ops > 1 ? response->results[1] : NULL, ticket, fi);
+    }
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return ret;
+}
+
+// Nothing to open yet, see capfs_client_readdir
+static int
+capfs_client_opendir(const char *path, struct fuse_file_info *fi) {
+    fi->fh = 0;
+    return 0;
+}
+
+static int
+capfs_client_read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+    // By capsule when the server said which, the blocks are then fetched
+    //   in parallel on its side and no handle is involved, so any
+    //   connection will do. Except for a file open for writing: its writes
+    //   are gathered on the server of its handle, only that one reads them
+    client_file_t *file = CLIENT_FILE(fi);
+    client_conn_t *conn = file->conn;
+    // Which sees what was kept once it is written back
+    if (file->lease != NULL) {
+        pthread_mutex_lock(&file->lease->lock);
+        if (client_lease_dirty(file->lease)) {
+            client_lease_writeback(file->lease);
+        }
+        pthread_mutex_unlock(&file->lease->lock);
+    }
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__READ);
+    if (file->has_gob) {
+        conn = file->writable ? file->conn : NULL;
+        op.type = CAPFS__OP_TYPE__READ_FILE;
+        // Sharded, to the owner of the file, where other handles on it
+        //   gather their writes
+        op.path = file->path;
+        op.has_gob = true;
+        op.gob.data = file->gob;
+        op.gob.len = sizeof(gdp_name_t);
+    } else {
+        op.has_fh = true;
+        op.fh = file->fh;
+    }
+    op.has_offset = true;
+    op.offset = offset;
+    op.has_size = true;
+    op.size = size;
+    Capfs__Op *ops[] = { &op };
+
+    Capfs__Response *response;
+    int ret = client_call(conn, ops, 1, &response);
+    // Its server is gone, and the writes it gathered with it. Reads are
+    //   safe to run again anywhere
+    if (ret != 0 && op.type == CAPFS__OP_TYPE__READ_FILE && conn != NULL) {
+        ret = client_call(NULL, ops, 1, &response);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+    Capfs__Result *result = response->results[0];
+    ret = result->err;
+    if (ret == 0) {
+        ret = min(result->data.len, size);
+        memcpy(buf, result->data.data, ret);
+    }
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return ret;
+}
+
+// Opens, reads from offset and closes the directory in one request, and
+//   again for as long as the server fills whole answers and the kernel
+//   wants more
+static int
+capfs_client_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                     off_t offset, struct fuse_file_info *fi) {
+    for (;;) {
+        Capfs__Op opendir = CLIENT_OP(CAPFS__OP_TYPE__OPENDIR);
+        opendir.path = (char *) path;
+        Capfs__Op readdir = CLIENT_OP(CAPFS__OP_TYPE__READDIR);
+        readdir.path = (char *) path;
+        readdir.has_offset = true;
+        readdir.offset = offset;
+        Capfs__Op releasedir = CLIENT_OP(CAPFS__OP_TYPE__RELEASEDIR);
+        Capfs__Op *ops[] = { &opendir, &readdir, &releasedir };
+
+        Capfs__Response *response;
+        int ret = client_call(NULL, ops, 3, &response);
+        if (ret != 0) {
+            return ret;
+        }
+        Capfs__Result *result = response->results[1];
+        ret = result->err;
+        bool full = false;
+        for (size_t i = 0; ret == 0 && i < result->n_entries; i++) {
+            Capfs__DirEntry *entry = result->entries[i];
+
+            // Cached like the local frontend does, for the getattr of each
+            //   entry that follows
+            struct stat st;
+            capfs_rpc_attr_to_stat(entry->attr, &st);
+            if (strcmp(entry->name, ".") != 0
+                && strcmp(entry->name, "..") != 0) {
+                char child[PATH_MAX];
+                path_child(path, entry->name, child);
+                attr_cache_put(child, &st);
+            }
+            if (filler(buf, entry->name, &st, entry->next) != 0) {
+                full = true;
+                break;
+            }
+            offset = entry->next;
+        }
+        bool more = result->n_entries == RPC_READDIR_MAX;
+        protobuf_c_message_free_unpacked(&response->base, NULL);
+        if (ret != 0 || full || !more) {
+            return ret;
+        }
+    }
+}
+
+static int
+capfs_client_release(const char *path, struct fuse_file_info *fi) {
+    client_file_t *file = CLIENT_FILE(fi);
+    int err = file->lease != NULL ? client_lease_detach(file) : 0;
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__RELEASE);
+    op.path = (char *) path;
+    op.has_fh = true;
+    op.fh = file->fh;
+    int ret = client_call_one(file->conn, &op);
+    free(file->path);
+    free(file);
+    // Written to, the size and mtime hints just changed
+    attr_cache_invalidate(path);
+    return ret != 0 ? ret : err;
+}
+
+static int
+capfs_client_releasedir(const char *path, struct fuse_file_info *fi) {
+    return 0;
+}
+
+static int
+capfs_client_rename(const char *from, const char *to) {
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__RENAME);
+    op.path = (char *) from;
+    op.to = (char *) to;
+    client_lease_changing(from);
+    client_lease_changing(to);
+    int ret = client_call_one(NULL, &op);
+    if (ret == 0) {
+        client_lease_moved(from, to);
+    }
+    attr_cache_clear();
+    return ret;
+}
+
+static int
+capfs_client_rmdir(const char *path) {
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__RMDIR);
+    op.path = (char *) path;
+    int ret = client_call_one(NULL, &op);
+    attr_cache_clear();
+    return ret;
+}
+
+static int
+capfs_client_statfs(const char *path, struct statvfs *st) {
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__STATFS);
+    op.path = (char *) path;
+    Capfs__Op *ops[] = { &op };
+
+    Capfs__Response *response;
+    int ret = client_call(NULL, ops, 1, &response);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = response->results[0]->err;
+    if (ret == 0) {
+        capfs_rpc_statfs_to_statvfs(response->results[0]->statfs, st);
+    }
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return ret;
+}
+
+static int
+capfs_client_truncate(const char *path, off_t file_size) {
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__TRUNCATE);
+    op.path = (char *) path;
+    op.has_size = true;
+    op.size = file_size;
+    client_lease_changing(path);
+    int ret = client_call_one(NULL, &op);
+    attr_cache_invalidate(path);
+    return ret;
+}
+
+static int
+capfs_client_unlink(const char *path) {
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__UNLINK);
+    op.path = (char *) path;
+    client_lease_changing(path);
+    int ret = client_call_one(NULL, &op);
+    if (ret == 0) {
+        client_lease_moved(path, NULL);
+    }
+    attr_cache_invalidate(path);
+    return ret;
+}
+
+// UTIME_NOW is resolved on the server, by its clock
+static int
+capfs_client_utimens(const char *path, const struct timespec ts[2]) {
+    if (ts != NULL && ts[1].tv_nsec == UTIME_OMIT) {
+        return 0;
+    }
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__UTIMENS);
+    op.path = (char *) path;
+    op.has_sec = true;
+    op.sec = ts != NULL ? ts[1].tv_sec : 0;
+    op.has_nsec = true;
+    op.nsec = ts != NULL ? ts[1].tv_nsec : UTIME_NOW;
+    client_lease_changing(path);
+    int ret = client_call_one(NULL, &op);
+    attr_cache_invalidate(path);
+    return ret;
+}
+
+static int
+capfs_client_write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi) {
+    // Kept under a write lease until fsync, release or the revoke
+    client_file_t *file = CLIENT_FILE(fi);
+    if (file->lease != NULL && size > 0) {
+        int ret = client_lease_write(file, buf, size, offset);
+        if (ret != 0) {
+            attr_cache_invalidate(path);
+            return ret;
+        }
+    }
+
+    Capfs__Op op = CLIENT_OP(CAPFS__OP_TYPE__WRITE);
+    op.path = (char *) path;
+    op.has_fh = true;
+    op.fh = CLIENT_FILE(fi)->fh;
+    op.has_offset = true;
+    op.offset = offset;
+    op.has_data = true;
+    op.data.data = (uint8_t *) buf;
+    op.data.len = size;
+    Capfs__Op *ops[] = { &op };
+
+    Capfs__Response *response;
+    int ret = client_call(CLIENT_FILE(fi)->conn, ops, 1, &response);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = response->results[0]->err;
+    if (ret == 0) {
+        ret = response->results[0]->size;
+    }
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    attr_cache_invalidate(path);
+    return ret;
+}
+
+static struct fuse_operations capfs_client_operations = {
+    .access = capfs_client_access,
+    .chmod = capfs_client_chmod,
+    .chown = capfs_client_chown,
+    .create = capfs_client_create,
+    .flush = capfs_client_flush,
+    .fsync = capfs_client_fsync,
+    .fsyncdir = capfs_client_fsyncdir,
+    .ftruncate = capfs_client_ftruncate,
+    .getattr = capfs_client_getattr,
+    .init = capfs_client_init,
+    .mkdir = capfs_client_mkdir,
+    .open = capfs_client_open,
+    .opendir = capfs_client_opendir,
+    .read = capfs_client_read,
+    .readdir = capfs_client_readdir,
+    .release = capfs_client_release,
+    .releasedir = capfs_client_releasedir,
+    .rename = capfs_client_rename,
+    .rmdir = capfs_client_rmdir,
+    .statfs = capfs_client_statfs,
+    .truncate = capfs_client_truncate,
+    .unlink = capfs_client_unlink,
+    .utimens = capfs_client_utimens,
+    .write = capfs_client_write,
+};
+
+static int
+client_setup(const capfs_options_t *options) {
+    client_options = options;
+    client_sharded = options->shards != NULL;
+    char *list = strdup(client_sharded ? options->shards : options->server);
+    char *save;
+    for (char *address = strtok_r(list, "+", &save); address != NULL;
+         address = strtok_r(NULL, "+", &save)) {
+        client_servers = realloc(client_servers,
+                                 (client_n_servers + 1) * sizeof(char *));
+        client_servers[client_n_servers++] = address;
+    }
+    if (client_n_servers == 0) {
+        free(list);
+        return EX_USAGE;
+    }
+
+    client_conns = calloc(client_n_servers * CLIENT_CONNECTIONS,
+                          sizeof(client_conn_t));
+    for (int i = 0; i < client_n_servers * CLIENT_CONNECTIONS; i++) {
+        client_conn_t *conn = &client_conns[i];
+        conn->server = i / CLIENT_CONNECTIONS;
+        conn->address = client_servers[conn->server];
+        pthread_mutex_init(&conn->send_lock, NULL);
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+        conn->fd = -1;
+    }
+
+    // Tells this mount apart from the others, however many connections each
+    if (options->lease) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        client_owner = ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec)
+                       ^ ((uint64_t) getpid() << 40);
+        if (client_owner == 0) {
+            client_owner = 1;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_revoke_thread, NULL) != 0) {
+            return EX_OSERR;
+        }
+        pthread_detach(thread);
+    }
+    return EX_OK;
+}
+
+int
+capfs_client_main(int argc, char *argv[], const capfs_options_t *options) {
+    int ret = client_setup(options);
+    if (ret != EX_OK) {
+        return ret;
+    }
+    return fuse_main(argc, argv, &capfs_client_operations, NULL);
+}
@@ -0,0 +1,58 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#ifndef _CAPFS_CLIENT_H_
+#define _CAPFS_CLIENT_H_
+
+#include "capfs.h"
+
+// Connections to each server, shared by all FUSE threads
+#define CLIENT_CONNECTIONS 4
+// Times a request is tried again on another replica, when the one it went
+//   to cannot run it or cannot be reached. CLIENT_RETRY_MS apart while no
+//   leader is known
+#define CLIENT_RETRIES 40
+#define CLIENT_RETRY_MS 50
+// With -o lease, leases kept at most, those on closed files are given back
+//   past that. Writes a file keeps under a write lease before sending them
+//   anyway, below RPC_MAX_MESSAGE
+#define CLIENT_LEASES_MAX 1024
+#define CLIENT_LEASE_BUFFER_MAX (4 * 1024 * 1024)
+
+// High-level frontend that runs every operation on the capfs_server at
+//   options->server instead of opening logs itself. Each FUSE call is one
+//   request, batching the ops it needs, and many can be outstanding at once.
+//   Given replicas, writes go to their leader and reads to any of them.
+//   Given shards (options->shards), each request goes to the one owning its
+//   paths. With options->lease, files are cached and written back under
+//   leases, see capfs_lease.h
+int capfs_client_main(int argc, char *argv[], const capfs_options_t *options);
+
+#endif // _CAPFS_CLIENT_H_
@@ -29,27 +29,80 @@
 
 #include "capfs_dir.h"
 
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-// Does not perform writeback
+#include "capfs_cache.h"
+#include "capfs_util.h"
+
+// A directory is guarded by the lock of its log: lookups and listings share
+//   it, mutations hold it alone for the whole read-modify-write
+static void
+capfs_dir_rdlock(capfs_dir_t *dir) {
+    pthread_rwlock_rdlock(capfs_file_lock(dir->file->gob));
+}
+
+static void
+capfs_dir_wrlock(capfs_dir_t *dir) {
+    pthread_rwlock_wrlock(capfs_file_lock(dir->file->gob));
+}
+
+static void
+capfs_dir_unlock(capfs_dir_t *dir) {
+    pthread_rwlock_unlock(capfs_file_lock(dir->file->gob));
+}
+
+// Two directories are locked in address order so that concurrent renames
+//   cannot deadlock. Both may share a lock
+static void
+capfs_dir_wrlock_pair(capfs_dir_t *a, capfs_dir_t *b) {
+    pthread_rwlock_t *lock_a = capfs_file_lock(a->file->gob);
+    pthread_rwlock_t *lock_b = capfs_file_lock(b->file->gob);
+    if (lock_a == lock_b) {
+        pthread_rwlock_wrlock(lock_a);
+        return;
+    }
+    pthread_rwlock_wrlock(lock_a < lock_b ? lock_a : lock_b);
+    pthread_rwlock_wrlock(lock_a < lock_b ? lock_b : lock_a);
+}
+
+static void
+capfs_dir_unlock_pair(capfs_dir_t *a, capfs_dir_t *b) {
+    pthread_rwlock_t *lock_a = capfs_file_lock(a->file->gob);
+    pthread_rwlock_t *lock_b = capfs_file_lock(b->file->gob);
+    pthread_rwlock_unlock(lock_a);
+    if (lock_a != lock_b) {
+        pthread_rwlock_unlock(lock_b);
+    }
+}
+
+static void
+capfs_dir_entry_init(capfs_dir_entry_t *entry, const char *name, bool is_dir,
+                     mode_t mode, gdp_name_t gob) {
+    memset(entry, 0, DIR_ENTRY_SIZE);
+    entry->is_dir = is_dir;
+    entry->valid = true;
+    entry->mode = mode;
+    entry->mtime = time(NULL);
+    entry->size = 0;
+    memcpy(entry->gob, gob, sizeof(gdp_name_t));
+    strcpy(entry->name, name);
+}
+
+// Does not perform writeback. The entry is copied whole, hints included
 static EP_STAT
-capfs_dir_table_insert_entry(capfs_dir_table_t *table, const char *name,
-                             bool is_dir, gdp_name_t gob) {
+capfs_dir_table_insert_entry(capfs_dir_table_t *table,
+                             const capfs_dir_entry_t *new_entry) {
     EP_STAT estat;
 
-    // Make capfs_dir_entry_t
-    capfs_dir_entry_t new_entry;
-    new_entry.is_dir = is_dir;
-    new_entry.valid = true;
-    memcpy(new_entry.gob, gob, sizeof(gdp_name_t));
-    strcpy(new_entry.name, name);
-
     // Insert entry into available slot (for parent)
     size_t i = 0;
     for (; i < DIR_ENTRIES; i++) {
         capfs_dir_entry_t entry = table->entries[i];
         if (!entry.valid) {
-            memcpy(table->entries + i, &new_entry, DIR_ENTRY_SIZE);
+            memcpy(table->entries + i, new_entry, DIR_ENTRY_SIZE);
             break;
         }
     }
@@ -66,6 +119,534 @@ fail0:
     return estat;
 }
 
+// An empty directory, holding only . and ..
+static EP_STAT
+capfs_dir_table_init(capfs_dir_table_t *table, gdp_name_t gob,
+                     gdp_name_t parent_gob) {
+    EP_STAT estat;
+    memset(table, 0, DIR_TABLE_SIZE);
+
+    capfs_dir_entry_t entry;
+    capfs_dir_entry_init(&entry, ".", true, 0, gob);
+    estat = capfs_dir_table_insert_entry(table, &entry);
+    EP_STAT_CHECK(estat, return estat);
+    capfs_dir_entry_init(&entry, "..", true, 0, parent_gob);
+    return capfs_dir_table_insert_entry(table, &entry);
+}
+
+// Returns DIR_ENTRIES if not found. name need not be terminated, so path
+//   components can be looked up in place
+static size_t
+capfs_dir_table_find_n(capfs_dir_table_t *table, const char *name,
+                       size_t length) {
+    if (length > FILE_NAME_MAX_LEN) {
+        return DIR_ENTRIES;
+    }
+    size_t i = 0;
+    for (; i < DIR_ENTRIES; i++) {
+        capfs_dir_entry_t *entry = table->entries + i;
+        if (entry->valid && entry->name[length] == '\0'
+            && memcmp(entry->name, name, length) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+static size_t
+capfs_dir_table_find(capfs_dir_table_t *table, const char *name) {
+    return capfs_dir_table_find_n(table, name, strlen(name));
+}
+
+// Does not perform writeback. Leaves a hole for the next insert, so entries
+//   never move and readdir cursors stay valid
+static void
+capfs_dir_table_remove_entry(capfs_dir_table_t *table, size_t index) {
+    memset(table->entries + index, 0, DIR_ENTRY_SIZE);
+    table->length--;
+}
+
+static EP_STAT
+capfs_dir_table_apply(capfs_dir_table_t *table, uint8_t type,
+                      capfs_dir_entry_t *entry) {
+    if (type == DIR_RECORD_INSERT) {
+        return capfs_dir_table_insert_entry(table, entry);
+    }
+    size_t index = capfs_dir_table_find(table, entry->name);
+    if (index == DIR_ENTRIES) {
+        return EP_STAT_NOT_FOUND;
+    }
+    if (type == DIR_RECORD_UPDATE) {
+        table->entries[index].mtime = entry->mtime;
+        table->entries[index].size = entry->size;
+        table->entries[index].mode = entry->mode;
+        return EP_STAT_OK;
+    }
+    capfs_dir_table_remove_entry(table, index);
+    return EP_STAT_OK;
+}
+
+// Validates a raw directory log record
+static EP_STAT
+capfs_dir_parse_header(const char *record, size_t size,
+                       capfs_dir_record_header_t *header) {
+    if (size < DIR_RECORD_HEADER_SIZE) {
+        return EP_STAT_END_OF_FILE;
+    }
+    memcpy(header, record, DIR_RECORD_HEADER_SIZE);
+    if (header->magic != DIR_RECORD_MAGIC) {
+        return EP_STAT_END_OF_FILE;
+    }
+    switch (header->type) {
+    case DIR_RECORD_CHECKPOINT:
+        if (size < DIR_CHECKPOINT_SIZE) {
+            return EP_STAT_END_OF_FILE;
+        }
+        return EP_STAT_OK;
+    case DIR_RECORD_INSERT:
+    case DIR_RECORD_REMOVE:
+    case DIR_RECORD_UPDATE:
+        if (size < DIR_DELTA_SIZE) {
+            return EP_STAT_END_OF_FILE;
+        }
+        return EP_STAT_OK;
+    case DIR_RECORD_BATCH:
+        if (header->count > DIR_BATCH_MAX
+            || size < DIR_RECORD_HEADER_SIZE
+                      + header->count * DIR_BATCH_DELTA_SIZE) {
+            return EP_STAT_END_OF_FILE;
+        }
+        return EP_STAT_OK;
+    default:
+        return EP_STAT_END_OF_FILE;
+    }
+}
+
+// Applies a parsed delta or batch record to a table in memory
+static EP_STAT
+capfs_dir_table_apply_record(capfs_dir_table_t *table,
+                             capfs_dir_record_header_t *header,
+                             const char *record) {
+    EP_STAT estat;
+    const char *body = record + DIR_RECORD_HEADER_SIZE;
+
+    if (header->type != DIR_RECORD_BATCH) {
+        capfs_dir_entry_t entry;
+        memcpy(&entry, body, DIR_ENTRY_SIZE);
+        return capfs_dir_table_apply(table, header->type, &entry);
+    }
+
+    for (size_t i = 0; i < header->count; i++) {
+        capfs_dir_delta_t delta;
+        memcpy(&delta, body + i * DIR_BATCH_DELTA_SIZE, DIR_BATCH_DELTA_SIZE);
+        estat = capfs_dir_table_apply(table, delta.type, &delta.entry);
+        EP_STAT_CHECK(estat, goto fail0);
+    }
+    return EP_STAT_OK;
+
+fail0:
+    return estat;
+}
+
+// Reads the last checkpoint and replays every delta after it
+static EP_STAT
+capfs_dir_replay(capfs_file_t *file, capfs_dir_table_t *table) {
+    EP_STAT estat;
+
+    char last[DIR_CHECKPOINT_SIZE];
+    char record[DIR_CHECKPOINT_SIZE];
+    capfs_dir_record_header_t last_header;
+    capfs_dir_record_header_t header;
+
+    // Read last record
+    gdp_recno_t last_recno;
+    size_t size = DIR_CHECKPOINT_SIZE;
+    estat = capfs_file_read_record(file, -1, last, &size, &last_recno, NULL);
+    EP_STAT_CHECK(estat, goto fail0);
+    estat = capfs_dir_parse_header(last, size, &last_header);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // Common case: nothing to replay
+    if (last_header.type == DIR_RECORD_CHECKPOINT) {
+        memcpy(table, last + DIR_RECORD_HEADER_SIZE, DIR_TABLE_SIZE);
+        return EP_STAT_OK;
+    }
+
+    // Replayed before, by us or an earlier mount, if the log still ends with
+    //   the same record
+    uint64_t tag = capfs_cache_hash(last, size);
+    if (capfs_cache_get(CACHE_DIR, file->gob, last_recno, tag, table,
+                        DIR_TABLE_SIZE)) {
+        return EP_STAT_OK;
+    }
+
+    // Read checkpoint
+    gdp_recno_t checkpoint = last_header.checkpoint;
+    size = DIR_CHECKPOINT_SIZE;
+    estat = capfs_file_read_record(file, checkpoint, record, &size, NULL,
+                                   NULL);
+    EP_STAT_CHECK(estat, goto fail0);
+    estat = capfs_dir_parse_header(record, size, &header);
+    EP_STAT_CHECK(estat, goto fail0);
+    if (header.type != DIR_RECORD_CHECKPOINT) {
+        estat = EP_STAT_END_OF_FILE;
+        goto fail0;
+    }
+    memcpy(table, record + DIR_RECORD_HEADER_SIZE, DIR_TABLE_SIZE);
+
+    // Replay deltas, the last record (already in hand) goes last
+    for (gdp_recno_t recno = checkpoint + 1; recno < last_recno; recno++) {
+        size = DIR_CHECKPOINT_SIZE;
+        estat = capfs_file_read_record(file, recno, record, &size, NULL, NULL);
+        EP_STAT_CHECK(estat, goto fail0);
+        estat = capfs_dir_parse_header(record, size, &header);
+        EP_STAT_CHECK(estat, goto fail0);
+        estat = capfs_dir_table_apply_record(table, &header, record);
+        EP_STAT_CHECK(estat, goto fail0);
+    }
+    estat = capfs_dir_table_apply_record(table, &last_header, last);
+    EP_STAT_CHECK(estat, goto fail0);
+    capfs_cache_put(CACHE_DIR, file->gob, last_recno, tag, table,
+                    DIR_TABLE_SIZE);
+    return EP_STAT_OK;
+
+fail0:
+    return estat;
+}
+
+// Appends a checkpoint of the full table
+static EP_STAT
+capfs_dir_write_checkpoint(capfs_file_t *file, capfs_dir_table_t *table) {
+    EP_STAT estat;
+
+    char record[DIR_CHECKPOINT_SIZE];
+
+    // Last record gives us the hash to chain onto, and our recno
+    gdp_recno_t last_recno;
+    capfs_hash_t *prevhash;
+    size_t size = DIR_RECORD_HEADER_SIZE;
+    estat = capfs_file_read_record(file, -1, record, &size, &last_recno,
+                                   &prevhash);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    capfs_dir_record_header_t header;
+    memset(&header, 0, DIR_RECORD_HEADER_SIZE);
+    header.magic = DIR_RECORD_MAGIC;
+    header.type = DIR_RECORD_CHECKPOINT;
+    header.checkpoint = last_recno + 1;
+    header.deltas = 0;
+    memcpy(record, &header, DIR_RECORD_HEADER_SIZE);
+    memcpy(record + DIR_RECORD_HEADER_SIZE, table, DIR_TABLE_SIZE);
+
+    estat = capfs_file_append_record(file, prevhash, record,
+                                     DIR_CHECKPOINT_SIZE);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    capfs_hash_free(prevhash);
+    return EP_STAT_OK;
+
+fail1:
+    capfs_hash_free(prevhash);
+fail0:
+    return estat;
+}
+
+// Unflushed mutations of a single directory. Until they are written back,
+//   lookups in that directory are served from table, which already has the
+//   pending deltas applied. A state is only touched, created or freed under
+//   its directory's lock; dir_states_lock covers the list links
+typedef struct capfs_dir_state {
+    capfs_file_t *file;
+    capfs_dir_table_t table;
+    size_t num_pending;
+    capfs_dir_delta_t pending[DIR_BATCH_MAX];
+    time_t dirty_since;
+    struct capfs_dir_state *next;
+} capfs_dir_state_t;
+
+static capfs_dir_state_t *dir_states = NULL;
+static pthread_mutex_t dir_states_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Writes back expired batches every DIR_FLUSH_WINDOW, so an idle mount does
+//   not keep them until its next path operation. Started with the first
+//   batch rather than at init, like the pool thread in capfs_file.c
+static pthread_t dir_flusher;
+static bool dir_flusher_started;
+static bool dir_flusher_stop;
+static pthread_mutex_t dir_flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dir_flusher_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t dir_flusher_once = PTHREAD_ONCE_INIT;
+
+static capfs_dir_state_t *
+capfs_dir_state_find(gdp_name_t gob) {
+    pthread_mutex_lock(&dir_states_lock);
+    capfs_dir_state_t *state = dir_states;
+    while (state != NULL && !GDP_NAME_SAME(state->file->gob, gob)) {
+        state = state->next;
+    }
+    pthread_mutex_unlock(&dir_states_lock);
+    return state;
+}
+
+static void
+capfs_dir_state_free(capfs_dir_state_t *state) {
+    pthread_mutex_lock(&dir_states_lock);
+    capfs_dir_state_t **prev = &dir_states;
+    while (*prev != state) {
+        prev = &(*prev)->next;
+    }
+    *prev = state->next;
+    pthread_mutex_unlock(&dir_states_lock);
+
+    capfs_file_close(state->file);
+    capfs_file_free(state->file);
+    free(state);
+}
+
+// Writes back every pending delta in one record and forgets the state.
+//   On failure the state is kept so that the deltas are not lost
+static EP_STAT
+capfs_dir_state_flush(capfs_dir_state_t *state) {
+    EP_STAT estat;
+
+    char record[DIR_RECORD_HEADER_SIZE + DIR_BATCH_MAX * DIR_BATCH_DELTA_SIZE];
+    capfs_dir_record_header_t header;
+
+    capfs_hash_t *prevhash;
+    gdp_recno_t recno;
+    size_t size = DIR_RECORD_HEADER_SIZE;
+    estat = capfs_file_read_record(state->file, -1, record, &size, &recno,
+                                   &prevhash);
+    EP_STAT_CHECK(estat, goto fail0);
+    // Only the header is needed here
+    memcpy(&header, record, DIR_RECORD_HEADER_SIZE);
+    if (size < DIR_RECORD_HEADER_SIZE || header.magic != DIR_RECORD_MAGIC) {
+        estat = EP_STAT_END_OF_FILE;
+        goto fail1;
+    }
+
+    if (header.deltas + 1 >= DIR_CHECKPOINT_INTERVAL) {
+        // Time for a checkpoint, the table is already up to date
+        capfs_hash_free(prevhash);
+        estat = capfs_dir_write_checkpoint(state->file, &state->table);
+        EP_STAT_CHECK(estat, goto fail0);
+    } else if (state->num_pending == 1) {
+        header.type = state->pending[0].type;
+        header.count = 0;
+        header.deltas++;
+        memcpy(record, &header, DIR_RECORD_HEADER_SIZE);
+        memcpy(record + DIR_RECORD_HEADER_SIZE, &state->pending[0].entry,
+               DIR_ENTRY_SIZE);
+        estat = capfs_file_append_record(state->file, prevhash, record,
+                                         DIR_DELTA_SIZE);
+        EP_STAT_CHECK(estat, goto fail1);
+        capfs_hash_free(prevhash);
+        // The table is what a replay up to the new record would find
+        capfs_cache_put(CACHE_DIR, state->file->gob, recno + 1,
+                        capfs_cache_hash(record, DIR_DELTA_SIZE),
+                        &state->table, DIR_TABLE_SIZE);
+    } else {
+        header.type = DIR_RECORD_BATCH;
+        header.count = state->num_pending;
+        header.deltas++;
+        size = state->num_pending * DIR_BATCH_DELTA_SIZE;
+        memcpy(record, &header, DIR_RECORD_HEADER_SIZE);
+        memcpy(record + DIR_RECORD_HEADER_SIZE, state->pending, size);
+        estat = capfs_file_append_record(state->file, prevhash, record,
+                                         DIR_RECORD_HEADER_SIZE + size);
+        EP_STAT_CHECK(estat, goto fail1);
+        capfs_hash_free(prevhash);
+        capfs_cache_put(CACHE_DIR, state->file->gob, recno + 1,
+                        capfs_cache_hash(record, DIR_RECORD_HEADER_SIZE
+                                                 + size),
+                        &state->table, DIR_TABLE_SIZE);
+    }
+
+    capfs_dir_state_free(state);
+    return EP_STAT_OK;
+
+fail1:
+    capfs_hash_free(prevhash);
+fail0:
+    return estat;
+}
+
+// Flushes every dirty directory, or only those whose flush window has passed.
+//   The gobs are collected first since a directory lock may not be taken
+//   while holding dir_states_lock
+static EP_STAT
+capfs_dir_flush_states(bool expired_only) {
+    EP_STAT estat = EP_STAT_OK;
+
+    pthread_mutex_lock(&dir_states_lock);
+    size_t num_gobs = 0;
+    for (capfs_dir_state_t *state = dir_states; state != NULL;
+         state = state->next) {
+        num_gobs++;
+    }
+    gdp_name_t *gobs = calloc(sizeof(gdp_name_t), num_gobs + 1);
+    num_gobs = 0;
+    for (capfs_dir_state_t *state = dir_states; state != NULL;
+         state = state->next) {
+        memcpy(gobs[num_gobs++], state->file->gob, sizeof(gdp_name_t));
+    }
+    pthread_mutex_unlock(&dir_states_lock);
+
+    time_t now = time(NULL);
+    for (size_t i = 0; i < num_gobs; i++) {
+        pthread_rwlock_t *lock = capfs_file_lock(gobs[i]);
+        pthread_rwlock_wrlock(lock);
+        // Someone else may have flushed it in the meantime
+        capfs_dir_state_t *state = capfs_dir_state_find(gobs[i]);
+        if (state != NULL
+            && (!expired_only
+                || now - state->dirty_since >= DIR_FLUSH_WINDOW)) {
+            EP_STAT flush_estat = capfs_dir_state_flush(state);
+            if (!EP_STAT_ISOK(flush_estat)) {
+                estat = flush_estat;
+            }
+        }
+        pthread_rwlock_unlock(lock);
+    }
+    free(gobs);
+    return estat;
+}
+
+static void *
+capfs_dir_flusher_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&dir_flusher_lock);
+    while (!dir_flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += DIR_FLUSH_WINDOW;
+        pthread_cond_timedwait(&dir_flusher_cond, &dir_flusher_lock,
+                               &deadline);
+        if (dir_flusher_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&dir_flusher_lock);
+        capfs_dir_flush_states(true);
+        pthread_mutex_lock(&dir_flusher_lock);
+    }
+    pthread_mutex_unlock(&dir_flusher_lock);
+    return NULL;
+}
+
+static void
+capfs_dir_flusher_start(void) {
+    pthread_mutex_lock(&dir_flusher_lock);
+    if (!dir_flusher_stop) {
+        dir_flusher_started = pthread_create(&dir_flusher, NULL,
+                                             capfs_dir_flusher_thread,
+                                             NULL) == 0;
+    }
+    pthread_mutex_unlock(&dir_flusher_lock);
+}
+
+void
+capfs_dir_flush_stop(void) {
+    pthread_mutex_lock(&dir_flusher_lock);
+    dir_flusher_stop = true;
+    pthread_cond_broadcast(&dir_flusher_cond);
+    bool started = dir_flusher_started;
+    dir_flusher_started = false;
+    pthread_mutex_unlock(&dir_flusher_lock);
+    if (started) {
+        pthread_join(dir_flusher, NULL);
+    }
+}
+
+static EP_STAT
+capfs_dir_state_new(capfs_dir_t *dir, capfs_dir_state_t **state) {
+    EP_STAT estat;
+
+    pthread_once(&dir_flusher_once, capfs_dir_flusher_start);
+    *state = calloc(sizeof(capfs_dir_state_t), 1);
+    estat = capfs_dir_replay(dir->file, &(*state)->table);
+    EP_STAT_CHECK(estat, goto fail0);
+    // Keep our own handle so the state can be flushed after dir is closed
+    estat = capfs_file_open_gob(dir->file->gob, &(*state)->file);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    (*state)->dirty_since = time(NULL);
+    pthread_mutex_lock(&dir_states_lock);
+    (*state)->next = dir_states;
+    dir_states = *state;
+    pthread_mutex_unlock(&dir_states_lock);
+    return EP_STAT_OK;
+
+fail0:
+    free(*state);
+    return estat;
+}
+
+
+// Serves the table from unflushed state if there is any, otherwise from the
+//   log
+static EP_STAT
+capfs_dir_read_table(capfs_dir_t *dir, capfs_dir_table_t *table) {
+    capfs_dir_state_t *state = capfs_dir_state_find(dir->file->gob);
+    if (state != NULL) {
+        memcpy(table, &state->table, DIR_TABLE_SIZE);
+        return EP_STAT_OK;
+    }
+    return capfs_dir_replay(dir->file, table);
+}
+
+// Caller holds the directory lock
+static EP_STAT
+capfs_dir_flush_locked(capfs_dir_t *dir) {
+    capfs_dir_state_t *state = capfs_dir_state_find(dir->file->gob);
+    if (state == NULL) {
+        return EP_STAT_OK;
+    }
+    return capfs_dir_state_flush(state);
+}
+
+// Writeback is deferred: the delta is applied to the in-memory state and
+//   written out with the rest of the batch once the flush window passes, the
+//   batch fills up, or the directory is fsynced
+static EP_STAT
+capfs_dir_write_delta(capfs_dir_t *dir, uint8_t type,
+                      capfs_dir_entry_t *entry) {
+    EP_STAT estat;
+
+    // A full batch whose flush failed before must go out first, nothing is
+    //   applied unless there is room to queue it
+    capfs_dir_state_t *state = capfs_dir_state_find(dir->file->gob);
+    if (state != NULL && state->num_pending == DIR_BATCH_MAX) {
+        estat = capfs_dir_state_flush(state);
+        EP_STAT_CHECK(estat, goto fail0);
+        state = NULL;
+    }
+    if (state == NULL) {
+        estat = capfs_dir_state_new(dir, &state);
+        EP_STAT_CHECK(estat, goto fail0);
+    }
+
+    // Leaves the table alone on failure
+    estat = capfs_dir_table_apply(&state->table, type, entry);
+    EP_STAT_CHECK(estat, goto fail0);
+    capfs_dir_delta_t *delta = state->pending + state->num_pending;
+    memset(delta, 0, DIR_BATCH_DELTA_SIZE);
+    delta->type = type;
+    memcpy(&delta->entry, entry, DIR_ENTRY_SIZE);
+    state->num_pending++;
+
+    // The delta is queued and the state kept if this fails, so it is written
+    //   back by a later flush like any other; not the caller's failure
+    if (state->num_pending == DIR_BATCH_MAX
+        || time(NULL) - state->dirty_since >= DIR_FLUSH_WINDOW) {
+        capfs_dir_state_flush(state);
+    }
+    return EP_STAT_OK;
+
+fail0:
+    return estat;
+}
+
 // Should only be called manually! See test/make_root.c
 EP_STAT
 capfs_dir_make_root(void) {
@@ -86,15 +667,10 @@ capfs_dir_make_root(void) {
 
     // Write empty directory
     capfs_dir_table_t table;
-    memset(&table, 0, DIR_TABLE_SIZE);
-    // Add . and ..
-    estat = capfs_dir_table_insert_entry(&table, ".", true, file->gob);
-    EP_STAT_CHECK(estat, goto fail1);
-    estat = capfs_dir_table_insert_entry(&table, "..", true, file->gob);
+    estat = capfs_dir_table_init(&table, file->gob, file->gob);
     EP_STAT_CHECK(estat, goto fail1);
     // Commit
-    estat = capfs_file_write(file, (const char *) &table, DIR_TABLE_SIZE,
-                             0);
+    estat = capfs_dir_write_checkpoint(file, &table);
     EP_STAT_CHECK(estat, goto fail1);
 
     // Close & Cleanup
@@ -114,8 +690,22 @@ capfs_dir_open_root(capfs_dir_t **dir) {
     EP_STAT estat;    
     capfs_file_t *file;
 
+    // The cache of an earlier mount saves looking the root up by name
+    gdp_name_t gob;
+    if (capfs_cache_root(gob)) {
+        estat = capfs_file_open_gob(gob, &file);
+        if (EP_STAT_ISOK(estat)) {
+            *dir = capfs_dir_new(file);
+            return EP_STAT_OK;
+        }
+        // Moved or gone with its store, or just unreachable for now. The
+        //   name says which, and a missing root is not made here
+        capfs_cache_forget_root();
+    }
+
     estat = capfs_file_open("/", &file);
     EP_STAT_CHECK(estat, goto fail0);
+    capfs_cache_set_root(file->gob);
     *dir = capfs_dir_new(file);
     return EP_STAT_OK;
 
@@ -131,11 +721,11 @@ capfs_dir_make_step_1(capfs_dir_t *parent, const char *name,
     }
     EP_STAT estat;
 
-    // Read and parse parent table
-    char names[DIR_ENTRIES][FILE_NAME_MAX_LEN + 1];
-    gdp_name_t gobs[DIR_ENTRIES];
-
-    estat = capfs_dir_readdir(parent, parent_table, names, gobs);
+    // Read parent table. This is only an early check, the log is created
+    //   without holding the parent and step 2 checks again
+    capfs_dir_rdlock(parent);
+    estat = capfs_dir_read_table(parent, parent_table);
+    capfs_dir_unlock(parent);
     EP_STAT_CHECK(estat, goto fail0);
 
     // Capacity check (in parent)
@@ -145,13 +735,7 @@ capfs_dir_make_step_1(capfs_dir_t *parent, const char *name,
     }
 
     // Check existence (in parent)
-    size_t index = 0;
-    for (; index < DIR_ENTRIES; index++) {
-        if (strcmp(names[index], name) == 0) {
-            break;
-        }
-    }
-    if (index != DIR_ENTRIES) {
+    if (capfs_dir_table_find(parent_table, name) != DIR_ENTRIES) {
         estat = EP_STAT_INVALID_ARG;
         goto fail0;
     }
@@ -167,24 +751,52 @@ fail0:
 
 static EP_STAT
 capfs_dir_make_step_2(capfs_dir_t *parent, const char *name, bool is_dir,
-                      capfs_file_t *file, capfs_dir_table_t *parent_table) {
+                      mode_t mode, capfs_file_t *file) {
     EP_STAT estat;
+    capfs_dir_wrlock(parent);
 
-    estat = capfs_dir_table_insert_entry(parent_table, name, is_dir, file->gob);
+    // Another thread may have taken the name or the last slot while the log
+    //   was being created
+    capfs_dir_table_t parent_table;
+    estat = capfs_dir_read_table(parent, &parent_table);
     EP_STAT_CHECK(estat, goto fail0);
+    if (parent_table.length == DIR_ENTRIES) {
+        estat = EP_STAT_OUT_OF_MEMORY;
+        goto fail0;
+    }
+    if (capfs_dir_table_find(&parent_table, name) != DIR_ENTRIES) {
+        estat = EP_STAT_INVALID_ARG;
+        goto fail0;
+    }
+
+    capfs_dir_entry_t entry;
+    capfs_dir_entry_init(&entry, name, is_dir, mode, file->gob);
 
     // Writeback (for parent)
-    estat = capfs_file_write(parent->file, (const char *) parent_table,
-                             DIR_TABLE_SIZE, 0);
+    estat = capfs_dir_write_delta(parent, DIR_RECORD_INSERT, &entry);
     EP_STAT_CHECK(estat, goto fail0);
+    capfs_dir_unlock(parent);
     return EP_STAT_OK;
 
 fail0:
+    capfs_dir_unlock(parent);
     return estat;
 }
 
+// Takes back a log step 1 created when the rest failed, so nothing leaks or
+//   stays counted. Frees file
+static void
+capfs_dir_make_undo(capfs_file_t *file) {
+    gdp_name_t gob;
+    memcpy(gob, file->gob, sizeof(gdp_name_t));
+    capfs_file_close(file);
+    capfs_file_free(file);
+    capfs_log_remove(gob);
+    capfs_file_usage_add(-1, 0);
+}
+
 EP_STAT
-capfs_dir_make_file(capfs_dir_t *parent, const char *name, 
+capfs_dir_make_file(capfs_dir_t *parent, const char *name, mode_t mode,
                     capfs_file_t **file) {
     EP_STAT estat;
 
@@ -192,17 +804,26 @@ capfs_dir_make_file(capfs_dir_t *parent, const char *name,
     estat = capfs_dir_make_step_1(parent, name, file, &parent_table);
     EP_STAT_CHECK(estat, goto fail0);
 
-    estat = capfs_dir_make_step_2(parent, name, false, *file, &parent_table);
-    EP_STAT_CHECK(estat, goto fail0);
+    // Logs come out of the pool with the default mode
+    if (mode != 0) {
+        estat = capfs_file_set_attr(*file, mode, NULL);
+        EP_STAT_CHECK(estat, goto fail1);
+    }
+
+    estat = capfs_dir_make_step_2(parent, name, false, mode, *file);
+    EP_STAT_CHECK(estat, goto fail1);
 
     return EP_STAT_OK;
 
+fail1:
+    capfs_dir_make_undo(*file);
 fail0:
     return estat;
 }
 
 EP_STAT
-capfs_dir_mkdir(capfs_dir_t *parent, const char *name, capfs_dir_t **dir) {
+capfs_dir_mkdir(capfs_dir_t *parent, const char *name, mode_t mode,
+                capfs_dir_t **dir) {
     EP_STAT estat;
 
     capfs_file_t *file;
@@ -214,59 +835,96 @@ capfs_dir_mkdir(capfs_dir_t *parent, const char *name, capfs_dir_t **dir) {
 
     // Write empty directory (for child)
     capfs_dir_table_t child_table;
-    memset(&child_table, 0, DIR_TABLE_SIZE);
-    // Add . and ..
-    estat = capfs_dir_table_insert_entry(&child_table, ".", true, file->gob);
-    EP_STAT_CHECK(estat, goto fail1);
-    estat = capfs_dir_table_insert_entry(&child_table, "..", true,
-                                         parent->file->gob);
+    estat = capfs_dir_table_init(&child_table, file->gob, parent->file->gob);
     EP_STAT_CHECK(estat, goto fail1);
     // Commit
-    estat = capfs_file_write(file, (const char *) &child_table, DIR_TABLE_SIZE,
-                             0);
+    estat = capfs_dir_write_checkpoint(file, &child_table);
     EP_STAT_CHECK(estat, goto fail1);
 
-    estat = capfs_dir_make_step_2(parent, name, true, file, &parent_table);
+    estat = capfs_dir_make_step_2(parent, name, true, mode, file);
     EP_STAT_CHECK(estat, goto fail1);
 
     return EP_STAT_OK;
 
 fail1:
-    capfs_dir_free(*dir);
+    capfs_dir_make_undo(file);
+    free(*dir);
 fail0:
     return estat;
 }
 
 static EP_STAT
-capfs_dir_open_step_1(capfs_dir_t *parent, const char *name, bool *is_dir,
-                      gdp_name_t *gob) {
+capfs_dir_lookup_n(capfs_dir_t *parent, const char *name, size_t length,
+                   capfs_dir_entry_t *entry) {
     if (parent == NULL) {
         return EP_STAT_INVALID_ARG;
     }
     EP_STAT estat;
 
-    // Read in names/gobs
+    capfs_dir_rdlock(parent);
+
     capfs_dir_table_t table;
-    char names[DIR_ENTRIES][FILE_NAME_MAX_LEN + 1];
-    gdp_name_t gobs[DIR_ENTRIES];
-    estat = capfs_dir_readdir(parent, &table, names, gobs);
+    estat = capfs_dir_read_table(parent, &table);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Verify child is there
-    size_t index = 0;
-    for (; index < DIR_ENTRIES; index++) {
-        if (strcmp(names[index], name) == 0) {
-            break;
-        }
-    }
+    size_t index = capfs_dir_table_find_n(&table, name, length);
     if (index == DIR_ENTRIES) {
         estat = EP_STAT_NOT_FOUND;
         goto fail0;
     }
+    *entry = table.entries[index];
+    capfs_dir_unlock(parent);
+    return EP_STAT_OK;
+
+fail0:
+    capfs_dir_unlock(parent);
+    return estat;
+}
+
+EP_STAT
+capfs_dir_table_read(capfs_dir_t *dir, capfs_dir_table_t *table) {
+    if (dir == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    EP_STAT estat;
+
+    capfs_dir_rdlock(dir);
+    estat = capfs_dir_read_table(dir, table);
+    capfs_dir_unlock(dir);
+    return estat;
+}
+
+bool
+capfs_dir_table_lookup(capfs_dir_table_t *table, const char *name,
+                       capfs_dir_entry_t *entry) {
+    size_t index = capfs_dir_table_find(table, name);
+    if (index == DIR_ENTRIES) {
+        return false;
+    }
+    *entry = table->entries[index];
+    return true;
+}
+
+// Resolves a single name without opening it
+EP_STAT
+capfs_dir_lookup(capfs_dir_t *parent, const char *name,
+                 capfs_dir_entry_t *entry) {
+    return capfs_dir_lookup_n(parent, name, strlen(name), entry);
+}
+
+static EP_STAT
+capfs_dir_open_step_1(capfs_dir_t *parent, const char *name, bool *is_dir,
+                      gdp_name_t *gob) {
+    EP_STAT estat;
+
+    // Verify child is there
+    capfs_dir_entry_t entry;
+    estat = capfs_dir_lookup(parent, name, &entry);
+    EP_STAT_CHECK(estat, goto fail0);
 
     // Copy data and finish
-    *is_dir = table.entries[index].is_dir;
-    memcpy(gob, gobs[index], sizeof(gdp_name_t));
+    *is_dir = entry.is_dir;
+    memcpy(gob, entry.gob, sizeof(gdp_name_t));
     return EP_STAT_OK;
 
 fail0:
@@ -336,28 +994,48 @@ fail0:
     return estat;
 }
 
-// If last token is a directory, does not open it
+// Opens the directory holding the last component of path, which itself is
+//   not opened (it need not exist). Components are looked up in place, so
+//   there is no limit on depth
 EP_STAT
-capfs_dir_opendir_path(char **path_tokens, size_t num_tokens,
-                       capfs_dir_t **dir) {
+capfs_dir_opendir_path(const char *path, capfs_dir_t **dir) {
     EP_STAT estat;
 
+    // Every path operation comes through here, so expired batches are written
+    //   back no later than the next operation
+    capfs_dir_flush_states(true);
+
     estat = capfs_dir_open_root(dir);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Directory exists
-    for (size_t i = 0; i < num_tokens - 1; i++) {
-        capfs_dir_t *new_dir;
-        estat = capfs_dir_opendir(*dir, path_tokens[i], &new_dir);
+    const char *cursor = path;
+    path_token_t token;
+    path_token_t next;
+    bool more = path_next(&cursor, &token);
+    while (more && path_next(&cursor, &next)) {
+        // Directory exists
+        capfs_dir_entry_t entry;
+        estat = capfs_dir_lookup_n(*dir, token.name, token.length, &entry);
+        EP_STAT_CHECK(estat, goto fail1);
+        if (!entry.is_dir) {
+            estat = EP_STAT_INVALID_ARG;
+            goto fail1;
+        }
+
+        capfs_file_t *file;
+        estat = capfs_dir_open_step_2(&entry.gob, &file);
         EP_STAT_CHECK(estat, goto fail1);
         estat = capfs_dir_closedir(*dir);
-        EP_STAT_CHECK(estat, goto fail0);
-        *dir = new_dir;
+        capfs_dir_free(*dir);
+        *dir = capfs_dir_new(file);
+        EP_STAT_CHECK(estat, goto fail1);
+        token = next;
     }
     return EP_STAT_OK;
 
 fail1:
     capfs_dir_closedir(*dir);
+    capfs_dir_free(*dir);
 fail0:
     return estat;
 }
@@ -366,58 +1044,42 @@ bool
 capfs_dir_has_child(capfs_dir_t *parent, const char *name, bool is_dir) {
     EP_STAT estat;
 
-    capfs_dir_table_t table;
-    char names[DIR_ENTRIES][FILE_NAME_MAX_LEN + 1];
-    estat = capfs_dir_readdir(parent, &table, names, NULL);
+    capfs_dir_entry_t entry;
+    estat = capfs_dir_lookup(parent, name, &entry);
     EP_STAT_CHECK(estat, goto fail0);
-
-    for (size_t i = 0; i < table.length; i++) {
-        if (strcmp(names[i], name) == 0) {
-            return is_dir == table.entries[i].is_dir;
-        }
-    }
+    return is_dir == entry.is_dir;
 
 fail0:
     return false;
 }
 
 
-// Provide NULL to table or gobs if not needed
+// Hands entries to filler one at a time, starting at slot *cursor. Each
+//   entry comes with the cursor of the one after it; when filler returns
+//   false the listing stops and *cursor is left at the refused entry
 EP_STAT
-capfs_dir_readdir(capfs_dir_t *dir, capfs_dir_table_t *table,
-                  char names[DIR_ENTRIES][FILE_NAME_MAX_LEN + 1],
-                  gdp_name_t gobs[DIR_ENTRIES]) {
-    if (dir == NULL) {
+capfs_dir_readdir(capfs_dir_t *dir, off_t *cursor, capfs_dir_filler_t filler,
+                  void *arg) {
+    if (dir == NULL || *cursor < 0) {
         return EP_STAT_INVALID_ARG;
     }
     EP_STAT estat;
 
-    // Clear names array
-    for (size_t i = 0; i < DIR_ENTRIES; i++) {
-        names[i][0] = '\0';
-    }
-
-    // Read file contents
-    char block_buf[DIR_TABLE_SIZE];
-    estat = capfs_file_read(dir->file, block_buf, DIR_TABLE_SIZE, 0);
+    // Listing works on a copy, filler runs without the lock
+    capfs_dir_table_t table;
+    capfs_dir_rdlock(dir);
+    estat = capfs_dir_read_table(dir, &table);
+    capfs_dir_unlock(dir);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Copy into capfs_dir_table_t
-    if (table == NULL) {
-        capfs_dir_table_t _table;
-        table = &_table;
-    }
-    memcpy(table, block_buf, DIR_TABLE_SIZE);
-
-    // Copy table entry names and gobs
-    for (size_t i = 0; i < DIR_ENTRIES; i++) {
-        capfs_dir_entry_t entry = table->entries[i];
-        if (!entry.valid) {
-            break;
+    // Slots are stable, so holes are skipped rather than compacted
+    for (; *cursor < DIR_ENTRIES; (*cursor)++) {
+        capfs_dir_entry_t *entry = table.entries + *cursor;
+        if (!entry->valid) {
+            continue;
         }
-        strcpy(names[i], entry.name);
-        if (gobs != NULL) {
-            memcpy(gobs[i], entry.gob, sizeof(gdp_name_t));
+        if (!filler(arg, entry, *cursor + 1)) {
+            break;
         }
     }
     return EP_STAT_OK;
@@ -432,18 +1094,11 @@ capfs_dir_remove_entry(capfs_dir_t *parent, capfs_dir_table_t *table,
                        size_t index) {
     EP_STAT estat;
 
-    // Remove by shifting everything else up
-    for (index++; index < table->length; index++) {
-        table->entries[index - 1] = table->entries[index];
-    }
-    // Zero out last one
-    memset(table->entries + index - 1, 0, DIR_ENTRY_SIZE);
-    table->length--;
-
     // Writeback
-    estat = capfs_file_write(parent->file, (const char *) table,
-                             DIR_TABLE_SIZE, 0);
+    estat = capfs_dir_write_delta(parent, DIR_RECORD_REMOVE,
+                                  table->entries + index);
     EP_STAT_CHECK(estat, goto fail0);
+    capfs_dir_table_remove_entry(table, index);
     return EP_STAT_OK;
 
 fail0:
@@ -457,38 +1112,25 @@ capfs_dir_rename(capfs_dir_t *from, capfs_dir_t *to, const char *from_name,
         return EP_STAT_INVALID_ARG;
     }
     EP_STAT estat;
-
-    char names[DIR_ENTRIES][FILE_NAME_MAX_LEN + 1];
-    gdp_name_t gobs[DIR_ENTRIES];
+    capfs_dir_wrlock_pair(from, to);
 
     // Get "from" table + gob (checks from_name exists)
     capfs_dir_table_t from_table;
-    estat = capfs_dir_readdir(from, &from_table, names, gobs);
+    estat = capfs_dir_read_table(from, &from_table);
     EP_STAT_CHECK(estat, goto fail0);
 
-    size_t from_index = 0;
-    for (; from_index < from_table.length; from_index++) {
-        if (strcmp(names[from_index], from_name) == 0) {
-            break;
-        }
-    }
-    if (from_index == from_table.length) {
+    size_t from_index = capfs_dir_table_find(&from_table, from_name);
+    if (from_index == DIR_ENTRIES) {
         estat = EP_STAT_INVALID_ARG;
         goto fail0;
     }
 
     // Get "to" table (checks to_name doesn't exist)
     capfs_dir_table_t to_table;
-    estat = capfs_dir_readdir(to, &to_table, names, NULL);
+    estat = capfs_dir_read_table(to, &to_table);
     EP_STAT_CHECK(estat, goto fail0);
 
-    size_t to_index = 0;
-    for (; to_index < to_table.length; to_index++) {
-        if (strcmp(names[to_index], to_name) == 0) {
-            break;
-        }
-    }
-    if (to_index != to_table.length) {
+    if (capfs_dir_table_find(&to_table, to_name) != DIR_ENTRIES) {
         estat = EP_STAT_INVALID_ARG;
         goto fail0;
     }
@@ -499,21 +1141,68 @@ capfs_dir_rename(capfs_dir_t *from, capfs_dir_t *to, const char *from_name,
         goto fail0;
     }
 
-    // Insert into to_table, write back
-    estat = capfs_dir_table_insert_entry(&to_table, to_name, false, 
-                                         gobs[from_index]);
-    EP_STAT_CHECK(estat, goto fail0);
-    estat = capfs_file_write(to->file, (const char *) &to_table, DIR_TABLE_SIZE,
-                             0);
+    // Insert into "to", write back
+    capfs_dir_entry_t entry = from_table.entries[from_index];
+    memset(entry.name, 0, FILE_NAME_MAX_LEN + 1);
+    strcpy(entry.name, to_name);
+    estat = capfs_dir_write_delta(to, DIR_RECORD_INSERT, &entry);
     EP_STAT_CHECK(estat, goto fail0);
+    // The insert must reach the log before the remove does, otherwise a crash
+    //   in between would lose the entry
+    if (!GDP_NAME_SAME(from->file->gob, to->file->gob)) {
+        estat = capfs_dir_flush_locked(to);
+        EP_STAT_CHECK(estat, goto fail0);
+    }
 
     // Remove from from_table, write back
     estat = capfs_dir_remove_entry(from, &from_table, from_index);
     EP_STAT_CHECK(estat, goto fail0);
 
+    capfs_dir_unlock_pair(from, to);
+    return EP_STAT_OK;
+
+fail0:
+    capfs_dir_unlock_pair(from, to);
+    return estat;
+}
+
+// Refreshes the size and mtime hints of an entry
+EP_STAT
+capfs_dir_set_attr(capfs_dir_t *parent, const char *name, size_t size,
+                   time_t mtime, mode_t mode) {
+    if (parent == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    EP_STAT estat;
+    capfs_dir_wrlock(parent);
+
+    capfs_dir_table_t table;
+    estat = capfs_dir_read_table(parent, &table);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    size_t index = capfs_dir_table_find(&table, name);
+    if (index == DIR_ENTRIES) {
+        estat = EP_STAT_NOT_FOUND;
+        goto fail0;
+    }
+    // Nothing changed
+    capfs_dir_entry_t entry = table.entries[index];
+    mode = mode != 0 ? mode : entry.mode;
+    if (entry.size == size && entry.mtime == mtime && entry.mode == mode) {
+        capfs_dir_unlock(parent);
+        return EP_STAT_OK;
+    }
+
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.mode = mode;
+    estat = capfs_dir_write_delta(parent, DIR_RECORD_UPDATE, &entry);
+    EP_STAT_CHECK(estat, goto fail0);
+    capfs_dir_unlock(parent);
     return EP_STAT_OK;
 
 fail0:
+    capfs_dir_unlock(parent);
     return estat;
 }
 
@@ -526,29 +1215,106 @@ capfs_dir_remove_step_1(capfs_dir_t *parent, const char *name,
     EP_STAT estat;
 
     // Read parent contents
-    char names[DIR_ENTRIES][FILE_NAME_MAX_LEN + 1];
-    estat = capfs_dir_readdir(parent, table, names, NULL);
+    estat = capfs_dir_read_table(parent, table);
     EP_STAT_CHECK(estat, goto fail0);
 
     // Find name
-    for (; *index < DIR_ENTRIES; (*index)++) {
-        if (strcmp(names[*index], name) == 0) {
-            break;
+    *index = capfs_dir_table_find(table, name);
+    if (*index == DIR_ENTRIES) {
+        estat = EP_STAT_NOT_FOUND;
+        goto fail0;
+    }
+    return EP_STAT_OK;
+
+fail0:
+    return estat;
+}
+
+// One half of a rename between directories another process writes, the
+//   other is capfs_dir_unlink. Linking what is already there is fine, so
+//   it may be done again. Written back before returning
+EP_STAT
+capfs_dir_link(capfs_dir_t *parent, const char *name,
+               const capfs_dir_entry_t *entry) {
+    if (parent == NULL || strlen(name) > FILE_NAME_MAX_LEN) {
+        return EP_STAT_INVALID_ARG;
+    }
+    EP_STAT estat;
+    capfs_dir_wrlock(parent);
+
+    capfs_dir_table_t table;
+    estat = capfs_dir_read_table(parent, &table);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    size_t index = capfs_dir_table_find(&table, name);
+    if (index != DIR_ENTRIES) {
+        if (!GDP_NAME_SAME(table.entries[index].gob, entry->gob)) {
+            estat = EP_STAT_INVALID_ARG;
+            goto fail0;
         }
+        capfs_dir_unlock(parent);
+        return EP_STAT_OK;
     }
-    if (*index == DIR_ENTRIES) {
+    if (table.length == DIR_ENTRIES) {
+        estat = EP_STAT_OUT_OF_MEMORY;
+        goto fail0;
+    }
+
+    capfs_dir_entry_t linked = *entry;
+    memset(linked.name, 0, FILE_NAME_MAX_LEN + 1);
+    strcpy(linked.name, name);
+    linked.valid = true;
+    estat = capfs_dir_write_delta(parent, DIR_RECORD_INSERT, &linked);
+    EP_STAT_CHECK(estat, goto fail0);
+    estat = capfs_dir_flush_locked(parent);
+    EP_STAT_CHECK(estat, goto fail0);
+    capfs_dir_unlock(parent);
+    return EP_STAT_OK;
+
+fail0:
+    capfs_dir_unlock(parent);
+    return estat;
+}
+
+// Removes name only if it still names gob, leaving the usage counters alone
+//   since the log lives on elsewhere. Written back before returning
+EP_STAT
+capfs_dir_unlink(capfs_dir_t *parent, const char *name,
+                 const gdp_name_t gob) {
+    if (parent == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    EP_STAT estat;
+    capfs_dir_wrlock(parent);
+
+    capfs_dir_table_t table;
+    size_t index = 0;
+    estat = capfs_dir_remove_step_1(parent, name, &table, &index);
+    EP_STAT_CHECK(estat, goto fail0);
+    if (!GDP_NAME_SAME(table.entries[index].gob, gob)) {
         estat = EP_STAT_NOT_FOUND;
         goto fail0;
     }
+
+    estat = capfs_dir_remove_entry(parent, &table, index);
+    EP_STAT_CHECK(estat, goto fail0);
+    estat = capfs_dir_flush_locked(parent);
+    EP_STAT_CHECK(estat, goto fail0);
+    capfs_dir_unlock(parent);
     return EP_STAT_OK;
 
 fail0:
+    capfs_dir_unlock(parent);
     return estat;
 }
 
 EP_STAT
 capfs_dir_remove_file(capfs_dir_t *parent, const char *name) {
+    if (parent == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
     EP_STAT estat;
+    capfs_dir_wrlock(parent);
 
     capfs_dir_table_t table;
     size_t index = 0;
@@ -561,17 +1327,25 @@ capfs_dir_remove_file(capfs_dir_t *parent, const char *name) {
         goto fail0;
     }
 
+    uint64_t size = table.entries[index].size;
     estat = capfs_dir_remove_entry(parent, &table, index);
     EP_STAT_CHECK(estat, goto fail0);
+    capfs_dir_unlock(parent);
+    capfs_file_usage_add(-1, -(int64_t) size);
     return EP_STAT_OK;
 
 fail0:
+    capfs_dir_unlock(parent);
     return estat;
 }
 
 EP_STAT
 capfs_dir_rmdir(capfs_dir_t *parent, const char *name) {
+    if (parent == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
     EP_STAT estat;
+    capfs_dir_wrlock(parent);
 
     capfs_dir_table_t table;
     size_t index = 0;
@@ -584,15 +1358,36 @@ capfs_dir_rmdir(capfs_dir_t *parent, const char *name) {
         goto fail0;
     }
 
+    uint64_t size = table.entries[index].size;
     estat = capfs_dir_remove_entry(parent, &table, index);
     EP_STAT_CHECK(estat, goto fail0);
+    capfs_dir_unlock(parent);
+    capfs_file_usage_add(-1, -(int64_t) size);
     return EP_STAT_OK;
 
 fail0:
+    capfs_dir_unlock(parent);
     return estat;
 }
 
-// Does not free for you
+EP_STAT
+capfs_dir_flush(capfs_dir_t *dir) {
+    if (dir == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    EP_STAT estat;
+
+    capfs_dir_wrlock(dir);
+    estat = capfs_dir_flush_locked(dir);
+    capfs_dir_unlock(dir);
+    return estat;
+}
+
+EP_STAT
+capfs_dir_flush_all(void) {
+    return capfs_dir_flush_states(false);
+}
+
 EP_STAT
 capfs_dir_closedir(capfs_dir_t *dir) {
     if (dir == NULL) {
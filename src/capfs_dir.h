@@ -46,6 +46,26 @@
 // Should be exactly BLOCK_SIZE
 #define DIR_TABLE_SIZE (DIR_ENTRIES_SIZE + DIR_META_SIZE)
 
+// Directory log records
+#define DIR_RECORD_MAGIC 0x63617064
+#define DIR_RECORD_CHECKPOINT 1
+#define DIR_RECORD_INSERT 2
+#define DIR_RECORD_REMOVE 3
+#define DIR_RECORD_BATCH 4
+#define DIR_RECORD_UPDATE 5
+// Number of delta records between full table checkpoints
+#define DIR_CHECKPOINT_INTERVAL 128
+// Bytes
+#define DIR_RECORD_HEADER_SIZE 16
+#define DIR_DELTA_SIZE (DIR_RECORD_HEADER_SIZE + DIR_ENTRY_SIZE)
+#define DIR_CHECKPOINT_SIZE (DIR_RECORD_HEADER_SIZE + DIR_TABLE_SIZE)
+// Most deltas held in memory (and written in one batch record) per directory
+#define DIR_BATCH_MAX 128
+// Bytes
+#define DIR_BATCH_DELTA_SIZE (8 + DIR_ENTRY_SIZE)
+// Seconds a directory may hold unflushed deltas
+#define DIR_FLUSH_WINDOW 1
+
 typedef struct capfs_dir {
     capfs_file_t *file;
 } capfs_dir_t;
@@ -55,37 +75,83 @@ typedef struct capfs_dir_entry {
     unsigned valid : 1;
     unsigned padding1 : 6;
 
-    unsigned char padding2[15];
+    unsigned char padding2;
+    uint16_t mode;          // Type and permission bits, 0 for the default.
+                            //   The only copy for directories, a hint for
+                            //   files
+    uint32_t mtime;         // Attribute hints, refreshed when the child
+    uint64_t size;          //   is closed or truncated
     unsigned char gob[32];
     char name[FILE_NAME_MAX_LEN + 1];
 } capfs_dir_entry_t;
 
+// Every record in a directory log starts with this header. A checkpoint is
+//   followed by the full table, an insert or remove delta by a single entry,
+//   and a batch by count capfs_dir_delta_t. Readers replay the deltas on top
+//   of the last checkpoint.
+typedef struct capfs_dir_record_header {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t padding;
+    uint16_t count;         // Batch records only
+    uint32_t checkpoint;    // recno of the checkpoint this record builds on
+    uint32_t deltas;        // Deltas since that checkpoint, including this one
+} capfs_dir_record_header_t;
+
+typedef struct capfs_dir_delta {
+    uint8_t type;
+    unsigned char padding[7];
+    capfs_dir_entry_t entry;
+} capfs_dir_delta_t;
+
 typedef struct capfs_dir_table {
     uint8_t length;
     unsigned char padding[DIR_META_SIZE - 1];
     capfs_dir_entry_t entries[DIR_ENTRIES];
 } capfs_dir_table_t;
 
+// Returns false to stop a readdir. next is the cursor to resume after entry
+typedef bool (*capfs_dir_filler_t)(void *arg, capfs_dir_entry_t *entry,
+                                   off_t next);
+
 EP_STAT capfs_dir_make_root(void);
 EP_STAT capfs_dir_open_root(capfs_dir_t **dir);
-EP_STAT capfs_dir_make_file(capfs_dir_t *parent, const char *name,
+// mode is the type and permission bits to create with, 0 for the default
+EP_STAT capfs_dir_make_file(capfs_dir_t *parent, const char *name, mode_t mode,
                             capfs_file_t **file);
-EP_STAT capfs_dir_mkdir(capfs_dir_t *parent, const char *name,
+EP_STAT capfs_dir_mkdir(capfs_dir_t *parent, const char *name, mode_t mode,
                         capfs_dir_t **dir);
+EP_STAT capfs_dir_lookup(capfs_dir_t *parent, const char *name,
+                         capfs_dir_entry_t *entry);
+// One read of the whole table, for callers looking up many names at once
+EP_STAT capfs_dir_table_read(capfs_dir_t *dir, capfs_dir_table_t *table);
+bool capfs_dir_table_lookup(capfs_dir_table_t *table, const char *name,
+                            capfs_dir_entry_t *entry);
 EP_STAT capfs_dir_open_file(capfs_dir_t *parent, const char *name,
                             capfs_file_t **file);
 EP_STAT capfs_dir_opendir(capfs_dir_t *parent, const char *name,
                           capfs_dir_t **dir);
-EP_STAT capfs_dir_opendir_path(char **path_tokens, size_t num_tokens,
-                               capfs_dir_t **dir);
+EP_STAT capfs_dir_opendir_path(const char *path, capfs_dir_t **dir);
 bool capfs_dir_has_child(capfs_dir_t *parent, const char *name, bool is_dir);
-EP_STAT capfs_dir_readdir(capfs_dir_t *dir, capfs_dir_table_t *table,
-                          char names[DIR_ENTRIES][FILE_NAME_MAX_LEN + 1],
-                          gdp_name_t gobs[DIR_ENTRIES]);
+EP_STAT capfs_dir_readdir(capfs_dir_t *dir, off_t *cursor,
+                          capfs_dir_filler_t filler, void *arg);
 EP_STAT capfs_dir_rename(capfs_dir_t *from, capfs_dir_t *to,
                          const char *from_name, const char *to_name);
+// A rename done as two steps, see capfs_shard.c
+EP_STAT capfs_dir_link(capfs_dir_t *parent, const char *name,
+                       const capfs_dir_entry_t *entry);
+EP_STAT capfs_dir_unlink(capfs_dir_t *parent, const char *name,
+                         const gdp_name_t gob);
+// Leaves the mode (type and permission bits) alone when it is 0
+EP_STAT capfs_dir_set_attr(capfs_dir_t *parent, const char *name, size_t size,
+                           time_t mtime, mode_t mode);
 EP_STAT capfs_dir_remove_file(capfs_dir_t *parent, const char *name);
 EP_STAT capfs_dir_rmdir(capfs_dir_t *parent, const char *name);
+EP_STAT capfs_dir_flush(capfs_dir_t *dir);
+EP_STAT capfs_dir_flush_all(void);
+// Stops the thread writing back expired batches, before the last
+//   capfs_dir_flush_all of an unmount
+void capfs_dir_flush_stop(void);
 EP_STAT capfs_dir_closedir(capfs_dir_t *dir);
 capfs_dir_t *capfs_dir_new(capfs_file_t *file);
 void capfs_dir_free(capfs_dir_t *dir);
@@ -29,10 +29,58 @@
 
 #include "capfs_file.h"
 
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "capfs_cache.h"
 #include "capfs_util.h"
 
+static pthread_rwlock_t file_locks[FILE_LOCK_STRIPES];
+static pthread_once_t file_locks_once = PTHREAD_ONCE_INIT;
+
+static void
+capfs_file_locks_init(void) {
+    for (size_t i = 0; i < FILE_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(file_locks + i, NULL);
+    }
+}
+
+// Readers of a log share its lock, anything that appends holds it alone so
+//   the prevhash chain is never forked. Logs are striped over a fixed set of
+//   locks by gob, which is already a hash
+pthread_rwlock_t *
+capfs_file_lock(const gdp_name_t gob) {
+    pthread_once(&file_locks_once, capfs_file_locks_init);
+    uint32_t stripe;
+    memcpy(&stripe, gob, sizeof(uint32_t));
+    return file_locks + stripe % FILE_LOCK_STRIPES;
+}
+
+// Files made by capfs_file_new only know their gob; the log is opened on the
+//   first access, so a handle nobody reads or writes costs no round trip
+static EP_STAT
+capfs_file_log(capfs_file_t *file, capfs_log_t **log) {
+    EP_STAT estat = EP_STAT_OK;
+
+    *log = __atomic_load_n(&file->log, __ATOMIC_ACQUIRE);
+    if (*log != NULL) {
+        return EP_STAT_OK;
+    }
+    pthread_mutex_lock(&file->log_lock);
+    if (file->log == NULL) {
+        capfs_log_t *opened;
+        estat = capfs_log_open(file->gob, &opened);
+        if (EP_STAT_ISOK(estat)) {
+            __atomic_store_n(&file->log, opened, __ATOMIC_RELEASE);
+        }
+    }
+    *log = file->log;
+    pthread_mutex_unlock(&file->log_lock);
+    return estat;
+}
+
 // offset -> inode ptrs index
 // Returns an index as if indirect ptrs began indexing at DIRECT_PTRS
 static size_t
@@ -67,6 +115,9 @@ capfs_file_inode_print(inode_t *inode) {
     printf("has_indirect_block: %d\n", inode->has_indirect_block);
     printf("recno: %d\n", inode->recno);
     printf("length: %ld\n", inode->length);
+    printf("mode: %o\n", inode->mode);
+    printf("mtime: %u.%09u\n", inode->mtime, inode->mtime_nsec);
+    printf("ctime: %u.%09u\n", inode->ctime, inode->ctime_nsec);
     printf("direct_ptrs: ");
     for (size_t i = 0; i < DIRECT_PTRS; i++) {
         if (inode->direct_ptrs[i] != 0) {
@@ -83,247 +134,604 @@ capfs_file_inode_print(inode_t *inode) {
     printf("\n");
 }
 
+// Data blocks live in records that never change once appended, so they are
+//   cached by gob and recno and never need invalidating. Blocks are handed
+//   out by reference; an evicted block is freed when its last one is put
+static capfs_block_t *block_table[BLOCK_CACHE_BUCKETS];
+static capfs_block_t *lru_head;   // Most recently used
+static capfs_block_t *lru_tail;
+static size_t block_count;
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+// Never written blocks (holes) all share this one
+static capfs_block_t zero_block;
+
+static size_t
+capfs_block_bucket(const gdp_name_t gob, uint32_t recno) {
+    uint32_t hash;
+    memcpy(&hash, gob, sizeof(uint32_t));
+    return (hash ^ (recno * 2654435761u)) % BLOCK_CACHE_BUCKETS;
+}
+
+static void
+capfs_block_lru_unlink(capfs_block_t *block) {
+    if (block->lru_prev != NULL) {
+        block->lru_prev->lru_next = block->lru_next;
+    } else {
+        lru_head = block->lru_next;
+    }
+    if (block->lru_next != NULL) {
+        block->lru_next->lru_prev = block->lru_prev;
+    } else {
+        lru_tail = block->lru_prev;
+    }
+}
+
+static void
+capfs_block_lru_push(capfs_block_t *block) {
+    block->lru_prev = NULL;
+    block->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = block;
+    } else {
+        lru_tail = block;
+    }
+    lru_head = block;
+}
+
+// Caller holds block_lock
+static capfs_block_t *
+capfs_block_find_locked(const gdp_name_t gob, uint32_t recno) {
+    capfs_block_t *block = block_table[capfs_block_bucket(gob, recno)];
+    while (block != NULL && (block->recno != recno
+                             || memcmp(block->gob, gob, sizeof(gdp_name_t)))) {
+        block = block->next;
+    }
+    return block;
+}
+
+// Caller holds block_lock
+static void
+capfs_block_evict_locked(capfs_block_t *block) {
+    capfs_block_t **link = block_table + capfs_block_bucket(block->gob,
+                                                            block->recno);
+    while (*link != block) {
+        link = &(*link)->next;
+    }
+    *link = block->next;
+    capfs_block_lru_unlink(block);
+    block->cached = false;
+    block_count--;
+    if (block->ref == 0) {
+        free(block);
+    }
+}
+
+void
+capfs_block_put(capfs_block_t *block) {
+    if (block == NULL || block == &zero_block) {
+        return;
+    }
+    pthread_mutex_lock(&block_lock);
+    block->ref--;
+    if (block->ref == 0 && !block->cached) {
+        free(block);
+    }
+    pthread_mutex_unlock(&block_lock);
+}
+
+// Takes a reference on the block of record recno if it is cached (or a
+//   hole), NULL otherwise
+static capfs_block_t *
+capfs_block_get_cached(const gdp_name_t gob, uint32_t recno) {
+    // Never written (a hole), reads as zeros
+    if (recno == 0) {
+        return &zero_block;
+    }
+
+    pthread_mutex_lock(&block_lock);
+    capfs_block_t *cached = capfs_block_find_locked(gob, recno);
+    if (cached != NULL) {
+        cached->ref++;
+        capfs_block_lru_unlink(cached);
+        capfs_block_lru_push(cached);
+    }
+    pthread_mutex_unlock(&block_lock);
+    return cached;
+}
+
+// Reads the data block of record recno, from the cache file if an earlier
+//   mount kept it. Records may carry an indirect block before the data
 static EP_STAT
-capfs_file_read_block_from_recno(size_t recno, gdp_gin_t *ginp,
-                                 char **buf, size_t *size, off_t *offset) {
+capfs_file_load_block(capfs_log_t *log, const gdp_name_t gob, uint32_t recno,
+                      char data[BLOCK_SIZE]) {
     EP_STAT estat;
 
-    // Open GIN
-    gdp_datum_t *direct_datum = gdp_datum_new();
-    estat = gdp_gin_read_by_recno(ginp, recno, direct_datum);
+    if (capfs_cache_get(CACHE_BLOCK, gob, recno, 0, data, BLOCK_SIZE)) {
+        return EP_STAT_OK;
+    }
+
+    capfs_record_t *record;
+    estat = capfs_log_read(log, recno, &record);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Get inode metadata
-    gdp_buf_t *direct_buf = gdp_datum_getbuf(direct_datum);
-    size_t buf_len = gdp_buf_getlength(direct_buf);
-    if (buf_len < INODE_SIZE) {
+    // Only the metadata says where the data starts
+    size_t length = capfs_record_length(record);
+    inode_t inode2;
+    if (length < INODE_SIZE) {
         estat = EP_STAT_END_OF_FILE;
-        goto fail0;
+        goto fail1;
+    }
+    capfs_record_copy(record, 0, &inode2, INODE_METADATA_SIZE);
+    size_t skip = INODE_SIZE;
+    if (inode2.has_indirect_block) {
+        skip += INDIRECT_SIZE;
     }
-    inode_t inode2;
-    gdp_buf_read(direct_buf, (void *) &inode2, INODE_SIZE);
 
     // Sanity check
-    if ((buf_len < INODE_SIZE + BLOCK_SIZE
-            && !inode2.has_indirect_block)
-        || (buf_len < INODE_SIZE + INDIRECT_SIZE + BLOCK_SIZE
-            && inode2.has_indirect_block)) {
+    if (length < skip + BLOCK_SIZE) {
         estat = EP_STAT_END_OF_FILE;
-        goto fail0;
+        goto fail1;
     }
+    capfs_record_copy(record, skip, data, BLOCK_SIZE);
+    capfs_record_free(record);
+    capfs_cache_put(CACHE_BLOCK, gob, recno, 0, data, BLOCK_SIZE);
+    return EP_STAT_OK;
 
-    // Get raw data
-    char data_buf[BLOCK_SIZE];
-    if (inode2.has_indirect_block) {
-        size_t buf_size = INDIRECT_SIZE + BLOCK_SIZE;
-        char temp_buf[buf_size];
-        gdp_buf_read(direct_buf, (void *) temp_buf, buf_size);
-        memcpy(data_buf, temp_buf + INDIRECT_SIZE, BLOCK_SIZE);
-    } else {
-        size_t buf_size = BLOCK_SIZE;
-        char temp_buf[buf_size];
-        gdp_buf_read(direct_buf, (void *) temp_buf, buf_size);
-        memcpy(data_buf, temp_buf, BLOCK_SIZE);
-    }
+fail1:
+    capfs_record_free(record);
+fail0:
+    return estat;
+}
 
-    // Copy over relevant portions
-    size_t start_byte = *offset % BLOCK_SIZE;
-    size_t num = min(*size, BLOCK_SIZE - start_byte);
-    memcpy(*buf, data_buf + start_byte, num);
+// Takes a reference on the data block of record recno, loading it on a miss
+static EP_STAT
+capfs_file_get_block(capfs_log_t *log, const gdp_name_t gob, uint32_t recno,
+                     capfs_block_t **block) {
+    EP_STAT estat;
 
-    // Iterate & cleanup
-    gdp_datum_free(direct_datum);
-    *buf += num;
-    *offset += num;
-    *size -= num;
+    capfs_block_t *cached = capfs_block_get_cached(gob, recno);
+    if (cached != NULL) {
+        *block = cached;
+        return EP_STAT_OK;
+    }
+
+    // Raw data goes straight into the block, the only copy
+    capfs_block_t *loaded = malloc(sizeof(capfs_block_t));
+    estat = capfs_file_load_block(log, gob, recno, loaded->data);
+    EP_STAT_CHECK(estat, goto fail0);
+    memcpy(loaded->gob, gob, sizeof(gdp_name_t));
+    loaded->recno = recno;
+    loaded->ref = 1;
+    loaded->cached = true;
+
+    // Somebody else may have read it meanwhile
+    pthread_mutex_lock(&block_lock);
+    cached = capfs_block_find_locked(gob, recno);
+    if (cached != NULL) {
+        cached->ref++;
+        pthread_mutex_unlock(&block_lock);
+        free(loaded);
+        *block = cached;
+        return EP_STAT_OK;
+    }
+    size_t bucket = capfs_block_bucket(gob, recno);
+    loaded->next = block_table[bucket];
+    block_table[bucket] = loaded;
+    capfs_block_lru_push(loaded);
+    block_count++;
+    while (block_count > BLOCK_CACHE_SIZE) {
+        capfs_block_evict_locked(lru_tail);
+    }
+    pthread_mutex_unlock(&block_lock);
+    *block = loaded;
     return EP_STAT_OK;
 
 fail0:
-    gdp_datum_free(direct_datum);
+    free(loaded);
     return estat;
 }
 
+// The blocks a read misses are fetched FILE_FETCH_THREADS at a time, each
+//   one a round trip of its own, instead of one after the other. The reader
+//   queues all but one, fetches that one itself, then helps with the queue
+//   until its batch is done. The workers start on the first batch, for the
+//   same reason as the pool thread below
+typedef struct capfs_fetch_batch {
+    size_t pending;         // Under fetch_lock
+    pthread_cond_t done;
+} capfs_fetch_batch_t;
+
+typedef struct capfs_fetch {
+    capfs_log_t *log;
+    const unsigned char *gob;
+    uint32_t recno;
+    capfs_block_t **block;
+    EP_STAT estat;
+    capfs_fetch_batch_t *batch;
+    struct capfs_fetch *next;
+} capfs_fetch_t;
+
+static capfs_fetch_t *fetch_head;
+static capfs_fetch_t *fetch_tail;
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t fetch_once = PTHREAD_ONCE_INIT;
+
+// Caller holds fetch_lock
+static capfs_fetch_t *
+capfs_fetch_pop_locked(void) {
+    capfs_fetch_t *fetch = fetch_head;
+    if (fetch != NULL) {
+        fetch_head = fetch->next;
+        if (fetch_head == NULL) {
+            fetch_tail = NULL;
+        }
+    }
+    return fetch;
+}
+
+// Runs one fetch. Takes and returns with fetch_lock held
+static void
+capfs_fetch_run_locked(capfs_fetch_t *fetch) {
+    pthread_mutex_unlock(&fetch_lock);
+    fetch->estat = capfs_file_get_block(fetch->log, fetch->gob, fetch->recno,
+                                        fetch->block);
+    pthread_mutex_lock(&fetch_lock);
+    if (--fetch->batch->pending == 0) {
+        pthread_cond_broadcast(&fetch->batch->done);
+    }
+}
+
+static void *
+capfs_fetch_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&fetch_lock);
+    while (true) {
+        capfs_fetch_t *fetch = capfs_fetch_pop_locked();
+        if (fetch == NULL) {
+            pthread_cond_wait(&fetch_cond, &fetch_lock);
+            continue;
+        }
+        capfs_fetch_run_locked(fetch);
+    }
+    return NULL;
+}
+
+static void
+capfs_fetch_start(void) {
+    for (size_t i = 0; i < FILE_FETCH_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, capfs_fetch_thread, NULL) == 0) {
+            pthread_detach(thread);
+        }
+    }
+}
+
+// Fills in every fetch's block and estat
+static void
+capfs_fetch_all(capfs_fetch_t *fetches, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (count == 1) {
+        fetches[0].estat = capfs_file_get_block(fetches[0].log,
+                                                fetches[0].gob,
+                                                fetches[0].recno,
+                                                fetches[0].block);
+        return;
+    }
+    pthread_once(&fetch_once, capfs_fetch_start);
+
+    capfs_fetch_batch_t batch = { count, PTHREAD_COND_INITIALIZER };
+    pthread_mutex_lock(&fetch_lock);
+    for (size_t i = 1; i < count; i++) {
+        fetches[i].batch = &batch;
+        fetches[i].next = NULL;
+        if (fetch_tail != NULL) {
+            fetch_tail->next = &fetches[i];
+        } else {
+            fetch_head = &fetches[i];
+        }
+        fetch_tail = &fetches[i];
+    }
+    pthread_cond_broadcast(&fetch_cond);
+
+    fetches[0].batch = &batch;
+    capfs_fetch_run_locked(&fetches[0]);
+    while (batch.pending > 0) {
+        // Anyone's fetch moves things along, ours are somewhere in there
+        capfs_fetch_t *fetch = capfs_fetch_pop_locked();
+        if (fetch != NULL) {
+            capfs_fetch_run_locked(fetch);
+        } else {
+            pthread_cond_wait(&batch.done, &fetch_lock);
+        }
+    }
+    pthread_mutex_unlock(&fetch_lock);
+    pthread_cond_destroy(&batch.done);
+}
+
 static EP_STAT
-capfs_file_read_indirect_from_recno(size_t indirect_recno, gdp_gin_t *ginp,
-        uint32_t indirect_block[DIRECT_IN_INDIRECT]) {
+capfs_file_read_indirect_from_recno(size_t indirect_recno, capfs_log_t *log,
+        const gdp_name_t gob, uint32_t indirect_block[DIRECT_IN_INDIRECT]) {
     EP_STAT estat;
 
-    // Open GIN
-    gdp_datum_t *indirect_datum = gdp_datum_new();
-    estat = gdp_gin_read_by_recno(ginp, indirect_recno, indirect_datum);
+    // No block in this range was written yet
+    if (indirect_recno == 0) {
+        memset(indirect_block, 0, INDIRECT_SIZE);
+        return EP_STAT_OK;
+    }
+    if (capfs_cache_get(CACHE_INDIRECT, gob, indirect_recno, 0,
+                        indirect_block, INDIRECT_SIZE)) {
+        return EP_STAT_OK;
+    }
+
+    capfs_record_t *record;
+    estat = capfs_log_read(log, indirect_recno, &record);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Read datum into buffer, get indirect block
-    gdp_buf_t *indirect_buf = gdp_datum_getbuf(indirect_datum);
-    size_t buf_len = gdp_buf_getlength(indirect_buf);
-    if (buf_len < INODE_SIZE + INDIRECT_SIZE + BLOCK_SIZE) {
+    // The indirect block sits between the inode and the data
+    if (capfs_record_length(record)
+        < INODE_SIZE + INDIRECT_SIZE + BLOCK_SIZE) {
         estat = EP_STAT_END_OF_FILE;
-        goto fail0;
+        goto fail1;
     }
-    char temp_buf[INODE_SIZE + INDIRECT_SIZE + BLOCK_SIZE];
-    gdp_buf_read(indirect_buf, (void *) temp_buf,
-                 INODE_SIZE + INDIRECT_SIZE + BLOCK_SIZE);
-    memcpy(indirect_block, temp_buf + INODE_SIZE, INDIRECT_SIZE);
+    capfs_record_copy(record, INODE_SIZE, indirect_block, INDIRECT_SIZE);
+    capfs_cache_put(CACHE_INDIRECT, gob, indirect_recno, 0, indirect_block,
+                    INDIRECT_SIZE);
 
     // Cleanup
-    gdp_datum_free(indirect_datum);
+    capfs_record_free(record);
     return EP_STAT_OK;
 
+fail1:
+    capfs_record_free(record);
 fail0:
-    gdp_datum_free(indirect_datum);
     return estat;
 }
 
 static EP_STAT
-capfs_file_read_inode(gdp_gin_t *ginp, inode_t *inode, gdp_hash_t **prevhash) {
+capfs_file_read_inode(capfs_log_t *log, inode_t *inode,
+                      capfs_hash_t **prevhash) {
     EP_STAT estat;
 
     // Read last record
-    gdp_datum_t *last_record = gdp_datum_new();
-    estat = gdp_gin_read_by_recno(ginp, -1, last_record);
+    capfs_record_t *record;
+    estat = capfs_log_read(log, -1, &record);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Read datum into buffer, get inode
-    gdp_buf_t *dbuf = gdp_datum_getbuf(last_record);
-    size_t buf_len = gdp_buf_getlength(dbuf);
-    if (buf_len < INODE_SIZE + BLOCK_SIZE) {   // returned data is too small
+    // Get inode
+    if (capfs_record_length(record) < INODE_SIZE + BLOCK_SIZE) {
         estat = EP_STAT_END_OF_FILE;
-        goto fail0;
+        goto fail1;
     }
-    gdp_buf_read(dbuf, (void *) inode, INODE_SIZE);
+    capfs_record_copy(record, 0, inode, INODE_SIZE);
     if (prevhash != NULL) {
-        *prevhash = gdp_datum_hash(last_record, ginp);
+        *prevhash = capfs_record_hash(record);
     }
-    gdp_datum_free(last_record);
+    capfs_record_free(record);
     return EP_STAT_OK;
 
+fail1:
+    capfs_record_free(record);
 fail0:
-    gdp_datum_free(last_record);
+    return estat;
+}
+
+// Appends the gathered writes. Caller holds wbuf_lock
+static EP_STAT
+capfs_file_flush_locked(capfs_file_t *file, size_t size) {
+    if (size == 0) {
+        return EP_STAT_OK;
+    }
+    EP_STAT estat = capfs_file_write(file, file->wbuf, size,
+                                     file->wbuf_offset);
+    // Dropped on failure too, the writes that gathered them already returned,
+    //   so the error is kept for the fsync or close that comes later
+    if (!EP_STAT_ISOK(estat)) {
+        file->wbuf_error = estat;
+    }
+    memmove(file->wbuf, file->wbuf + size, file->wbuf_size - size);
+    file->wbuf_offset += size;
+    file->wbuf_size -= size;
+    return estat;
+}
+
+// Appends the gathered writes for reads and metadata changes that must see
+//   them. Only the error of this append is returned, an earlier one stays for
+//   the next capfs_file_flush
+static EP_STAT
+capfs_file_drain(capfs_file_t *file) {
+    pthread_mutex_lock(&file->wbuf_lock);
+    EP_STAT estat = capfs_file_flush_locked(file, file->wbuf_size);
+    pthread_mutex_unlock(&file->wbuf_lock);
     return estat;
 }
 
 EP_STAT
-capfs_file_read(capfs_file_t *file, char *buf, size_t size, off_t offset) {
+capfs_file_read_blocks(capfs_file_t *file, size_t size, off_t offset,
+                       capfs_block_ref_t *refs, size_t *count) {
     if (file == NULL) {
         return EP_STAT_INVALID_ARG;
     }
     EP_STAT estat;
-    gdp_gin_t *ginp = file->ginp;
+    capfs_log_t *log;
+    estat = capfs_file_log(file, &log);
+    EP_STAT_CHECK(estat, return estat);
+    *count = 0;
+    // Where each block's part starts, and the blocks to fetch
+    size_t starts[FILE_BLOCKS_SPANNED(size, offset)];
+    capfs_fetch_t fetches[FILE_BLOCKS_SPANNED(size, offset)];
+
+    // Reads see our own gathered writes
+    estat = capfs_file_drain(file);
+    EP_STAT_CHECK(estat, return estat);
+    pthread_rwlock_t *lock = capfs_file_lock(file->gob);
+    pthread_rwlock_rdlock(lock);
 
     // Read inode
     inode_t inode;
-    estat = capfs_file_read_inode(ginp, &inode, NULL);
+    estat = capfs_file_read_inode(log, &inode, NULL);
     EP_STAT_CHECK(estat, goto fail0);
+    // Readers share the lock, they all store the same value
+    __atomic_store_n(&file->recno, inode.recno, __ATOMIC_RELAXED);
 
-    // Error checking
-    if (inode.length < offset + size) {
-        estat = EP_STAT_END_OF_FILE;
-        goto fail0;
+    // Reads past the end are short
+    if (offset >= (off_t) inode.length) {
+        size = 0;
     }
+    size = min(size, inode.length - offset);
 
-    // Get direct ptrs, perform lookups, write to buf
-    while (!capfs_file_offset_requires_indirect(offset) && size > 0) {
+    // Look up each block's recno, through its indirect block if needed.
+    //   Cached blocks are taken right away, the rest fetched together below
+    uint32_t indirect_block[DIRECT_IN_INDIRECT];
+    size_t indirect_loaded = 0;
+    size_t missed = 0;
+    while (size > 0) {
         size_t ptr = capfs_file_inode_ptr(offset);
-        uint32_t recno = inode.direct_ptrs[ptr];
-        estat = capfs_file_read_block_from_recno(recno, ginp, &buf, &size,
-                                                 &offset);
-        EP_STAT_CHECK(estat, goto fail0);
+        uint32_t recno;
+        if (!capfs_file_offset_requires_indirect(offset)) {
+            recno = inode.direct_ptrs[ptr];
+        } else {
+            if (indirect_loaded != ptr) {
+                estat = capfs_file_read_indirect_from_recno(
+                    inode.indirect_ptrs[ptr - DIRECT_PTRS], log, file->gob,
+                    indirect_block);
+                EP_STAT_CHECK(estat, goto fail1);
+                indirect_loaded = ptr;
+            }
+            recno = indirect_block[capfs_file_indirect_ptr(offset)];
+        }
+
+        capfs_block_ref_t *ref = refs + *count;
+        ref->block = capfs_block_get_cached(file->gob, recno);
+        if (ref->block == NULL) {
+            fetches[missed++] = (capfs_fetch_t) {
+                .log = log,
+                .gob = file->gob,
+                .recno = recno,
+                .block = &ref->block,
+            };
+        }
+        starts[*count] = offset % BLOCK_SIZE;
+        ref->size = min(size, BLOCK_SIZE - starts[*count]);
+        (*count)++;
+        offset += ref->size;
+        size -= ref->size;
     }
 
-    // Get indirect block, perform lookups, write to buf
-    while (size > 0) {
-        size_t ptr = capfs_file_inode_ptr(offset);
-        uint32_t indirect_recno = inode.indirect_ptrs[ptr - DIRECT_PTRS];
-        // Get indirect block
-        uint32_t indirect_block[DIRECT_IN_INDIRECT];
-        estat = capfs_file_read_indirect_from_recno(indirect_recno, ginp,
-                                                    indirect_block);
-        EP_STAT_CHECK(estat, goto fail0);
-        // Iterate within indirect block
-        while (capfs_file_inode_ptr(offset) == ptr && size > 0) {
-            size_t index = capfs_file_indirect_ptr(offset);
-            uint32_t recno = indirect_block[index];
-            estat = capfs_file_read_block_from_recno(recno, ginp, &buf, &size,
-                                                     &offset);
-            EP_STAT_CHECK(estat, goto fail0);
+    capfs_fetch_all(fetches, missed);
+    for (size_t i = 0; i < missed; i++) {
+        if (!EP_STAT_ISOK(fetches[i].estat)) {
+            estat = fetches[i].estat;
+            goto fail1;
         }
     }
+    for (size_t i = 0; i < *count; i++) {
+        refs[i].data = refs[i].block->data + starts[i];
+    }
 
     // Cleanup
+    pthread_rwlock_unlock(lock);
     return EP_STAT_OK;
 
+fail1:
+    capfs_file_put_blocks(refs, *count);
+    *count = 0;
 fail0:
+    pthread_rwlock_unlock(lock);
     return estat;
 }
 
-static EP_STAT
-capfs_file_write_record(gdp_gin_t *ginp, gdp_hash_t *prevhash,
-                        gdp_hash_t **newhash, inode_t *inode,
-                        uint32_t indirect_block[DIRECT_IN_INDIRECT],
-                        char data_block[BLOCK_SIZE]) {
+void
+capfs_file_put_blocks(capfs_block_ref_t *refs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        capfs_block_put(refs[i].block);
+    }
+}
+
+EP_STAT
+capfs_file_read(capfs_file_t *file, char *buf, size_t size, off_t offset) {
     EP_STAT estat;
 
-    gdp_datum_t *datum = gdp_datum_new();
-    gdp_buf_t *buf = gdp_datum_getbuf(datum);
+    capfs_block_ref_t refs[FILE_BLOCKS_SPANNED(size, offset)];
+    size_t count;
+    estat = capfs_file_read_blocks(file, size, offset, refs, &count);
+    EP_STAT_CHECK(estat, goto fail0);
 
-    if (indirect_block == NULL) {
-        size_t size = INODE_SIZE + BLOCK_SIZE;
-        char payload[size];
-        memcpy(payload, inode, INODE_SIZE);
-        memcpy(payload + INODE_SIZE, data_block, BLOCK_SIZE);
-        gdp_buf_write(buf, (void *) payload, size);
-    } else {
-        size_t size = INODE_SIZE + INDIRECT_SIZE + BLOCK_SIZE;
-        char payload[size];
-        memcpy(payload, inode, INODE_SIZE);
-        memcpy(payload + INODE_SIZE, indirect_block, INDIRECT_SIZE);
-        memcpy(payload + INODE_SIZE + INDIRECT_SIZE, data_block, BLOCK_SIZE);
-        gdp_buf_write(buf, (void *) payload, size);
+    for (size_t i = 0; i < count; i++) {
+        memcpy(buf, refs[i].data, refs[i].size);
+        buf += refs[i].size;
+        size -= refs[i].size;
     }
+    capfs_file_put_blocks(refs, count);
 
-    estat = gdp_gin_append(ginp, datum, prevhash);
-    EP_STAT_CHECK(estat, goto fail0);
-    *newhash = gdp_datum_hash(datum, ginp);
-
-    gdp_datum_free(datum);
+    // Error checking
+    if (size > 0) {
+        estat = EP_STAT_END_OF_FILE;
+        goto fail0;
+    }
     return EP_STAT_OK;
 
 fail0:
-    gdp_datum_free(datum);
     return estat;
 }
 
+// Appends inode, the indirect block if any and data_block as one record.
+//   *prevhash moves on to the new record
 static EP_STAT
-capfs_file_write_block(gdp_gin_t *ginp, gdp_hash_t **prevhash, uint32_t recno,
-                       inode_t *inode,
+capfs_file_write_record(capfs_log_t *log, capfs_hash_t **prevhash,
+                        inode_t *inode,
+                        uint32_t indirect_block[DIRECT_IN_INDIRECT],
+                        const char *data_block) {
+    EP_STAT estat;
+
+    // Pieces go into the record as they are, without a staging payload
+    struct iovec iov[3];
+    int iovcnt = 0;
+    iov[iovcnt++] = (struct iovec) { inode, INODE_SIZE };
+    if (indirect_block != NULL) {
+        iov[iovcnt++] = (struct iovec) { indirect_block, INDIRECT_SIZE };
+    }
+    iov[iovcnt++] = (struct iovec) { (void *) data_block, BLOCK_SIZE };
+
+    capfs_hash_t *hash;
+    estat = capfs_log_append(log, iov, iovcnt, *prevhash, &hash);
+    EP_STAT_CHECK(estat, return estat);
+    capfs_hash_free(*prevhash);
+    *prevhash = hash;
+    return EP_STAT_OK;
+}
+
+static EP_STAT
+capfs_file_write_block(capfs_file_t *file, capfs_hash_t **prevhash,
+                       uint32_t recno, inode_t *inode,
                        uint32_t indirect_block[DIRECT_IN_INDIRECT],
                        const char **buf, size_t *size, off_t *offset) {
     EP_STAT estat;
 
     size_t local_offset = *offset % BLOCK_SIZE;
-    size_t num;
+    // Number of bytes we're writing
+    size_t num = min(*size, BLOCK_SIZE - local_offset);
+    // A whole block is appended straight from the caller's buffer
+    const char *data_block = *buf;
     char write_buf[BLOCK_SIZE];
-    // Handling the first block (if not aligned) -- read + copy before write
-    if (local_offset != 0) {
-        // Dummy variables so the originals are not modified
-        size_t sz = *size;
-        off_t off = *offset;
-        estat = capfs_file_read_block_from_recno(recno, ginp,
-                                                 (char **) &write_buf,
-                                                 &sz, &off);
+    // Partial block keeps the rest of its old contents -- read + copy first
+    if (num < BLOCK_SIZE) {
+        capfs_block_t *block;
+        estat = capfs_file_get_block(file->log, file->gob, recno, &block);
         EP_STAT_CHECK(estat, goto fail0);
-        // Number of bytes we're writing
-        num = min(*size, BLOCK_SIZE - local_offset);
+        memcpy(write_buf, block->data, BLOCK_SIZE);
+        capfs_block_put(block);
         memcpy(write_buf + local_offset, *buf, num);
-    } else {    // just write
-        num = min(*size, BLOCK_SIZE);
-        memcpy(write_buf, *buf, num);
+        data_block = write_buf;
     }
 
     // Update inode
     recno = inode->recno + 1;
     inode->recno = recno;
-    inode->has_indirect_block = false;
+    inode->has_indirect_block = indirect_block != NULL;
     if (*offset + num > inode->length) {
         // Check if write exceeds file size
         inode->length = *offset + num;
@@ -339,8 +747,8 @@ capfs_file_write_block(gdp_gin_t *ginp, gdp_hash_t **prevhash, uint32_t recno,
         inode->indirect_ptrs[inode_ptr - DIRECT_PTRS] = recno;
     }
     // Write to log
-    estat = capfs_file_write_record(ginp, *prevhash, prevhash, inode,
-                                    indirect_block, write_buf);
+    estat = capfs_file_write_record(file->log, prevhash, inode,
+                                    indirect_block, data_block);
     EP_STAT_CHECK(estat, goto fail0);
 
     *offset += num;
@@ -352,58 +760,40 @@ fail0:
     return estat;
 }
 
-EP_STAT
-capfs_file_write(capfs_file_t *file, const char *buf, size_t size,
-                 off_t offset) {
-    if (file == NULL) {
-        return EP_STAT_INVALID_ARG;
-    }
+// Appends the blocks covering [offset, offset + size) on top of inode. The
+//   caller holds capfs_file_lock for writing. Writing past the end leaves a
+//   hole of unwritten blocks, which read as zeros
+static EP_STAT
+capfs_file_write_locked(capfs_file_t *file, inode_t *inode,
+                        capfs_hash_t **prevhash, const char *buf, size_t size,
+                        off_t offset) {
     EP_STAT estat;
-    gdp_gin_t *ginp = file->ginp;
-
-    // Read inode
-    inode_t inode;
-    gdp_hash_t *prevhash;
-    estat = capfs_file_read_inode(ginp, &inode, &prevhash);
-    EP_STAT_CHECK(estat, goto fail0);
-
-    // Error checking
-    if (offset > inode.length) {
-        estat = EP_STAT_END_OF_FILE;
-        goto fail0;
-    }
 
     // Handle direct ptrs
     while (!capfs_file_offset_requires_indirect(offset) && size > 0) {
         size_t ptr = capfs_file_inode_ptr(offset);
-        uint32_t recno = inode.direct_ptrs[ptr];
-        estat = capfs_file_write_block(ginp, &prevhash, recno, &inode,
+        uint32_t recno = inode->direct_ptrs[ptr];
+        estat = capfs_file_write_block(file, prevhash, recno, inode,
                                        NULL, &buf, &size, &offset);
         EP_STAT_CHECK(estat, goto fail0);
     }
 
     // Handle indirect ptrs
     while (size > 0) {
-        // Handling the first indirect block (if not aligned) -- read + copy 1st
-        size_t indirect_offset =
-            (offset - DIRECT_PTRS_SIZE) % INDIRECT_PTR_SIZE;
+        // Other blocks under this indirect block keep their pointers
         size_t indirect_ptr = capfs_file_inode_ptr(offset);
+        uint32_t indirect_recno = inode->indirect_ptrs[
+            indirect_ptr - DIRECT_PTRS];
         uint32_t indirect_block[DIRECT_IN_INDIRECT];
-        if (indirect_offset != 0) {
-            uint32_t indirect_recno = inode.indirect_ptrs[ \
-                indirect_ptr - DIRECT_PTRS];
-            // Read indirect block
-            estat = capfs_file_read_indirect_from_recno(indirect_recno, ginp,
-                                                        indirect_block);
-            EP_STAT_CHECK(estat, goto fail0);
-        } else {    // just write data
-            memset(indirect_block, 0, INDIRECT_SIZE);
-        }
+        estat = capfs_file_read_indirect_from_recno(indirect_recno,
+                                                    file->log, file->gob,
+                                                    indirect_block);
+        EP_STAT_CHECK(estat, goto fail0);
         // Iterate within indirect block
         while (capfs_file_inode_ptr(offset) == indirect_ptr && size > 0) {
             size_t index = capfs_file_indirect_ptr(offset);
             uint32_t recno = indirect_block[index];
-            estat = capfs_file_write_block(ginp, &prevhash, recno, &inode,
+            estat = capfs_file_write_block(file, prevhash, recno, inode,
                                            indirect_block,
                                            &buf, &size, &offset);
             EP_STAT_CHECK(estat, goto fail0);
@@ -415,24 +805,216 @@ fail0:
     return estat;
 }
 
+// Usage counters, see capfs_file_usage_t. Signed, a removal may be counted
+//   before the write that grew the file shows up in its size hint
+static int64_t usage_files;
+static int64_t usage_bytes;
+
+void
+capfs_file_usage_add(int64_t files, int64_t bytes) {
+    __atomic_add_fetch(&usage_files, files, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&usage_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void
+capfs_file_usage(capfs_file_usage_t *usage) {
+    int64_t files = __atomic_load_n(&usage_files, __ATOMIC_RELAXED);
+    int64_t bytes = __atomic_load_n(&usage_bytes, __ATOMIC_RELAXED);
+    usage->files = max(files, 0);
+    usage->bytes = max(bytes, 0);
+    usage->pool = capfs_file_pool_count();
+}
+
+// Moves ctime, and mtime too when the data changed, to now
+static void
+capfs_file_touch(inode_t *inode, bool modified) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    inode->ctime = now.tv_sec;
+    inode->ctime_nsec = now.tv_nsec;
+    if (modified) {
+        inode->mtime = now.tv_sec;
+        inode->mtime_nsec = now.tv_nsec;
+    }
+}
+
+// Keeps what an inode says about the file in the handle
+static void
+capfs_file_note_inode(capfs_file_t *file, const inode_t *inode) {
+    file->length = inode->length;
+    file->recno = inode->recno;
+    file->mode = inode->mode;
+    file->mtime.tv_sec = inode->mtime;
+    file->mtime.tv_nsec = inode->mtime_nsec;
+    file->ctime.tv_sec = inode->ctime;
+    file->ctime.tv_nsec = inode->ctime_nsec;
+}
+
+EP_STAT
+capfs_file_write(capfs_file_t *file, const char *buf, size_t size,
+                 off_t offset) {
+    if (file == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    EP_STAT estat;
+    capfs_log_t *log;
+    estat = capfs_file_log(file, &log);
+    EP_STAT_CHECK(estat, return estat);
+    pthread_rwlock_t *lock = capfs_file_lock(file->gob);
+    pthread_rwlock_wrlock(lock);
+
+    // Read inode
+    inode_t inode;
+    capfs_hash_t *prevhash;
+    estat = capfs_file_read_inode(log, &inode, &prevhash);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    unsigned long old_length = inode.length;
+    capfs_file_touch(&inode, true);
+    estat = capfs_file_write_locked(file, &inode, &prevhash, buf, size,
+                                    offset);
+    EP_STAT_CHECK(estat, goto fail1);
+    capfs_file_note_inode(file, &inode);
+    capfs_file_usage_add(0, (int64_t) inode.length - (int64_t) old_length);
+    capfs_hash_free(prevhash);
+    pthread_rwlock_unlock(lock);
+    return EP_STAT_OK;
+
+fail1:
+    capfs_hash_free(prevhash);
+fail0:
+    pthread_rwlock_unlock(lock);
+    return estat;
+}
+
+// Gathers size bytes at offset, taken from fill (or buf, when the source is
+//   one contiguous buffer that may be appended from directly)
+static EP_STAT
+capfs_file_gather(capfs_file_t *file, const char *buf, size_t size,
+                  off_t offset, capfs_file_fill_t fill, void *arg) {
+    if (file == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    EP_STAT estat = EP_STAT_OK;
+    off_t end = offset + size;
+    pthread_mutex_lock(&file->wbuf_lock);
+
+    // Only a write that continues the gathered ones joins them
+    if (file->wbuf_size > 0
+        && offset != file->wbuf_offset + (off_t) file->wbuf_size) {
+        estat = capfs_file_flush_locked(file, file->wbuf_size);
+        EP_STAT_CHECK(estat, goto fail0);
+    }
+    if (file->wbuf_size == 0) {
+        // Already as large and aligned as a gathered write would be
+        if (buf != NULL && offset % BLOCK_SIZE == 0
+            && size >= FILE_WRITE_BUFFER_SIZE) {
+            estat = capfs_file_write(file, buf, size, offset);
+            EP_STAT_CHECK(estat, goto fail0);
+            pthread_mutex_unlock(&file->wbuf_lock);
+            return EP_STAT_OK;
+        }
+        if (file->wbuf == NULL) {
+            file->wbuf = malloc(FILE_WRITE_BUFFER_SIZE);
+        }
+        file->wbuf_offset = offset;
+    }
+
+    while (size > 0) {
+        size_t num = min(size, FILE_WRITE_BUFFER_SIZE - file->wbuf_size);
+        if (fill(arg, file->wbuf + file->wbuf_size, num) != num) {
+            estat = EP_STAT_END_OF_FILE;
+            goto fail0;
+        }
+        file->wbuf_size += num;
+        size -= num;
+        if (file->wbuf_size < FILE_WRITE_BUFFER_SIZE) {
+            break;
+        }
+        // Full, append up to the last block boundary and keep the rest so
+        //   the next append starts aligned
+        off_t wbuf_end = file->wbuf_offset + file->wbuf_size;
+        size_t keep = wbuf_end % BLOCK_SIZE;
+        estat = capfs_file_flush_locked(file, file->wbuf_size - keep);
+        EP_STAT_CHECK(estat, goto fail0);
+    }
+    file->length = max(file->length, (unsigned long) end);
+    pthread_mutex_unlock(&file->wbuf_lock);
+    return EP_STAT_OK;
+
+fail0:
+    pthread_mutex_unlock(&file->wbuf_lock);
+    return estat;
+}
+
+static size_t
+capfs_file_fill_buf(void *arg, char *dst, size_t size) {
+    const char **src = arg;
+    memcpy(dst, *src, size);
+    *src += size;
+    return size;
+}
+
+EP_STAT
+capfs_file_write_buffered(capfs_file_t *file, const char *buf, size_t size,
+                          off_t offset) {
+    const char *src = buf;
+    return capfs_file_gather(file, buf, size, offset, capfs_file_fill_buf,
+                             &src);
+}
+
+EP_STAT
+capfs_file_write_fill(capfs_file_t *file, size_t size, off_t offset,
+                      capfs_file_fill_t fill, void *arg) {
+    return capfs_file_gather(file, NULL, size, offset, fill, arg);
+}
+
+EP_STAT
+capfs_file_flush(capfs_file_t *file) {
+    if (file == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    pthread_mutex_lock(&file->wbuf_lock);
+    capfs_file_flush_locked(file, file->wbuf_size);
+    // Reported once, to the fsync, flush or release that comes first
+    EP_STAT estat = file->wbuf_error;
+    file->wbuf_error = EP_STAT_OK;
+    pthread_mutex_unlock(&file->wbuf_lock);
+    return estat;
+}
+
 EP_STAT
 capfs_file_get_length(capfs_file_t *file, size_t *length) {
     if (file == NULL) {
         return EP_STAT_INVALID_ARG;
     }
     EP_STAT estat;
-    gdp_gin_t *ginp = file->ginp;
+    capfs_log_t *log;
+    estat = capfs_file_log(file, &log);
+    EP_STAT_CHECK(estat, return estat);
+    pthread_rwlock_t *lock = capfs_file_lock(file->gob);
+    pthread_rwlock_rdlock(lock);
 
     // Read inode
     inode_t inode;
-    gdp_hash_t *prevhash;
-    estat = capfs_file_read_inode(ginp, &inode, &prevhash);
+    estat = capfs_file_read_inode(log, &inode, NULL);
     EP_STAT_CHECK(estat, goto fail0);
 
+    pthread_rwlock_unlock(lock);
+
+    // Gathered writes count, they are in the log as far as callers can tell
+    pthread_mutex_lock(&file->wbuf_lock);
+    capfs_file_note_inode(file, &inode);
     *length = inode.length;
+    if (file->wbuf_size > 0) {
+        *length = max(*length, file->wbuf_offset + file->wbuf_size);
+    }
+    file->length = *length;
+    pthread_mutex_unlock(&file->wbuf_lock);
     return EP_STAT_OK;
 
 fail0:
+    pthread_rwlock_unlock(lock);
     return estat;
 }
 
@@ -442,74 +1024,213 @@ capfs_file_truncate(capfs_file_t *file, off_t file_size) {
         return EP_STAT_INVALID_ARG;
     }
     EP_STAT estat;
-    gdp_gin_t *ginp = file->ginp;
+    capfs_log_t *log;
+    estat = capfs_file_log(file, &log);
+    EP_STAT_CHECK(estat, return estat);
+
+    // Pending writes land before the cut, not after it
+    estat = capfs_file_drain(file);
+    EP_STAT_CHECK(estat, return estat);
+
+    pthread_rwlock_t *lock = capfs_file_lock(file->gob);
+    pthread_rwlock_wrlock(lock);
 
     // Read inode
     inode_t inode;
-    gdp_hash_t *prevhash;
-    estat = capfs_file_read_inode(ginp, &inode, &prevhash);
+    capfs_hash_t *prevhash;
+    estat = capfs_file_read_inode(log, &inode, &prevhash);
     EP_STAT_CHECK(estat, goto fail0);
 
-    // Error checking
-    if (file_size > inode.length) {
-        estat = EP_STAT_INVALID_ARG;
-        goto fail0;
+    unsigned long old_length = inode.length;
+
+    // Growing only moves the length, the new range is a hole. Shrinking drops
+    //   every block past the cut so growing again later reads zeros there
+    uint32_t indirect_block[DIRECT_IN_INDIRECT];
+    bool has_indirect_block = false;
+    if (file_size < inode.length) {
+        // Zero the rest of the block the cut falls into
+        size_t local_offset = file_size % BLOCK_SIZE;
+        if (local_offset != 0) {
+            char zeros[BLOCK_SIZE];
+            memset(zeros, 0, BLOCK_SIZE);
+            estat = capfs_file_write_locked(file, &inode, &prevhash, zeros,
+                                            BLOCK_SIZE - local_offset,
+                                            file_size);
+            EP_STAT_CHECK(estat, goto fail1);
+        }
+
+        // First block entirely past the cut
+        off_t first = file_size + (BLOCK_SIZE - local_offset) % BLOCK_SIZE;
+        for (size_t i = 0; i < DIRECT_PTRS; i++) {
+            if ((off_t) (i * BLOCK_SIZE) >= first) {
+                inode.direct_ptrs[i] = 0;
+            }
+        }
+        for (size_t i = 0; i < INDIRECT_PTRS; i++) {
+            off_t start = DIRECT_PTRS_SIZE + (off_t) i * INDIRECT_PTR_SIZE;
+            if (start >= first) {
+                inode.indirect_ptrs[i] = 0;
+            } else if (start + INDIRECT_PTR_SIZE > first
+                       && inode.indirect_ptrs[i] != 0) {
+                // The cut falls inside this indirect block, rewrite it
+                estat = capfs_file_read_indirect_from_recno(
+                    inode.indirect_ptrs[i], log, file->gob, indirect_block);
+                EP_STAT_CHECK(estat, goto fail1);
+                for (size_t j = capfs_file_indirect_ptr(first);
+                     j < DIRECT_IN_INDIRECT; j++) {
+                    indirect_block[j] = 0;
+                }
+                inode.indirect_ptrs[i] = inode.recno + 1;
+                has_indirect_block = true;
+            }
+        }
     }
 
     // Update length + metadata
     inode.length = file_size;
     inode.recno++;
-    inode.has_indirect_block = false;
+    inode.has_indirect_block = has_indirect_block;
+    capfs_file_touch(&inode, true);
 
     // Write in an empty block
     char data_block[BLOCK_SIZE];
     memset(data_block, 0, BLOCK_SIZE);
-    estat = capfs_file_write_record(ginp, prevhash, &prevhash, &inode, NULL,
+    estat = capfs_file_write_record(log, &prevhash, &inode,
+                                    has_indirect_block ? indirect_block : NULL,
                                     data_block);
-    EP_STAT_CHECK(estat, goto fail0);
+    EP_STAT_CHECK(estat, goto fail1);
+    capfs_file_note_inode(file, &inode);
+    capfs_file_usage_add(0, (int64_t) inode.length - (int64_t) old_length);
 
+    capfs_hash_free(prevhash);
+    pthread_rwlock_unlock(lock);
     return EP_STAT_OK;
 
+fail1:
+    capfs_hash_free(prevhash);
 fail0:
+    pthread_rwlock_unlock(lock);
     return estat;
 }
 
-static EP_STAT
-_capfs_file_create(const char *name, capfs_file_t **file) {
+EP_STAT
+capfs_file_set_attr(capfs_file_t *file, mode_t mode,
+                    const struct timespec *mtime) {
+    if (file == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
     EP_STAT estat;
+    capfs_log_t *log;
+    estat = capfs_file_log(file, &log);
+    EP_STAT_CHECK(estat, return estat);
 
-    // Create GCI - prep for creating DataCapsule
-    gdp_create_info_t *gci = gdp_create_info_new();
-    estat = gdp_create_info_set_creator(gci, "CapFS",
-                                        "fa19.cs262.eecs.berkeley.edu");
-    EP_STAT_CHECK(estat, goto fail0);
-    // Create a new key, save it in KEYS
-    estat = gdp_create_info_new_owner_key(gci, NULL, NULL, 0, NULL, "null");
-    EP_STAT_CHECK(estat, goto fail0);
+    // Writes still pending would move mtime again when they land
+    estat = capfs_file_drain(file);
+    EP_STAT_CHECK(estat, return estat);
 
-    // Create DataCapsule
-    gdp_gin_t *ginp;
-    estat = gdp_gin_create(gci, name, &ginp);
+    pthread_rwlock_t *lock = capfs_file_lock(file->gob);
+    pthread_rwlock_wrlock(lock);
+
+    // Read inode
+    inode_t inode;
+    capfs_hash_t *prevhash;
+    estat = capfs_file_read_inode(log, &inode, &prevhash);
     EP_STAT_CHECK(estat, goto fail0);
 
-    gdp_name_t gob;
-    memcpy(&gob, gdp_gin_getname(ginp), sizeof(gdp_name_t));
+    // Only the metadata changes, like a truncate to the same length
+    inode.recno++;
+    inode.has_indirect_block = false;
+    capfs_file_touch(&inode, false);
+    if (mode != 0) {
+        inode.mode = mode;
+    }
+    if (mtime != NULL) {
+        inode.mtime = mtime->tv_sec;
+        inode.mtime_nsec = mtime->tv_nsec;
+    }
 
-    // Close and re-open the capsule (workaround)
-    estat = gdp_gin_close(ginp);
+    char data_block[BLOCK_SIZE];
+    memset(data_block, 0, BLOCK_SIZE);
+    estat = capfs_file_write_record(log, &prevhash, &inode, NULL,
+                                    data_block);
     EP_STAT_CHECK(estat, goto fail1);
-    gdp_open_info_t *goi = gdp_open_info_new();
-    estat = gdp_gin_open(gob, GDP_MODE_RA, goi, &ginp);
-    EP_STAT_CHECK(estat, goto fail2);
+    capfs_file_note_inode(file, &inode);
+
+    capfs_hash_free(prevhash);
+    pthread_rwlock_unlock(lock);
+    return EP_STAT_OK;
+
+fail1:
+    capfs_hash_free(prevhash);
+fail0:
+    pthread_rwlock_unlock(lock);
+    return estat;
+}
+
+// Reads up to *size bytes of a record; *size is set to the bytes read.
+// Provide NULL to recno_out or hash if not needed. Unlike the inode based
+//   calls these do not lock, the caller holds capfs_file_lock
+EP_STAT
+capfs_file_read_record(capfs_file_t *file, gdp_recno_t recno, char *buf,
+                       size_t *size, gdp_recno_t *recno_out,
+                       capfs_hash_t **hash) {
+    if (file == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    EP_STAT estat;
+    capfs_log_t *log;
+    estat = capfs_file_log(file, &log);
+    EP_STAT_CHECK(estat, return estat);
+
+    capfs_record_t *record;
+    estat = capfs_log_read(log, recno, &record);
+    EP_STAT_CHECK(estat, return estat);
+
+    *size = capfs_record_copy(record, 0, buf, *size);
+    if (recno_out != NULL) {
+        *recno_out = capfs_record_recno(record);
+    }
+    if (hash != NULL) {
+        *hash = capfs_record_hash(record);
+    }
+
+    capfs_record_free(record);
+    return EP_STAT_OK;
+}
+
+EP_STAT
+capfs_file_append_record(capfs_file_t *file, capfs_hash_t *prevhash,
+                         const char *buf, size_t size) {
+    if (file == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    EP_STAT estat;
+    capfs_log_t *log;
+    estat = capfs_file_log(file, &log);
+    EP_STAT_CHECK(estat, return estat);
+
+    struct iovec iov = { (void *) buf, size };
+    return capfs_log_append(log, &iov, 1, prevhash, NULL);
+}
+
+static EP_STAT
+_capfs_file_create(const char *name, capfs_file_t **file) {
+    EP_STAT estat;
+
+    gdp_name_t gob;
+    estat = capfs_log_create(name, gob);
+    EP_STAT_CHECK(estat, goto fail0);
 
     *file = capfs_file_new(gob);
-    (*file)->ginp = ginp;
+    estat = capfs_log_open(gob, &(*file)->log);
+    EP_STAT_CHECK(estat, goto fail1);
 
     // Get the hash of the zeroth log record
-    gdp_datum_t *datum = gdp_datum_new();
-    estat = gdp_gin_read_by_recno(ginp, 0, datum);
-    EP_STAT_CHECK(estat, goto fail3);
-    gdp_hash_t *prevhash = gdp_datum_hash(datum, ginp);
+    capfs_record_t *record;
+    estat = capfs_log_read((*file)->log, 0, &record);
+    EP_STAT_CHECK(estat, goto fail2);
+    capfs_hash_t *prevhash = capfs_record_hash(record);
+    capfs_record_free(record);
 
     // Write inode
     inode_t inode;
@@ -518,36 +1239,24 @@ _capfs_file_create(const char *name, capfs_file_t **file) {
     inode.has_indirect_block = false;
     inode.recno = 1;
     inode.length = 0;
+    capfs_file_touch(&inode, true);
     // Write data
     char data_block[BLOCK_SIZE];
     memset(data_block, 0, BLOCK_SIZE);
-    // Combine
-    char payload[INODE_SIZE + BLOCK_SIZE];
-    memcpy(payload, (void *) &inode, INODE_SIZE);
-    memcpy(payload + INODE_SIZE, data_block, BLOCK_SIZE);
 
     // Write first record
-    gdp_datum_reset(datum);
-    gdp_buf_t *buf = gdp_datum_getbuf(datum);
-    gdp_buf_write(buf, payload, INODE_SIZE + BLOCK_SIZE);
-
-    estat = gdp_gin_append(ginp, datum, prevhash);
-    EP_STAT_CHECK(estat, goto fail3);
-
-    // Cleanup
-    gdp_datum_free(datum);
-    gdp_create_info_free(&gci);
+    estat = capfs_file_write_record((*file)->log, &prevhash, &inode, NULL,
+                                    data_block);
+    capfs_hash_free(prevhash);
+    EP_STAT_CHECK(estat, goto fail2);
     return EP_STAT_OK;
 
-fail3:
-    gdp_datum_free(datum);
-    capfs_file_free(*file);
 fail2:
-    gdp_open_info_free(goi);
+    capfs_log_close((*file)->log);
 fail1:
-    gdp_gin_delete(ginp);
+    capfs_file_free(*file);
+    capfs_log_remove(gob);
 fail0:
-    gdp_create_info_free(&gci);
     return estat;
 }
 
@@ -559,6 +1268,7 @@ capfs_file_create(const char *path, capfs_file_t **file) {
     get_human_name(path, human_name);
     estat = _capfs_file_create(human_name, file);
     EP_STAT_CHECK(estat, goto fail0);
+    capfs_file_usage_add(1, 0);
 
     return EP_STAT_OK;
 
@@ -566,12 +1276,112 @@ fail0:
     return estat;
 }
 
+// Creating a log means a new key and several round trips, so a background
+//   thread keeps FILE_POOL_SIZE of them ready (opened, first inode written).
+//   It is started on the first create rather than at init, fuse_main forks
+//   after init and threads do not survive that
+static capfs_file_t *file_pool[FILE_POOL_SIZE];
+static size_t file_pool_count;
+static pthread_t file_pool_thread;
+static bool file_pool_started;
+static bool file_pool_stop;
+static pthread_mutex_t file_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t file_pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t file_pool_once = PTHREAD_ONCE_INIT;
+
+static void *
+capfs_file_pool_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&file_pool_lock);
+    while (!file_pool_stop) {
+        if (file_pool_count == FILE_POOL_SIZE) {
+            pthread_cond_wait(&file_pool_cond, &file_pool_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&file_pool_lock);
+
+        capfs_file_t *file;
+        EP_STAT estat = _capfs_file_create(NULL, &file);
+        pthread_mutex_lock(&file_pool_lock);
+        if (!EP_STAT_ISOK(estat)) {
+            // Creates fall back to doing it themselves meanwhile
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += FILE_POOL_RETRY;
+            pthread_cond_timedwait(&file_pool_cond, &file_pool_lock,
+                                   &deadline);
+            continue;
+        }
+
+        // Even when stopping, the drain removes it with the rest
+        file_pool[file_pool_count++] = file;
+    }
+    pthread_mutex_unlock(&file_pool_lock);
+    return NULL;
+}
+
+static void
+capfs_file_pool_start(void) {
+    pthread_mutex_lock(&file_pool_lock);
+    if (!file_pool_stop) {
+        file_pool_started = pthread_create(&file_pool_thread, NULL,
+                                           capfs_file_pool_thread,
+                                           NULL) == 0;
+    }
+    pthread_mutex_unlock(&file_pool_lock);
+}
+
+void
+capfs_file_pool_drain(void) {
+    pthread_mutex_lock(&file_pool_lock);
+    file_pool_stop = true;
+    pthread_cond_broadcast(&file_pool_cond);
+    bool started = file_pool_started;
+    file_pool_started = false;
+    pthread_mutex_unlock(&file_pool_lock);
+    if (started) {
+        pthread_join(file_pool_thread, NULL);
+    }
+
+    // Nothing points at these logs, so they would be left behind for good
+    pthread_mutex_lock(&file_pool_lock);
+    while (file_pool_count > 0) {
+        capfs_file_t *file = file_pool[--file_pool_count];
+        capfs_log_close(file->log);
+        capfs_log_remove(file->gob);
+        capfs_file_free(file);
+    }
+    pthread_mutex_unlock(&file_pool_lock);
+}
+
+size_t
+capfs_file_pool_count(void) {
+    pthread_mutex_lock(&file_pool_lock);
+    size_t count = file_pool_count;
+    pthread_mutex_unlock(&file_pool_lock);
+    return count;
+}
+
 EP_STAT
 capfs_file_create_gob(capfs_file_t **file) {
     EP_STAT estat;
 
+    pthread_once(&file_pool_once, capfs_file_pool_start);
+    pthread_mutex_lock(&file_pool_lock);
+    if (file_pool_count > 0) {
+        *file = file_pool[--file_pool_count];
+        pthread_cond_signal(&file_pool_cond);
+        pthread_mutex_unlock(&file_pool_lock);
+        capfs_file_usage_add(1, 0);
+        return EP_STAT_OK;
+    }
+    pthread_mutex_unlock(&file_pool_lock);
+
+    // Pool ran dry, pay for it here
     estat = _capfs_file_create(NULL, file);
     EP_STAT_CHECK(estat, goto fail0);
+    capfs_file_usage_add(1, 0);
     return EP_STAT_OK;
 
 fail0:
@@ -586,7 +1396,7 @@ capfs_file_open(const char *path, capfs_file_t **file) {
     get_human_name(path, human_name);
 
     gdp_name_t gob;
-    estat = gdp_parse_name(human_name, gob);
+    estat = capfs_log_lookup(human_name, gob);
     EP_STAT_CHECK(estat, goto fail0);
 
     return capfs_file_open_gob(gob, file);
@@ -599,22 +1409,14 @@ EP_STAT
 capfs_file_open_gob(gdp_name_t gob, capfs_file_t **file) {
     EP_STAT estat;
 
-    // Make goi
-    gdp_open_info_t *goi = gdp_open_info_new();
-    *file = capfs_file_new(gob);
-
     // Open
-    gdp_gin_t *ginp;
-    estat = gdp_gin_open(gob, GDP_MODE_RA, goi, &ginp);
+    *file = capfs_file_new(gob);
+    estat = capfs_log_open(gob, &(*file)->log);
     EP_STAT_CHECK(estat, goto fail0);
-    (*file)->ginp = ginp;
-
-    gdp_open_info_free(goi);
     return EP_STAT_OK;
 
 fail0:
     capfs_file_free(*file);
-    gdp_open_info_free(goi);
     return estat;
 }
 
@@ -626,9 +1428,14 @@ capfs_file_close(capfs_file_t *file) {
     }
     EP_STAT estat;
 
-    estat = gdp_gin_close(file->ginp);
+    // The log is closed either way, a failed flush is still reported
+    EP_STAT flushed = capfs_file_flush(file);
+    if (file->log == NULL) {
+        return flushed;
+    }
+    estat = capfs_log_close(file->log);
     EP_STAT_CHECK(estat, goto fail0);
-    return EP_STAT_OK;
+    return flushed;
 
 fail0:
     return estat;
@@ -638,6 +1445,9 @@ capfs_file_t *
 capfs_file_new(const gdp_name_t gob) {
     capfs_file_t *file = calloc(sizeof(capfs_file_t), 1);
     memcpy(file->gob, gob, sizeof(gdp_name_t));
+    file->wbuf_error = EP_STAT_OK;
+    pthread_mutex_init(&file->wbuf_lock, NULL);
+    pthread_mutex_init(&file->log_lock, NULL);
     return file;
 }
 
@@ -646,5 +1456,8 @@ capfs_file_free(capfs_file_t *file) {
     if (file == NULL) {
         return;
     }
+    pthread_mutex_destroy(&file->wbuf_lock);
+    pthread_mutex_destroy(&file->log_lock);
+    free(file->wbuf);
     free(file);
 }
@@ -31,7 +31,7 @@
 #define _CAPFS_FILE_H_
 
 // Bump the final number when creating a fresh file system
-#define FILE_PREFIX "edu.berkeley.eecs.cs262.fa19.capfs.3."
+#define FILE_PREFIX "edu.berkeley.eecs.cs262.fa19.capfs.5."
 
 #define FILE_NAME_MAX_LEN 127
 
@@ -39,7 +39,7 @@
 #define INODE_SIZE (8 * 1024)
 #define INDIRECT_SIZE (8 * 1024)
 #define BLOCK_SIZE (32 * 1024)
-#define INODE_METADATA_SIZE 16
+#define INODE_METADATA_SIZE 32
 // Number of ptrs
 #define DIRECT_PTRS ((INODE_SIZE / 4) * 3 / 4)
 #define INDIRECT_PTRS ((INODE_SIZE - INODE_METADATA_SIZE - DIRECT_PTRS * 4) / 4)
@@ -52,38 +52,151 @@
 // Roughly 32GB
 // #define MAX_FILE_SIZE (DIRECT_PTRS_SIZE + INDIRECT_PTRS * INDIREC_PTR_SIZE)
 
+// Number of rwlocks shared by all logs
+#define FILE_LOCK_STRIPES 256
+// Sequential writes are gathered until this many bytes, a multiple of
+//   BLOCK_SIZE, before they are appended
+#define FILE_WRITE_BUFFER_SIZE (4 * BLOCK_SIZE)
+// Data blocks kept in memory (32MB) and buckets to find them by gob + recno
+#define BLOCK_CACHE_SIZE 1024
+#define BLOCK_CACHE_BUCKETS 4096
+// Logs created ahead of time for capfs_file_create_gob, and seconds to wait
+//   before trying again when creating one fails
+#define FILE_POOL_SIZE 16
+#define FILE_POOL_RETRY 5
+// Threads fetching the blocks a read misses, in parallel
+#define FILE_FETCH_THREADS 8
+// Blocks touched by a read of size bytes at offset
+#define FILE_BLOCKS_SPANNED(size, offset) \
+    (((offset) % BLOCK_SIZE + (size) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
 #include <ep/ep.h>
 #include <gdp/gdp.h>
 
+#include "capfs_store.h"
+
 typedef struct capfs_file {
     gdp_name_t gob;
-    gdp_gin_t *ginp;
+    capfs_log_t *log;
+    unsigned long length;   // As of the last inode this handle read or wrote
+    unsigned int recno;     // Ditto, changes with every append to the file
+    mode_t mode;            // Ditto, 0 for the default
+    struct timespec mtime;  // Ditto
+    struct timespec ctime;  // Ditto
+    pthread_mutex_t log_lock;   // Opening log, NULL until first access
+    pthread_mutex_t wbuf_lock;
+    char *wbuf;             // Gathered writes not yet in the log, or NULL
+    off_t wbuf_offset;
+    size_t wbuf_size;
+    EP_STAT wbuf_error;     // A failed append of gathered writes, returned by
+                            //   the next flush after it
 } capfs_file_t;
 
+// A cached data block. Records never change once appended, so neither does
+//   the block of a given gob and recno
+typedef struct capfs_block {
+    gdp_name_t gob;
+    uint32_t recno;
+    unsigned int ref;       // References handed out, not counting the cache
+    bool cached;            // Still in the cache, otherwise freed at ref 0
+    struct capfs_block *next;
+    struct capfs_block *lru_prev;
+    struct capfs_block *lru_next;
+    char data[BLOCK_SIZE];
+} capfs_block_t;
+
+// The part of a block a read covers
+typedef struct capfs_block_ref {
+    capfs_block_t *block;
+    const char *data;
+    size_t size;
+} capfs_block_ref_t;
+
+// What statfs reports as used. Counted in memory as this mount creates,
+//   writes, truncates and removes files, never read back from the logs
+typedef struct capfs_file_usage {
+    uint64_t files;         // Files and directories
+    uint64_t bytes;         // Sum of their lengths
+    uint64_t pool;          // Logs created ahead of time, not yet handed out
+} capfs_file_usage_t;
+
 typedef struct inode {
     unsigned is_dir : 1;            // File data
     unsigned has_indirect_block: 1; // Record data
     unsigned padding1 : 6;
 
+    unsigned char padding2;
+    uint16_t mode;                  // File data, type and permission bits as
+                                    //   in st_mode, 0 for the default
     unsigned int recno;             // Record data
     unsigned long length;           // File data
-    unsigned char padding2[3];  // Should be INODE_METADATA_SIZE - size of meta
+    uint32_t mtime;                 // File data, changed by writes
+    uint32_t mtime_nsec;
+    uint32_t ctime;                 // File data, changed by any append
+    uint32_t ctime_nsec;
     uint32_t direct_ptrs[DIRECT_PTRS];
     uint32_t indirect_ptrs[INDIRECT_PTRS]; 
 } inode_t;
 
+_Static_assert(sizeof(inode_t) == INODE_SIZE,
+               "inode_t metadata must fill INODE_METADATA_SIZE");
+
+pthread_rwlock_t *capfs_file_lock(const gdp_name_t gob);
 EP_STAT capfs_file_read(capfs_file_t *file, char *buf, size_t size,
                         off_t offset);
+// Hands out references to the cached blocks covering the read instead of
+//   copying them; refs needs FILE_BLOCKS_SPANNED(size, offset) entries. Reads
+//   past the end are short. Put the references back with
+//   capfs_file_put_blocks
+EP_STAT capfs_file_read_blocks(capfs_file_t *file, size_t size, off_t offset,
+                               capfs_block_ref_t *refs, size_t *count);
+void capfs_file_put_blocks(capfs_block_ref_t *refs, size_t count);
+void capfs_block_put(capfs_block_t *block);
 EP_STAT capfs_file_write(capfs_file_t *file, const char *buf, size_t size,
                          off_t offset);
+// Gathers sequential writes into FILE_WRITE_BUFFER_SIZE appends. Errors may
+//   only show up in a later capfs_file_flush
+EP_STAT capfs_file_write_buffered(capfs_file_t *file, const char *buf,
+                                  size_t size, off_t offset);
+// Copies the next size bytes of a write into dst, returns how many it copied
+typedef size_t (*capfs_file_fill_t)(void *arg, char *dst, size_t size);
+// Same as capfs_file_write_buffered, but the data is copied by fill straight
+//   into the gathered writes, e.g. from a pipe
+EP_STAT capfs_file_write_fill(capfs_file_t *file, size_t size, off_t offset,
+                              capfs_file_fill_t fill, void *arg);
+EP_STAT capfs_file_flush(capfs_file_t *file);
 EP_STAT capfs_file_get_length(capfs_file_t *file, size_t *length);
 EP_STAT capfs_file_truncate(capfs_file_t *file, off_t file_size);
+// Sets the mode (type and permission bits) unless it is 0 and mtime unless it
+//   is NULL. ctime moves to now either way
+EP_STAT capfs_file_set_attr(capfs_file_t *file, mode_t mode,
+                            const struct timespec *mtime);
+// Raw record access for logs that do not use the inode layout (directories)
+EP_STAT capfs_file_read_record(capfs_file_t *file, gdp_recno_t recno,
+                               char *buf, size_t *size, gdp_recno_t *recno_out,
+                               capfs_hash_t **hash);
+EP_STAT capfs_file_append_record(capfs_file_t *file, capfs_hash_t *prevhash,
+                                 const char *buf, size_t size);
 EP_STAT capfs_file_create(const char *path, capfs_file_t **file);
 // Creates a file with no human_name, but is still accessible by gob
 EP_STAT capfs_file_create_gob(capfs_file_t **file);
+// Number of logs ready in the pool
+size_t capfs_file_pool_count(void);
+// Stops filling the pool and removes the logs still in it, at unmount
+void capfs_file_pool_drain(void);
+void capfs_file_usage(capfs_file_usage_t *usage);
+// Removals happen in the directory layer, which reports them here
+void capfs_file_usage_add(int64_t files, int64_t bytes);
 EP_STAT capfs_file_open(const char *path, capfs_file_t **file);
 EP_STAT capfs_file_open_gob(gdp_name_t gob, capfs_file_t **file);
 EP_STAT capfs_file_close(capfs_file_t *file);
+// A file that only knows its gob, the log is opened on first access
 capfs_file_t *capfs_file_new(const gdp_name_t gob);
 void capfs_file_free(capfs_file_t *file);
 
@@ -0,0 +1,375 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_lease.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// A mount's lease on a file. revoking once it was asked to give it back,
+//   which it has to by deadline
+typedef struct lease_holder {
+    uint64_t owner;
+    void *conn;             // Where it was last granted, and revokes go
+    uint32_t mode;
+    bool revoking;
+    uint64_t deadline;
+    struct lease_holder *next;
+} lease_holder_t;
+
+// Handles a mount has open on a file through one connection
+typedef struct lease_open {
+    uint64_t owner;
+    void *conn;
+    unsigned readers;
+    unsigned writers;
+    struct lease_open *next;
+} lease_open_t;
+
+// Only there while someone has the file open or a lease on it
+typedef struct lease_file {
+    gdp_name_t gob;
+    lease_holder_t *holders;
+    lease_open_t *opens;
+    struct lease_file *next;
+} lease_file_t;
+
+static lease_file_t *lease_files[LEASE_BUCKETS];
+static size_t lease_holders;
+static pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+// A lease was given back or dropped
+static pthread_cond_t lease_cond;
+static void (*lease_revoke)(void *conn, const gdp_name_t gob);
+static void (*lease_expire)(void *conn);
+
+static uint64_t
+lease_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t
+lease_bucket(const gdp_name_t gob) {
+    uint32_t hash;
+    memcpy(&hash, gob, sizeof(uint32_t));
+    return hash % LEASE_BUCKETS;
+}
+
+// Without one, a client is its connection
+static uint64_t
+lease_owner(void *conn, uint64_t owner) {
+    return owner != 0 ? owner : (uint64_t) (uintptr_t) conn;
+}
+
+// Caller holds lease_lock. NULL if there is none and not create
+static lease_file_t *
+lease_file_get(const gdp_name_t gob, bool create) {
+    lease_file_t **bucket = &lease_files[lease_bucket(gob)];
+    for (lease_file_t *file = *bucket; file != NULL; file = file->next) {
+        if (memcmp(file->gob, gob, sizeof(gdp_name_t)) == 0) {
+            return file;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    lease_file_t *file = calloc(1, sizeof(lease_file_t));
+    memcpy(file->gob, gob, sizeof(gdp_name_t));
+    file->next = *bucket;
+    *bucket = file;
+    return file;
+}
+
+// Caller holds lease_lock. Frees the file once nothing is left on it
+static void
+lease_file_gc(lease_file_t *file) {
+    if (file->holders != NULL || file->opens != NULL) {
+        return;
+    }
+    lease_file_t **link = &lease_files[lease_bucket(file->gob)];
+    while (*link != file) {
+        link = &(*link)->next;
+    }
+    *link = file->next;
+    free(file);
+}
+
+// Caller holds lease_lock
+static lease_holder_t *
+lease_holder_find(lease_file_t *file, uint64_t owner) {
+    for (lease_holder_t *holder = file->holders; holder != NULL;
+         holder = holder->next) {
+        if (holder->owner == owner) {
+            return holder;
+        }
+    }
+    return NULL;
+}
+
+// Caller holds lease_lock. Asks for the leases of others on gob that a
+//   change, or an open for writing or not, would get in the way of, and
+//   waits until they are given back or expire. The file may be gone after
+static void
+lease_clear(const gdp_name_t gob, uint64_t owner, bool write) {
+    for (;;) {
+        lease_file_t *file = lease_file_get(gob, false);
+        if (file == NULL) {
+            return;
+        }
+        uint64_t now = lease_now();
+        uint64_t deadline = 0;
+        lease_holder_t **link = &file->holders;
+        while (*link != NULL) {
+            lease_holder_t *holder = *link;
+            if (holder->owner == owner
+                || (!write && holder->mode == LEASE_READ)) {
+                link = &holder->next;
+                continue;
+            }
+            if (!holder->revoking) {
+                holder->revoking = true;
+                holder->deadline = now + LEASE_REVOKE_MS;
+                lease_revoke(holder->conn, gob);
+            } else if (holder->deadline <= now) {
+                // Whatever it kept is lost with its connection
+                lease_expire(holder->conn);
+                *link = holder->next;
+                free(holder);
+                __atomic_fetch_sub(&lease_holders, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (deadline == 0 || holder->deadline < deadline) {
+                deadline = holder->deadline;
+            }
+            link = &holder->next;
+        }
+        if (deadline == 0) {
+            return;
+        }
+        struct timespec ts = {
+            (time_t) (deadline / 1000),
+            (long) (deadline % 1000) * 1000000
+        };
+        pthread_cond_timedwait(&lease_cond, &lease_lock, &ts);
+    }
+}
+
+void
+capfs_lease_init(void (*revoke)(void *conn, const gdp_name_t gob),
+                 void (*expire)(void *conn)) {
+    // Deadlines are on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&lease_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    lease_revoke = revoke;
+    lease_expire = expire;
+}
+
+bool
+capfs_lease_any(void) {
+    return __atomic_load_n(&lease_holders, __ATOMIC_RELAXED) > 0;
+}
+
+void
+capfs_lease_wait(void *conn, uint64_t owner, const gdp_name_t gob,
+                 bool write) {
+    pthread_mutex_lock(&lease_lock);
+    lease_clear(gob, lease_owner(conn, owner), write);
+    pthread_mutex_unlock(&lease_lock);
+}
+
+uint32_t
+capfs_lease_open(void *conn, uint64_t owner, const gdp_name_t gob,
+                 bool write, uint32_t want) {
+    owner = lease_owner(conn, owner);
+
+    // Again, for what was granted since the wait
+    pthread_mutex_lock(&lease_lock);
+    lease_clear(gob, owner, write);
+    lease_file_t *file = lease_file_get(gob, true);
+
+    lease_open_t *open = file->opens;
+    while (open != NULL && (open->owner != owner || open->conn != conn)) {
+        open = open->next;
+    }
+    if (open == NULL) {
+        open = calloc(1, sizeof(lease_open_t));
+        open->owner = owner;
+        open->conn = conn;
+        open->next = file->opens;
+        file->opens = open;
+    }
+    if (write) {
+        open->writers++;
+    } else {
+        open->readers++;
+    }
+
+    // Exclusive while nobody else has it open or a lease on it, shared
+    //   while nobody else writes
+    uint32_t granted = 0;
+    lease_holder_t *own = lease_holder_find(file, owner);
+    if (want != 0 && (own == NULL || !own->revoking)) {
+        bool others_open = false;
+        bool others_write = false;
+        for (lease_open_t *other = file->opens; other != NULL;
+             other = other->next) {
+            if (other->owner != owner) {
+                others_open = true;
+                others_write |= other->writers > 0;
+            }
+        }
+        bool others_lease = false;
+        for (lease_holder_t *other = file->holders; other != NULL;
+             other = other->next) {
+            others_lease |= other->owner != owner;
+        }
+        if (want == LEASE_WRITE && !others_open && !others_lease) {
+            granted = LEASE_WRITE;
+        } else if (!others_write) {
+            granted = LEASE_READ;
+        }
+        // Never less than it already had
+        if (own != NULL && own->mode > granted) {
+            granted = own->mode;
+        }
+    }
+    if (granted != 0) {
+        if (own == NULL) {
+            own = calloc(1, sizeof(lease_holder_t));
+            own->owner = owner;
+            own->next = file->holders;
+            file->holders = own;
+            __atomic_fetch_add(&lease_holders, 1, __ATOMIC_RELAXED);
+        }
+        own->conn = conn;
+        own->mode = granted;
+    }
+    pthread_mutex_unlock(&lease_lock);
+    return granted;
+}
+
+void
+capfs_lease_close(void *conn, uint64_t owner, const gdp_name_t gob,
+                  bool write) {
+    owner = lease_owner(conn, owner);
+
+    pthread_mutex_lock(&lease_lock);
+    lease_file_t *file = lease_file_get(gob, false);
+    if (file == NULL) {
+        goto done;
+    }
+    for (lease_open_t **link = &file->opens; *link != NULL;
+         link = &(*link)->next) {
+        lease_open_t *open = *link;
+        if (open->owner != owner || open->conn != conn) {
+            continue;
+        }
+        if (write && open->writers > 0) {
+            open->writers--;
+        } else if (!write && open->readers > 0) {
+            open->readers--;
+        }
+        if (open->readers == 0 && open->writers == 0) {
+            *link = open->next;
+            free(open);
+        }
+        break;
+    }
+    lease_file_gc(file);
+done:
+    pthread_mutex_unlock(&lease_lock);
+}
+
+void
+capfs_lease_release(void *conn, uint64_t owner, const gdp_name_t gob) {
+    owner = lease_owner(conn, owner);
+
+    pthread_mutex_lock(&lease_lock);
+    lease_file_t *file = lease_file_get(gob, false);
+    if (file == NULL) {
+        goto done;
+    }
+    for (lease_holder_t **link = &file->holders; *link != NULL;
+         link = &(*link)->next) {
+        if ((*link)->owner == owner) {
+            lease_holder_t *holder = *link;
+            *link = holder->next;
+            free(holder);
+            __atomic_fetch_sub(&lease_holders, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    lease_file_gc(file);
+    pthread_cond_broadcast(&lease_cond);
+done:
+    pthread_mutex_unlock(&lease_lock);
+}
+
+void
+capfs_lease_drop(void *conn) {
+    pthread_mutex_lock(&lease_lock);
+    for (size_t i = 0; i < LEASE_BUCKETS; i++) {
+        lease_file_t *file = lease_files[i];
+        while (file != NULL) {
+            lease_file_t *next = file->next;
+            lease_holder_t **holder = &file->holders;
+            while (*holder != NULL) {
+                if ((*holder)->conn == conn) {
+                    lease_holder_t *dropped = *holder;
+                    *holder = dropped->next;
+                    free(dropped);
+                    __atomic_fetch_sub(&lease_holders, 1, __ATOMIC_RELAXED);
+                } else {
+                    holder = &(*holder)->next;
+                }
+            }
+            lease_open_t **open = &file->opens;
+            while (*open != NULL) {
+                if ((*open)->conn == conn) {
+                    lease_open_t *dropped = *open;
+                    *open = dropped->next;
+                    free(dropped);
+                } else {
+                    open = &(*open)->next;
+                }
+            }
+            lease_file_gc(file);
+            file = next;
+        }
+    }
+    pthread_cond_broadcast(&lease_cond);
+    pthread_mutex_unlock(&lease_lock);
+}
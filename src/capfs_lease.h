@@ -0,0 +1,84 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#ifndef _CAPFS_LEASE_H_
+#define _CAPFS_LEASE_H_
+
+// What a lease lets its holder do without asking, in Op.lease and
+//   Result.lease
+#define LEASE_READ 1
+#define LEASE_WRITE 2
+// How long an open or a change waits for the leases in its way to be given
+//   back, before the connection of whoever holds them is cut off
+#define LEASE_REVOKE_MS 5000
+// Buckets of the gob -> lease table
+#define LEASE_BUCKETS 1024
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <gdp/gdp.h>
+
+// A mount (-o lease) may hold a shared read or an exclusive write lease on
+//   a file's capsule. While it does, nobody else can change the file without
+//   it hearing first, so it keeps the file's pages and attributes without
+//   asking again and, with a write lease, keeps writes to send later. One
+//   is granted on CREATE or OPEN when nobody else could tell, and revoked
+//   before that stops being true: another mount opening the file (for
+//   writing, for read leases) or changing it by path. Revoking sends the
+//   gob in an unasked Response.revoke on the connection the lease was
+//   granted on. The holder writes back what it kept and answers with
+//   LEASE_RELEASE, and the open that is waiting goes on. A holder that has
+//   not answered after LEASE_REVOKE_MS loses the lease and its connection
+//
+// Holders are told apart by Op.owner, one per mount over all of its
+//   connections. One that sent none is its connection. conn is only
+//   compared here and handed back to revoke and expire, which are called
+//   with the lease lock held and must not call in again
+void capfs_lease_init(void (*revoke)(void *conn, const gdp_name_t gob),
+                      void (*expire)(void *conn));
+// Whether anyone holds a lease at all, before looking up what a change hits
+bool capfs_lease_any(void);
+// Before owner opens gob, for writing or not, or with write changes it by
+//   path: waits until the leases of others in the way are back
+void capfs_lease_wait(void *conn, uint64_t owner, const gdp_name_t gob,
+                      bool write);
+// owner opened gob on conn. Returns what it was granted of want: want,
+//   LEASE_READ or 0
+uint32_t capfs_lease_open(void *conn, uint64_t owner, const gdp_name_t gob,
+                          bool write, uint32_t want);
+void capfs_lease_close(void *conn, uint64_t owner, const gdp_name_t gob,
+                       bool write);
+// LEASE_RELEASE
+void capfs_lease_release(void *conn, uint64_t owner, const gdp_name_t gob);
+// conn went away, and with it the opens and the leases on it
+void capfs_lease_drop(void *conn);
+
+#endif // _CAPFS_LEASE_H_
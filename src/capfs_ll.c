@@ -0,0 +1,1262 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "capfs_ll.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <ep/ep.h>
+#include <gdp/gdp.h>
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+
+#include <fuse_lowlevel.h>
+
+#include "capfs_file.h"
+#include "capfs_dir.h"
+#include "capfs_store.h"
+#include "capfs_util.h"
+
+// The kernel names everything by inode number. Each number maps to a node
+//   that keeps its log open for as long as the kernel holds a reference, so
+//   no operation resolves a path. node_lock covers the table and every field
+//   below that changes after creation; the logs themselves are locked by the
+//   file and directory layers. The kernel holds an inode for the duration of
+//   a request, so a node cannot be forgotten while a request is using it.
+typedef struct capfs_node {
+    fuse_ino_t ino;
+    gdp_name_t gob;
+    bool is_dir;
+    bool modified;          // Written since the parent's hints were updated
+    uint64_t nlookup;       // Kernel references, dropped by forget
+    uint32_t open;          // Open file handles
+    fuse_ino_t parent;      // Where the attribute hints live
+    char name[FILE_NAME_MAX_LEN + 1];
+    union {                 // Opened on first use
+        capfs_dir_t *dir;
+        capfs_file_t *file;
+    };
+    struct stat attr;
+    unsigned int cached_recno;  // Last version the kernel page cache holds
+    struct capfs_node *next;
+} capfs_node_t;
+
+static capfs_node_t *node_table[NODE_TABLE_SIZE];
+static capfs_node_t *root_node;
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The kernel caches pages, attributes and names for a long time, so whenever
+//   we see that something changed behind its back it is told to drop them.
+//   Notifications must not be sent from inside a request (the kernel may be
+//   waiting on that request), so they are queued for a separate thread. With
+//   -o watch the store also reports appends by other mounts, which the same
+//   thread turns into notifications
+typedef enum {
+    LL_INVAL_INODE,         // Drop the pages and attributes of ino
+    LL_INVAL_ENTRY,         // Drop name from the directory ino
+    LL_INVAL_CHANGED,       // The log of ino grew to recno, see what moved
+} capfs_inval_type_t;
+
+typedef struct capfs_inval {
+    fuse_ino_t ino;         // Inode, or the parent of name
+    capfs_inval_type_t type;
+    char name[FILE_NAME_MAX_LEN + 1];
+    gdp_recno_t recno;
+    struct capfs_inval *next;
+} capfs_inval_t;
+
+static capfs_inval_t *inval_head;
+static capfs_inval_t **inval_tail = &inval_head;
+static bool inval_stop;
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static bool ll_watch;
+
+// Caller holds inval_lock
+static void
+capfs_ll_queue_locked(capfs_inval_t *inval) {
+    *inval_tail = inval;
+    inval_tail = &inval->next;
+    pthread_cond_signal(&inval_cond);
+}
+
+// name is NULL to drop the inode's pages and attributes, otherwise the name
+//   is dropped from the directory ino
+static void
+capfs_ll_queue_inval(fuse_ino_t ino, const char *name) {
+    capfs_inval_t *inval = calloc(sizeof(capfs_inval_t), 1);
+    inval->ino = ino;
+    inval->type = LL_INVAL_INODE;
+    if (name != NULL) {
+        inval->type = LL_INVAL_ENTRY;
+        strcpy(inval->name, name);
+    }
+    pthread_mutex_lock(&inval_lock);
+    capfs_ll_queue_locked(inval);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+// Root keeps the reserved number the kernel starts from
+static fuse_ino_t
+capfs_ll_ino(const gdp_name_t gob) {
+    if (root_node != NULL
+        && memcmp(gob, root_node->gob, sizeof(gdp_name_t)) == 0) {
+        return FUSE_ROOT_ID;
+    }
+    return capfs_ino(gob);
+}
+
+// Store callback for -o watch. Several appends to one log before the thread
+//   gets to it are looked at once
+static void
+capfs_ll_watch_notify(const gdp_name_t gob, gdp_recno_t recno, void *arg) {
+    (void) arg;
+    fuse_ino_t ino = capfs_ll_ino(gob);
+
+    pthread_mutex_lock(&inval_lock);
+    for (capfs_inval_t *inval = inval_head; inval != NULL;
+         inval = inval->next) {
+        if (inval->type == LL_INVAL_CHANGED && inval->ino == ino) {
+            inval->recno = max(inval->recno, recno);
+            pthread_mutex_unlock(&inval_lock);
+            return;
+        }
+    }
+    capfs_inval_t *inval = calloc(sizeof(capfs_inval_t), 1);
+    inval->ino = ino;
+    inval->type = LL_INVAL_CHANGED;
+    inval->recno = recno;
+    capfs_ll_queue_locked(inval);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+// Caller holds node_lock
+static capfs_node_t *
+capfs_node_find_locked(fuse_ino_t ino) {
+    capfs_node_t *node = node_table[ino % NODE_TABLE_SIZE];
+    while (node != NULL && node->ino != ino) {
+        node = node->next;
+    }
+    return node;
+}
+
+static capfs_node_t *
+capfs_node_find(fuse_ino_t ino) {
+    pthread_mutex_lock(&node_lock);
+    capfs_node_t *node = capfs_node_find_locked(ino);
+    pthread_mutex_unlock(&node_lock);
+    return node;
+}
+
+static void
+capfs_node_insert(capfs_node_t *node) {
+    size_t bucket = node->ino % NODE_TABLE_SIZE;
+    node->next = node_table[bucket];
+    node_table[bucket] = node;
+}
+
+// Drops kernel references and open handles, freeing the node once neither
+//   the kernel nor a handle refers to it
+static void
+capfs_node_put(capfs_node_t *node, uint64_t nlookup, uint32_t open) {
+    pthread_mutex_lock(&node_lock);
+    node->nlookup -= min(node->nlookup, nlookup);
+    node->open -= min(node->open, open);
+    if (node == root_node || node->nlookup > 0 || node->open > 0) {
+        pthread_mutex_unlock(&node_lock);
+        return;
+    }
+    capfs_node_t **link = &node_table[node->ino % NODE_TABLE_SIZE];
+    while (*link != node) {
+        link = &(*link)->next;
+    }
+    *link = node->next;
+    pthread_mutex_unlock(&node_lock);
+
+    if (ll_watch) {
+        capfs_log_unwatch(node->gob);
+    }
+    if (node->is_dir && node->dir != NULL) {
+        capfs_dir_closedir(node->dir);
+        capfs_dir_free(node->dir);
+    } else if (!node->is_dir && node->file != NULL) {
+        capfs_file_close(node->file);
+        capfs_file_free(node->file);
+    }
+    free(node);
+}
+
+// Takes in the attribute hints of a fresh directory entry. If they moved
+//   while the kernel was caching the old ones, the kernel is told to drop
+//   them along with the pages. Caller holds node_lock
+static void
+capfs_node_refresh_locked(capfs_node_t *node, capfs_dir_entry_t *entry) {
+    // Hints are only newer than what we hold if nobody is writing here
+    if (node->modified || node == root_node) {
+        return;
+    }
+    struct stat attr;
+    capfs_entry_stat(entry, &attr);
+    bool changed = node->nlookup > 0
+                   && (node->attr.st_size != attr.st_size
+                       || node->attr.st_mtime != attr.st_mtime
+                       || node->attr.st_mode != attr.st_mode);
+    node->attr = attr;
+    node->attr.st_ino = node->ino;
+    if (changed) {
+        capfs_ll_queue_inval(node->ino, NULL);
+    }
+}
+
+// Takes a kernel reference on the node for entry, creating it if needed
+static capfs_node_t *
+capfs_node_get(capfs_node_t *parent, capfs_dir_entry_t *entry) {
+    fuse_ino_t ino = capfs_ll_ino(entry->gob);
+    pthread_mutex_lock(&node_lock);
+    capfs_node_t *node = capfs_node_find_locked(ino);
+    bool created = node == NULL;
+    if (created) {
+        node = calloc(sizeof(capfs_node_t), 1);
+        node->ino = ino;
+        memcpy(node->gob, entry->gob, sizeof(gdp_name_t));
+        node->is_dir = entry->is_dir;
+        capfs_node_insert(node);
+    }
+    capfs_node_refresh_locked(node, entry);
+    node->parent = parent->ino;
+    strcpy(node->name, entry->name);
+    node->nlookup++;
+    pthread_mutex_unlock(&node_lock);
+
+    // For as long as the kernel may cache it. The request holds the inode,
+    //   so no forget comes before this
+    if (created && ll_watch) {
+        capfs_log_watch(node->gob, capfs_ll_watch_notify, NULL);
+    }
+    return node;
+}
+
+// Hands a file to the node, unless another thread got there first
+static void
+capfs_node_install(capfs_node_t *node, capfs_file_t *file) {
+    pthread_mutex_lock(&node_lock);
+    bool installed = node->file == NULL;
+    if (installed && node->is_dir) {
+        node->dir = capfs_dir_new(file);
+    } else if (installed) {
+        node->file = file;
+    }
+    pthread_mutex_unlock(&node_lock);
+    if (!installed) {
+        capfs_file_close(file);
+        capfs_file_free(file);
+    }
+}
+
+// Gives the node a file for its gob if it has none yet. No round trip, the
+//   log opens on first access
+static EP_STAT
+capfs_node_open(capfs_node_t *node) {
+    if (__atomic_load_n(&node->file, __ATOMIC_ACQUIRE) != NULL) {
+        return EP_STAT_OK;
+    }
+
+    capfs_node_install(node, capfs_file_new(node->gob));
+    return EP_STAT_OK;
+}
+
+static EP_STAT
+capfs_node_get_dir(fuse_ino_t ino, capfs_node_t **node) {
+    *node = capfs_node_find(ino);
+    if (*node == NULL || !(*node)->is_dir) {
+        return EP_STAT_NOT_FOUND;
+    }
+    return capfs_node_open(*node);
+}
+
+static EP_STAT
+capfs_node_get_file(fuse_ino_t ino, capfs_node_t **node) {
+    *node = capfs_node_find(ino);
+    if (*node == NULL || (*node)->is_dir) {
+        return EP_STAT_NOT_FOUND;
+    }
+    return capfs_node_open(*node);
+}
+
+// Refreshes the size and mtime hints in the parent directory entry, and the
+//   mode unless it is 0
+static EP_STAT
+capfs_node_update_hints(capfs_node_t *node, mode_t mode) {
+    EP_STAT estat;
+
+    pthread_mutex_lock(&node_lock);
+    fuse_ino_t parent_ino = node->parent;
+    char name[FILE_NAME_MAX_LEN + 1];
+    strcpy(name, node->name);
+    size_t size = node->attr.st_size;
+    time_t mtime = node->attr.st_mtime;
+    node->modified = false;
+    pthread_mutex_unlock(&node_lock);
+
+    capfs_node_t *parent;
+    estat = capfs_node_get_dir(parent_ino, &parent);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    estat = capfs_dir_set_attr(parent->dir, name, size, mtime, mode);
+    EP_STAT_CHECK(estat, goto fail0);
+    return EP_STAT_OK;
+
+fail0:
+    return estat;
+}
+
+// Stores new permission bits and/or mtime in the inode of a file and in the
+//   hints of its parent entry. Directories only have the hints
+static EP_STAT
+capfs_node_set_attr(capfs_node_t *node, int to_set, const struct stat *attr) {
+    EP_STAT estat;
+
+    // Root has no entry to keep them in
+    if (node == root_node) {
+        return EP_STAT_OK;
+    }
+
+    // atime is not kept, it always reads as the mtime
+    mode_t mode = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec mtime = now;
+    struct timespec *new_mtime = NULL;
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        mode = (node->is_dir ? S_IFDIR : S_IFREG) | (attr->st_mode & 07777);
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        new_mtime = &mtime;
+    } else if (to_set & FUSE_SET_ATTR_MTIME) {
+        mtime = attr->st_mtim;
+        new_mtime = &mtime;
+    }
+    if (mode == 0 && new_mtime == NULL) {
+        return EP_STAT_OK;
+    }
+
+    if (!node->is_dir) {
+        estat = capfs_node_get_file(node->ino, &node);
+        EP_STAT_CHECK(estat, goto fail0);
+        estat = capfs_file_set_attr(node->file, mode, new_mtime);
+        EP_STAT_CHECK(estat, goto fail0);
+        now = node->file->ctime;
+    }
+
+    pthread_mutex_lock(&node_lock);
+    if (mode != 0) {
+        node->attr.st_mode = mode;
+    }
+    if (new_mtime != NULL) {
+        node->attr.st_mtim = mtime;
+        node->attr.st_atim = mtime;
+    }
+    node->attr.st_ctim = now;
+    if (!node->is_dir) {
+        node->cached_recno = node->file->recno;
+    }
+    pthread_mutex_unlock(&node_lock);
+    return capfs_node_update_hints(node, mode);
+
+fail0:
+    return estat;
+}
+
+static void
+capfs_ll_entry_param(capfs_node_t *node, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = node->ino;
+    pthread_mutex_lock(&node_lock);
+    e->attr = node->attr;
+    pthread_mutex_unlock(&node_lock);
+    e->attr_timeout = LL_ATTR_TIMEOUT;
+    e->entry_timeout = LL_ENTRY_TIMEOUT;
+}
+
+static void
+capfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                mode_t mode, struct fuse_file_info *fi) {
+    EP_STAT estat;
+
+    capfs_node_t *dir;
+    estat = capfs_node_get_dir(parent, &dir);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // Check file does not exist
+    capfs_dir_entry_t entry;
+    if (EP_STAT_ISOK(capfs_dir_lookup(dir->dir, name, &entry))) {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+
+    // Create the file in the directory
+    capfs_file_t *file;
+    estat = capfs_dir_make_file(dir->dir, name, S_IFREG | (mode & 07777),
+                                &file);
+    EP_STAT_CHECK(estat, goto fail0);
+    estat = capfs_dir_lookup(dir->dir, name, &entry);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    // The new log is already open, hand it to the node
+    capfs_node_t *node = capfs_node_get(dir, &entry);
+    capfs_node_install(node, file);
+    pthread_mutex_lock(&node_lock);
+    node->open++;
+    pthread_mutex_unlock(&node_lock);
+
+    struct fuse_entry_param e;
+    capfs_ll_entry_param(node, &e);
+    fuse_reply_create(req, &e, fi);
+    return;
+
+fail1:
+    capfs_file_close(file);
+    capfs_file_free(file);
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_destroy(void *userdata) {
+    (void) userdata;
+
+    // Write back any batched directory mutations and drop unused pooled logs
+    //   before unmounting
+    capfs_dir_flush_stop();
+    capfs_dir_flush_all();
+    capfs_file_pool_drain();
+}
+
+static void
+capfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    capfs_node_t *node = capfs_node_find(ino);
+    if (node != NULL) {
+        capfs_node_put(node, nlookup, 0);
+    }
+    fuse_reply_none(req);
+}
+
+static void
+capfs_ll_forget_multi(fuse_req_t req, size_t count,
+                      struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        capfs_node_t *node = capfs_node_find(forgets[i].ino);
+        if (node != NULL) {
+            capfs_node_put(node, forgets[i].nlookup, 0);
+        }
+    }
+    fuse_reply_none(req);
+}
+
+// Appends the writes gathered on node. The kernel pages already hold them, so
+//   they stay valid across the new records
+static EP_STAT
+capfs_node_flush(capfs_node_t *node) {
+    EP_STAT estat = capfs_file_flush(node->file);
+    EP_STAT_CHECK(estat, return estat);
+    pthread_mutex_lock(&node_lock);
+    node->cached_recno = node->file->recno;
+    pthread_mutex_unlock(&node_lock);
+    return EP_STAT_OK;
+}
+
+// Called on every close() of a descriptor, so gathered writes fail there
+static void
+capfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) fi;
+    EP_STAT estat;
+
+    capfs_node_t *node;
+    estat = capfs_node_get_file(ino, &node);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    estat = capfs_node_flush(node);
+    EP_STAT_CHECK(estat, goto fail1);
+    fuse_reply_err(req, 0);
+    return;
+
+fail1:
+    fuse_reply_err(req, EIO);
+    return;
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+               struct fuse_file_info *fi) {
+    (void) fi;
+    EP_STAT estat;
+
+    capfs_node_t *node;
+    estat = capfs_node_get_file(ino, &node);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    estat = capfs_node_flush(node);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    // Size and mtime hints are metadata, only fsync proper waits for them
+    pthread_mutex_lock(&node_lock);
+    bool stale = !datasync && node->modified;
+    pthread_mutex_unlock(&node_lock);
+    if (stale) {
+        estat = capfs_node_update_hints(node, 0);
+        EP_STAT_CHECK(estat, goto fail1);
+    }
+    fuse_reply_err(req, 0);
+    return;
+
+fail1:
+    fuse_reply_err(req, EIO);
+    return;
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                  struct fuse_file_info *fi) {
+    (void) datasync;
+    (void) fi;
+    EP_STAT estat;
+
+    capfs_node_t *node;
+    estat = capfs_node_get_dir(ino, &node);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    estat = capfs_dir_flush(node->dir);
+    EP_STAT_CHECK(estat, goto fail1);
+    fuse_reply_err(req, 0);
+    return;
+
+fail1:
+    fuse_reply_err(req, EIO);
+    return;
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) fi;
+
+    // Attributes came with the lookup and are kept current by writes
+    capfs_node_t *node = capfs_node_find(ino);
+    if (node == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    pthread_mutex_lock(&node_lock);
+    struct stat attr = node->attr;
+    pthread_mutex_unlock(&node_lock);
+    fuse_reply_attr(req, &attr, LL_ATTR_TIMEOUT);
+}
+
+static void
+capfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    capfs_conn_init(conn, userdata);
+}
+
+static void
+capfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    EP_STAT estat;
+
+    capfs_node_t *dir;
+    estat = capfs_node_get_dir(parent, &dir);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // One entry gives the gob, the type and the attribute hints
+    capfs_dir_entry_t entry;
+    estat = capfs_dir_lookup(dir->dir, name, &entry);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    struct fuse_entry_param e;
+    capfs_ll_entry_param(capfs_node_get(dir, &entry), &e);
+    fuse_reply_entry(req, &e);
+    return;
+
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+               mode_t mode) {
+    EP_STAT estat;
+
+    capfs_node_t *dir;
+    estat = capfs_node_get_dir(parent, &dir);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // Child does not exist
+    capfs_dir_entry_t entry;
+    if (EP_STAT_ISOK(capfs_dir_lookup(dir->dir, name, &entry))) {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+
+    // Create the child in the directory
+    capfs_dir_t *child;
+    estat = capfs_dir_mkdir(dir->dir, name, S_IFDIR | (mode & 07777),
+                            &child);
+    EP_STAT_CHECK(estat, goto fail0);
+    estat = capfs_dir_lookup(dir->dir, name, &entry);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    // Only the log is kept, the node wraps it again
+    capfs_node_t *node = capfs_node_get(dir, &entry);
+    capfs_node_install(node, child->file);
+    free(child);
+
+    struct fuse_entry_param e;
+    capfs_ll_entry_param(node, &e);
+    fuse_reply_entry(req, &e);
+    return;
+
+fail1:
+    capfs_dir_closedir(child);
+    capfs_dir_free(child);
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    EP_STAT estat;
+
+    capfs_node_t *node;
+    estat = capfs_node_get_file(ino, &node);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // Close-to-open: pick up writes made elsewhere since the pages were read.
+    //   Nothing cached yet means nothing to check, and the log stays unopened
+    pthread_mutex_lock(&node_lock);
+    bool cached = node->cached_recno != 0;
+    pthread_mutex_unlock(&node_lock);
+    size_t length;
+    bool refreshed = cached
+                     && EP_STAT_ISOK(capfs_file_get_length(node->file,
+                                                           &length));
+    unsigned int recno = node->file->recno;
+    pthread_mutex_lock(&node_lock);
+    // Cached pages are good as long as nobody appended since they were read
+    fi->keep_cache = refreshed && recno == node->cached_recno;
+    bool changed = refreshed && !fi->keep_cache && node->cached_recno != 0;
+    if (refreshed) {
+        node->cached_recno = recno;
+    }
+    if (refreshed && !node->modified) {
+        node->attr.st_size = length;
+    }
+    node->open++;
+    pthread_mutex_unlock(&node_lock);
+    // Without keep_cache the kernel drops the pages itself, the attributes
+    //   (the size in particular) still need to go
+    if (changed) {
+        capfs_ll_queue_inval(node->ino, NULL);
+    }
+    fuse_reply_open(req, fi);
+    return;
+
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+// Names the kernel resolved under dir may have been removed or replaced by
+//   another client. Listing the directory is the natural point to notice, so
+//   every known child is looked up again, all in one read of the table, and
+//   dropped if it moved. The entry is the only copy of a subdirectory's
+//   attributes, those are taken in too; a file's are newer in its own log
+static void
+capfs_ll_check_children(capfs_node_t *dir) {
+    typedef struct {
+        fuse_ino_t ino;
+        char name[FILE_NAME_MAX_LEN + 1];
+    } child_t;
+    size_t count = 0, capacity = 0;
+    child_t *children = NULL;
+
+    pthread_mutex_lock(&node_lock);
+    for (size_t i = 0; i < NODE_TABLE_SIZE; i++) {
+        for (capfs_node_t *n = node_table[i]; n != NULL; n = n->next) {
+            if (n->parent != dir->ino || n == root_node || n->nlookup == 0) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity == 0 ? 16 : capacity * 2;
+                children = realloc(children, capacity * sizeof(child_t));
+            }
+            children[count].ino = n->ino;
+            strcpy(children[count].name, n->name);
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&node_lock);
+    if (count == 0) {
+        return;
+    }
+
+    // One read of the table for all of them, not a round trip each
+    capfs_dir_table_t *table = malloc(sizeof(capfs_dir_table_t));
+    EP_STAT estat = capfs_dir_table_read(dir->dir, table);
+    for (size_t i = 0; i < count; i++) {
+        capfs_dir_entry_t entry;
+        if (!EP_STAT_ISOK(estat)
+            || !capfs_dir_table_lookup(table, children[i].name, &entry)
+            || capfs_ll_ino(entry.gob) != children[i].ino) {
+            capfs_ll_queue_inval(dir->ino, children[i].name);
+            continue;
+        }
+        pthread_mutex_lock(&node_lock);
+        capfs_node_t *node = capfs_node_find_locked(children[i].ino);
+        if (node != NULL && node->is_dir) {
+            capfs_node_refresh_locked(node, &entry);
+        }
+        pthread_mutex_unlock(&node_lock);
+    }
+    free(table);
+    free(children);
+}
+
+static void
+capfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    EP_STAT estat;
+
+    capfs_node_t *node;
+    estat = capfs_node_get_dir(ino, &node);
+    EP_STAT_CHECK(estat, goto fail0);
+    pthread_mutex_lock(&node_lock);
+    node->open++;
+    pthread_mutex_unlock(&node_lock);
+    capfs_ll_check_children(node);
+    fuse_reply_open(req, fi);
+    return;
+
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+// Another mount appended to the log of ino. A directory has its known
+//   children looked up again and its listing dropped, a file has its length
+//   read again and its pages dropped. Whatever this queues is sent by the
+//   calling thread on a later turn
+static void
+capfs_ll_changed(fuse_ino_t ino, gdp_recno_t recno) {
+    // Held like an open handle, the kernel may forget it meanwhile
+    pthread_mutex_lock(&node_lock);
+    capfs_node_t *node = capfs_node_find_locked(ino);
+    if (node != NULL) {
+        node->open++;
+    }
+    pthread_mutex_unlock(&node_lock);
+    if (node == NULL) {
+        return;
+    }
+
+    // GDP also reports our own appends. For a directory looking again finds
+    //   nothing moved, for a file the recno tells
+    capfs_node_open(node);
+    if (node->is_dir) {
+        capfs_ll_check_children(node);
+        capfs_ll_queue_inval(node->ino, NULL);
+    } else if (recno > (gdp_recno_t) node->file->recno) {
+        size_t length;
+        if (EP_STAT_ISOK(capfs_file_get_length(node->file, &length))) {
+            pthread_mutex_lock(&node_lock);
+            if (!node->modified) {
+                node->attr.st_size = length;
+                node->attr.st_mtim = node->file->mtime;
+                node->attr.st_atim = node->file->mtime;
+                node->attr.st_ctim = node->file->ctime;
+            }
+            node->cached_recno = node->file->recno;
+            pthread_mutex_unlock(&node_lock);
+            capfs_ll_queue_inval(node->ino, NULL);
+        }
+    }
+    capfs_node_put(node, 0, 1);
+}
+
+static void *
+capfs_ll_inval_thread(void *arg) {
+    struct fuse_chan *ch = arg;
+
+    pthread_mutex_lock(&inval_lock);
+    while (!inval_stop) {
+        if (inval_head == NULL) {
+            pthread_cond_wait(&inval_cond, &inval_lock);
+            continue;
+        }
+        capfs_inval_t *inval = inval_head;
+        inval_head = inval->next;
+        if (inval_head == NULL) {
+            inval_tail = &inval_head;
+        }
+        pthread_mutex_unlock(&inval_lock);
+
+        // Errors only mean the kernel had nothing cached
+        if (inval->type == LL_INVAL_ENTRY) {
+            fuse_lowlevel_notify_inval_entry(ch, inval->ino, inval->name,
+                                             strlen(inval->name));
+        } else if (inval->type == LL_INVAL_INODE) {
+            fuse_lowlevel_notify_inval_inode(ch, inval->ino, 0, 0);
+        } else {
+            capfs_ll_changed(inval->ino, inval->recno);
+        }
+        free(inval);
+        pthread_mutex_lock(&inval_lock);
+    }
+    pthread_mutex_unlock(&inval_lock);
+    return NULL;
+}
+
+static void
+capfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+              struct fuse_file_info *fi) {
+    (void) fi;
+    EP_STAT estat;
+    capfs_block_ref_t refs[FILE_BLOCKS_SPANNED(size, off)];
+
+    capfs_node_t *node;
+    estat = capfs_node_get_file(ino, &node);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // Reads past the end are short, not errors
+    size_t count;
+    estat = capfs_file_read_blocks(node->file, size, off, refs, &count);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    // The kernel now caches pages as of this version
+    pthread_mutex_lock(&node_lock);
+    node->cached_recno = node->file->recno;
+    pthread_mutex_unlock(&node_lock);
+
+    // The reply points into the cached blocks, nothing is copied on our side
+    struct fuse_bufvec *bufv = calloc(sizeof(struct fuse_bufvec)
+                                      + count * sizeof(struct fuse_buf), 1);
+    bufv->count = count;
+    for (size_t i = 0; i < count; i++) {
+        bufv->buf[i].mem = (void *) refs[i].data;
+        bufv->buf[i].size = refs[i].size;
+        bufv->buf[i].fd = -1;
+    }
+    if (count == 0) {
+        fuse_reply_buf(req, NULL, 0);
+    } else {
+        fuse_reply_data(req, bufv, 0);
+    }
+    free(bufv);
+    capfs_file_put_blocks(refs, count);
+    return;
+
+fail1:
+    fuse_reply_err(req, EIO);
+    return;
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+typedef struct capfs_ll_readdir_ctx {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t used;
+} capfs_ll_readdir_ctx_t;
+
+static bool
+capfs_ll_readdir_fill(void *arg, capfs_dir_entry_t *entry, off_t next) {
+    capfs_ll_readdir_ctx_t *ctx = arg;
+
+    struct stat st;
+    capfs_entry_stat(entry, &st);
+    st.st_ino = capfs_ll_ino(entry->gob);
+
+    // Listings carry the same hints as lookups, use them to spot changes.
+    //   Not those of . and .., which are not the directories' own entries
+    bool dots = strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0;
+    pthread_mutex_lock(&node_lock);
+    capfs_node_t *node = dots ? NULL : capfs_node_find_locked(st.st_ino);
+    if (node != NULL) {
+        capfs_node_refresh_locked(node, entry);
+    }
+    pthread_mutex_unlock(&node_lock);
+
+    size_t length = fuse_add_direntry(ctx->req, ctx->buf + ctx->used,
+                                      ctx->size - ctx->used, entry->name, &st,
+                                      next);
+    // Reply buffer is full, the kernel comes back with next
+    if (length > ctx->size - ctx->used) {
+        return false;
+    }
+    ctx->used += length;
+    return true;
+}
+
+static void
+capfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                 struct fuse_file_info *fi) {
+    (void) fi;
+    EP_STAT estat;
+
+    capfs_node_t *node;
+    estat = capfs_node_get_dir(ino, &node);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // Resume where the previous call stopped
+    capfs_ll_readdir_ctx_t ctx = { req, malloc(size), size, 0 };
+    off_t cursor = off;
+    estat = capfs_dir_readdir(node->dir, &cursor, capfs_ll_readdir_fill,
+                              &ctx);
+    EP_STAT_CHECK(estat, goto fail1);
+    fuse_reply_buf(req, ctx.buf, ctx.used);
+    free(ctx.buf);
+    return;
+
+fail1:
+    free(ctx.buf);
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) fi;
+
+    capfs_node_t *node = capfs_node_find(ino);
+    if (node == NULL || node->is_dir) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    // Errors were reported by flush already, nobody is left to tell
+    capfs_node_flush(node);
+
+    // Written to, so the hints readdir hands out are stale
+    pthread_mutex_lock(&node_lock);
+    bool stale = node->open == 1 && node->modified;
+    pthread_mutex_unlock(&node_lock);
+    if (stale) {
+        capfs_node_update_hints(node, 0);
+    }
+    capfs_node_put(node, 0, 1);
+    fuse_reply_err(req, 0);
+}
+
+static void
+capfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info *fi) {
+    (void) fi;
+
+    capfs_node_t *node = capfs_node_find(ino);
+    if (node == NULL || !node->is_dir) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    capfs_node_put(node, 0, 1);
+    fuse_reply_err(req, 0);
+}
+
+static void
+capfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                fuse_ino_t newparent, const char *newname) {
+    EP_STAT estat;
+
+    capfs_node_t *from;
+    estat = capfs_node_get_dir(parent, &from);
+    EP_STAT_CHECK(estat, goto fail0);
+    capfs_node_t *to;
+    estat = capfs_node_get_dir(newparent, &to);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    estat = capfs_dir_rename(from->dir, to->dir, name, newname);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // A node the kernel still holds must find its hints under the new name
+    capfs_dir_entry_t entry;
+    if (EP_STAT_ISOK(capfs_dir_lookup(to->dir, newname, &entry))) {
+        pthread_mutex_lock(&node_lock);
+        capfs_node_t *node = capfs_node_find_locked(capfs_ll_ino(entry.gob));
+        if (node != NULL) {
+            node->parent = to->ino;
+            strcpy(node->name, newname);
+        }
+        pthread_mutex_unlock(&node_lock);
+    }
+    fuse_reply_err(req, 0);
+    return;
+
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    EP_STAT estat;
+
+    capfs_node_t *dir;
+    estat = capfs_node_get_dir(parent, &dir);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    estat = capfs_dir_rmdir(dir->dir, name);
+    EP_STAT_CHECK(estat, goto fail0);
+    fuse_reply_err(req, 0);
+    return;
+
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                 int to_set, struct fuse_file_info *fi) {
+    (void) fi;
+    EP_STAT estat;
+
+    capfs_node_t *node = capfs_node_find(ino);
+    if (node == NULL) {
+        goto fail0;
+    }
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        estat = capfs_node_get_file(ino, &node);
+        EP_STAT_CHECK(estat, goto fail0);
+        estat = capfs_file_truncate(node->file, attr->st_size);
+        EP_STAT_CHECK(estat, goto fail0);
+        pthread_mutex_lock(&node_lock);
+        node->attr.st_size = attr->st_size;
+        node->attr.st_mtime = time(NULL);
+        node->cached_recno = node->file->recno;
+        pthread_mutex_unlock(&node_lock);
+        capfs_node_update_hints(node, 0);
+    }
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_MTIME
+                  | FUSE_SET_ATTR_MTIME_NOW)) {
+        estat = capfs_node_set_attr(node, to_set, attr);
+        EP_STAT_CHECK(estat, goto fail0);
+    }
+    pthread_mutex_lock(&node_lock);
+    struct stat reply = node->attr;
+    pthread_mutex_unlock(&node_lock);
+    fuse_reply_attr(req, &reply, LL_ATTR_TIMEOUT);
+    return;
+
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    (void) ino;
+    struct statvfs st;
+    capfs_statvfs(&st);
+    fuse_reply_statfs(req, &st);
+}
+
+static void
+capfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    EP_STAT estat;
+
+    capfs_node_t *dir;
+    estat = capfs_node_get_dir(parent, &dir);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    estat = capfs_dir_remove_file(dir->dir, name);
+    EP_STAT_CHECK(estat, goto fail0);
+    fuse_reply_err(req, 0);
+    return;
+
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static void
+capfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                   off_t off, struct fuse_file_info *fi) {
+    (void) fi;
+    EP_STAT estat;
+
+    capfs_node_t *node;
+    estat = capfs_node_get_file(ino, &node);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    size_t size = fuse_buf_size(bufv);
+    estat = capfs_write_bufvec(node->file, bufv, off);
+    EP_STAT_CHECK(estat, goto fail1);
+    pthread_mutex_lock(&node_lock);
+    node->modified = true;
+    node->attr.st_size = max(node->attr.st_size, (off_t) (off + size));
+    node->attr.st_mtime = time(NULL);
+    // The kernel copied the write into its pages already
+    node->cached_recno = node->file->recno;
+    pthread_mutex_unlock(&node_lock);
+    fuse_reply_write(req, size);
+    return;
+
+fail1:
+    fuse_reply_err(req, EIO);
+    return;
+fail0:
+    fuse_reply_err(req, ENOENT);
+}
+
+static struct fuse_lowlevel_ops capfs_ll_operations = {
+    .create = capfs_ll_create,
+    .destroy = capfs_ll_destroy,
+    .forget = capfs_ll_forget,
+    .forget_multi = capfs_ll_forget_multi,
+    .flush = capfs_ll_flush,
+    .fsync = capfs_ll_fsync,
+    .fsyncdir = capfs_ll_fsyncdir,
+    .getattr = capfs_ll_getattr,
+    .init = capfs_ll_init,
+    .lookup = capfs_ll_lookup,
+    .mkdir = capfs_ll_mkdir,
+    .open = capfs_ll_open,
+    .opendir = capfs_ll_opendir,
+    .read = capfs_ll_read,
+    .readdir = capfs_ll_readdir,
+    .release = capfs_ll_release,
+    .releasedir = capfs_ll_releasedir,
+    .rename = capfs_ll_rename,
+    .rmdir = capfs_ll_rmdir,
+    .setattr = capfs_ll_setattr,
+    .statfs = capfs_ll_statfs,
+    .unlink = capfs_ll_unlink,
+    .write_buf = capfs_ll_write_buf,
+};
+
+// The kernel never looks up the root, it starts out referenced
+static EP_STAT
+capfs_ll_init_root(void) {
+    EP_STAT estat;
+
+    capfs_dir_t *dir;
+    estat = capfs_dir_open_root(&dir);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    root_node = calloc(sizeof(capfs_node_t), 1);
+    root_node->ino = FUSE_ROOT_ID;
+    memcpy(root_node->gob, dir->file->gob, sizeof(gdp_name_t));
+    root_node->is_dir = true;
+    root_node->nlookup = 1;
+    root_node->parent = FUSE_ROOT_ID;
+    root_node->dir = dir;
+    root_node->attr.st_ino = FUSE_ROOT_ID;
+    root_node->attr.st_uid = getuid();
+    root_node->attr.st_gid = getgid();
+    root_node->attr.st_mode = S_IFDIR | 0755;
+    root_node->attr.st_nlink = 1;
+    capfs_node_insert(root_node);
+    if (ll_watch) {
+        capfs_log_watch(root_node->gob, capfs_ll_watch_notify, NULL);
+    }
+    return EP_STAT_OK;
+
+fail0:
+    return estat;
+}
+
+int
+capfs_ll_main(int argc, char *argv[], const capfs_options_t *options) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int ret = EX_USAGE;
+
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+                           &foreground) == -1) {
+        goto fail0;
+    }
+
+    ll_watch = options->watch;
+    if (!EP_STAT_ISOK(capfs_ll_init_root())) {
+        ret = EX_UNAVAILABLE;
+        goto fail1;
+    }
+
+    ret = EX_OSERR;
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch == NULL) {
+        goto fail1;
+    }
+    struct fuse_session *se = fuse_lowlevel_new(&args, &capfs_ll_operations,
+                                                sizeof(capfs_ll_operations),
+                                                (void *) options);
+    if (se == NULL) {
+        goto fail2;
+    }
+    if (fuse_set_signal_handlers(se) == -1) {
+        goto fail3;
+    }
+    fuse_session_add_chan(se, ch);
+    fuse_daemonize(foreground);
+
+    // Started after daemonizing, the fork would leave it behind
+    pthread_t inval_thread;
+    if (pthread_create(&inval_thread, NULL, capfs_ll_inval_thread, ch) != 0) {
+        goto fail4;
+    }
+
+    if (multithreaded) {
+        ret = fuse_session_loop_mt(se) == 0 ? 0 : EX_SOFTWARE;
+    } else {
+        ret = fuse_session_loop(se) == 0 ? 0 : EX_SOFTWARE;
+    }
+
+    pthread_mutex_lock(&inval_lock);
+    inval_stop = true;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+    pthread_join(inval_thread, NULL);
+fail4:
+    fuse_remove_signal_handlers(se);
+    fuse_session_remove_chan(ch);
+fail3:
+    fuse_session_destroy(se);
+fail2:
+    fuse_unmount(mountpoint, ch);
+fail1:
+    free(mountpoint);
+fail0:
+    fuse_opt_free_args(&args);
+    return ret;
+}
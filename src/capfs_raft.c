@@ -0,0 +1,897 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_raft.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capfs_dir.h"
+#include "capfs_rpc.h"
+#include "capfs_store.h"
+#include "capfs_util.h"
+
+typedef enum raft_role {
+    RAFT_FOLLOWER,
+    RAFT_CANDIDATE,
+    RAFT_LEADER,
+} raft_role_t;
+
+// Which paths a write changed, or everything if clear
+typedef struct raft_entry {
+    uint64_t term;
+    char **paths;
+    size_t n_paths;
+    bool clear;
+} raft_entry_t;
+
+// Another replica, and what the leader knows of it. fd and next_id belong
+//   to its thread, the rest is under raft_lock
+typedef struct raft_peer {
+    char *address;
+    int fd;                   // -1 until connected
+    uint64_t next_id;
+    uint64_t retry_at;        // Not asked again before, after a failure
+    uint64_t asked_term;      // Term its vote was last asked for in
+    uint64_t next_index;      // First entry it is sent next
+    uint64_t match;           // Last entry it is known to have
+    uint64_t applied;         // Last entry it is known to have applied
+    uint64_t heartbeat_at;    // When it is sent an append next
+    uint64_t acked_at;        // When the last append it answered was sent
+    // It may answer reads until lease_until, having applied up to
+    //   lease_commit. Leases given before it heard of lease_commit end by
+    //   lease_prev_until
+    uint64_t lease_commit;
+    uint64_t lease_until;
+    uint64_t lease_prev_until;
+} raft_peer_t;
+
+static pthread_mutex_t raft_lock = PTHREAD_MUTEX_INITIALIZER;
+// Anything below changed
+static pthread_cond_t raft_cond;
+static bool raft_on;
+static int raft_self;
+static int raft_count;
+static raft_peer_t raft_peers[RAFT_MAX_REPLICAS];
+static char raft_state_path[PATH_MAX];
+static uint64_t raft_random;
+
+// Kept in raft_state_path, a vote must not be given twice in a term
+static uint64_t raft_term;
+static int raft_voted_for = -1;
+
+// Times are in ms of CLOCK_MONOTONIC
+static raft_role_t raft_role;
+static int raft_leader = -1;
+static int raft_votes;
+static uint64_t raft_election_at;
+static uint64_t raft_heard_at;
+static uint64_t raft_lease_until;
+static uint64_t raft_refreshed_term;
+static uint64_t raft_term_start;
+
+// Entries raft_base + 1 to raft_base + raft_length. Those before are
+//   applied everywhere, or a replica that missed them starts over
+static raft_entry_t *raft_log;
+static size_t raft_length;
+static size_t raft_size;
+static uint64_t raft_base;
+static uint64_t raft_base_term;
+static uint64_t raft_committed;
+static uint64_t raft_applied;
+
+static uint64_t
+raft_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Waits for a change until at the latest, raft_lock held
+static void
+raft_wait_until(uint64_t at) {
+    struct timespec ts = { at / 1000, (at % 1000) * 1000000 };
+    pthread_cond_timedwait(&raft_cond, &raft_lock, &ts);
+}
+
+static uint64_t
+raft_last(void) {
+    return raft_base + raft_length;
+}
+
+// 0 if the entry is not in the log
+static uint64_t
+raft_term_at(uint64_t index) {
+    if (index == raft_base) {
+        return raft_base_term;
+    }
+    if (index < raft_base || index > raft_last()) {
+        return 0;
+    }
+    return raft_log[index - raft_base - 1].term;
+}
+
+static void
+raft_append(uint64_t term, char *const *paths, size_t n_paths, bool clear) {
+    if (raft_length == raft_size) {
+        raft_size = raft_size == 0 ? 64 : 2 * raft_size;
+        raft_log = realloc(raft_log, raft_size * sizeof(raft_entry_t));
+    }
+    raft_entry_t *entry = &raft_log[raft_length++];
+    entry->term = term;
+    entry->paths = malloc(max(n_paths, 1) * sizeof(char *));
+    for (size_t i = 0; i < n_paths; i++) {
+        entry->paths[i] = strdup(paths[i]);
+    }
+    entry->n_paths = n_paths;
+    entry->clear = clear;
+}
+
+static void
+raft_entry_free(raft_entry_t *entry) {
+    for (size_t i = 0; i < entry->n_paths; i++) {
+        free(entry->paths[i]);
+    }
+    free(entry->paths);
+}
+
+// Drops the entries after index
+static void
+raft_truncate(uint64_t index) {
+    while (raft_last() > index) {
+        raft_entry_free(&raft_log[--raft_length]);
+    }
+}
+
+// Drops the entries up to index
+static void
+raft_compact(uint64_t index) {
+    index = min(index, raft_last());
+    if (index <= raft_base) {
+        return;
+    }
+    size_t n = index - raft_base;
+    raft_base_term = raft_term_at(index);
+    for (size_t i = 0; i < n; i++) {
+        raft_entry_free(&raft_log[i]);
+    }
+    memmove(raft_log, raft_log + n, (raft_length - n) * sizeof(raft_entry_t));
+    raft_length -= n;
+    raft_base = index;
+}
+
+// Keeps what a replica that lags may still need, up to RAFT_LOG_MAX. A
+//   follower needs nothing it applied: a new leader makes everyone refresh
+static void
+raft_trim(void) {
+    uint64_t index = raft_applied;
+    if (raft_role == RAFT_LEADER && raft_length <= RAFT_LOG_MAX) {
+        for (int i = 0; i < raft_count; i++) {
+            if (i != raft_self) {
+                index = min(index, raft_peers[i].applied);
+            }
+        }
+    }
+    raft_compact(index);
+}
+
+static EP_STAT
+raft_persist(void) {
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", raft_state_path);
+    FILE *file = fopen(tmp, "w");
+    if (file == NULL) {
+        return ep_stat_from_errno(errno);
+    }
+    fprintf(file, "%" PRIu64 " %d\n", raft_term, raft_voted_for);
+    int err = 0;
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        err = errno;
+    }
+    if (fclose(file) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err == 0 && rename(tmp, raft_state_path) != 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        unlink(tmp);
+        return ep_stat_from_errno(err);
+    }
+    return EP_STAT_OK;
+}
+
+static void
+raft_load(void) {
+    FILE *file = fopen(raft_state_path, "r");
+    if (file == NULL) {
+        return;
+    }
+    if (fscanf(file, "%" SCNu64 " %d", &raft_term, &raft_voted_for) != 2) {
+        raft_term = 0;
+        raft_voted_for = -1;
+    }
+    fclose(file);
+}
+
+static void
+raft_election_reset(uint64_t now) {
+    // xorshift, seeded apart on every replica so they do not all stand at once
+    raft_random ^= raft_random << 13;
+    raft_random ^= raft_random >> 7;
+    raft_random ^= raft_random << 17;
+    raft_election_at = now + RAFT_ELECTION_MIN_MS
+                       + raft_random % (RAFT_ELECTION_MAX_MS
+                                        - RAFT_ELECTION_MIN_MS);
+}
+
+static void
+raft_step_down(uint64_t term) {
+    if (term > raft_term) {
+        raft_term = term;
+        raft_voted_for = -1;
+        raft_leader = -1;
+        raft_persist();
+    }
+    raft_role = RAFT_FOLLOWER;
+    pthread_cond_broadcast(&raft_cond);
+}
+
+// Whether a majority answered the leader so lately that none of them can
+//   have voted for anyone else since, see raft_handle_vote
+static bool
+raft_leader_lease(uint64_t now) {
+    int acked = 1;
+    for (int i = 0; i < raft_count; i++) {
+        if (i != raft_self && raft_peers[i].acked_at + RAFT_ELECTION_MIN_MS
+                              > now + RAFT_SLACK_MS) {
+            acked++;
+        }
+    }
+    return 2 * acked > raft_count;
+}
+
+// Commits what a majority has, of this term only
+static void
+raft_advance(void) {
+    for (uint64_t index = raft_last(); index > raft_committed; index--) {
+        if (raft_term_at(index) != raft_term) {
+            break;
+        }
+        int count = 1;
+        for (int i = 0; i < raft_count; i++) {
+            if (i != raft_self && raft_peers[i].match >= index) {
+                count++;
+            }
+        }
+        if (2 * count > raft_count) {
+            // The leader's own caches saw the writes happen
+            raft_committed = index;
+            raft_applied = index;
+            pthread_cond_broadcast(&raft_cond);
+            break;
+        }
+    }
+}
+
+static void
+raft_become_leader(uint64_t now) {
+    raft_role = RAFT_LEADER;
+    raft_leader = raft_self;
+    // Whatever the last leader wrote is read afresh
+    attr_cache_clear();
+    capfs_store_refresh();
+    raft_refreshed_term = raft_term;
+    for (int i = 0; i < raft_count; i++) {
+        raft_peer_t *peer = &raft_peers[i];
+        peer->next_index = raft_last() + 1;
+        peer->match = 0;
+        peer->applied = 0;
+        peer->heartbeat_at = 0;
+        peer->acked_at = 0;
+        // Followers may still answer reads on the last leader's lease
+        peer->lease_commit = 0;
+        peer->lease_until = now + RAFT_LEASE_MS + RAFT_SLACK_MS;
+        peer->lease_prev_until = peer->lease_until;
+    }
+    // Serves once this commits, see capfs_raft_can_serve
+    raft_append(raft_term, NULL, 0, false);
+    raft_term_start = raft_last();
+    raft_election_at = now + RAFT_ELECTION_MAX_MS;
+    raft_advance();
+    pthread_cond_broadcast(&raft_cond);
+}
+
+static void
+raft_stand(uint64_t now) {
+    raft_election_reset(now);
+    raft_term++;
+    raft_voted_for = raft_self;
+    raft_leader = -1;
+    if (!EP_STAT_ISOK(raft_persist())) {
+        // Could vote twice after a restart, so sits this term out
+        raft_role = RAFT_FOLLOWER;
+        return;
+    }
+    raft_role = RAFT_CANDIDATE;
+    raft_votes = 1;
+    if (2 * raft_votes > raft_count) {
+        raft_become_leader(now);
+    }
+    pthread_cond_broadcast(&raft_cond);
+}
+
+// Forgets what the committed entries changed. A new leader or a snapshot
+//   forgets everything
+static void
+raft_apply(void) {
+    if (raft_refreshed_term != raft_term) {
+        attr_cache_clear();
+        capfs_store_refresh();
+        raft_refreshed_term = raft_term;
+        raft_applied = raft_committed;
+        return;
+    }
+    if (raft_applied >= raft_committed) {
+        return;
+    }
+    for (uint64_t index = raft_applied + 1; index <= raft_committed; index++) {
+        raft_entry_t *entry = &raft_log[index - raft_base - 1];
+        if (entry->clear) {
+            attr_cache_clear();
+        }
+        for (size_t i = 0; i < entry->n_paths; i++) {
+            attr_cache_invalidate(entry->paths[i]);
+        }
+    }
+    // The directories and files they wrote to
+    capfs_store_refresh();
+    raft_applied = raft_committed;
+}
+
+static void
+raft_message_free(Capfs__Raft *message) {
+    for (size_t i = 0; i < message->n_entries; i++) {
+        Capfs__RaftEntry *entry = message->entries[i];
+        for (size_t j = 0; j < entry->n_paths; j++) {
+            free(entry->paths[j]);
+        }
+        free(entry->paths);
+        free(entry);
+    }
+    free(message->entries);
+}
+
+// What peer misses, as copies: it is sent without raft_lock held
+static void
+raft_append_message(raft_peer_t *peer, Capfs__Raft *message, uint64_t now) {
+    if (peer->next_index <= raft_base) {
+        // What it misses is gone from the log, it starts over
+        message->has_snapshot = true;
+        message->snapshot = true;
+        peer->next_index = raft_base + 1;
+    }
+    uint64_t prev = peer->next_index - 1;
+    message->has_prev_index = true;
+    message->prev_index = prev;
+    message->has_prev_term = true;
+    message->prev_term = raft_term_at(prev);
+
+    size_t n = min(raft_last() - prev, RAFT_APPEND_MAX);
+    message->entries = malloc(max(n, 1) * sizeof(Capfs__RaftEntry *));
+    for (size_t i = 0; i < n; i++) {
+        raft_entry_t *entry = &raft_log[prev + i - raft_base];
+        Capfs__RaftEntry *copy = malloc(sizeof(Capfs__RaftEntry));
+        capfs__raft_entry__init(copy);
+        copy->term = entry->term;
+        copy->paths = malloc(max(entry->n_paths, 1) * sizeof(char *));
+        for (size_t j = 0; j < entry->n_paths; j++) {
+            copy->paths[j] = strdup(entry->paths[j]);
+        }
+        copy->n_paths = entry->n_paths;
+        copy->has_clear = entry->clear;
+        copy->clear = entry->clear;
+        message->entries[i] = copy;
+    }
+    message->n_entries = n;
+    message->has_commit = true;
+    message->commit = raft_committed;
+    message->has_lease_ms = true;
+    message->lease_ms = RAFT_LEASE_MS;
+
+    // Taken as if it arrived right away, and with the clocks apart
+    if (raft_committed > peer->lease_commit) {
+        peer->lease_prev_until = peer->lease_until;
+        peer->lease_commit = raft_committed;
+    }
+    peer->lease_until = max(peer->lease_until,
+                            now + RAFT_LEASE_MS + RAFT_SLACK_MS);
+    peer->heartbeat_at = now + RAFT_HEARTBEAT_MS;
+}
+
+// Asks peer, without raft_lock held. The answer is freed with
+//   protobuf_c_message_free_unpacked
+static EP_STAT
+raft_call(raft_peer_t *peer, Capfs__Op *op, Capfs__Raft **reply) {
+    EP_STAT estat;
+    Capfs__Response *response;
+
+    if (peer->fd < 0) {
+        estat = capfs_rpc_connect(peer->address, &peer->fd);
+        if (!EP_STAT_ISOK(estat)) {
+            peer->fd = -1;
+            return estat;
+        }
+        // A replica that went quiet must not hold up an election
+        capfs_rpc_timeout(peer->fd, RAFT_ELECTION_MIN_MS);
+    }
+
+    estat = capfs_rpc_call(peer->fd, peer->next_id++, op, &response);
+    EP_STAT_CHECK(estat, goto fail0);
+    if (response->results[0]->raft == NULL) {
+        estat = EP_STAT_INVALID_ARG;
+        goto fail1;
+    }
+    *reply = response->results[0]->raft;
+    response->results[0]->raft = NULL;
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return EP_STAT_OK;
+
+fail1:
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+fail0:
+    close(peer->fd);
+    peer->fd = -1;
+    return estat;
+}
+
+static void
+raft_vote_reply(const Capfs__Raft *reply, uint64_t now) {
+    if (raft_role != RAFT_CANDIDATE || !reply->ok) {
+        return;
+    }
+    raft_votes++;
+    if (2 * raft_votes > raft_count) {
+        raft_become_leader(now);
+    }
+}
+
+static void
+raft_append_reply(raft_peer_t *peer, const Capfs__Raft *reply,
+                  uint64_t sent_at, uint64_t prev, uint64_t now) {
+    if (raft_role != RAFT_LEADER) {
+        return;
+    }
+    peer->acked_at = max(peer->acked_at, sent_at);
+    if (reply->ok) {
+        peer->match = max(peer->match, reply->match);
+        peer->next_index = peer->match + 1;
+    } else {
+        // Back to where the logs agree, at once
+        peer->next_index = max(min(reply->match + 1, prev), 1);
+        peer->heartbeat_at = 0;
+    }
+    peer->applied = max(peer->applied, reply->applied);
+    if (raft_leader_lease(now)) {
+        raft_election_at = now + RAFT_ELECTION_MAX_MS;
+    }
+    raft_advance();
+    raft_trim();
+    pthread_cond_broadcast(&raft_cond);
+}
+
+// Asks for votes as a candidate and sends appends as the leader
+static void *
+raft_peer_thread(void *arg) {
+    raft_peer_t *peer = arg;
+
+    pthread_mutex_lock(&raft_lock);
+    for (;;) {
+        uint64_t now = raft_now();
+        Capfs__Op op = CAPFS__OP__INIT;
+        Capfs__Raft message = CAPFS__RAFT__INIT;
+        message.term = raft_term;
+        message.from = raft_self;
+        if (now < peer->retry_at) {
+            raft_wait_until(peer->retry_at);
+            continue;
+        } else if (raft_role == RAFT_CANDIDATE
+                   && peer->asked_term != raft_term) {
+            op.type = CAPFS__OP_TYPE__RAFT_VOTE;
+            message.has_last_index = true;
+            message.last_index = raft_last();
+            message.has_last_term = true;
+            message.last_term = raft_term_at(raft_last());
+            peer->asked_term = raft_term;
+        } else if (raft_role == RAFT_LEADER
+                   && (now >= peer->heartbeat_at
+                       || peer->next_index <= raft_last()
+                       || peer->lease_commit < raft_committed)) {
+            op.type = CAPFS__OP_TYPE__RAFT_APPEND;
+            raft_append_message(peer, &message, now);
+        } else {
+            raft_wait_until(raft_role == RAFT_LEADER
+                            ? peer->heartbeat_at : now + RAFT_HEARTBEAT_MS);
+            continue;
+        }
+        op.raft = &message;
+        uint64_t term = raft_term;
+        uint64_t sent_at = now;
+        pthread_mutex_unlock(&raft_lock);
+
+        Capfs__Raft *reply;
+        EP_STAT estat = raft_call(peer, &op, &reply);
+        raft_message_free(&message);
+
+        pthread_mutex_lock(&raft_lock);
+        now = raft_now();
+        if (!EP_STAT_ISOK(estat)) {
+            // Its vote is asked for again too
+            if (op.type == CAPFS__OP_TYPE__RAFT_VOTE
+                && peer->asked_term == term) {
+                peer->asked_term = 0;
+            }
+            peer->retry_at = now + RAFT_HEARTBEAT_MS;
+            continue;
+        }
+        if (reply->term > raft_term) {
+            raft_step_down(reply->term);
+        } else if (reply->term == term && term == raft_term) {
+            if (op.type == CAPFS__OP_TYPE__RAFT_VOTE) {
+                raft_vote_reply(reply, now);
+            } else {
+                raft_append_reply(peer, reply, sent_at, message.prev_index,
+                                  now);
+            }
+        }
+        protobuf_c_message_free_unpacked(&reply->base, NULL);
+    }
+    return NULL;
+}
+
+// Stands for election when no leader was heard from in time, and makes a
+//   leader cut off from the majority step down
+static void *
+raft_ticker_thread(void *arg) {
+    pthread_mutex_lock(&raft_lock);
+    for (;;) {
+        uint64_t now = raft_now();
+        if (now >= raft_election_at) {
+            if (raft_role != RAFT_LEADER) {
+                raft_stand(now);
+            } else if (!raft_leader_lease(now)) {
+                raft_role = RAFT_FOLLOWER;
+                raft_leader = -1;
+                raft_election_reset(now);
+                pthread_cond_broadcast(&raft_cond);
+            } else {
+                raft_election_at = now + RAFT_ELECTION_MAX_MS;
+            }
+        }
+        raft_wait_until(min(raft_election_at, now + RAFT_HEARTBEAT_MS));
+    }
+    return NULL;
+}
+
+static void
+raft_handle_vote(const Capfs__Raft *in, Capfs__Raft *out, uint64_t now) {
+    // Stays with a leader it heard from lately. A leader's lease counts on
+    //   this, and a replica that was cut off cannot take over on rejoining
+    bool sticky = raft_role == RAFT_LEADER
+                  ? raft_leader_lease(now)
+                  : raft_leader >= 0
+                    && now < raft_heard_at + RAFT_ELECTION_MIN_MS;
+    if (sticky) {
+        return;
+    }
+    if (in->term > raft_term) {
+        raft_step_down(in->term);
+    }
+    if (in->term < raft_term
+        || (raft_voted_for >= 0 && raft_voted_for != (int) in->from)) {
+        return;
+    }
+    // Only for a log at least as far along as this one
+    uint64_t last_term = raft_term_at(raft_last());
+    if (in->last_term < last_term
+        || (in->last_term == last_term && in->last_index < raft_last())) {
+        return;
+    }
+    raft_voted_for = in->from;
+    if (!EP_STAT_ISOK(raft_persist())) {
+        raft_voted_for = -1;
+        return;
+    }
+    out->ok = true;
+    raft_election_reset(now);
+}
+
+static void
+raft_handle_append(const Capfs__Raft *in, Capfs__Raft *out, uint64_t now) {
+    if (in->term < raft_term) {
+        return;
+    }
+    if (in->term > raft_term || raft_role != RAFT_FOLLOWER) {
+        raft_step_down(in->term);
+    }
+    raft_leader = in->from;
+    raft_heard_at = now;
+    raft_election_reset(now);
+
+    uint64_t prev = in->prev_index;
+    out->has_match = true;
+    if (in->snapshot) {
+        // Starts over at prev, with nothing cached
+        raft_truncate(raft_base);
+        raft_base = prev;
+        raft_base_term = in->prev_term;
+        raft_committed = prev;
+        raft_applied = prev;
+        raft_refreshed_term = 0;
+    } else if (prev > raft_last()) {
+        out->match = raft_last();
+        return;
+    } else if (prev >= raft_base && raft_term_at(prev) != in->prev_term) {
+        // Entries of a leader that did not get to commit them
+        raft_truncate(max(prev - 1, raft_base));
+        out->match = prev > raft_base ? prev - 1 : 0;
+        return;
+    }
+
+    // Entries up to raft_base were applied already
+    for (size_t i = 0; i < in->n_entries; i++) {
+        const Capfs__RaftEntry *entry = in->entries[i];
+        uint64_t index = prev + 1 + i;
+        if (index <= raft_base) {
+            continue;
+        }
+        if (index <= raft_last()) {
+            if (raft_term_at(index) == entry->term) {
+                continue;
+            }
+            raft_truncate(index - 1);
+        }
+        raft_append(entry->term, entry->paths, entry->n_paths,
+                    entry->has_clear && entry->clear);
+    }
+    uint64_t match = prev + in->n_entries;
+    out->ok = true;
+    out->match = match;
+    if (in->commit > raft_committed) {
+        raft_committed = max(raft_committed, min(in->commit, match));
+    }
+    raft_apply();
+    // Only with everything the leader committed forgotten
+    if (in->has_lease_ms && in->lease_ms > RAFT_SLACK_MS
+        && raft_applied >= in->commit) {
+        raft_lease_until = now + in->lease_ms - RAFT_SLACK_MS;
+    }
+    raft_trim();
+}
+
+EP_STAT
+capfs_raft_start(const char *replicas, const char *self,
+                 const char *state_dir) {
+    EP_STAT estat = EP_STAT_OK;
+    char *list = strdup(replicas);
+    char *save;
+
+    raft_self = -1;
+    for (char *address = strtok_r(list, "+", &save); address != NULL;
+         address = strtok_r(NULL, "+", &save)) {
+        if (raft_count == RAFT_MAX_REPLICAS) {
+            estat = EP_STAT_BUF_OVERFLOW;
+            goto fail;
+        }
+        if (strcmp(address, self) == 0) {
+            raft_self = raft_count;
+        }
+        raft_peers[raft_count].address = strdup(address);
+        raft_peers[raft_count].fd = -1;
+        raft_count++;
+    }
+    if (raft_self < 0) {
+        estat = EP_STAT_NOT_FOUND;
+        goto fail;
+    }
+    free(list);
+
+    if (state_dir == NULL) {
+        state_dir = RAFT_STATE_PATH;
+    }
+    if (mkdir(state_dir, 0700) < 0 && errno != EEXIST) {
+        return ep_stat_from_errno(errno);
+    }
+    snprintf(raft_state_path, sizeof(raft_state_path), "%s/raft.%d",
+             state_dir, raft_self);
+    raft_load();
+
+    // Just in case this is a fresh file system, before any election and
+    //   by one replica only, so there is never a second root
+    if (raft_self == 0) {
+        capfs_dir_make_root();
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&raft_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    uint64_t now = raft_now();
+    raft_random = now ^ ((uint64_t) getpid() << 20)
+                  ^ ((uint64_t) (raft_self + 1) * 0x9e3779b97f4a7c15ULL);
+    if (raft_random == 0) {
+        raft_random = 1;
+    }
+    raft_election_reset(now);
+    raft_on = true;
+
+    pthread_t thread;
+    for (int i = 0; i < raft_count; i++) {
+        if (i == raft_self) {
+            continue;
+        }
+        if (pthread_create(&thread, NULL, raft_peer_thread, &raft_peers[i])
+            != 0) {
+            return ep_stat_from_errno(EAGAIN);
+        }
+        pthread_detach(thread);
+    }
+    if (pthread_create(&thread, NULL, raft_ticker_thread, NULL) != 0) {
+        return ep_stat_from_errno(EAGAIN);
+    }
+    pthread_detach(thread);
+    return EP_STAT_OK;
+
+fail:
+    free(list);
+    while (raft_count > 0) {
+        free(raft_peers[--raft_count].address);
+    }
+    return estat;
+}
+
+bool
+capfs_raft_enabled(void) {
+    return raft_on;
+}
+
+bool
+capfs_raft_can_serve(bool read_only, int *leader) {
+    bool ok;
+
+    pthread_mutex_lock(&raft_lock);
+    uint64_t now = raft_now();
+    // Just elected: settles what the last leader committed first
+    uint64_t deadline = now + RAFT_ELECTION_MIN_MS;
+    while (raft_role == RAFT_LEADER && raft_committed < raft_term_start
+           && now < deadline) {
+        raft_wait_until(deadline);
+        now = raft_now();
+    }
+    if (raft_role == RAFT_LEADER) {
+        ok = raft_committed >= raft_term_start && raft_leader_lease(now);
+    } else {
+        ok = read_only && raft_role == RAFT_FOLLOWER
+             && now < raft_lease_until;
+    }
+    *leader = raft_leader;
+    pthread_mutex_unlock(&raft_lock);
+    return ok;
+}
+
+EP_STAT
+capfs_raft_commit(char *const *paths, size_t n_paths, bool clear) {
+    EP_STAT estat = EP_STAT_OK;
+
+    pthread_mutex_lock(&raft_lock);
+    if (raft_role != RAFT_LEADER) {
+        estat = ep_stat_from_errno(EAGAIN);
+        goto done;
+    }
+    uint64_t term = raft_term;
+    raft_append(term, paths, n_paths, clear);
+    uint64_t index = raft_last();
+    raft_advance();
+    pthread_cond_broadcast(&raft_cond);
+
+    uint64_t deadline = raft_now() + RAFT_COMMIT_TIMEOUT_MS;
+    for (;;) {
+        uint64_t now = raft_now();
+        if (raft_role != RAFT_LEADER || raft_term != term) {
+            estat = ep_stat_from_errno(EAGAIN);
+            break;
+        }
+        // Every follower either forgot the paths or stopped answering reads
+        bool applied = raft_committed >= index;
+        uint64_t at = deadline;
+        for (int i = 0; i < raft_count; i++) {
+            raft_peer_t *peer = &raft_peers[i];
+            if (i == raft_self || peer->applied >= index) {
+                continue;
+            }
+            uint64_t until = index > peer->lease_commit
+                             ? peer->lease_until : peer->lease_prev_until;
+            if (until > now) {
+                applied = false;
+                at = min(at, until);
+            }
+        }
+        if (applied) {
+            break;
+        }
+        if (now >= deadline) {
+            estat = ep_stat_from_errno(ETIMEDOUT);
+            break;
+        }
+        raft_wait_until(at);
+    }
+
+done:
+    pthread_mutex_unlock(&raft_lock);
+    return estat;
+}
+
+int
+capfs_raft_handle(const Capfs__Op *op, Capfs__Result *result) {
+    const Capfs__Raft *in = op->raft;
+    if (!raft_on || in == NULL || in->from >= (uint32_t) raft_count
+        || (int) in->from == raft_self) {
+        return -EINVAL;
+    }
+
+    Capfs__Raft *out = malloc(sizeof(Capfs__Raft));
+    capfs__raft__init(out);
+    out->from = raft_self;
+    out->has_ok = true;
+    pthread_mutex_lock(&raft_lock);
+    uint64_t now = raft_now();
+    if (op->type == CAPFS__OP_TYPE__RAFT_VOTE) {
+        raft_handle_vote(in, out, now);
+    } else {
+        raft_handle_append(in, out, now);
+    }
+    out->term = raft_term;
+    out->has_applied = true;
+    out->applied = raft_applied;
+    pthread_mutex_unlock(&raft_lock);
+    result->raft = out;
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#ifndef _CAPFS_RAFT_H_
+#define _CAPFS_RAFT_H_
+
+// Replicas a group can have at most
+#define RAFT_MAX_REPLICAS 7
+// The leader sends at least this often, commits go out right away
+#define RAFT_HEARTBEAT_MS 50
+// A follower that heard nothing from a leader for a random time between
+//   these stands for election
+#define RAFT_ELECTION_MIN_MS 300
+#define RAFT_ELECTION_MAX_MS 600
+// How long an append lets a follower answer reads
+#define RAFT_LEASE_MS 200
+// What the clocks of two replicas may drift apart by over one lease. Taken
+//   off the lease by the follower and added to it by the leader
+#define RAFT_SLACK_MS 50
+// Entries one append carries at most
+#define RAFT_APPEND_MAX 64
+// Entries kept beyond what every replica applied. Past it, a replica that
+//   lags is sent a snapshot instead
+#define RAFT_LOG_MAX 4096
+// How long a write waits for its entry to be applied everywhere
+#define RAFT_COMMIT_TIMEOUT_MS (2 * RAFT_ELECTION_MAX_MS)
+// Where the term and the vote are kept across restarts
+#define RAFT_STATE_PATH "/var/tmp/capfs"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <ep/ep.h>
+
+#include "proto/capfs.pb-c.h"
+
+// Servers sharing one store (-o replicas=A+B+C) elect a leader with Raft.
+//   Only the leader writes to the store. What it replicates is which paths a
+//   write changed, since the data is in the logs already: a follower forgets
+//   what it had cached for them and catches its logs up, then answers reads
+//   itself for as long as the leader's lease lets it
+//
+// Starts the replica that is self among the + separated replicas, keeping
+//   its term and vote under state_dir (RAFT_STATE_PATH if NULL)
+EP_STAT capfs_raft_start(const char *replicas, const char *self,
+                         const char *state_dir);
+bool capfs_raft_enabled(void);
+// Whether a request may run here. A follower only runs reads, and only while
+//   its lease lasts. When not, leader is who to ask instead, or -1
+bool capfs_raft_can_serve(bool read_only, int *leader);
+// Replicates that a write changed paths, or anything if clear, and waits
+//   until every replica forgot them or lost its lease
+EP_STAT capfs_raft_commit(char *const *paths, size_t n_paths, bool clear);
+// Answers RAFT_VOTE and RAFT_APPEND from the other replicas, 0 or -errno
+int capfs_raft_handle(const Capfs__Op *op, Capfs__Result *result);
+
+#endif // _CAPFS_RAFT_H_
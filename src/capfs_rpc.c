@@ -0,0 +1,400 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_rpc.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Splits HOST:PORT at the last colon, so the host may itself hold colons
+static EP_STAT
+rpc_resolve(const char *address, bool passive, struct addrinfo **info) {
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL) {
+        return EP_STAT_INVALID_ARG;
+    }
+    char host[NI_MAXHOST];
+    snprintf(host, sizeof(host), "%.*s", (int) (colon - address), address);
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = passive ? AI_PASSIVE : 0,
+    };
+    if (getaddrinfo(host[0] != '\0' ? host : NULL, colon + 1, &hints, info)
+        != 0) {
+        return EP_STAT_NOT_FOUND;
+    }
+    return EP_STAT_OK;
+}
+
+static EP_STAT
+rpc_unix_address(const char *path, struct sockaddr_un *sun) {
+    memset(sun, 0, sizeof(struct sockaddr_un));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        return EP_STAT_BUF_OVERFLOW;
+    }
+    strcpy(sun->sun_path, path);
+    return EP_STAT_OK;
+}
+
+EP_STAT
+capfs_rpc_connect(const char *address, int *fd) {
+    EP_STAT estat;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        estat = rpc_unix_address(address + 5, &sun);
+        EP_STAT_CHECK(estat, return estat);
+        *fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (*fd < 0) {
+            return ep_stat_from_errno(errno);
+        }
+        if (connect(*fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+            estat = ep_stat_from_errno(errno);
+            close(*fd);
+            return estat;
+        }
+        return EP_STAT_OK;
+    }
+
+    struct addrinfo *info;
+    estat = rpc_resolve(address, false, &info);
+    EP_STAT_CHECK(estat, return estat);
+    estat = EP_STAT_NOT_FOUND;
+    for (struct addrinfo *ai = info; ai != NULL; ai = ai->ai_next) {
+        *fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                     ai->ai_protocol);
+        if (*fd < 0) {
+            continue;
+        }
+        if (connect(*fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            // Requests are small and each one waits for its answer
+            int one = 1;
+            setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            estat = EP_STAT_OK;
+            break;
+        }
+        estat = ep_stat_from_errno(errno);
+        close(*fd);
+    }
+    freeaddrinfo(info);
+    return estat;
+}
+
+EP_STAT
+capfs_rpc_listen(const char *address, int *fd) {
+    EP_STAT estat;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        estat = rpc_unix_address(address + 5, &sun);
+        EP_STAT_CHECK(estat, return estat);
+        *fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (*fd < 0) {
+            return ep_stat_from_errno(errno);
+        }
+        // Left behind by a server that is gone
+        unlink(sun.sun_path);
+        if (bind(*fd, (struct sockaddr *) &sun, sizeof(sun)) < 0
+            || listen(*fd, RPC_BACKLOG) < 0) {
+            estat = ep_stat_from_errno(errno);
+            close(*fd);
+            return estat;
+        }
+        return EP_STAT_OK;
+    }
+
+    struct addrinfo *info;
+    estat = rpc_resolve(address, true, &info);
+    EP_STAT_CHECK(estat, return estat);
+    estat = EP_STAT_NOT_FOUND;
+    for (struct addrinfo *ai = info; ai != NULL; ai = ai->ai_next) {
+        *fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                     ai->ai_protocol);
+        if (*fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(*fd, ai->ai_addr, ai->ai_addrlen) == 0
+            && listen(*fd, RPC_BACKLOG) == 0) {
+            estat = EP_STAT_OK;
+            break;
+        }
+        estat = ep_stat_from_errno(errno);
+        close(*fd);
+    }
+    freeaddrinfo(info);
+    return estat;
+}
+
+static EP_STAT
+rpc_write_all(int fd, const uint8_t *buf, size_t size) {
+    while (size > 0) {
+        // A peer that went away is an error here, not a SIGPIPE
+        ssize_t sent = send(fd, buf, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ep_stat_from_errno(errno);
+        }
+        buf += sent;
+        size -= sent;
+    }
+    return EP_STAT_OK;
+}
+
+static EP_STAT
+rpc_read_all(int fd, uint8_t *buf, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(fd, buf, size, 0);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ep_stat_from_errno(errno);
+        }
+        if (received == 0) {
+            return EP_STAT_END_OF_FILE;
+        }
+        buf += received;
+        size -= received;
+    }
+    return EP_STAT_OK;
+}
+
+EP_STAT
+capfs_rpc_send(int fd, const ProtobufCMessage *message) {
+    size_t size = protobuf_c_message_get_packed_size(message);
+    if (size > RPC_MAX_MESSAGE) {
+        return EP_STAT_BUF_OVERFLOW;
+    }
+    // Length and message in one send
+    uint8_t *buf = malloc(sizeof(uint32_t) + size);
+    uint32_t length = htonl(size);
+    memcpy(buf, &length, sizeof(uint32_t));
+    protobuf_c_message_pack(message, buf + sizeof(uint32_t));
+    EP_STAT estat = rpc_write_all(fd, buf, sizeof(uint32_t) + size);
+    free(buf);
+    return estat;
+}
+
+EP_STAT
+capfs_rpc_recv(int fd, const ProtobufCMessageDescriptor *descriptor,
+               ProtobufCMessage **message) {
+    EP_STAT estat;
+
+    uint32_t length;
+    estat = rpc_read_all(fd, (uint8_t *) &length, sizeof(uint32_t));
+    EP_STAT_CHECK(estat, goto fail0);
+    size_t size = ntohl(length);
+    if (size > RPC_MAX_MESSAGE) {
+        estat = EP_STAT_BUF_OVERFLOW;
+        goto fail0;
+    }
+
+    uint8_t *buf = malloc(size);
+    estat = rpc_read_all(fd, buf, size);
+    EP_STAT_CHECK(estat, goto fail1);
+    *message = protobuf_c_message_unpack(descriptor, NULL, size, buf);
+    if (*message == NULL) {
+        estat = EP_STAT_INVALID_ARG;
+        goto fail1;
+    }
+    free(buf);
+    return EP_STAT_OK;
+
+fail1:
+    free(buf);
+fail0:
+    return estat;
+}
+
+void
+capfs_rpc_timeout(int fd, unsigned ms) {
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+EP_STAT
+capfs_rpc_call(int fd, uint64_t id, Capfs__Op *op,
+               Capfs__Response **response) {
+    EP_STAT estat;
+
+    Capfs__Op *ops[] = { op };
+    Capfs__Request request = CAPFS__REQUEST__INIT;
+    request.id = id;
+    request.n_ops = 1;
+    request.ops = ops;
+    estat = capfs_rpc_send(fd, &request.base);
+    EP_STAT_CHECK(estat, goto fail0);
+    estat = capfs_rpc_recv(fd, &capfs__response__descriptor,
+                           (ProtobufCMessage **) response);
+    EP_STAT_CHECK(estat, goto fail0);
+    if ((*response)->id != id || (*response)->n_results != 1) {
+        estat = EP_STAT_INVALID_ARG;
+        goto fail1;
+    }
+    return EP_STAT_OK;
+
+fail1:
+    protobuf_c_message_free_unpacked(&(*response)->base, NULL);
+fail0:
+    return estat;
+}
+
+bool
+capfs_rpc_read_only(Capfs__Op *const *ops, size_t n_ops) {
+    for (size_t i = 0; i < n_ops; i++) {
+        switch (ops[i]->type) {
+        case CAPFS__OP_TYPE__GETATTR:
+        case CAPFS__OP_TYPE__OPENDIR:
+        case CAPFS__OP_TYPE__READDIR:
+        case CAPFS__OP_TYPE__RELEASEDIR:
+        case CAPFS__OP_TYPE__READ_FILE:
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// FNV-1a of the directory's path. The directory of /a is /
+int
+capfs_rpc_shard_path(const char *path, bool dir, int n_shards) {
+    size_t length = strlen(path);
+    if (!dir) {
+        const char *slash = strrchr(path, '/');
+        length = slash != NULL && slash != path ? (size_t) (slash - path) : 1;
+    }
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t) path[i]) * 16777619u;
+    }
+    return hash % n_shards;
+}
+
+int
+capfs_rpc_shard(Capfs__Op *const *ops, size_t n_ops, int n_shards) {
+    for (size_t i = 0; i < n_ops; i++) {
+        if (ops[i]->path == NULL) {
+            continue;
+        }
+        switch (ops[i]->type) {
+        // A directory's own handle and entries are with its owner
+        case CAPFS__OP_TYPE__OPENDIR:
+        case CAPFS__OP_TYPE__READDIR:
+        case CAPFS__OP_TYPE__FSYNCDIR:
+        case CAPFS__OP_TYPE__RELEASEDIR:
+            return capfs_rpc_shard_path(ops[i]->path, true, n_shards);
+        default:
+            return capfs_rpc_shard_path(ops[i]->path, false, n_shards);
+        }
+    }
+    return -1;
+}
+
+void
+capfs_rpc_attr_from_stat(const struct stat *st, Capfs__Attr *attr) {
+    capfs__attr__init(attr);
+    attr->ino = st->st_ino;
+    attr->mode = st->st_mode;
+    attr->nlink = st->st_nlink;
+    attr->size = st->st_size;
+    attr->blocks = st->st_blocks;
+    attr->blksize = st->st_blksize;
+    attr->mtime_sec = st->st_mtim.tv_sec;
+    attr->mtime_nsec = st->st_mtim.tv_nsec;
+    attr->ctime_sec = st->st_ctim.tv_sec;
+    attr->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+// Owned by whoever mounted it, like the local frontends report
+void
+capfs_rpc_attr_to_stat(const Capfs__Attr *attr, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = attr->ino;
+    st->st_mode = attr->mode;
+    st->st_nlink = attr->nlink;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = attr->size;
+    st->st_blocks = attr->blocks;
+    st->st_blksize = attr->blksize;
+    st->st_mtim.tv_sec = attr->mtime_sec;
+    st->st_mtim.tv_nsec = attr->mtime_nsec;
+    st->st_atim = st->st_mtim;
+    st->st_ctim.tv_sec = attr->ctime_sec;
+    st->st_ctim.tv_nsec = attr->ctime_nsec;
+}
+
+void
+capfs_rpc_statfs_from_statvfs(const struct statvfs *st,
+                              Capfs__Statfs *statfs) {
+    capfs__statfs__init(statfs);
+    statfs->bsize = st->f_bsize;
+    statfs->frsize = st->f_frsize;
+    statfs->blocks = st->f_blocks;
+    statfs->bfree = st->f_bfree;
+    statfs->bavail = st->f_bavail;
+    statfs->files = st->f_files;
+    statfs->ffree = st->f_ffree;
+    statfs->namemax = st->f_namemax;
+}
+
+void
+capfs_rpc_statfs_to_statvfs(const Capfs__Statfs *statfs, struct statvfs *st) {
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = statfs->bsize;
+    st->f_frsize = statfs->frsize;
+    st->f_blocks = statfs->blocks;
+    st->f_bfree = statfs->bfree;
+    st->f_bavail = statfs->bavail;
+    st->f_files = statfs->files;
+    st->f_ffree = statfs->ffree;
+    st->f_favail = statfs->ffree;
+    st->f_namemax = statfs->namemax;
+}
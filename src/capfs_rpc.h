@@ -0,0 +1,83 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#ifndef _CAPFS_RPC_H_
+#define _CAPFS_RPC_H_
+
+// Largest message either side accepts, well above a CAPFS_MAX_IO read
+#define RPC_MAX_MESSAGE (16 * 1024 * 1024)
+// Entries a READDIR answers with at most, the client asks again for more
+#define RPC_READDIR_MAX 256
+// Connections waiting to be accepted
+#define RPC_BACKLOG 64
+// Requests outstanding on one connection at most. The client waits for an
+//   answer before sending more, and the server stops reading
+#define RPC_MAX_IN_FLIGHT 32
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <ep/ep.h>
+
+#include "proto/capfs.pb-c.h"
+
+// Messages travel as a 4 byte length in network order and the packed
+//   protobuf. An address is unix:PATH for a Unix socket or HOST:PORT for TCP
+EP_STAT capfs_rpc_connect(const char *address, int *fd);
+EP_STAT capfs_rpc_listen(const char *address, int *fd);
+EP_STAT capfs_rpc_send(int fd, const ProtobufCMessage *message);
+// Free the message with protobuf_c_message_free_unpacked
+EP_STAT capfs_rpc_recv(int fd, const ProtobufCMessageDescriptor *descriptor,
+                       ProtobufCMessage **message);
+// Sends and receives on fd time out after ms, for servers asking each other
+void capfs_rpc_timeout(int fd, unsigned ms);
+// One op as a request with this id, and its answer, which has its one
+//   result. Free the response with protobuf_c_message_free_unpacked
+EP_STAT capfs_rpc_call(int fd, uint64_t id, Capfs__Op *op,
+                       Capfs__Response **response);
+
+// Whether the ops only read, so any replica may answer them, see
+//   capfs_raft.h
+bool capfs_rpc_read_only(Capfs__Op *const *ops, size_t n_ops);
+// Which of n_shards owns the directory path is in, or with dir, path
+//   itself, see capfs_shard.h
+int capfs_rpc_shard_path(const char *path, bool dir, int n_shards);
+// Which of n_shards runs the ops, by the first with a path. -1 if any may
+int capfs_rpc_shard(Capfs__Op *const *ops, size_t n_ops, int n_shards);
+
+void capfs_rpc_attr_from_stat(const struct stat *st, Capfs__Attr *attr);
+void capfs_rpc_attr_to_stat(const Capfs__Attr *attr, struct stat *st);
+void capfs_rpc_statfs_from_statvfs(const struct statvfs *st,
+                                   Capfs__Statfs *statfs);
+void capfs_rpc_statfs_to_statvfs(const Capfs__Statfs *statfs,
+                                 struct statvfs *st);
+
+#endif // _CAPFS_RPC_H_
@@ -0,0 +1,805 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+
+#include <fuse.h>
+
+#include "capfs.h"
+#include "capfs_dir.h"
+#include "capfs_lease.h"
+#include "capfs_raft.h"
+#include "capfs_rpc.h"
+#include "capfs_shard.h"
+#include "capfs_util.h"
+
+// Every op runs through capfs_operations, the same code the high-level
+//   frontend runs for the kernel. Handles a client opened are remembered
+//   with their path, so a client that goes away does not leak them, and
+//   files with what they count as for the leases on them
+typedef struct server_handle {
+    uint64_t fh;
+    bool is_dir;
+    char *path;
+    bool has_gob;
+    gdp_name_t gob;
+    bool write;
+    uint64_t owner;
+} server_handle_t;
+
+// Requests on a connection run on the worker threads, as many at once as
+//   the client sent, and are answered as they finish. The connection's
+//   thread only reads, and stops reading while RPC_MAX_IN_FLIGHT of them
+//   are still running
+typedef struct server_conn {
+    int fd;
+    pthread_mutex_t send_lock;      // One response on the socket at a time
+    pthread_mutex_t lock;           // The handles and in_flight
+    pthread_cond_t cond;            // in_flight went down
+    unsigned in_flight;
+    server_handle_t *handles;
+    size_t count;
+    size_t size;
+} server_conn_t;
+
+typedef struct server_job {
+    server_conn_t *conn;
+    Capfs__Request *request;
+    struct server_job *next;
+} server_job_t;
+
+static server_job_t *jobs_head;
+static server_job_t *jobs_tail;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+// The handle ops without one of their own use, and how getting it went
+typedef struct server_batch {
+    uint64_t fh;
+    int err;
+} server_batch_t;
+
+static void
+server_handle_add(server_conn_t *conn, const server_handle_t *handle) {
+    pthread_mutex_lock(&conn->lock);
+    if (conn->count == conn->size) {
+        conn->size *= 2;
+        conn->handles = realloc(conn->handles,
+                                conn->size * sizeof(server_handle_t));
+    }
+    server_handle_t *added = &conn->handles[conn->count++];
+    *added = *handle;
+    added->path = strdup(handle->path);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Takes the handle out of the connection's list, false if it was not there
+static bool
+server_handle_take(server_conn_t *conn, uint64_t fh, bool is_dir,
+                   server_handle_t *handle) {
+    pthread_mutex_lock(&conn->lock);
+    for (size_t i = 0; i < conn->count; i++) {
+        if (conn->handles[i].fh == fh && conn->handles[i].is_dir == is_dir) {
+            *handle = conn->handles[i];
+            conn->handles[i] = conn->handles[--conn->count];
+            pthread_mutex_unlock(&conn->lock);
+            return true;
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return false;
+}
+
+static int
+server_handle_release(server_conn_t *conn, server_handle_t *handle) {
+    struct fuse_file_info fi = { .fh = handle->fh };
+    int ret = handle->is_dir
+              ? capfs_operations.releasedir(handle->path, &fi)
+              : capfs_operations.release(handle->path, &fi);
+    if (handle->has_gob) {
+        capfs_lease_close(conn, handle->owner, handle->gob, handle->write);
+    }
+    free(handle->path);
+    return ret;
+}
+
+// The capsule of the file at path, false if there is none
+static bool
+server_path_gob(const char *path, gdp_name_t gob) {
+    capfs_dir_t *dir;
+    if (!EP_STAT_ISOK(capfs_dir_opendir_path(path, &dir))) {
+        return false;
+    }
+    capfs_dir_entry_t entry;
+    bool found = EP_STAT_ISOK(capfs_dir_lookup(dir, path_basename(path),
+                                               &entry))
+                 && !entry.is_dir;
+    if (found) {
+        memcpy(gob, entry.gob, sizeof(gdp_name_t));
+    }
+    capfs_dir_closedir(dir);
+    return found;
+}
+
+// Before the file at path is opened or changed, the leases other mounts
+//   hold on it that this gets in the way of are given back
+static void
+server_lease_wait(server_conn_t *conn, const Capfs__Op *op, const char *path,
+                  bool write) {
+    gdp_name_t gob;
+    if (capfs_lease_any() && server_path_gob(path, gob)) {
+        capfs_lease_wait(conn, op->owner, gob, write);
+    }
+}
+
+// Called with the lease lock held, see capfs_lease.h. The holder hears on
+//   the connection it was granted the lease on, between two responses
+static void
+server_lease_revoke(void *arg, const gdp_name_t gob) {
+    server_conn_t *conn = arg;
+    Capfs__Response response = CAPFS__RESPONSE__INIT;
+    response.has_revoke = true;
+    response.revoke.data = (uint8_t *) gob;
+    response.revoke.len = sizeof(gdp_name_t);
+    pthread_mutex_lock(&conn->send_lock);
+    EP_STAT estat = capfs_rpc_send(conn->fd, &response.base);
+    pthread_mutex_unlock(&conn->send_lock);
+    if (!EP_STAT_ISOK(estat)) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+// It did not give the lease back in time. Cut off, it can no longer think
+//   it holds one
+static void
+server_lease_expire(void *arg) {
+    server_conn_t *conn = arg;
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+typedef struct server_readdir_ctx {
+    Capfs__Result *result;
+    size_t size;
+} server_readdir_ctx_t;
+
+static int
+server_readdir_fill(void *buf, const char *name, const struct stat *st,
+                    off_t next) {
+    server_readdir_ctx_t *ctx = buf;
+    Capfs__Result *result = ctx->result;
+
+    // Full, the client asks again from the last next it got
+    if (result->n_entries == RPC_READDIR_MAX) {
+        return 1;
+    }
+    if (result->n_entries == ctx->size) {
+        ctx->size = ctx->size == 0 ? 16 : 2 * ctx->size;
+        result->entries = realloc(result->entries,
+                                  ctx->size * sizeof(Capfs__DirEntry *));
+    }
+    Capfs__DirEntry *entry = malloc(sizeof(Capfs__DirEntry));
+    capfs__dir_entry__init(entry);
+    entry->name = strdup(name);
+    entry->attr = malloc(sizeof(Capfs__Attr));
+    capfs_rpc_attr_from_stat(st, entry->attr);
+    entry->next = next;
+    result->entries[result->n_entries++] = entry;
+    return 0;
+}
+
+static int
+server_op(server_conn_t *conn, const Capfs__Op *op, server_batch_t *batch,
+          Capfs__Result *result) {
+    const char *path = op->path != NULL ? op->path : "";
+    struct fuse_file_info fi = { .fh = op->has_fh ? op->fh : batch->fh };
+    struct stat st;
+    int ret;
+
+    // A name a rename between shards holds is left alone until it is done
+    switch (op->type) {
+    case CAPFS__OP_TYPE__RENAME:
+        if (op->to != NULL && capfs_shard_busy(op->to)) {
+            return -EBUSY;
+        }
+        // Fall through
+    case CAPFS__OP_TYPE__CREATE:
+    case CAPFS__OP_TYPE__MKDIR:
+    case CAPFS__OP_TYPE__RMDIR:
+    case CAPFS__OP_TYPE__UNLINK:
+        if (capfs_shard_busy(path)) {
+            return -EBUSY;
+        }
+        break;
+    default:
+        break;
+    }
+
+    // Nor is a file leased to another mount, until it gave the lease back
+    switch (op->type) {
+    case CAPFS__OP_TYPE__CREATE:
+    case CAPFS__OP_TYPE__OPEN:
+        server_lease_wait(conn, op, path,
+                          op->type == CAPFS__OP_TYPE__CREATE
+                          || (op->flags & O_ACCMODE) != O_RDONLY);
+        break;
+    case CAPFS__OP_TYPE__RENAME:
+        if (op->to != NULL) {
+            server_lease_wait(conn, op, op->to, true);
+        }
+        // Fall through
+    case CAPFS__OP_TYPE__TRUNCATE:
+    case CAPFS__OP_TYPE__UNLINK:
+    case CAPFS__OP_TYPE__CHMOD:
+    case CAPFS__OP_TYPE__UTIMENS:
+        server_lease_wait(conn, op, path, true);
+        break;
+    default:
+        break;
+    }
+
+    switch (op->type) {
+    case CAPFS__OP_TYPE__GETATTR:
+        ret = capfs_operations.getattr(path, &st);
+        if (ret == 0) {
+            result->attr = malloc(sizeof(Capfs__Attr));
+            capfs_rpc_attr_from_stat(&st, result->attr);
+        }
+        return ret;
+    case CAPFS__OP_TYPE__CREATE:
+    case CAPFS__OP_TYPE__OPEN:
+    case CAPFS__OP_TYPE__OPENDIR:
+        fi.flags = op->flags;
+        if (op->type == CAPFS__OP_TYPE__CREATE) {
+            ret = capfs_operations.create(path, op->mode, &fi);
+        } else if (op->type == CAPFS__OP_TYPE__OPEN) {
+            ret = capfs_operations.open(path, &fi);
+        } else {
+            ret = capfs_operations.opendir(path, &fi);
+        }
+        batch->fh = fi.fh;
+        batch->err = ret;
+        if (ret == 0) {
+            server_handle_t handle = {
+                .fh = fi.fh,
+                .is_dir = op->type == CAPFS__OP_TYPE__OPENDIR,
+                .path = (char *) path,
+            };
+            result->has_fh = true;
+            result->fh = fi.fh;
+            // Files also say what capsule they are, so later reads can skip
+            //   the handle and survive this connection going away
+            fh_entry_t *fh;
+            if (op->type != CAPFS__OP_TYPE__OPENDIR &&
+                EP_STAT_ISOK(fh_get(fi.fh, &fh))) {
+                result->has_gob = true;
+                result->gob.len = sizeof(gdp_name_t);
+                result->gob.data = malloc(sizeof(gdp_name_t));
+                memcpy(result->gob.data, fh->gob, sizeof(gdp_name_t));
+
+                handle.has_gob = true;
+                memcpy(handle.gob, fh->gob, sizeof(gdp_name_t));
+                handle.write = op->type == CAPFS__OP_TYPE__CREATE
+                               || (op->flags & O_ACCMODE) != O_RDONLY;
+                handle.owner = op->owner;
+                // Replicas would each have to revoke, none grants
+                uint32_t lease = capfs_lease_open(
+                        conn, op->owner, fh->gob, handle.write,
+                        op->has_lease && !capfs_raft_enabled()
+                        ? op->lease : 0);
+                if (op->has_lease) {
+                    result->has_lease = true;
+                    result->lease = lease;
+                }
+            }
+            server_handle_add(conn, &handle);
+        }
+        return ret;
+    case CAPFS__OP_TYPE__READ_FILE: {
+        // Straight to the capsule: blocks are fetched in parallel and only
+        //   the bytes asked for come back
+        if (!op->has_gob || op->gob.len != sizeof(gdp_name_t)) {
+            return -EINVAL;
+        }
+        size_t size = op->size < CAPFS_MAX_IO ? op->size : CAPFS_MAX_IO;
+        char *buf = malloc(size > 0 ? size : 1);
+        ret = capfs_read_gob(op->gob.data, buf, size, op->offset);
+        if (ret < 0) {
+            free(buf);
+            return ret;
+        }
+        result->has_data = true;
+        result->data.data = (uint8_t *) buf;
+        result->data.len = ret;
+        return 0;
+    }
+    case CAPFS__OP_TYPE__RAFT_VOTE:
+    case CAPFS__OP_TYPE__RAFT_APPEND:
+        return capfs_raft_handle(op, result);
+    case CAPFS__OP_TYPE__RENAME_PREPARE:
+    case CAPFS__OP_TYPE__RENAME_COMMIT:
+    case CAPFS__OP_TYPE__RENAME_ABORT:
+    case CAPFS__OP_TYPE__INVALIDATE:
+        return capfs_shard_handle(op);
+    case CAPFS__OP_TYPE__LEASE_RELEASE:
+        if (!op->has_gob || op->gob.len != sizeof(gdp_name_t)) {
+            return -EINVAL;
+        }
+        capfs_lease_release(conn, op->owner, op->gob.data);
+        return 0;
+    default:
+        break;
+    }
+
+    // Everything else working on a handle from earlier in the batch fails
+    //   the way getting that handle did
+    if (!op->has_fh && batch->err != 0) {
+        switch (op->type) {
+        case CAPFS__OP_TYPE__READ:
+        case CAPFS__OP_TYPE__WRITE:
+        case CAPFS__OP_TYPE__FLUSH:
+        case CAPFS__OP_TYPE__FSYNC:
+        case CAPFS__OP_TYPE__RELEASE:
+        case CAPFS__OP_TYPE__FTRUNCATE:
+        case CAPFS__OP_TYPE__READDIR:
+        case CAPFS__OP_TYPE__FSYNCDIR:
+        case CAPFS__OP_TYPE__RELEASEDIR:
+            return batch->err;
+        default:
+            break;
+        }
+    }
+
+    switch (op->type) {
+    case CAPFS__OP_TYPE__READ: {
+        // No more than the kernel would ever ask for at once
+        struct fuse_bufvec *bufv;
+        size_t size = op->size < CAPFS_MAX_IO ? op->size : CAPFS_MAX_IO;
+        ret = capfs_operations.read_buf(path, &bufv, size, op->offset, &fi);
+        if (ret == 0) {
+            // capfs_read_buf hands out a single memory buffer
+            result->has_data = true;
+            result->data.data = bufv->buf[0].mem;
+            result->data.len = bufv->buf[0].size;
+            free(bufv);
+        }
+        return ret;
+    }
+    case CAPFS__OP_TYPE__WRITE: {
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(op->data.len);
+        bufv.buf[0].mem = op->data.data;
+        ret = capfs_operations.write_buf(path, &bufv, op->offset, &fi);
+        if (ret >= 0) {
+            result->has_size = true;
+            result->size = ret;
+            ret = 0;
+        }
+        return ret;
+    }
+    case CAPFS__OP_TYPE__FLUSH:
+        return capfs_operations.flush(path, &fi);
+    case CAPFS__OP_TYPE__FSYNC:
+        return capfs_operations.fsync(path, op->flags, &fi);
+    case CAPFS__OP_TYPE__RELEASE:
+    case CAPFS__OP_TYPE__RELEASEDIR: {
+        server_handle_t handle;
+        return server_handle_take(conn, fi.fh,
+                                  op->type == CAPFS__OP_TYPE__RELEASEDIR,
+                                  &handle)
+               ? server_handle_release(conn, &handle) : -EBADF;
+    }
+    case CAPFS__OP_TYPE__TRUNCATE:
+        return capfs_operations.truncate(path, op->size);
+    case CAPFS__OP_TYPE__FTRUNCATE:
+        return capfs_operations.ftruncate(path, op->size, &fi);
+    case CAPFS__OP_TYPE__MKDIR:
+        return capfs_operations.mkdir(path, op->mode);
+    case CAPFS__OP_TYPE__READDIR: {
+        server_readdir_ctx_t ctx = { result, 0 };
+        return capfs_operations.readdir(path, &ctx, server_readdir_fill,
+                                        op->offset, &fi);
+    }
+    case CAPFS__OP_TYPE__FSYNCDIR:
+        return capfs_operations.fsyncdir(path, op->flags, &fi);
+    case CAPFS__OP_TYPE__RENAME:
+        // Into a directory another shard writes
+        if (capfs_shard_enabled() && op->to != NULL
+            && !capfs_shard_local(op->to)) {
+            return capfs_shard_rename(path, op->to);
+        }
+        return capfs_operations.rename(path, op->to != NULL ? op->to : "");
+    case CAPFS__OP_TYPE__RMDIR:
+        return capfs_operations.rmdir(path);
+    case CAPFS__OP_TYPE__UNLINK:
+        return capfs_operations.unlink(path);
+    case CAPFS__OP_TYPE__CHMOD:
+        return capfs_operations.chmod(path, op->mode);
+    case CAPFS__OP_TYPE__UTIMENS: {
+        struct timespec ts[2];
+        ts[1].tv_sec = op->sec;
+        ts[1].tv_nsec = op->nsec;
+        ts[0] = ts[1];
+        return capfs_operations.utimens(path, ts);
+    }
+    case CAPFS__OP_TYPE__STATFS: {
+        struct statvfs stv;
+        ret = capfs_operations.statfs(path, &stv);
+        if (ret == 0) {
+            result->statfs = malloc(sizeof(Capfs__Statfs));
+            capfs_rpc_statfs_from_statvfs(&stv, result->statfs);
+        }
+        return ret;
+    }
+    default:
+        return -ENOSYS;
+    }
+}
+
+// Everything in a result was allocated here, none of it is shared
+static void
+server_result_free(Capfs__Result *result) {
+    free(result->attr);
+    free(result->data.data);
+    free(result->gob.data);
+    for (size_t i = 0; i < result->n_entries; i++) {
+        free(result->entries[i]->name);
+        free(result->entries[i]->attr);
+        free(result->entries[i]);
+    }
+    free(result->entries);
+    free(result->statfs);
+    free(result->raft);
+}
+
+// From other servers: Raft's own messages, answered by every replica, and
+//   those between shards. Also leases given back, which opens on other
+//   connections may be waiting on
+static bool
+server_request_internal(const Capfs__Request *request) {
+    if (request->n_ops != 1) {
+        return false;
+    }
+    switch (request->ops[0]->type) {
+    case CAPFS__OP_TYPE__RAFT_VOTE:
+    case CAPFS__OP_TYPE__RAFT_APPEND:
+    case CAPFS__OP_TYPE__RENAME_PREPARE:
+    case CAPFS__OP_TYPE__RENAME_COMMIT:
+    case CAPFS__OP_TYPE__RENAME_ABORT:
+    case CAPFS__OP_TYPE__INVALIDATE:
+    case CAPFS__OP_TYPE__LEASE_RELEASE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Tells the other replicas which paths a write changed, once it is in the
+//   store. False if they may not have heard
+static bool
+server_replicate(char *const *paths, size_t n_paths, bool clear) {
+    if (!capfs_raft_enabled()) {
+        return true;
+    }
+    // Batched directory changes would otherwise reach them late
+    capfs_dir_flush_all();
+    return EP_STAT_ISOK(capfs_raft_commit(paths, n_paths, clear));
+}
+
+static bool
+server_replicate_request(const Capfs__Request *request) {
+    char **paths = malloc(max(2 * request->n_ops, 1) * sizeof(char *));
+    size_t n_paths = 0;
+    bool clear = false;
+    for (size_t i = 0; i < request->n_ops; i++) {
+        const Capfs__Op *op = request->ops[i];
+        switch (op->type) {
+        // Whole subtrees move or go, and every path under them
+        case CAPFS__OP_TYPE__RENAME:
+        case CAPFS__OP_TYPE__RMDIR:
+            clear = true;
+            break;
+        // Through a handle, from a client that did not say where
+        case CAPFS__OP_TYPE__WRITE:
+        case CAPFS__OP_TYPE__FLUSH:
+        case CAPFS__OP_TYPE__FSYNC:
+        case CAPFS__OP_TYPE__RELEASE:
+        case CAPFS__OP_TYPE__FTRUNCATE:
+            clear |= op->path == NULL;
+            break;
+        default:
+            break;
+        }
+        if (op->path != NULL) {
+            paths[n_paths++] = op->path;
+        }
+        if (op->to != NULL) {
+            paths[n_paths++] = op->to;
+        }
+    }
+    bool ok = server_replicate(paths, n_paths, clear);
+    free(paths);
+    return ok;
+}
+
+// Runs a request and answers it
+static void
+server_run(server_conn_t *conn, Capfs__Request *request) {
+    Capfs__Response response = CAPFS__RESPONSE__INIT;
+    response.id = request->id;
+    size_t n_ops = request->n_ops;
+
+    // A replica that may not run it, or a shard that does not own its
+    //   paths, says who may and runs nothing
+    bool read_only = capfs_rpc_read_only(request->ops, request->n_ops);
+    bool internal = server_request_internal(request);
+    bool replicated = capfs_raft_enabled() && !internal;
+    bool sharded = capfs_shard_enabled() && !internal;
+    int leader = -1;
+    bool redirect = false;
+    if (replicated) {
+        redirect = !capfs_raft_can_serve(read_only, &leader);
+    } else if (sharded) {
+        leader = capfs_shard_elsewhere(request->ops, request->n_ops);
+        redirect = leader >= 0;
+    }
+    if (redirect) {
+        response.has_redirect = true;
+        response.redirect = true;
+        response.has_leader = leader >= 0;
+        response.leader = leader >= 0 ? leader : 0;
+        n_ops = 0;
+    }
+    if (sharded && n_ops > 0) {
+        capfs_shard_refresh();
+    }
+
+    // One result per op, in the same order
+    server_batch_t batch = { 0, -EBADF };
+    Capfs__Result *results = malloc(max(n_ops, 1) * sizeof(Capfs__Result));
+    Capfs__Result **result_ptrs = malloc(max(n_ops, 1)
+                                         * sizeof(Capfs__Result *));
+    for (size_t i = 0; i < n_ops; i++) {
+        capfs__result__init(&results[i]);
+        results[i].err = server_op(conn, request->ops[i], &batch,
+                                   &results[i]);
+        result_ptrs[i] = &results[i];
+    }
+    // Not done while a follower may still answer reads from before it
+    if (n_ops > 0 && replicated && !read_only
+        && !server_replicate_request(request)) {
+        for (size_t i = 0; i < n_ops; i++) {
+            if (results[i].err == 0) {
+                results[i].err = -EIO;
+            }
+        }
+    }
+    if (n_ops > 0 && sharded && !read_only) {
+        capfs_shard_publish(request->ops, n_ops);
+    }
+    response.n_results = n_ops;
+    protobuf_c_message_free_unpacked(&request->base, NULL);
+    response.results = result_ptrs;
+
+    pthread_mutex_lock(&conn->send_lock);
+    EP_STAT estat = capfs_rpc_send(conn->fd, &response.base);
+    pthread_mutex_unlock(&conn->send_lock);
+    // Half sent or not at all, the stream is lost. Wakes the reader
+    if (!EP_STAT_ISOK(estat)) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+
+    for (size_t i = 0; i < response.n_results; i++) {
+        server_result_free(&results[i]);
+    }
+    free(result_ptrs);
+    free(results);
+
+    pthread_mutex_lock(&conn->lock);
+    conn->in_flight--;
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+static void *
+server_worker_thread(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&jobs_lock);
+        while (jobs_head == NULL) {
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+        }
+        server_job_t *job = jobs_head;
+        jobs_head = job->next;
+        if (jobs_head == NULL) {
+            jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&jobs_lock);
+
+        server_run(job->conn, job->request);
+        free(job);
+    }
+    return NULL;
+}
+
+static void *
+server_conn_thread(void *arg) {
+    server_conn_t *conn = arg;
+
+    for (;;) {
+        // Flow control: a client that sends faster than it is served ends
+        //   up blocked on its socket
+        pthread_mutex_lock(&conn->lock);
+        while (conn->in_flight >= RPC_MAX_IN_FLIGHT) {
+            pthread_cond_wait(&conn->cond, &conn->lock);
+        }
+        conn->in_flight++;
+        pthread_mutex_unlock(&conn->lock);
+
+        Capfs__Request *request;
+        if (!EP_STAT_ISOK(capfs_rpc_recv(conn->fd, &capfs__request__descriptor,
+                                         (ProtobufCMessage **) &request))) {
+            pthread_mutex_lock(&conn->lock);
+            conn->in_flight--;
+            pthread_mutex_unlock(&conn->lock);
+            break;
+        }
+
+        // Never queued behind writes that wait on them
+        if (server_request_internal(request)) {
+            server_run(conn, request);
+            continue;
+        }
+
+        server_job_t *job = malloc(sizeof(server_job_t));
+        job->conn = conn;
+        job->request = request;
+        job->next = NULL;
+        pthread_mutex_lock(&jobs_lock);
+        if (jobs_tail != NULL) {
+            jobs_tail->next = job;
+        } else {
+            jobs_head = job;
+        }
+        jobs_tail = job;
+        pthread_cond_signal(&jobs_cond);
+        pthread_mutex_unlock(&jobs_lock);
+    }
+
+    // Whatever is still running answers into the void, then goes
+    pthread_mutex_lock(&conn->lock);
+    while (conn->in_flight > 0) {
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    char **paths = malloc((conn->count + 1) * sizeof(char *));
+    size_t n_paths = 0;
+    while (conn->count > 0) {
+        server_handle_t *handle = &conn->handles[--conn->count];
+        if (!handle->is_dir) {
+            paths[n_paths++] = strdup(handle->path);
+        }
+        server_handle_release(conn, handle);
+    }
+    capfs_lease_drop(conn);
+    // What was written through them
+    if (n_paths > 0) {
+        server_replicate(paths, n_paths, false);
+    }
+    while (n_paths > 0) {
+        free(paths[--n_paths]);
+    }
+    free(paths);
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->send_lock);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->cond);
+    free(conn->handles);
+    free(conn);
+    return NULL;
+}
+
+// Takes SIGINT and SIGTERM for everyone, so batched directory changes are
+//   written back and pooled logs removed before going down
+static void *
+server_signal_thread(void *arg) {
+    sigset_t *signals = arg;
+    int sig;
+    sigwait(signals, &sig);
+    capfs_dir_flush_stop();
+    capfs_dir_flush_all();
+    capfs_file_pool_drain();
+    exit(EX_OK);
+}
+
+int
+capfs_server_main(const char *address) {
+    EP_STAT estat;
+
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, server_signal_thread, &signals);
+
+    int listen_fd;
+    estat = capfs_rpc_listen(address, &listen_fd);
+    if (!EP_STAT_ISOK(estat)) {
+        fprintf(stderr, "capfs_server: cannot listen on %s\n", address);
+        return EX_UNAVAILABLE;
+    }
+
+    capfs_lease_init(server_lease_revoke, server_lease_expire);
+    for (int i = 0; i < SERVER_WORKERS; i++) {
+        if (pthread_create(&thread, NULL, server_worker_thread, NULL) != 0) {
+            return EX_OSERR;
+        }
+    }
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return EX_OSERR;
+        }
+        server_conn_t *conn = calloc(sizeof(server_conn_t), 1);
+        conn->fd = fd;
+        pthread_mutex_init(&conn->send_lock, NULL);
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+        conn->size = SERVER_HANDLES;
+        conn->handles = malloc(conn->size * sizeof(server_handle_t));
+        if (pthread_create(&thread, NULL, server_conn_thread, conn) != 0) {
+            close(fd);
+            free(conn->handles);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
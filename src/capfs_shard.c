@@ -0,0 +1,722 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_shard.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capfs_dir.h"
+#include "capfs_rpc.h"
+#include "capfs_store.h"
+#include "capfs_util.h"
+
+// Another shard, asked by one thread at a time
+typedef struct shard_peer {
+    char *address;
+    pthread_mutex_t lock;
+    int fd;                 // -1 until connected
+    uint64_t next_id;
+} shard_peer_t;
+
+// A name held for a rename: the source by this shard until the rename is
+//   done, the target by the shard of its directory until the decision comes
+//   or expires_at passes (0 for never)
+typedef struct shard_hold {
+    char *path;
+    uint64_t txid;
+    uint64_t expires_at;
+    struct shard_hold *next;
+} shard_hold_t;
+
+// A rename decided here that is not done yet: entry is still to be linked
+//   at to and unlinked at from
+typedef struct shard_rename {
+    uint64_t txid;
+    char *from;
+    char *to;
+    capfs_dir_entry_t entry;
+    bool running;           // By a thread that will finish or give it back
+    struct shard_rename *next;
+} shard_rename_t;
+
+// The state file is a list of records, each followed by its from and to
+//   paths: a rename that was decided, and one that was done
+#define SHARD_RECORD_COMMIT 1
+#define SHARD_RECORD_DONE 2
+
+typedef struct shard_record {
+    uint32_t type;
+    uint32_t from_length;
+    uint32_t to_length;
+    uint32_t padding;
+    uint64_t txid;
+    capfs_dir_entry_t entry;
+} shard_record_t;
+
+static bool shard_on;
+static int shard_self;
+static int shard_count;
+static shard_peer_t shard_peers[SHARD_MAX];
+
+// Covers everything below
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static shard_hold_t *shard_holds;
+static shard_rename_t *shard_renames;
+static int shard_state_fd = -1;
+static uint64_t shard_next_txid;
+
+static uint64_t
+shard_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Caller holds shard_lock. Forgets the holds that expired on the way
+static shard_hold_t *
+shard_hold_find(const char *path) {
+    uint64_t now = shard_now();
+    shard_hold_t **link = &shard_holds;
+    while (*link != NULL) {
+        shard_hold_t *hold = *link;
+        if (hold->expires_at != 0 && hold->expires_at <= now) {
+            *link = hold->next;
+            free(hold->path);
+            free(hold);
+            continue;
+        }
+        if (strcmp(hold->path, path) == 0) {
+            return hold;
+        }
+        link = &hold->next;
+    }
+    return NULL;
+}
+
+// False if another rename holds path
+static bool
+shard_hold(const char *path, uint64_t txid, uint64_t expires_at) {
+    pthread_mutex_lock(&shard_lock);
+    shard_hold_t *hold = shard_hold_find(path);
+    if (hold != NULL) {
+        pthread_mutex_unlock(&shard_lock);
+        return hold->txid == txid;
+    }
+    hold = malloc(sizeof(shard_hold_t));
+    hold->path = strdup(path);
+    hold->txid = txid;
+    hold->expires_at = expires_at;
+    hold->next = shard_holds;
+    shard_holds = hold;
+    pthread_mutex_unlock(&shard_lock);
+    return true;
+}
+
+static void
+shard_release(uint64_t txid) {
+    pthread_mutex_lock(&shard_lock);
+    shard_hold_t **link = &shard_holds;
+    while (*link != NULL) {
+        shard_hold_t *hold = *link;
+        if (hold->txid == txid) {
+            *link = hold->next;
+            free(hold->path);
+            free(hold);
+        } else {
+            link = &hold->next;
+        }
+    }
+    pthread_mutex_unlock(&shard_lock);
+}
+
+// Sends op to another shard. Its result, or -EAGAIN if no answer came,
+//   whether or not it ran
+static int
+shard_call(int index, Capfs__Op *op) {
+    EP_STAT estat;
+    shard_peer_t *peer = &shard_peers[index];
+
+    pthread_mutex_lock(&peer->lock);
+    if (peer->fd < 0) {
+        estat = capfs_rpc_connect(peer->address, &peer->fd);
+        if (!EP_STAT_ISOK(estat)) {
+            peer->fd = -1;
+            goto fail0;
+        }
+        capfs_rpc_timeout(peer->fd, SHARD_CALL_TIMEOUT_MS);
+    }
+    Capfs__Response *response;
+    estat = capfs_rpc_call(peer->fd, peer->next_id++, op, &response);
+    if (!EP_STAT_ISOK(estat)) {
+        close(peer->fd);
+        peer->fd = -1;
+        goto fail0;
+    }
+    int ret = response->results[0]->err;
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    pthread_mutex_unlock(&peer->lock);
+    return ret;
+
+fail0:
+    pthread_mutex_unlock(&peer->lock);
+    return -EAGAIN;
+}
+
+// Has every other shard forget what it cached, after a directory moved or
+//   went. One that cannot be reached has nothing cached by the time it is
+//   back
+static void
+shard_broadcast_invalidate(void) {
+    Capfs__Op op = CAPFS__OP__INIT;
+    op.type = CAPFS__OP_TYPE__INVALIDATE;
+    for (int i = 0; i < shard_count; i++) {
+        if (i != shard_self) {
+            shard_call(i, &op);
+        }
+    }
+}
+
+// Caller holds shard_lock. On disk when this returns
+static EP_STAT
+shard_state_write(uint32_t type, const shard_rename_t *rename) {
+    shard_record_t record;
+    memset(&record, 0, sizeof(shard_record_t));
+    record.type = type;
+    record.txid = rename->txid;
+    if (type == SHARD_RECORD_COMMIT) {
+        record.from_length = strlen(rename->from);
+        record.to_length = strlen(rename->to);
+        record.entry = rename->entry;
+    }
+
+    // In one write, a torn one is dropped when read back
+    size_t size = sizeof(shard_record_t) + record.from_length
+                  + record.to_length;
+    char *buf = malloc(size);
+    memcpy(buf, &record, sizeof(shard_record_t));
+    memcpy(buf + sizeof(shard_record_t), rename->from, record.from_length);
+    memcpy(buf + sizeof(shard_record_t) + record.from_length, rename->to,
+           record.to_length);
+    ssize_t written = write(shard_state_fd, buf, size);
+    free(buf);
+    if (written < 0 || fdatasync(shard_state_fd) < 0) {
+        return ep_stat_from_errno(errno);
+    }
+    if ((size_t) written != size) {
+        return ep_stat_from_errno(EIO);
+    }
+    return EP_STAT_OK;
+}
+
+static void
+shard_rename_free(shard_rename_t *rename) {
+    free(rename->from);
+    free(rename->to);
+    free(rename);
+}
+
+// Reads back the renames that were decided before a restart and not done.
+//   They hold their source again until the retry thread finishes them
+static void
+shard_state_load(void) {
+    shard_record_t record;
+    while (read(shard_state_fd, &record, sizeof(shard_record_t))
+           == sizeof(shard_record_t)) {
+        if (record.type == SHARD_RECORD_DONE) {
+            shard_rename_t **link = &shard_renames;
+            while (*link != NULL && (*link)->txid != record.txid) {
+                link = &(*link)->next;
+            }
+            if (*link != NULL) {
+                shard_rename_t *rename = *link;
+                *link = rename->next;
+                shard_rename_free(rename);
+            }
+            continue;
+        }
+        if (record.type != SHARD_RECORD_COMMIT
+            || record.from_length >= PATH_MAX || record.to_length >= PATH_MAX) {
+            break;
+        }
+        shard_rename_t *rename = calloc(sizeof(shard_rename_t), 1);
+        rename->txid = record.txid;
+        rename->entry = record.entry;
+        rename->from = calloc(record.from_length + 1, 1);
+        rename->to = calloc(record.to_length + 1, 1);
+        if (read(shard_state_fd, rename->from, record.from_length)
+            != (ssize_t) record.from_length
+            || read(shard_state_fd, rename->to, record.to_length)
+               != (ssize_t) record.to_length) {
+            shard_rename_free(rename);
+            break;
+        }
+        rename->next = shard_renames;
+        shard_renames = rename;
+    }
+    for (shard_rename_t *rename = shard_renames; rename != NULL;
+         rename = rename->next) {
+        shard_hold(rename->from, rename->txid, 0);
+    }
+}
+
+// The rename is over, one way or the other: forgotten here and on disk
+static void
+shard_rename_done(shard_rename_t *rename) {
+    pthread_mutex_lock(&shard_lock);
+    shard_rename_t **link = &shard_renames;
+    while (*link != rename) {
+        link = &(*link)->next;
+    }
+    *link = rename->next;
+    // Lost, it is only done again after a restart
+    shard_state_write(SHARD_RECORD_DONE, rename);
+    if (shard_renames == NULL) {
+        ftruncate(shard_state_fd, 0);
+    }
+    pthread_mutex_unlock(&shard_lock);
+    shard_release(rename->txid);
+    shard_rename_free(rename);
+}
+
+// Links the entry at the target, then unlinks the source. 0 once done,
+//   -errno if the target refused, which leaves the source as it was, or
+//   -EAGAIN to be tried again. Frees the rename unless -EAGAIN
+static int
+shard_rename_finish(shard_rename_t *rename) {
+    EP_STAT estat;
+
+    Capfs__Op op = CAPFS__OP__INIT;
+    op.type = CAPFS__OP_TYPE__RENAME_COMMIT;
+    op.path = rename->from;
+    op.to = rename->to;
+    op.has_txid = true;
+    op.txid = rename->txid;
+    op.has_gob = true;
+    op.gob.len = sizeof(gdp_name_t);
+    op.gob.data = rename->entry.gob;
+    op.has_is_dir = true;
+    op.is_dir = rename->entry.is_dir;
+    op.has_mode = true;
+    op.mode = rename->entry.mode;
+    op.has_size = true;
+    op.size = rename->entry.size;
+    op.has_sec = true;
+    op.sec = rename->entry.mtime;
+    int ret = shard_call(capfs_rpc_shard_path(rename->to, false, shard_count),
+                         &op);
+    if (ret == -EAGAIN) {
+        goto fail0;
+    }
+
+    if (ret == 0) {
+        // Already gone is what doing it again after a restart finds
+        capfs_dir_t *dir;
+        estat = capfs_dir_opendir_path(rename->from, &dir);
+        if (EP_STAT_ISOK(estat)) {
+            estat = capfs_dir_unlink(dir, path_basename(rename->from),
+                                     rename->entry.gob);
+            capfs_dir_closedir(dir);
+            capfs_dir_free(dir);
+        }
+        if (!EP_STAT_ISOK(estat) && !EP_STAT_IS_SAME(estat, EP_STAT_NOT_FOUND)) {
+            ret = -EAGAIN;
+            goto fail0;
+        }
+        if (rename->entry.is_dir) {
+            attr_cache_clear();
+            shard_broadcast_invalidate();
+        } else {
+            attr_cache_invalidate(rename->from);
+        }
+    }
+    shard_rename_done(rename);
+    return ret;
+
+fail0:
+    pthread_mutex_lock(&shard_lock);
+    rename->running = false;
+    pthread_mutex_unlock(&shard_lock);
+    return ret;
+}
+
+// Finishes the renames whose target could not be reached, or that were
+//   decided before a restart
+static void *
+shard_retry_thread(void *arg) {
+    for (;;) {
+        struct timespec ts = { 0, SHARD_RETRY_MS * 1000000L };
+        nanosleep(&ts, NULL);
+
+        for (;;) {
+            pthread_mutex_lock(&shard_lock);
+            shard_rename_t *rename = shard_renames;
+            while (rename != NULL && rename->running) {
+                rename = rename->next;
+            }
+            if (rename != NULL) {
+                rename->running = true;
+            }
+            pthread_mutex_unlock(&shard_lock);
+            // The rest waits for the next round once one fails
+            if (rename == NULL || shard_rename_finish(rename) == -EAGAIN) {
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+EP_STAT
+capfs_shard_start(const char *shards, const char *self,
+                  const char *state_dir) {
+    EP_STAT estat = EP_STAT_OK;
+    char *list = strdup(shards);
+    char *save;
+
+    shard_self = -1;
+    for (char *address = strtok_r(list, "+", &save); address != NULL;
+         address = strtok_r(NULL, "+", &save)) {
+        if (shard_count == SHARD_MAX) {
+            estat = EP_STAT_BUF_OVERFLOW;
+            goto fail;
+        }
+        if (strcmp(address, self) == 0) {
+            shard_self = shard_count;
+        }
+        shard_peers[shard_count].address = strdup(address);
+        pthread_mutex_init(&shard_peers[shard_count].lock, NULL);
+        shard_peers[shard_count].fd = -1;
+        shard_count++;
+    }
+    if (shard_self < 0) {
+        estat = EP_STAT_NOT_FOUND;
+        goto fail;
+    }
+    free(list);
+
+    if (state_dir == NULL) {
+        state_dir = SHARD_STATE_PATH;
+    }
+    if (mkdir(state_dir, 0700) < 0 && errno != EEXIST) {
+        return ep_stat_from_errno(errno);
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/shard.%d", state_dir, shard_self);
+    shard_state_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (shard_state_fd < 0) {
+        return ep_stat_from_errno(errno);
+    }
+    shard_state_load();
+
+    // Apart from those of every other shard and every earlier run
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    shard_next_txid = ((uint64_t) shard_self << 56)
+                      | (((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec)
+                         & ((1ULL << 56) - 1));
+    shard_on = true;
+
+    // Just in case this is a fresh file system, nobody else makes it
+    if (shard_self == 0) {
+        capfs_dir_make_root();
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, shard_retry_thread, NULL) != 0) {
+        return ep_stat_from_errno(EAGAIN);
+    }
+    pthread_detach(thread);
+    return EP_STAT_OK;
+
+fail:
+    free(list);
+    while (shard_count > 0) {
+        free(shard_peers[--shard_count].address);
+    }
+    return estat;
+}
+
+bool
+capfs_shard_enabled(void) {
+    return shard_on;
+}
+
+int
+capfs_shard_elsewhere(Capfs__Op *const *ops, size_t n_ops) {
+    int shard = capfs_rpc_shard(ops, n_ops, shard_count);
+    return shard != shard_self ? shard : -1;
+}
+
+// Logs open here may have grown in another shard, the rest is read afresh
+//   when opened
+void
+capfs_shard_refresh(void) {
+    capfs_store_refresh();
+}
+
+void
+capfs_shard_publish(Capfs__Op *const *ops, size_t n_ops) {
+    bool changed = false;
+    bool moved = false;
+    for (size_t i = 0; i < n_ops; i++) {
+        switch (ops[i]->type) {
+        case CAPFS__OP_TYPE__MKDIR:
+            changed = true;
+            break;
+        case CAPFS__OP_TYPE__RMDIR:
+            changed = true;
+            moved = true;
+            break;
+        // Between shards, capfs_shard_rename said so itself
+        case CAPFS__OP_TYPE__RENAME:
+            changed = true;
+            moved |= ops[i]->to != NULL && capfs_shard_local(ops[i]->to);
+            break;
+        default:
+            break;
+        }
+    }
+    // The other shards walk through these directories to their own
+    if (changed) {
+        capfs_dir_flush_all();
+    }
+    // And may have cached what was under one that moved or went
+    if (moved) {
+        shard_broadcast_invalidate();
+    }
+}
+
+bool
+capfs_shard_busy(const char *path) {
+    if (!shard_on) {
+        return false;
+    }
+    pthread_mutex_lock(&shard_lock);
+    bool busy = shard_hold_find(path) != NULL;
+    pthread_mutex_unlock(&shard_lock);
+    return busy;
+}
+
+bool
+capfs_shard_local(const char *to) {
+    return capfs_rpc_shard_path(to, false, shard_count) == shard_self;
+}
+
+int
+capfs_shard_rename(const char *from, const char *to) {
+    if (strlen(from) == 0 || strlen(to) == 0) {
+        return -ENOENT;
+    }
+    EP_STAT estat;
+    int ret;
+
+    shard_rename_t *rename = calloc(sizeof(shard_rename_t), 1);
+    rename->from = strdup(from);
+    rename->to = strdup(to);
+    pthread_mutex_lock(&shard_lock);
+    rename->txid = shard_next_txid++;
+    pthread_mutex_unlock(&shard_lock);
+
+    // Nothing else here moves or removes the source meanwhile
+    if (!shard_hold(from, rename->txid, 0)) {
+        ret = -EBUSY;
+        goto fail0;
+    }
+    capfs_dir_t *dir;
+    estat = capfs_dir_opendir_path(from, &dir);
+    if (!EP_STAT_ISOK(estat)) {
+        ret = -ENOENT;
+        goto fail1;
+    }
+    estat = capfs_dir_lookup(dir, path_basename(from), &rename->entry);
+    capfs_dir_closedir(dir);
+    capfs_dir_free(dir);
+    if (!EP_STAT_ISOK(estat)) {
+        ret = -ENOENT;
+        goto fail1;
+    }
+
+    // Phase one: the target's shard holds the name, which is free
+    int target = capfs_rpc_shard_path(to, false, shard_count);
+    Capfs__Op op = CAPFS__OP__INIT;
+    op.type = CAPFS__OP_TYPE__RENAME_PREPARE;
+    op.path = rename->from;
+    op.to = rename->to;
+    op.has_txid = true;
+    op.txid = rename->txid;
+    ret = shard_call(target, &op);
+    if (ret != 0) {
+        goto fail2;
+    }
+
+    // Decided: from here on it happens, across a restart if need be
+    pthread_mutex_lock(&shard_lock);
+    estat = shard_state_write(SHARD_RECORD_COMMIT, rename);
+    if (EP_STAT_ISOK(estat)) {
+        rename->running = true;
+        rename->next = shard_renames;
+        shard_renames = rename;
+    }
+    pthread_mutex_unlock(&shard_lock);
+    if (!EP_STAT_ISOK(estat)) {
+        ret = -EIO;
+        goto fail2;
+    }
+
+    // Phase two, left to the retry thread if the target is not there
+    ret = shard_rename_finish(rename);
+    return ret == -EAGAIN ? -EIO : ret;
+
+fail2:
+    op.type = CAPFS__OP_TYPE__RENAME_ABORT;
+    shard_call(target, &op);
+    if (ret == -EAGAIN) {
+        ret = -EIO;
+    }
+fail1:
+    shard_release(rename->txid);
+fail0:
+    shard_rename_free(rename);
+    return ret;
+}
+
+// Holds the name for the rename if it is free
+static int
+shard_handle_prepare(const Capfs__Op *op) {
+    EP_STAT estat;
+
+    if (!shard_hold(op->to, op->txid,
+                    shard_now() + SHARD_PREPARE_TIMEOUT_MS)) {
+        return -EBUSY;
+    }
+    capfs_dir_t *dir;
+    estat = capfs_dir_opendir_path(op->to, &dir);
+    if (!EP_STAT_ISOK(estat)) {
+        shard_release(op->txid);
+        return -ENOENT;
+    }
+    capfs_dir_entry_t entry;
+    estat = capfs_dir_lookup(dir, path_basename(op->to), &entry);
+    capfs_dir_closedir(dir);
+    capfs_dir_free(dir);
+    if (EP_STAT_ISOK(estat)) {
+        shard_release(op->txid);
+        return -EEXIST;
+    }
+    return 0;
+}
+
+// Links the entry, whether or not the name is still held for it. Asked
+//   again after a restart, what it linked before is fine
+static int
+shard_handle_commit(const Capfs__Op *op) {
+    EP_STAT estat;
+
+    if (!op->has_gob || op->gob.len != sizeof(gdp_name_t)) {
+        return -EINVAL;
+    }
+    capfs_dir_entry_t entry;
+    memset(&entry, 0, sizeof(capfs_dir_entry_t));
+    entry.is_dir = op->is_dir;
+    entry.valid = true;
+    entry.mode = op->mode;
+    entry.mtime = op->sec;
+    entry.size = op->size;
+    memcpy(entry.gob, op->gob.data, sizeof(gdp_name_t));
+
+    int ret = 0;
+    capfs_dir_t *dir;
+    estat = capfs_dir_opendir_path(op->to, &dir);
+    if (EP_STAT_ISOK(estat)) {
+        estat = capfs_dir_link(dir, path_basename(op->to), &entry);
+        capfs_dir_closedir(dir);
+        capfs_dir_free(dir);
+    }
+    // Refusals are final, the source stays where it is. Anything else
+    //   is asked again
+    if (EP_STAT_IS_SAME(estat, EP_STAT_INVALID_ARG)) {
+        ret = -EEXIST;
+    } else if (EP_STAT_IS_SAME(estat, EP_STAT_NOT_FOUND)) {
+        ret = -ENOENT;
+    } else if (EP_STAT_IS_SAME(estat, EP_STAT_OUT_OF_MEMORY)) {
+        ret = -ENOSPC;
+    } else if (!EP_STAT_ISOK(estat)) {
+        return -EAGAIN;
+    }
+    shard_release(op->txid);
+    if (ret == 0 && entry.is_dir) {
+        attr_cache_clear();
+    } else if (ret == 0) {
+        attr_cache_invalidate(op->to);
+    }
+    return ret;
+}
+
+int
+capfs_shard_handle(const Capfs__Op *op) {
+    switch (op->type) {
+    case CAPFS__OP_TYPE__RENAME_PREPARE:
+        if (op->to == NULL || !op->has_txid) {
+            return -EINVAL;
+        }
+        capfs_shard_refresh();
+        return shard_handle_prepare(op);
+    case CAPFS__OP_TYPE__RENAME_COMMIT:
+        if (op->to == NULL || !op->has_txid) {
+            return -EINVAL;
+        }
+        capfs_shard_refresh();
+        return shard_handle_commit(op);
+    case CAPFS__OP_TYPE__RENAME_ABORT:
+        if (op->has_txid) {
+            shard_release(op->txid);
+        }
+        return 0;
+    case CAPFS__OP_TYPE__INVALIDATE:
+        if (op->path != NULL) {
+            attr_cache_invalidate(op->path);
+        } else {
+            attr_cache_clear();
+        }
+        return 0;
+    default:
+        return -ENOSYS;
+    }
+}
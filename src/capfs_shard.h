@@ -0,0 +1,84 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#ifndef _CAPFS_SHARD_H_
+#define _CAPFS_SHARD_H_
+
+// Shards a file system can be split into at most
+#define SHARD_MAX 64
+// How long a shard asked to take a name holds it for the rename before
+//   giving up on it, if the decision does not come
+#define SHARD_PREPARE_TIMEOUT_MS 5000
+// How long one shard waits on another
+#define SHARD_CALL_TIMEOUT_MS 2000
+// How often renames that were decided but not done are tried again
+#define SHARD_RETRY_MS 500
+// Where the decided renames are kept across restarts
+#define SHARD_STATE_PATH "/var/tmp/capfs"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <ep/ep.h>
+
+#include "proto/capfs.pb-c.h"
+
+// Servers sharing one store (-o shards=A+B+C) split the directories between
+//   them by a hash of their path, see capfs_rpc_shard. A directory's entries
+//   are written by its shard only, which also runs every op on a path in
+//   it, so a client sends each request straight there. A rename into a
+//   directory of another shard is run in two phases: the shard of the target
+//   holds the name (RENAME_PREPARE), this one writes down the decision, has
+//   it link the entry (RENAME_COMMIT) and only then unlinks the source
+//
+// Starts the shard that is self among the + separated shards, keeping the
+//   renames it decided under state_dir (SHARD_STATE_PATH if NULL). The
+//   first one makes the root
+EP_STAT capfs_shard_start(const char *shards, const char *self,
+                          const char *state_dir);
+bool capfs_shard_enabled(void);
+// Which other shard runs the ops, -1 if this one may
+int capfs_shard_elsewhere(Capfs__Op *const *ops, size_t n_ops);
+// Catches up with what the other shards wrote, before running a request
+void capfs_shard_refresh(void);
+// Lets the other shards see what the ops changed, after running them
+void capfs_shard_publish(Capfs__Op *const *ops, size_t n_ops);
+// Whether path is held by a rename in progress
+bool capfs_shard_busy(const char *path);
+// Whether to is in a directory of this shard, so a rename there is local
+bool capfs_shard_local(const char *to);
+// Renames from, in a directory of this shard, to a directory of another.
+//   0 or -errno, -EIO if it may yet happen
+int capfs_shard_rename(const char *from, const char *to);
+// Answers RENAME_PREPARE, RENAME_COMMIT, RENAME_ABORT and INVALIDATE from
+//   the other shards, 0 or -errno
+int capfs_shard_handle(const Capfs__Op *op);
+
+#endif // _CAPFS_SHARD_H_
@@ -0,0 +1,173 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_store.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const capfs_store_t *stores[] = {
+    &capfs_store_gdp,
+    &capfs_store_local,
+};
+
+// Set once before any log is touched, read without a lock afterwards
+static const capfs_store_t *store;
+static const char *store_path;
+static const char *shape_profile;
+static uint64_t shape_seed = 1;
+
+EP_STAT
+capfs_store_select(const char *name, const char *path) {
+    for (size_t i = 0; i < sizeof(stores) / sizeof(stores[0]); i++) {
+        if (strcmp(stores[i]->name, name) == 0) {
+            store = stores[i];
+            store_path = path;
+            return EP_STAT_OK;
+        }
+    }
+    return EP_STAT_NOT_FOUND;
+}
+
+void
+capfs_store_shape(const char *profile, uint64_t seed) {
+    shape_profile = profile;
+    shape_seed = seed;
+}
+
+EP_STAT
+capfs_store_init(void) {
+    EP_STAT estat;
+
+    // Tests and benchmarks that call init() directly pick it this way
+    if (store == NULL) {
+        const char *name = getenv("CAPFS_STORE");
+        estat = capfs_store_select(name != NULL ? name : "gdp",
+                                   getenv("CAPFS_STORE_PATH"));
+        EP_STAT_CHECK(estat, return estat);
+    }
+    if (shape_profile == NULL && getenv("CAPFS_SHAPE") != NULL) {
+        const char *seed = getenv("CAPFS_SHAPE_SEED");
+        capfs_store_shape(getenv("CAPFS_SHAPE"),
+                          seed != NULL ? strtoull(seed, NULL, 0) : 1);
+    }
+    if (shape_profile != NULL && store != &capfs_store_shaped) {
+        estat = capfs_store_shaped_wrap(store, shape_profile, shape_seed);
+        EP_STAT_CHECK(estat, return estat);
+        store = &capfs_store_shaped;
+    }
+    return store->init(store_path);
+}
+
+EP_STAT
+capfs_log_create(const char *human_name, gdp_name_t gob) {
+    return store->create(human_name, gob);
+}
+
+EP_STAT
+capfs_log_lookup(const char *human_name, gdp_name_t gob) {
+    return store->lookup(human_name, gob);
+}
+
+EP_STAT
+capfs_log_remove(const gdp_name_t gob) {
+    return store->remove(gob);
+}
+
+EP_STAT
+capfs_log_open(const gdp_name_t gob, capfs_log_t **log) {
+    return store->open(gob, log);
+}
+
+EP_STAT
+capfs_log_close(capfs_log_t *log) {
+    return store->close(log);
+}
+
+EP_STAT
+capfs_log_append(capfs_log_t *log, const struct iovec *iov, int iovcnt,
+                 capfs_hash_t *prevhash, capfs_hash_t **hash) {
+    return store->append(log, iov, iovcnt, prevhash, hash);
+}
+
+EP_STAT
+capfs_log_read(capfs_log_t *log, gdp_recno_t recno, capfs_record_t **record) {
+    return store->read(log, recno, record);
+}
+
+size_t
+capfs_record_length(capfs_record_t *record) {
+    return store->record_length(record);
+}
+
+gdp_recno_t
+capfs_record_recno(capfs_record_t *record) {
+    return store->record_recno(record);
+}
+
+size_t
+capfs_record_copy(capfs_record_t *record, size_t offset, void *buf,
+                  size_t size) {
+    return store->record_copy(record, offset, buf, size);
+}
+
+capfs_hash_t *
+capfs_record_hash(capfs_record_t *record) {
+    return store->record_hash(record);
+}
+
+void
+capfs_record_free(capfs_record_t *record) {
+    if (record != NULL) {
+        store->record_free(record);
+    }
+}
+
+void
+capfs_hash_free(capfs_hash_t *hash) {
+    if (hash != NULL) {
+        store->hash_free(hash);
+    }
+}
+
+EP_STAT
+capfs_store_refresh(void) {
+    return store->refresh != NULL ? store->refresh() : EP_STAT_OK;
+}
+
+EP_STAT
+capfs_log_watch(const gdp_name_t gob, capfs_watch_t notify, void *arg) {
+    return store->watch != NULL ? store->watch(gob, notify, arg) : EP_STAT_OK;
+}
+
+EP_STAT
+capfs_log_unwatch(const gdp_name_t gob) {
+    return store->unwatch != NULL ? store->unwatch(gob) : EP_STAT_OK;
+}
@@ -0,0 +1,142 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#ifndef _CAPFS_STORE_H_
+#define _CAPFS_STORE_H_
+
+// Local segment files grow by this many bytes at a time
+#define STORE_LOCAL_GROW (64 * 1024 * 1024)
+// Initial records in a local segment's recno -> offset index
+#define STORE_LOCAL_INDEX 1024
+// Buckets in the gob -> open segment table
+#define STORE_LOCAL_BUCKETS 1024
+// Where local segments live unless -o store_path says otherwise
+#define STORE_LOCAL_PATH "/var/tmp/capfs"
+// How often watched local segments are checked for appends by others, which
+//   bounds how late a watcher hears of them
+#define STORE_LOCAL_WATCH_MS 100
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <ep/ep.h>
+#include <gdp/gdp.h>
+
+// Each backend has its own idea of these, nobody else looks inside
+typedef struct capfs_log capfs_log_t;
+typedef struct capfs_record capfs_record_t;
+typedef struct capfs_hash capfs_hash_t;
+
+// Told that someone appended to a watched log, recno being its last record
+//   as far as the backend knows. Runs on a thread of the backend's, so it
+//   must not block
+typedef void (*capfs_watch_t)(const gdp_name_t gob, gdp_recno_t recno,
+                              void *arg);
+
+// Where the logs live. A new log has record 0 only, which holds nothing but
+//   gives the first append a hash to chain to. Reading recno -1 reads the
+//   last record
+typedef struct capfs_store {
+    const char *name;
+    // path is backend specific, e.g. the directory of the local segments
+    EP_STAT (*init)(const char *path);
+    // human_name is NULL for a log only reachable by its gob
+    EP_STAT (*create)(const char *human_name, gdp_name_t gob);
+    EP_STAT (*lookup)(const char *human_name, gdp_name_t gob);
+    EP_STAT (*remove)(const gdp_name_t gob);
+    EP_STAT (*open)(const gdp_name_t gob, capfs_log_t **log);
+    EP_STAT (*close)(capfs_log_t *log);
+    // Appends the pieces as one record. hash may be NULL
+    EP_STAT (*append)(capfs_log_t *log, const struct iovec *iov, int iovcnt,
+                      capfs_hash_t *prevhash, capfs_hash_t **hash);
+    EP_STAT (*read)(capfs_log_t *log, gdp_recno_t recno,
+                    capfs_record_t **record);
+    size_t (*record_length)(capfs_record_t *record);
+    gdp_recno_t (*record_recno)(capfs_record_t *record);
+    // Copies of one record must go front to back, offsets never decrease.
+    //   Returns the bytes copied, short at the end of the record
+    size_t (*record_copy)(capfs_record_t *record, size_t offset, void *buf,
+                          size_t size);
+    capfs_hash_t *(*record_hash)(capfs_record_t *record);
+    void (*record_free)(capfs_record_t *record);
+    void (*hash_free)(capfs_hash_t *hash);
+    // Catches the open logs up with appends made by other processes sharing
+    //   the store (the replicas of capfs_raft.c). NULL if reads see them
+    //   anyway
+    EP_STAT (*refresh)(void);
+    // Calls notify after appends to the log by other processes (GDP
+    //   subscriptions also report our own). The log stays open until
+    //   unwatch. NULL if the backend cannot tell
+    EP_STAT (*watch)(const gdp_name_t gob, capfs_watch_t notify, void *arg);
+    EP_STAT (*unwatch)(const gdp_name_t gob);
+} capfs_store_t;
+
+extern const capfs_store_t capfs_store_gdp;
+extern const capfs_store_t capfs_store_local;
+extern const capfs_store_t capfs_store_shaped;
+
+// Picks the backend by name ("gdp" or "local") before capfs_store_init.
+//   Without it the CAPFS_STORE and CAPFS_STORE_PATH environment variables
+//   decide, and GDP is the default
+EP_STAT capfs_store_select(const char *name, const char *path);
+// Puts the backend behind a simulated network with the named profile (none,
+//   lan, wan50, wan100, wan200 or RTT:JITTER:MBIT:SPIKE_PCT:SPIKE_MS, see
+//   capfs_store_shaped.c) and seed. Without it CAPFS_SHAPE and
+//   CAPFS_SHAPE_SEED decide, and nothing is shaped
+void capfs_store_shape(const char *profile, uint64_t seed);
+EP_STAT capfs_store_shaped_wrap(const capfs_store_t *store,
+                                const char *profile, uint64_t seed);
+EP_STAT capfs_store_init(void);
+
+EP_STAT capfs_log_create(const char *human_name, gdp_name_t gob);
+EP_STAT capfs_log_lookup(const char *human_name, gdp_name_t gob);
+EP_STAT capfs_log_remove(const gdp_name_t gob);
+EP_STAT capfs_log_open(const gdp_name_t gob, capfs_log_t **log);
+EP_STAT capfs_log_close(capfs_log_t *log);
+EP_STAT capfs_log_append(capfs_log_t *log, const struct iovec *iov,
+                         int iovcnt, capfs_hash_t *prevhash,
+                         capfs_hash_t **hash);
+EP_STAT capfs_log_read(capfs_log_t *log, gdp_recno_t recno,
+                       capfs_record_t **record);
+size_t capfs_record_length(capfs_record_t *record);
+gdp_recno_t capfs_record_recno(capfs_record_t *record);
+size_t capfs_record_copy(capfs_record_t *record, size_t offset, void *buf,
+                         size_t size);
+capfs_hash_t *capfs_record_hash(capfs_record_t *record);
+void capfs_record_free(capfs_record_t *record);
+void capfs_hash_free(capfs_hash_t *hash);
+EP_STAT capfs_store_refresh(void);
+// Do nothing if the backend cannot watch
+EP_STAT capfs_log_watch(const gdp_name_t gob, capfs_watch_t notify,
+                        void *arg);
+EP_STAT capfs_log_unwatch(const gdp_name_t gob);
+
+#endif // _CAPFS_STORE_H_
@@ -0,0 +1,306 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_store.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Logs in GDP, through the router and log servers gdp_init found
+typedef struct gdp_record {
+    gdp_datum_t *datum;
+    gdp_gin_t *ginp;
+    size_t length;
+    size_t consumed;        // Drained from the front of the datum so far
+} gdp_record_t;
+
+// A subscription, with a log of its own so closing the others leaves it be
+typedef struct gdp_watch {
+    gdp_name_t gob;
+    gdp_gin_t *ginp;
+    capfs_watch_t notify;
+    void *arg;
+    struct gdp_watch *next;
+} gdp_watch_t;
+
+static gdp_watch_t *watches;
+static pthread_mutex_t watches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static EP_STAT
+gdp_store_init(const char *path) {
+    (void) path;
+    return gdp_init(NULL);
+}
+
+static EP_STAT
+gdp_store_create(const char *human_name, gdp_name_t gob) {
+    EP_STAT estat;
+
+    // Create GCI - prep for creating DataCapsule
+    gdp_create_info_t *gci = gdp_create_info_new();
+    estat = gdp_create_info_set_creator(gci, "CapFS",
+                                        "fa19.cs262.eecs.berkeley.edu");
+    EP_STAT_CHECK(estat, goto fail0);
+    // Create a new key, save it in KEYS
+    estat = gdp_create_info_new_owner_key(gci, NULL, NULL, 0, NULL, "null");
+    EP_STAT_CHECK(estat, goto fail0);
+
+    // Create DataCapsule
+    gdp_gin_t *ginp;
+    estat = gdp_gin_create(gci, human_name, &ginp);
+    EP_STAT_CHECK(estat, goto fail0);
+    memcpy(gob, gdp_gin_getname(ginp), sizeof(gdp_name_t));
+
+    // Close it, appends only work once it is opened again (workaround)
+    estat = gdp_gin_close(ginp);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    gdp_create_info_free(&gci);
+    return EP_STAT_OK;
+
+fail1:
+    gdp_gin_delete(ginp);
+fail0:
+    gdp_create_info_free(&gci);
+    return estat;
+}
+
+static EP_STAT
+gdp_store_lookup(const char *human_name, gdp_name_t gob) {
+    return gdp_parse_name(human_name, gob);
+}
+
+static EP_STAT
+gdp_store_open(const gdp_name_t gob, capfs_log_t **log) {
+    EP_STAT estat;
+
+    gdp_open_info_t *goi = gdp_open_info_new();
+    gdp_gin_t *ginp;
+    estat = gdp_gin_open((uint8_t *) gob, GDP_MODE_RA, goi, &ginp);
+    gdp_open_info_free(goi);
+    EP_STAT_CHECK(estat, return estat);
+    *log = (capfs_log_t *) ginp;
+    return EP_STAT_OK;
+}
+
+static EP_STAT
+gdp_store_remove(const gdp_name_t gob) {
+    EP_STAT estat;
+
+    capfs_log_t *log;
+    estat = gdp_store_open(gob, &log);
+    EP_STAT_CHECK(estat, return estat);
+    return gdp_gin_delete((gdp_gin_t *) log);
+}
+
+static EP_STAT
+gdp_store_close(capfs_log_t *log) {
+    return gdp_gin_close((gdp_gin_t *) log);
+}
+
+static EP_STAT
+gdp_store_append(capfs_log_t *log, const struct iovec *iov, int iovcnt,
+                 capfs_hash_t *prevhash, capfs_hash_t **hash) {
+    EP_STAT estat;
+    gdp_gin_t *ginp = (gdp_gin_t *) log;
+
+    // Pieces go into the datum as they are, without a staging payload
+    gdp_datum_t *datum = gdp_datum_new();
+    gdp_buf_t *buf = gdp_datum_getbuf(datum);
+    for (int i = 0; i < iovcnt; i++) {
+        gdp_buf_write(buf, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    estat = gdp_gin_append(ginp, datum, (gdp_hash_t *) prevhash);
+    EP_STAT_CHECK(estat, goto fail0);
+    if (hash != NULL) {
+        *hash = (capfs_hash_t *) gdp_datum_hash(datum, ginp);
+    }
+
+    gdp_datum_free(datum);
+    return EP_STAT_OK;
+
+fail0:
+    gdp_datum_free(datum);
+    return estat;
+}
+
+static EP_STAT
+gdp_store_read(capfs_log_t *log, gdp_recno_t recno, capfs_record_t **record) {
+    EP_STAT estat;
+
+    gdp_record_t *gdp_record = malloc(sizeof(gdp_record_t));
+    gdp_record->datum = gdp_datum_new();
+    gdp_record->ginp = (gdp_gin_t *) log;
+    estat = gdp_gin_read_by_recno(gdp_record->ginp, recno,
+                                  gdp_record->datum);
+    EP_STAT_CHECK(estat, goto fail0);
+    gdp_record->length = gdp_buf_getlength(
+        gdp_datum_getbuf(gdp_record->datum));
+    gdp_record->consumed = 0;
+    *record = (capfs_record_t *) gdp_record;
+    return EP_STAT_OK;
+
+fail0:
+    gdp_datum_free(gdp_record->datum);
+    free(gdp_record);
+    return estat;
+}
+
+static size_t
+gdp_store_record_length(capfs_record_t *record) {
+    return ((gdp_record_t *) record)->length;
+}
+
+static gdp_recno_t
+gdp_store_record_recno(capfs_record_t *record) {
+    return gdp_datum_getrecno(((gdp_record_t *) record)->datum);
+}
+
+// The datum is a buffer that is read by draining it, hence front to back
+static size_t
+gdp_store_record_copy(capfs_record_t *record, size_t offset, void *buf,
+                      size_t size) {
+    gdp_record_t *gdp_record = (gdp_record_t *) record;
+    if (offset < gdp_record->consumed) {
+        return 0;
+    }
+    gdp_buf_t *dbuf = gdp_datum_getbuf(gdp_record->datum);
+    gdp_buf_drain(dbuf, offset - gdp_record->consumed);
+    size_t copied = gdp_buf_read(dbuf, buf, size);
+    gdp_record->consumed = offset + copied;
+    return copied;
+}
+
+static capfs_hash_t *
+gdp_store_record_hash(capfs_record_t *record) {
+    gdp_record_t *gdp_record = (gdp_record_t *) record;
+    return (capfs_hash_t *) gdp_datum_hash(gdp_record->datum,
+                                           gdp_record->ginp);
+}
+
+static void
+gdp_store_record_free(capfs_record_t *record) {
+    gdp_record_t *gdp_record = (gdp_record_t *) record;
+    gdp_datum_free(gdp_record->datum);
+    free(gdp_record);
+}
+
+static void
+gdp_store_hash_free(capfs_hash_t *hash) {
+    gdp_hash_free((gdp_hash_t *) hash);
+}
+
+// Runs on the GDP's event thread
+static void
+gdp_store_event(gdp_event_t *gev) {
+    gdp_watch_t *watch = gdp_event_getudata(gev);
+    if (gdp_event_gettype(gev) == GDP_EVENT_DATA) {
+        watch->notify(watch->gob,
+                      gdp_datum_getrecno(gdp_event_getdatum(gev)),
+                      watch->arg);
+    }
+    gdp_event_free(gev);
+}
+
+static EP_STAT
+gdp_store_watch(const gdp_name_t gob, capfs_watch_t notify, void *arg) {
+    EP_STAT estat;
+
+    gdp_watch_t *watch = calloc(sizeof(gdp_watch_t), 1);
+    memcpy(watch->gob, gob, sizeof(gdp_name_t));
+    watch->notify = notify;
+    watch->arg = arg;
+    capfs_log_t *log;
+    estat = gdp_store_open(gob, &log);
+    EP_STAT_CHECK(estat, goto fail0);
+    watch->ginp = (gdp_gin_t *) log;
+
+    // Starting at 0 means from the next append on, and 0 records means for
+    //   as long as the subscription lasts
+    estat = gdp_gin_subscribe_by_recno(watch->ginp, 0, 0, NULL,
+                                       gdp_store_event, watch);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    pthread_mutex_lock(&watches_lock);
+    watch->next = watches;
+    watches = watch;
+    pthread_mutex_unlock(&watches_lock);
+    return EP_STAT_OK;
+
+fail1:
+    gdp_gin_close(watch->ginp);
+fail0:
+    free(watch);
+    return estat;
+}
+
+static EP_STAT
+gdp_store_unwatch(const gdp_name_t gob) {
+    pthread_mutex_lock(&watches_lock);
+    gdp_watch_t **link = &watches;
+    while (*link != NULL && !GDP_NAME_SAME((*link)->gob, gob)) {
+        link = &(*link)->next;
+    }
+    gdp_watch_t *watch = *link;
+    if (watch != NULL) {
+        *link = watch->next;
+    }
+    pthread_mutex_unlock(&watches_lock);
+    if (watch == NULL) {
+        return EP_STAT_NOT_FOUND;
+    }
+
+    EP_STAT estat = gdp_gin_unsubscribe(watch->ginp, gdp_store_event, watch);
+    gdp_gin_close(watch->ginp);
+    free(watch);
+    return estat;
+}
+
+const capfs_store_t capfs_store_gdp = {
+    .name = "gdp",
+    .init = gdp_store_init,
+    .create = gdp_store_create,
+    .lookup = gdp_store_lookup,
+    .remove = gdp_store_remove,
+    .open = gdp_store_open,
+    .close = gdp_store_close,
+    .append = gdp_store_append,
+    .read = gdp_store_read,
+    .record_length = gdp_store_record_length,
+    .record_recno = gdp_store_record_recno,
+    .record_copy = gdp_store_record_copy,
+    .record_hash = gdp_store_record_hash,
+    .record_free = gdp_store_record_free,
+    .hash_free = gdp_store_hash_free,
+    .watch = gdp_store_watch,
+    .unwatch = gdp_store_unwatch,
+};
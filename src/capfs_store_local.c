@@ -0,0 +1,645 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Each log is one segment file, <path>/<gob in hex>.log, mapped into memory
+//   and only ever appended to: a header, then every record as a
+//   local_record_header_t and its payload padded to 8 bytes. A record counts
+//   once its header carries the magic, which is stored last, so a torn
+//   append at the end is ignored when the segment is opened again. Segments
+//   are shared by everyone who opens the same gob; the index of record
+//   offsets is rebuilt when the first one opens it. Another process may
+//   append to a segment open here as long as nobody here does; its records
+//   show up after local_store_refresh, or by themselves within
+//   STORE_LOCAL_WATCH_MS if the segment is watched
+#define LOCAL_SEGMENT_MAGIC 0x43415046534c4f47ULL  // "CAPFSLOG"
+#define LOCAL_RECORD_MAGIC 0x52454344U             // "RECD"
+#define LOCAL_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+typedef struct local_segment_header {
+    uint64_t magic;
+    gdp_name_t gob;
+} local_segment_header_t;
+
+typedef struct local_record_header {
+    uint32_t magic;
+    uint32_t length;
+} local_record_header_t;
+
+typedef struct local_segment {
+    gdp_name_t gob;
+    int fd;
+    char *map;
+    size_t map_size;        // Size of the file, grown by STORE_LOCAL_GROW
+    size_t end;             // Bytes in use
+    size_t *index;          // recno -> offset of the record header
+    size_t count;           // Records, including record 0
+    size_t index_size;
+    unsigned int ref;       // Opens, under segments_lock
+    pthread_rwlock_t lock;  // Covers everything above but ref
+    struct local_segment *next;
+} local_segment_t;
+
+typedef struct local_record {
+    local_segment_t *segment;
+    gdp_recno_t recno;
+    size_t offset;          // Of the payload
+    size_t length;
+} local_record_t;
+
+// A record is named by its position, a local log cannot fork
+typedef struct local_hash {
+    gdp_recno_t recno;
+} local_hash_t;
+
+// A watched log, see local_watch_thread
+typedef struct local_watch {
+    local_segment_t *segment;   // Held open while watched
+    capfs_watch_t notify;
+    void *arg;
+    struct local_watch *next;
+} local_watch_t;
+
+static char local_path[PATH_MAX];
+static local_segment_t *segments[STORE_LOCAL_BUCKETS];
+static pthread_mutex_t segments_lock = PTHREAD_MUTEX_INITIALIZER;
+static local_watch_t *watches;
+static bool watch_started;
+static pthread_mutex_t watches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+local_bucket(const gdp_name_t gob) {
+    size_t hash;
+    memcpy(&hash, gob, sizeof(size_t));
+    return hash % STORE_LOCAL_BUCKETS;
+}
+
+static void
+local_segment_path(const gdp_name_t gob, char path[PATH_MAX]) {
+    char hex[2 * sizeof(gdp_name_t) + 1];
+    for (size_t i = 0; i < sizeof(gdp_name_t); i++) {
+        sprintf(hex + 2 * i, "%02x", gob[i]);
+    }
+    snprintf(path, PATH_MAX, "%s/%s.log", local_path, hex);
+}
+
+// Maps the first map_size bytes of the file, replacing the old mapping.
+//   Caller holds the segment lock for writing, or is the only one who knows
+//   the segment
+static EP_STAT
+local_segment_remap(local_segment_t *segment, size_t map_size) {
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     segment->fd, 0);
+    if (map == MAP_FAILED) {
+        return ep_stat_from_errno(errno);
+    }
+    if (segment->map != NULL) {
+        munmap(segment->map, segment->map_size);
+    }
+    segment->map = map;
+    segment->map_size = map_size;
+    return EP_STAT_OK;
+}
+
+// Same, after making the file that long
+static EP_STAT
+local_segment_map(local_segment_t *segment, size_t map_size) {
+    if (ftruncate(segment->fd, map_size) < 0) {
+        return ep_stat_from_errno(errno);
+    }
+    return local_segment_remap(segment, map_size);
+}
+
+static void
+local_segment_index(local_segment_t *segment, size_t offset) {
+    if (segment->count == segment->index_size) {
+        segment->index_size *= 2;
+        segment->index = realloc(segment->index,
+                                 segment->index_size * sizeof(size_t));
+    }
+    segment->index[segment->count++] = offset;
+}
+
+// Appends a record without taking the lock, see local_segment_map
+static EP_STAT
+local_segment_append(local_segment_t *segment, const struct iovec *iov,
+                     int iovcnt) {
+    EP_STAT estat;
+
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+    if (length > UINT32_MAX) {
+        return EP_STAT_BUF_OVERFLOW;
+    }
+    size_t size = sizeof(local_record_header_t) + LOCAL_ALIGN(length);
+    if (segment->end + size > segment->map_size) {
+        size_t map_size = segment->end + size + STORE_LOCAL_GROW;
+        estat = local_segment_map(segment, map_size - map_size
+                                                      % STORE_LOCAL_GROW);
+        EP_STAT_CHECK(estat, return estat);
+    }
+
+    // The payload first, the magic last makes the record count
+    local_record_header_t *header =
+        (local_record_header_t *) (segment->map + segment->end);
+    char *payload = (char *) (header + 1);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(payload, iov[i].iov_base, iov[i].iov_len);
+        payload += iov[i].iov_len;
+    }
+    header->length = length;
+    __atomic_store_n(&header->magic, LOCAL_RECORD_MAGIC, __ATOMIC_RELEASE);
+
+    local_segment_index(segment, segment->end);
+    segment->end += size;
+    return EP_STAT_OK;
+}
+
+static local_segment_t *
+local_segment_new(const gdp_name_t gob, int fd) {
+    local_segment_t *segment = calloc(sizeof(local_segment_t), 1);
+    memcpy(segment->gob, gob, sizeof(gdp_name_t));
+    segment->fd = fd;
+    segment->index_size = STORE_LOCAL_INDEX;
+    segment->index = malloc(segment->index_size * sizeof(size_t));
+    pthread_rwlock_init(&segment->lock, NULL);
+    return segment;
+}
+
+static void
+local_segment_free(local_segment_t *segment) {
+    if (segment->map != NULL) {
+        munmap(segment->map, segment->map_size);
+    }
+    close(segment->fd);
+    pthread_rwlock_destroy(&segment->lock);
+    free(segment->index);
+    free(segment);
+}
+
+// Finds where the records end and where each one starts, from the end
+//   known so far
+static EP_STAT
+local_segment_scan(local_segment_t *segment) {
+    local_segment_header_t *header = (local_segment_header_t *) segment->map;
+    if (segment->map_size < sizeof(local_segment_header_t)
+        || header->magic != LOCAL_SEGMENT_MAGIC) {
+        return EP_STAT_INVALID_ARG;
+    }
+
+    size_t offset = segment->end > 0 ? segment->end
+                                     : sizeof(local_segment_header_t);
+    while (offset + sizeof(local_record_header_t) <= segment->map_size) {
+        local_record_header_t *record =
+            (local_record_header_t *) (segment->map + offset);
+        size_t size = sizeof(local_record_header_t)
+                      + LOCAL_ALIGN((size_t) record->length);
+        if (__atomic_load_n(&record->magic, __ATOMIC_ACQUIRE)
+                != LOCAL_RECORD_MAGIC
+            || offset + size > segment->map_size) {
+            break;
+        }
+        local_segment_index(segment, offset);
+        offset += size;
+    }
+    segment->end = offset;
+    return segment->count > 0 ? EP_STAT_OK : EP_STAT_END_OF_FILE;
+}
+
+static EP_STAT
+local_store_init(const char *path) {
+    snprintf(local_path, PATH_MAX, "%s", path != NULL ? path
+                                                       : STORE_LOCAL_PATH);
+    if (mkdir(local_path, 0700) < 0 && errno != EEXIST) {
+        return ep_stat_from_errno(errno);
+    }
+    return EP_STAT_OK;
+}
+
+// Names are only hashed, like GDP does, but without a directory service
+//   behind them. FNV-1a with four offsets fills the 32 bytes; it only has to
+//   be stable, nobody is trying to collide names here
+static EP_STAT
+local_store_lookup(const char *human_name, gdp_name_t gob) {
+    for (size_t part = 0; part < sizeof(gdp_name_t) / 8; part++) {
+        uint64_t hash = 0xcbf29ce484222325ULL + part;
+        for (const char *c = human_name; *c != '\0'; c++) {
+            hash ^= (unsigned char) *c;
+            hash *= 0x100000001b3ULL;
+        }
+        memcpy(gob + 8 * part, &hash, 8);
+    }
+    return EP_STAT_OK;
+}
+
+static EP_STAT
+local_store_create(const char *human_name, gdp_name_t gob) {
+    EP_STAT estat;
+
+    if (human_name != NULL) {
+        local_store_lookup(human_name, gob);
+    } else if (getrandom(gob, sizeof(gdp_name_t), 0)
+               != (ssize_t) sizeof(gdp_name_t)) {
+        return ep_stat_from_errno(errno);
+    }
+
+    // Like a name in GDP, a log is only ever created once
+    char path[PATH_MAX];
+    local_segment_path(gob, path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return ep_stat_from_errno(errno);
+    }
+    local_segment_t *segment = local_segment_new(gob, fd);
+    estat = local_segment_map(segment, STORE_LOCAL_GROW);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    local_segment_header_t *header = (local_segment_header_t *) segment->map;
+    memcpy(header->gob, gob, sizeof(gdp_name_t));
+    header->magic = LOCAL_SEGMENT_MAGIC;
+    segment->end = sizeof(local_segment_header_t);
+
+    // Record 0, for the first append to chain to
+    estat = local_segment_append(segment, NULL, 0);
+    EP_STAT_CHECK(estat, goto fail0);
+
+    local_segment_free(segment);
+    return EP_STAT_OK;
+
+fail0:
+    local_segment_free(segment);
+    unlink(path);
+    return estat;
+}
+
+static EP_STAT
+local_store_remove(const gdp_name_t gob) {
+    char path[PATH_MAX];
+    local_segment_path(gob, path);
+    if (unlink(path) < 0) {
+        return ep_stat_from_errno(errno);
+    }
+    return EP_STAT_OK;
+}
+
+static EP_STAT
+local_store_open(const gdp_name_t gob, capfs_log_t **log) {
+    EP_STAT estat;
+    size_t bucket = local_bucket(gob);
+
+    // Already open, share it
+    pthread_mutex_lock(&segments_lock);
+    local_segment_t *segment = segments[bucket];
+    while (segment != NULL && !GDP_NAME_SAME(segment->gob, gob)) {
+        segment = segment->next;
+    }
+    if (segment != NULL) {
+        segment->ref++;
+        pthread_mutex_unlock(&segments_lock);
+        *log = (capfs_log_t *) segment;
+        return EP_STAT_OK;
+    }
+
+    // Opened under segments_lock, so two opens never map it twice
+    char path[PATH_MAX];
+    local_segment_path(gob, path);
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        estat = errno == ENOENT ? EP_STAT_NOT_FOUND : ep_stat_from_errno(errno);
+        goto fail0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        estat = ep_stat_from_errno(errno);
+        close(fd);
+        goto fail0;
+    }
+    segment = local_segment_new(gob, fd);
+    estat = local_segment_remap(segment, st.st_size);
+    EP_STAT_CHECK(estat, goto fail1);
+    estat = local_segment_scan(segment);
+    EP_STAT_CHECK(estat, goto fail1);
+
+    segment->ref = 1;
+    segment->next = segments[bucket];
+    segments[bucket] = segment;
+    pthread_mutex_unlock(&segments_lock);
+    *log = (capfs_log_t *) segment;
+    return EP_STAT_OK;
+
+fail1:
+    local_segment_free(segment);
+fail0:
+    pthread_mutex_unlock(&segments_lock);
+    return estat;
+}
+
+static EP_STAT
+local_store_close(capfs_log_t *log) {
+    local_segment_t *segment = (local_segment_t *) log;
+
+    pthread_mutex_lock(&segments_lock);
+    if (--segment->ref > 0) {
+        pthread_mutex_unlock(&segments_lock);
+        return EP_STAT_OK;
+    }
+    local_segment_t **prev = &segments[local_bucket(segment->gob)];
+    while (*prev != segment) {
+        prev = &(*prev)->next;
+    }
+    *prev = segment->next;
+    pthread_mutex_unlock(&segments_lock);
+
+    local_segment_free(segment);
+    return EP_STAT_OK;
+}
+
+static capfs_hash_t *
+local_hash_new(gdp_recno_t recno) {
+    local_hash_t *hash = malloc(sizeof(local_hash_t));
+    hash->recno = recno;
+    return (capfs_hash_t *) hash;
+}
+
+// Appends are serialized by the segment lock, so prevhash always names the
+//   record before; it is not checked
+static EP_STAT
+local_store_append(capfs_log_t *log, const struct iovec *iov, int iovcnt,
+                   capfs_hash_t *prevhash, capfs_hash_t **hash) {
+    (void) prevhash;
+    EP_STAT estat;
+    local_segment_t *segment = (local_segment_t *) log;
+
+    pthread_rwlock_wrlock(&segment->lock);
+    estat = local_segment_append(segment, iov, iovcnt);
+    EP_STAT_CHECK(estat, goto fail0);
+    gdp_recno_t recno = segment->count - 1;
+    pthread_rwlock_unlock(&segment->lock);
+
+    if (hash != NULL) {
+        *hash = local_hash_new(recno);
+    }
+    return EP_STAT_OK;
+
+fail0:
+    pthread_rwlock_unlock(&segment->lock);
+    return estat;
+}
+
+static EP_STAT
+local_store_read(capfs_log_t *log, gdp_recno_t recno,
+                 capfs_record_t **record) {
+    local_segment_t *segment = (local_segment_t *) log;
+
+    pthread_rwlock_rdlock(&segment->lock);
+    if (recno == -1) {
+        recno = segment->count - 1;
+    }
+    if (recno < 0 || (size_t) recno >= segment->count) {
+        pthread_rwlock_unlock(&segment->lock);
+        return EP_STAT_NOT_FOUND;
+    }
+    local_record_header_t *header =
+        (local_record_header_t *) (segment->map + segment->index[recno]);
+    local_record_t *local_record = malloc(sizeof(local_record_t));
+    local_record->segment = segment;
+    local_record->recno = recno;
+    local_record->offset = segment->index[recno]
+                           + sizeof(local_record_header_t);
+    local_record->length = header->length;
+    pthread_rwlock_unlock(&segment->lock);
+
+    *record = (capfs_record_t *) local_record;
+    return EP_STAT_OK;
+}
+
+static size_t
+local_store_record_length(capfs_record_t *record) {
+    return ((local_record_t *) record)->length;
+}
+
+static gdp_recno_t
+local_store_record_recno(capfs_record_t *record) {
+    return ((local_record_t *) record)->recno;
+}
+
+// Records never move within the file, but the mapping may while the segment
+//   grows, hence the lock
+static size_t
+local_store_record_copy(capfs_record_t *record, size_t offset, void *buf,
+                        size_t size) {
+    local_record_t *local_record = (local_record_t *) record;
+    if (offset >= local_record->length) {
+        return 0;
+    }
+    size_t copied = local_record->length - offset;
+    if (copied > size) {
+        copied = size;
+    }
+    local_segment_t *segment = local_record->segment;
+    pthread_rwlock_rdlock(&segment->lock);
+    memcpy(buf, segment->map + local_record->offset + offset, copied);
+    pthread_rwlock_unlock(&segment->lock);
+    return copied;
+}
+
+static capfs_hash_t *
+local_store_record_hash(capfs_record_t *record) {
+    return local_hash_new(((local_record_t *) record)->recno);
+}
+
+static void
+local_store_record_free(capfs_record_t *record) {
+    free(record);
+}
+
+static void
+local_store_hash_free(capfs_hash_t *hash) {
+    free(hash);
+}
+
+// Remaps the segment if it grew and indexes the records appended since.
+//   grew may be NULL
+static EP_STAT
+local_segment_refresh(local_segment_t *segment, bool *grew) {
+    EP_STAT estat = EP_STAT_OK;
+
+    pthread_rwlock_wrlock(&segment->lock);
+    size_t count = segment->count;
+    struct stat st;
+    if (fstat(segment->fd, &st) < 0) {
+        estat = ep_stat_from_errno(errno);
+    } else if ((size_t) st.st_size > segment->map_size) {
+        estat = local_segment_remap(segment, st.st_size);
+    }
+    if (EP_STAT_ISOK(estat)) {
+        local_segment_scan(segment);
+    }
+    if (grew != NULL) {
+        *grew = segment->count > count;
+    }
+    pthread_rwlock_unlock(&segment->lock);
+    return estat;
+}
+
+static EP_STAT
+local_store_refresh(void) {
+    EP_STAT estat = EP_STAT_OK;
+
+    pthread_mutex_lock(&segments_lock);
+    for (size_t i = 0; i < STORE_LOCAL_BUCKETS; i++) {
+        for (local_segment_t *segment = segments[i]; segment != NULL;
+             segment = segment->next) {
+            EP_STAT refreshed = local_segment_refresh(segment, NULL);
+            if (!EP_STAT_ISOK(refreshed)) {
+                estat = refreshed;
+            }
+        }
+    }
+    pthread_mutex_unlock(&segments_lock);
+    return estat;
+}
+
+// Segments have no way to signal an append, so watched ones are polled.
+//   Appends made here move the end the scan starts from, only those of
+//   other processes turn up as new records
+static void *
+local_watch_thread(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        usleep(STORE_LOCAL_WATCH_MS * 1000);
+        pthread_mutex_lock(&watches_lock);
+        for (local_watch_t *watch = watches; watch != NULL;
+             watch = watch->next) {
+            local_segment_t *segment = watch->segment;
+            bool grew;
+            if (!EP_STAT_ISOK(local_segment_refresh(segment, &grew))
+                || !grew) {
+                continue;
+            }
+            pthread_rwlock_rdlock(&segment->lock);
+            gdp_recno_t last = segment->count - 1;
+            pthread_rwlock_unlock(&segment->lock);
+            watch->notify(segment->gob, last, watch->arg);
+        }
+        pthread_mutex_unlock(&watches_lock);
+    }
+    return NULL;
+}
+
+static EP_STAT
+local_store_watch(const gdp_name_t gob, capfs_watch_t notify, void *arg) {
+    EP_STAT estat;
+
+    capfs_log_t *log;
+    estat = local_store_open(gob, &log);
+    EP_STAT_CHECK(estat, return estat);
+    local_watch_t *watch = calloc(sizeof(local_watch_t), 1);
+    watch->segment = (local_segment_t *) log;
+    watch->notify = notify;
+    watch->arg = arg;
+
+    pthread_mutex_lock(&watches_lock);
+    if (!watch_started) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, local_watch_thread, NULL) != 0) {
+            estat = ep_stat_from_errno(errno);
+            pthread_mutex_unlock(&watches_lock);
+            free(watch);
+            local_store_close(log);
+            return estat;
+        }
+        pthread_detach(thread);
+        watch_started = true;
+    }
+    watch->next = watches;
+    watches = watch;
+    pthread_mutex_unlock(&watches_lock);
+    return EP_STAT_OK;
+}
+
+static EP_STAT
+local_store_unwatch(const gdp_name_t gob) {
+    pthread_mutex_lock(&watches_lock);
+    local_watch_t **link = &watches;
+    while (*link != NULL && !GDP_NAME_SAME((*link)->segment->gob, gob)) {
+        link = &(*link)->next;
+    }
+    local_watch_t *watch = *link;
+    if (watch != NULL) {
+        *link = watch->next;
+    }
+    pthread_mutex_unlock(&watches_lock);
+    if (watch == NULL) {
+        return EP_STAT_NOT_FOUND;
+    }
+
+    local_store_close((capfs_log_t *) watch->segment);
+    free(watch);
+    return EP_STAT_OK;
+}
+
+const capfs_store_t capfs_store_local = {
+    .name = "local",
+    .init = local_store_init,
+    .create = local_store_create,
+    .lookup = local_store_lookup,
+    .remove = local_store_remove,
+    .open = local_store_open,
+    .close = local_store_close,
+    .append = local_store_append,
+    .read = local_store_read,
+    .record_length = local_store_record_length,
+    .record_recno = local_store_record_recno,
+    .record_copy = local_store_record_copy,
+    .record_hash = local_store_record_hash,
+    .record_free = local_store_record_free,
+    .hash_free = local_store_hash_free,
+    .refresh = local_store_refresh,
+    .watch = local_store_watch,
+    .unwatch = local_store_unwatch,
+};
@@ -0,0 +1,328 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "capfs_store.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Puts another backend behind a pretend wide area network. Every call that
+//   would be a round trip to a log server (create, lookup, remove, open,
+//   append, read) waits for a round trip drawn from a log-normal around the
+//   profile's median, sometimes plus a stall, plus the time its payload
+//   takes to cross a link of the profile's bandwidth. The link is shared:
+//   appends queue on one for uploads, reads on one for downloads, so
+//   pipelined calls still only get the bandwidth there is. What the backend
+//   itself takes is hidden in the wait, not added to it.
+//
+// Delays come from one seeded stream, numbered by call. The same calls in
+//   the same order see the same delays; with several threads the stream is
+//   the same but who gets which delay depends on arrival order
+typedef struct shape_profile {
+    const char *name;
+    double rtt_ms;      // Median round trip
+    double jitter;      // Sigma of the log-normal around the median
+    double mbit;        // Bandwidth each way, 0 for unlimited
+    double spike_pct;   // Chance a call stalls
+    double spike_ms;    // A stall takes between this and twice this
+    double create_ms;   // Extra for creating a log, GDP takes seconds
+} shape_profile_t;
+
+static const shape_profile_t shape_profiles[] = {
+    { "none", 0, 0, 0, 0, 0, 0 },
+    { "lan", 0.5, 0.2, 1000, 0, 0, 5 },
+    { "wan50", 50, 0.1, 100, 0.5, 250, 1000 },
+    { "wan100", 100, 0.15, 50, 1, 500, 1500 },
+    { "wan200", 200, 0.2, 20, 2, 1000, 2000 },
+};
+
+typedef struct shape_link {
+    pthread_mutex_t lock;
+    uint64_t free_at;   // When the last queued transfer is through, in ns
+} shape_link_t;
+
+static const capfs_store_t *inner;
+static shape_profile_t profile;
+static uint64_t seed;
+static uint64_t calls;
+static shape_link_t uplink = { PTHREAD_MUTEX_INITIALIZER, 0 };
+static shape_link_t downlink = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static uint64_t
+shape_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+shape_sleep_until(uint64_t deadline) {
+    struct timespec until = {
+        .tv_sec = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL)
+           == EINTR) {
+    }
+}
+
+// splitmix64, good enough to draw a few numbers per call from
+static uint64_t
+shape_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// In (0, 1), so the log below is finite
+static double
+shape_uniform(uint64_t *state) {
+    return ((shape_next(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+// Nanoseconds this call spends on the wire, extra_ms on top of a round trip
+static uint64_t
+shape_latency(double extra_ms) {
+    uint64_t state = seed ^ (__atomic_fetch_add(&calls, 1, __ATOMIC_RELAXED)
+                             * 0xd1b54a32d192ed03ULL);
+    double ms = profile.rtt_ms;
+    if (profile.jitter > 0) {
+        // Box-Muller, one normal is all we need
+        double u1 = shape_uniform(&state);
+        double u2 = shape_uniform(&state);
+        ms *= exp(profile.jitter * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2));
+    }
+    if (profile.spike_pct > 0
+        && shape_uniform(&state) * 100 < profile.spike_pct) {
+        ms += profile.spike_ms * (1 + shape_uniform(&state));
+    }
+    return (uint64_t) ((ms + extra_ms) * 1000000);
+}
+
+// Queues size bytes on the link, returns when the last of them is through
+static uint64_t
+shape_transfer(shape_link_t *link, uint64_t start, size_t size) {
+    if (profile.mbit <= 0 || size == 0) {
+        return start;
+    }
+    uint64_t transfer = (uint64_t) (size * 8 * 1000 / profile.mbit);
+    pthread_mutex_lock(&link->lock);
+    uint64_t done = (link->free_at > start ? link->free_at : start)
+                    + transfer;
+    link->free_at = done;
+    pthread_mutex_unlock(&link->lock);
+    return done;
+}
+
+EP_STAT
+capfs_store_shaped_wrap(const capfs_store_t *store, const char *name,
+                        uint64_t shape_seed) {
+    shape_profile_t parsed = { .name = name };
+    const shape_profile_t *found = NULL;
+    for (size_t i = 0; i < sizeof(shape_profiles) / sizeof(shape_profiles[0]);
+         i++) {
+        if (strcmp(shape_profiles[i].name, name) == 0) {
+            found = &shape_profiles[i];
+            break;
+        }
+    }
+    if (found == NULL) {
+        // RTT:JITTER:MBIT:SPIKE_PCT:SPIKE_MS[:CREATE_MS], e.g. 80:0.1:40:1:400
+        if (sscanf(name, "%lf:%lf:%lf:%lf:%lf:%lf", &parsed.rtt_ms,
+                   &parsed.jitter, &parsed.mbit, &parsed.spike_pct,
+                   &parsed.spike_ms, &parsed.create_ms) < 5
+            || parsed.rtt_ms < 0 || parsed.jitter < 0 || parsed.mbit < 0
+            || parsed.spike_ms < 0 || parsed.create_ms < 0) {
+            return EP_STAT_INVALID_ARG;
+        }
+        found = &parsed;
+    }
+    profile = *found;
+    inner = store;
+    seed = shape_seed;
+    calls = 0;
+    return EP_STAT_OK;
+}
+
+static EP_STAT
+shaped_store_init(const char *path) {
+    return inner->init(path);
+}
+
+static EP_STAT
+shaped_store_create(const char *human_name, gdp_name_t gob) {
+    uint64_t deadline = shape_now() + shape_latency(profile.create_ms);
+    EP_STAT estat = inner->create(human_name, gob);
+    shape_sleep_until(deadline);
+    return estat;
+}
+
+static EP_STAT
+shaped_store_lookup(const char *human_name, gdp_name_t gob) {
+    uint64_t deadline = shape_now() + shape_latency(0);
+    EP_STAT estat = inner->lookup(human_name, gob);
+    shape_sleep_until(deadline);
+    return estat;
+}
+
+static EP_STAT
+shaped_store_remove(const gdp_name_t gob) {
+    uint64_t deadline = shape_now() + shape_latency(0);
+    EP_STAT estat = inner->remove(gob);
+    shape_sleep_until(deadline);
+    return estat;
+}
+
+static EP_STAT
+shaped_store_open(const gdp_name_t gob, capfs_log_t **log) {
+    uint64_t deadline = shape_now() + shape_latency(0);
+    EP_STAT estat = inner->open(gob, log);
+    shape_sleep_until(deadline);
+    return estat;
+}
+
+// Closing only forgets the log here, GDP does not wait for an answer either
+static EP_STAT
+shaped_store_close(capfs_log_t *log) {
+    return inner->close(log);
+}
+
+static EP_STAT
+shaped_store_append(capfs_log_t *log, const struct iovec *iov, int iovcnt,
+                    capfs_hash_t *prevhash, capfs_hash_t **hash) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    // The record has to be through before the server can answer
+    uint64_t deadline = shape_transfer(&uplink, shape_now(), size)
+                        + shape_latency(0);
+    EP_STAT estat = inner->append(log, iov, iovcnt, prevhash, hash);
+    shape_sleep_until(deadline);
+    return estat;
+}
+
+static EP_STAT
+shaped_store_read(capfs_log_t *log, gdp_recno_t recno,
+                  capfs_record_t **record) {
+    uint64_t start = shape_now();
+    uint64_t latency = shape_latency(0);
+    EP_STAT estat = inner->read(log, recno, record);
+    uint64_t deadline = start + latency;
+    // Only now is the size known. The answer queues once the request is in
+    if (EP_STAT_ISOK(estat)) {
+        deadline = shape_transfer(&downlink, start + latency / 2,
+                                  inner->record_length(*record))
+                   + (latency - latency / 2);
+    }
+    shape_sleep_until(deadline);
+    return estat;
+}
+
+static size_t
+shaped_store_record_length(capfs_record_t *record) {
+    return inner->record_length(record);
+}
+
+static gdp_recno_t
+shaped_store_record_recno(capfs_record_t *record) {
+    return inner->record_recno(record);
+}
+
+static size_t
+shaped_store_record_copy(capfs_record_t *record, size_t offset, void *buf,
+                         size_t size) {
+    return inner->record_copy(record, offset, buf, size);
+}
+
+static capfs_hash_t *
+shaped_store_record_hash(capfs_record_t *record) {
+    return inner->record_hash(record);
+}
+
+static void
+shaped_store_record_free(capfs_record_t *record) {
+    inner->record_free(record);
+}
+
+static void
+shaped_store_hash_free(capfs_hash_t *hash) {
+    inner->hash_free(hash);
+}
+
+// Local to the node, nothing to delay
+static EP_STAT
+shaped_store_refresh(void) {
+    return inner->refresh != NULL ? inner->refresh() : EP_STAT_OK;
+}
+
+// Subscribing is a round trip. Notifications are not delayed, the polling
+//   or the GDP's own delivery already makes them late
+static EP_STAT
+shaped_store_watch(const gdp_name_t gob, capfs_watch_t notify, void *arg) {
+    if (inner->watch == NULL) {
+        return EP_STAT_OK;
+    }
+    uint64_t deadline = shape_now() + shape_latency(0);
+    EP_STAT estat = inner->watch(gob, notify, arg);
+    shape_sleep_until(deadline);
+    return estat;
+}
+
+static EP_STAT
+shaped_store_unwatch(const gdp_name_t gob) {
+    return inner->unwatch != NULL ? inner->unwatch(gob) : EP_STAT_OK;
+}
+
+const capfs_store_t capfs_store_shaped = {
+    .name = "shaped",
+    .init = shaped_store_init,
+    .create = shaped_store_create,
+    .lookup = shaped_store_lookup,
+    .remove = shaped_store_remove,
+    .open = shaped_store_open,
+    .close = shaped_store_close,
+    .append = shaped_store_append,
+    .read = shaped_store_read,
+    .record_length = shaped_store_record_length,
+    .record_recno = shaped_store_record_recno,
+    .record_copy = shaped_store_record_copy,
+    .record_hash = shaped_store_record_hash,
+    .record_free = shaped_store_record_free,
+    .hash_free = shaped_store_hash_free,
+    .refresh = shaped_store_refresh,
+    .watch = shaped_store_watch,
+    .unwatch = shaped_store_unwatch,
+};
@@ -29,120 +29,383 @@
 
 #include "capfs_util.h"
 
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <ep/ep_app.h>
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+
+#include <fuse_common.h>
 
 #include "capfs_file.h"
 
-static fh_entry_t fh_list[64];
+// Handles live in chunks that are allocated on demand and never move, so
+//   fh_get can index them without a lock. fh_lock covers allocation, the
+//   free list and the gob buckets. ref is atomic so that taking and dropping
+//   references on a known entry does not contend
+static fh_entry_t *fh_chunks[FH_MAX_CHUNKS];
+static size_t fh_num_chunks;
+static uint32_t fh_free_head;
+static uint32_t fh_gob_buckets[FH_GOB_BUCKETS];
+static pthread_mutex_t fh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static fh_entry_t *
+fh_entry(uint32_t index) {
+    return fh_chunks[index / FH_CHUNK_SIZE] + index % FH_CHUNK_SIZE;
+}
+
+static size_t
+fh_gob_bucket(const gdp_name_t gob) {
+    uint32_t hash;
+    memcpy(&hash, gob, sizeof(uint32_t));
+    return hash % FH_GOB_BUCKETS;
+}
 
 void
 fh_init(void) {
-    memset(fh_list, 0, sizeof(fh_entry_t) * 64);
-    for (size_t i = 0; i < 64; i++) {
-        fh_list[i].fh = i;
+    pthread_mutex_lock(&fh_lock);
+    fh_free_head = FH_NONE;
+    for (size_t i = 0; i < FH_GOB_BUCKETS; i++) {
+        fh_gob_buckets[i] = FH_NONE;
     }
+    pthread_mutex_unlock(&fh_lock);
 }
 
-static uint64_t
-fh_next(void) {
-    for (size_t i = 0; i < 64; ++i) {
-        if (!fh_list[i].valid) {
-            return i;
-        }
+// Adds a chunk and puts all of it on the free list. Caller holds fh_lock
+static EP_STAT
+fh_grow(void) {
+    if (fh_num_chunks == FH_MAX_CHUNKS) {
+        return EP_STAT_OUT_OF_MEMORY;
     }
-    return -1;
+    fh_entry_t *chunk = calloc(sizeof(fh_entry_t), FH_CHUNK_SIZE);
+    if (chunk == NULL) {
+        return EP_STAT_OUT_OF_MEMORY;
+    }
+    uint32_t base = fh_num_chunks * FH_CHUNK_SIZE;
+    for (uint32_t i = 0; i < FH_CHUNK_SIZE; i++) {
+        // Generations start at 1 so that an unset fi->fh (0) is never valid
+        chunk[i].fh = FH_MAKE(1, base + i);
+        chunk[i].next = i + 1 < FH_CHUNK_SIZE ? base + i + 1 : fh_free_head;
+    }
+    fh_free_head = base;
+    __atomic_store_n(&fh_chunks[fh_num_chunks], chunk, __ATOMIC_RELEASE);
+    fh_num_chunks++;
+    return EP_STAT_OK;
 }
 
 EP_STAT
-fh_new(fh_entry_t **fh) {
-    uint64_t index = fh_next();
-    if (index == -1) {
-        return EP_STAT_OUT_OF_MEMORY;
+fh_new(const gdp_name_t gob, fh_entry_t **fh) {
+    EP_STAT estat;
+    pthread_mutex_lock(&fh_lock);
+
+    if (fh_free_head == FH_NONE) {
+        estat = fh_grow();
+        EP_STAT_CHECK(estat, goto fail0);
     }
-    fh_list[index].valid = true;
-    fh_list[index].ref = 0;
-    *fh = fh_list + index;
+    uint32_t index = fh_free_head;
+    fh_entry_t *entry = fh_entry(index);
+    fh_free_head = entry->next;
+
+    memcpy(entry->gob, gob, sizeof(gdp_name_t));
+    entry->modified = false;
+    entry->ref = 0;
+    size_t bucket = fh_gob_bucket(gob);
+    entry->next = fh_gob_buckets[bucket];
+    fh_gob_buckets[bucket] = index;
+    __atomic_store_n(&entry->valid, true, __ATOMIC_RELEASE);
+    *fh = entry;
+
+    pthread_mutex_unlock(&fh_lock);
     return EP_STAT_OK;
+
+fail0:
+    pthread_mutex_unlock(&fh_lock);
+    return estat;
 }
 
+// Lock-free. A handle from before the slot was last freed carries an older
+//   generation and is refused
 EP_STAT
 fh_get(uint64_t fh, fh_entry_t **fh_ent) {
-    if (!fh_list[fh].valid) {
+    uint32_t index = FH_INDEX(fh);
+    fh_entry_t *chunk = index / FH_CHUNK_SIZE < FH_MAX_CHUNKS
+        ? __atomic_load_n(&fh_chunks[index / FH_CHUNK_SIZE], __ATOMIC_ACQUIRE)
+        : NULL;
+    if (chunk == NULL) {
         return EP_STAT_INVALID_ARG;
     }
-    *fh_ent = fh_list + fh;
+    fh_entry_t *entry = chunk + index % FH_CHUNK_SIZE;
+    if (!__atomic_load_n(&entry->valid, __ATOMIC_ACQUIRE)
+        || __atomic_load_n(&entry->fh, __ATOMIC_ACQUIRE) != fh) {
+        return EP_STAT_INVALID_ARG;
+    }
+    *fh_ent = entry;
     return EP_STAT_OK;
 }
 
+// Caller holds fh_lock
+static fh_entry_t *
+fh_find_by_gob(const gdp_name_t gob) {
+    uint32_t index = fh_gob_buckets[fh_gob_bucket(gob)];
+    while (index != FH_NONE) {
+        fh_entry_t *entry = fh_entry(index);
+        if (GDP_NAME_SAME(entry->gob, gob)) {
+            return entry;
+        }
+        index = entry->next;
+    }
+    return NULL;
+}
+
 EP_STAT
 fh_get_by_gob(gdp_name_t gob, fh_entry_t **fh_ent) {
-    for (size_t i = 0; i < 64; ++i) {
-        if (fh_list[i].valid) {
-            if (fh_list[i].is_dir) {
-                if (GDP_NAME_SAME(fh_list[i].dir->file->gob, gob)) {
-                    *fh_ent = fh_list + i;
-                    return EP_STAT_OK;
-                }
-            } else {
-                if (GDP_NAME_SAME(fh_list[i].file->gob, gob)) {
-                    *fh_ent = fh_list + i;
-                    return EP_STAT_OK;
-                }
-            }
-        }
+    pthread_mutex_lock(&fh_lock);
+    *fh_ent = fh_find_by_gob(gob);
+    pthread_mutex_unlock(&fh_lock);
+    return *fh_ent == NULL ? EP_STAT_NOT_FOUND : EP_STAT_OK;
+}
+
+// Like fh_get_by_gob, but also takes a reference. Fails if the last
+//   reference is being dropped, so the caller never revives a closing entry
+EP_STAT
+fh_ref_by_gob(gdp_name_t gob, fh_entry_t **fh_ent) {
+    pthread_mutex_lock(&fh_lock);
+    fh_entry_t *fh = fh_find_by_gob(gob);
+    uint32_t ref = fh == NULL ? 0 : __atomic_load_n(&fh->ref, __ATOMIC_ACQUIRE);
+    while (ref > 0 && !__atomic_compare_exchange_n(&fh->ref, &ref, ref + 1,
+                                                   false, __ATOMIC_ACQ_REL,
+                                                   __ATOMIC_ACQUIRE)) {
+    }
+    pthread_mutex_unlock(&fh_lock);
+    if (ref == 0) {
+        return EP_STAT_NOT_FOUND;
     }
-    return EP_STAT_NOT_FOUND;
+    *fh_ent = fh;
+    return EP_STAT_OK;
+}
+
+void
+fh_ref(fh_entry_t *fh) {
+    __atomic_add_fetch(&fh->ref, 1, __ATOMIC_ACQ_REL);
+}
+
+// Returns the references left, the caller frees the entry at 0
+uint32_t
+fh_unref(fh_entry_t *fh) {
+    return __atomic_sub_fetch(&fh->ref, 1, __ATOMIC_ACQ_REL);
 }
 
 void
 fh_free(uint64_t fh) {
-    fh_list[fh].valid = false;
-}
-
-// Returns the number of tokens. Path should be defined
-// Assumes path begins with a /
-size_t
-split_path(const char *path, char ***tokens) {
-    if (path == NULL || path[0] != '/') {
-        ep_app_error("Does not support NULL path or relative paths. Path: %s",
-                     path);
-    }
-    *tokens = calloc(sizeof(char *), 32);
-
-    char c;
-    size_t prev_index = 0;
-    size_t index = 1;
-    size_t tokens_index = 0;
-    while ((c = path[index]) != '\0' && tokens_index < 32) {
-        if (c == '/' || path[index + 1] == '\0') {
-            *tokens[tokens_index] = calloc(sizeof(char), FILE_NAME_MAX_LEN + 1);
-            size_t length = index - prev_index - 1;
-            strncpy(*tokens[tokens_index], path + prev_index,
-                   length < FILE_NAME_MAX_LEN + 1 ? length : FILE_NAME_MAX_LEN);
-            tokens_index++;
-            prev_index = index;
-        }
-        index++;
+    fh_entry_t *entry;
+    if (!EP_STAT_ISOK(fh_get(fh, &entry))) {
+        return;
+    }
+    pthread_mutex_lock(&fh_lock);
+
+    // Unlink from the gob bucket
+    uint32_t index = FH_INDEX(fh);
+    uint32_t *link = &fh_gob_buckets[fh_gob_bucket(entry->gob)];
+    while (*link != index) {
+        link = &fh_entry(*link)->next;
     }
+    *link = entry->next;
 
-    return tokens_index;
+    // Retire the handle, then recycle the slot
+    __atomic_store_n(&entry->valid, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->fh, FH_MAKE(FH_GENERATION(fh) + 1, index),
+                     __ATOMIC_RELEASE);
+    entry->next = fh_free_head;
+    fh_free_head = index;
+
+    pthread_mutex_unlock(&fh_lock);
+}
+
+typedef struct attr_cache_entry {
+    char *path;
+    struct stat st;
+    time_t expires;
+} attr_cache_entry_t;
+
+// Direct mapped by path hash, a colliding put evicts the older path
+static attr_cache_entry_t attr_cache[ATTR_CACHE_SIZE];
+static pthread_mutex_t attr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+attr_cache_slot(const char *path) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash % ATTR_CACHE_SIZE;
 }
 
 void
-free_tokens(char **tokens) {
-    if (tokens == NULL) {
-        return;
+attr_cache_put(const char *path, const struct stat *st) {
+    attr_cache_entry_t *entry = attr_cache + attr_cache_slot(path);
+    pthread_mutex_lock(&attr_cache_lock);
+    if (entry->path == NULL || strcmp(entry->path, path) != 0) {
+        free(entry->path);
+        entry->path = strdup(path);
     }
-    for (int i = 0; i < 32; ++i) {
-        if (tokens[i] == NULL) {
-            break;
-        }
-        free(tokens[i]);
+    entry->st = *st;
+    entry->expires = time(NULL) + ATTR_CACHE_TIMEOUT;
+    pthread_mutex_unlock(&attr_cache_lock);
+}
+
+bool
+attr_cache_get(const char *path, struct stat *st) {
+    attr_cache_entry_t *entry = attr_cache + attr_cache_slot(path);
+    pthread_mutex_lock(&attr_cache_lock);
+    bool hit = entry->path != NULL && strcmp(entry->path, path) == 0
+               && time(NULL) < entry->expires;
+    if (hit) {
+        *st = entry->st;
+    }
+    pthread_mutex_unlock(&attr_cache_lock);
+    return hit;
+}
+
+void
+attr_cache_invalidate(const char *path) {
+    attr_cache_entry_t *entry = attr_cache + attr_cache_slot(path);
+    pthread_mutex_lock(&attr_cache_lock);
+    if (entry->path != NULL && strcmp(entry->path, path) == 0) {
+        free(entry->path);
+        entry->path = NULL;
+    }
+    pthread_mutex_unlock(&attr_cache_lock);
+}
+
+// For renames and removals, where a whole subtree may go stale
+void
+attr_cache_clear(void) {
+    pthread_mutex_lock(&attr_cache_lock);
+    for (size_t i = 0; i < ATTR_CACHE_SIZE; i++) {
+        free(attr_cache[i].path);
+        attr_cache[i].path = NULL;
+    }
+    pthread_mutex_unlock(&attr_cache_lock);
+}
+
+typedef struct page_recno_entry {
+    gdp_name_t gob;
+    unsigned int recno;     // 0 for an empty slot
+} page_recno_entry_t;
+
+// Direct mapped by gob, a colliding put evicts the other file, whose next
+//   open then drops its pages
+static page_recno_entry_t page_recnos[PAGE_RECNO_SIZE];
+static pthread_mutex_t page_recno_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static page_recno_entry_t *
+page_recno_slot(const gdp_name_t gob) {
+    uint64_t hash;
+    memcpy(&hash, gob, sizeof(uint64_t));
+    return page_recnos + hash % PAGE_RECNO_SIZE;
+}
+
+void
+page_recno_put(const gdp_name_t gob, unsigned int recno) {
+    page_recno_entry_t *entry = page_recno_slot(gob);
+    pthread_mutex_lock(&page_recno_lock);
+    memcpy(entry->gob, gob, sizeof(gdp_name_t));
+    entry->recno = recno;
+    pthread_mutex_unlock(&page_recno_lock);
+}
+
+bool
+page_recno_get(const gdp_name_t gob, unsigned int *recno) {
+    page_recno_entry_t *entry = page_recno_slot(gob);
+    pthread_mutex_lock(&page_recno_lock);
+    bool hit = entry->recno != 0
+               && memcmp(entry->gob, gob, sizeof(gdp_name_t)) == 0;
+    if (hit) {
+        *recno = entry->recno;
+    }
+    pthread_mutex_unlock(&page_recno_lock);
+    return hit;
+}
+
+// Gobs are hashes, so their leading bytes make a stable inode number
+ino_t
+capfs_ino(const gdp_name_t gob) {
+    ino_t ino;
+    memcpy(&ino, gob, sizeof(ino_t));
+    // 0 and 1 mean "no inode" and "bad blocks" to some tools
+    return ino > 1 ? ino : ino + 2;
+}
+
+// Builds a stat from the attribute hints of a directory entry
+void
+capfs_entry_stat(capfs_dir_entry_t *entry, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = capfs_ino(entry->gob);
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    // Subdirectories are not counted, and a directory nlink of 1 tells find
+    //   and friends not to guess from it
+    st->st_nlink = 1;
+    mode_t perms = entry->mode & 07777;
+    if (entry->is_dir) {
+        st->st_mode = S_IFDIR | (entry->mode != 0 ? perms : 0755);
+    } else {
+        st->st_mode = S_IFREG | (entry->mode != 0 ? perms : 0777);
+        st->st_size = entry->size;
+        st->st_blocks = (entry->size + 511) / 512;
+    }
+    st->st_blksize = BLOCK_SIZE;
+    st->st_atime = entry->mtime;
+    st->st_mtime = entry->mtime;
+    st->st_ctime = entry->mtime;
+}
+
+// Steps *cursor past the next component of a path and points token at it.
+//   Repeated and trailing slashes are skipped. Returns false once the path
+//   is used up. Nothing is allocated or copied
+bool
+path_next(const char **cursor, path_token_t *token) {
+    const char *c = *cursor;
+    while (*c == '/') {
+        c++;
+    }
+    if (*c == '\0') {
+        *cursor = c;
+        return false;
+    }
+    token->name = c;
+    while (*c != '/' && *c != '\0') {
+        c++;
+    }
+    token->length = c - token->name;
+    *cursor = c;
+    return true;
+}
+
+// The last component of path, which ends the string so it is terminated.
+//   Empty for the root (or a trailing slash)
+const char *
+path_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
+}
+
+void
+path_child(const char *path, const char *name, char child[PATH_MAX]) {
+    size_t length = strlen(path);
+    if (length > 0 && path[length - 1] == '/') {
+        snprintf(child, PATH_MAX, "%s%s", path, name);
+    } else {
+        snprintf(child, PATH_MAX, "%s/%s", path, name);
     }
-    free(tokens);
 }
 
 void
@@ -150,3 +413,67 @@ get_human_name(const char *path, char human_name[256]) {
     strcpy(human_name, FILE_PREFIX);
     strcat(human_name, path);
 }
+
+void
+capfs_statvfs(struct statvfs *st) {
+    capfs_file_usage_t usage;
+    capfs_file_usage(&usage);
+
+    // Every log also holds a block in its first record, pooled ones included
+    fsblkcnt_t blocks = CAPFS_CAPACITY / BLOCK_SIZE;
+    fsblkcnt_t used = (usage.bytes + BLOCK_SIZE - 1) / BLOCK_SIZE
+                      + usage.files + usage.pool;
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = blocks;
+    st->f_bfree = used < blocks ? blocks - used : 0;
+    st->f_bavail = st->f_bfree;
+    st->f_files = CAPFS_MAX_FILES;
+    st->f_ffree = usage.files < CAPFS_MAX_FILES
+                  ? CAPFS_MAX_FILES - usage.files : 0;
+    st->f_favail = st->f_ffree;
+    st->f_namemax = FILE_NAME_MAX_LEN;
+}
+
+void
+capfs_conn_init(struct fuse_conn_info *conn, const capfs_options_t *options) {
+    // Large requests are what fill a block per append instead of a few bytes
+    conn->want |= FUSE_CAP_BIG_WRITES;
+    conn->max_write = CAPFS_MAX_IO;
+    conn->max_readahead = CAPFS_MAX_IO;
+    // Write data may arrive in a pipe and replies may leave through one. Not
+    //   SPLICE_MOVE: replies point into shared cached blocks
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    // The kernel gathers small writes into whole pages before sending them
+    if (options->writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+#else
+    (void) options;
+#endif
+}
+
+// Copies the next size bytes of a FUSE buffer, which advances past them
+static size_t
+capfs_fill_bufvec(void *arg, char *dst, size_t size) {
+    struct fuse_bufvec *src = arg;
+    struct fuse_bufvec dst_vec = FUSE_BUFVEC_INIT(size);
+    dst_vec.buf[0].mem = dst;
+    ssize_t copied = fuse_buf_copy(&dst_vec, src, 0);
+    return copied < 0 ? 0 : copied;
+}
+
+EP_STAT
+capfs_write_bufvec(capfs_file_t *file, struct fuse_bufvec *bufv,
+                   off_t offset) {
+    size_t size = fuse_buf_size(bufv);
+
+    // Plain memory is appended from where it is
+    if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+        return capfs_file_write_buffered(file, bufv->buf[0].mem, size, offset);
+    }
+    // A pipe is read straight into the gathered writes
+    return capfs_file_write_fill(file, size, offset, capfs_fill_bufvec, bufv);
+}
@@ -35,17 +35,42 @@
        __typeof__ (b) _b = (b); \
      _a < _b ? _a : _b; })
 
+#define max(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a > _b ? _a : _b; })
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
 #include <ep/ep.h>
 #include <gdp/gdp.h>
 
+#include "capfs.h"
 #include "capfs_dir.h"
 #include "capfs_file.h"
 
+// Handles are allocated in chunks of FH_CHUNK_SIZE, up to FH_MAX_CHUNKS
+#define FH_CHUNK_SIZE 1024
+#define FH_MAX_CHUNKS 1024
+// Buckets in the gob -> handle map
+#define FH_GOB_BUCKETS 4096
+#define FH_NONE UINT32_MAX
+// A handle is the slot index in the low 32 bits and the slot's generation in
+//   the high 32 bits, bumped every time the slot is freed
+#define FH_MAKE(generation, index) (((uint64_t) (generation) << 32) | (index))
+#define FH_INDEX(fh) ((uint32_t) (fh))
+#define FH_GENERATION(fh) ((uint32_t) ((fh) >> 32))
+
 typedef struct fh_entry {
     uint64_t fh;
     bool valid;
     bool is_dir;
-    uint16_t ref;
+    bool modified;
+    uint32_t ref;           // Atomic, see fh_ref
+    uint32_t next;          // Free list or gob bucket chain
+    gdp_name_t gob;
     union {
         capfs_dir_t *dir;
         capfs_file_t *file;
@@ -53,14 +78,58 @@ typedef struct fh_entry {
 } fh_entry_t;
 
 void fh_init(void);
-EP_STAT fh_new(fh_entry_t **fh);
+EP_STAT fh_new(const gdp_name_t gob, fh_entry_t **fh);
 EP_STAT fh_get(uint64_t fh, fh_entry_t **fh_ent);
 EP_STAT fh_get_by_gob(gdp_name_t gob, fh_entry_t **fh_ent);
+EP_STAT fh_ref_by_gob(gdp_name_t gob, fh_entry_t **fh_ent);
+void fh_ref(fh_entry_t *fh);
+uint32_t fh_unref(fh_entry_t *fh);
 void fh_free(uint64_t fh);
 
-size_t split_path(const char *path, char ***tokens);
-void free_tokens(char **tokens);
+// Number of cached paths
+#define ATTR_CACHE_SIZE 4096
+// Seconds a cached stat stays valid
+#define ATTR_CACHE_TIMEOUT 1
+
+void attr_cache_put(const char *path, const struct stat *st);
+bool attr_cache_get(const char *path, struct stat *st);
+void attr_cache_invalidate(const char *path);
+void attr_cache_clear(void);
+
+// Number of files whose cached pages are remembered
+#define PAGE_RECNO_SIZE 4096
+
+// The recno of a file's log that the kernel's cached pages were read at, so
+//   an open can tell whether they are still good (keep_cache)
+void page_recno_put(const gdp_name_t gob, unsigned int recno);
+bool page_recno_get(const gdp_name_t gob, unsigned int *recno);
+
+ino_t capfs_ino(const gdp_name_t gob);
+void capfs_entry_stat(capfs_dir_entry_t *entry, struct stat *st);
+
+// A path component. name points into the path and is not terminated
+typedef struct path_token {
+    const char *name;
+    size_t length;
+} path_token_t;
+
+bool path_next(const char **cursor, path_token_t *token);
+const char *path_basename(const char *path);
+void path_child(const char *path, const char *name, char child[PATH_MAX]);
 
 void get_human_name(const char *path, char human_name[256]);
 
+struct fuse_conn_info;
+struct fuse_bufvec;
+struct statvfs;
+
+// Negotiates what both frontends want from the kernel
+void capfs_conn_init(struct fuse_conn_info *conn,
+                     const capfs_options_t *options);
+// Fills in statfs from the usage counters, without going to GDP
+void capfs_statvfs(struct statvfs *st);
+// Writes a FUSE buffer (memory or a spliced pipe) through the gathered writes
+EP_STAT capfs_write_bufvec(capfs_file_t *file, struct fuse_bufvec *bufv,
+                           off_t offset);
+
 #endif // _CAPFS_UTIL_H_
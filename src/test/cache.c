@@ -0,0 +1,153 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "capfs.h"
+#include "capfs_cache.h"
+#include "capfs_dir.h"
+#include "capfs_file.h"
+#include "capfs_store.h"
+
+#define TEST_PATH "/tmp/capfs_test_cache"
+#define TEST_CACHE TEST_PATH "/cache"
+#define TEST_BLOCKS 8
+#define TEST_FILES 20
+
+static bool
+count_entry(void *arg, capfs_dir_entry_t *entry, off_t next) {
+    size_t *length = arg;
+    (*length)++;
+    return true;
+}
+
+// One mount with a cache of size_mb: lists /d and reads /d/f0, after making
+//   them if make
+static void
+mount_once(bool make, size_t size_mb, capfs_cache_stats_t *stats) {
+    OK(capfs_store_select("local", TEST_PATH "/store"));
+    OK(capfs_cache_open(TEST_CACHE, size_mb));
+    // Nobody else may use it meanwhile
+    NOTOK(capfs_cache_open(TEST_CACHE, size_mb));
+    init();
+
+    static char buf[TEST_BLOCKS * BLOCK_SIZE];
+    capfs_dir_t *root;
+    capfs_dir_t *dir;
+    capfs_file_t *file;
+    OK(capfs_dir_open_root(&root));
+    if (make) {
+        OK(capfs_dir_mkdir(root, "d", 0, &dir));
+        for (int i = 0; i < TEST_FILES; i++) {
+            char name[16];
+            sprintf(name, "f%d", i);
+            OK(capfs_dir_make_file(dir, name, 0, &file));
+            if (i == 0) {
+                for (size_t j = 0; j < sizeof(buf); j++) {
+                    buf[j] = j * 7;
+                }
+                OK(capfs_file_write(file, buf, sizeof(buf), 0));
+            }
+            OK(capfs_file_close(file));
+            capfs_file_free(file);
+        }
+        OK(capfs_dir_flush_all());
+    } else {
+        OK(capfs_dir_opendir(root, "d", &dir));
+    }
+
+    size_t length = 0;
+    off_t cursor = 0;
+    OK(capfs_dir_readdir(dir, &cursor, count_entry, &length));
+    assert(length == TEST_FILES + 2);
+    OK(capfs_dir_open_file(dir, "f0", &file));
+    memset(buf, 0, sizeof(buf));
+    OK(capfs_file_read(file, buf, sizeof(buf), 0));
+    for (size_t j = 0; j < sizeof(buf); j++) {
+        assert(buf[j] == (char) (j * 7));
+    }
+    capfs_file_close(file);
+    capfs_file_free(file);
+    capfs_cache_stats(stats);
+    capfs_cache_close();
+}
+
+// Each mount is a process of its own, nothing in memory carries over
+static void
+mount_child(bool make, size_t size_mb, capfs_cache_stats_t *stats) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    pid_t pid = fork();
+    if (pid == 0) {
+        mount_once(make, size_mb, stats);
+        assert(write(fds[1], stats, sizeof(*stats)) == sizeof(*stats));
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(read(fds[0], stats, sizeof(*stats)) == sizeof(*stats));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// A second mount finds the blocks and the directory table the first one
+//   read, a cache of another size starts over
+int main(int argc, char *argv[]) {
+    system("rm -rf " TEST_PATH);
+    assert(mkdir(TEST_PATH, 0700) == 0);
+
+    capfs_cache_stats_t stats;
+    mount_child(true, 16, &stats);
+    printf("Cold: %lu hits, %lu misses, %zu of %zu slots\n",
+           (unsigned long) stats.hits, (unsigned long) stats.misses,
+           stats.used, stats.slots);
+    assert(stats.used >= TEST_BLOCKS);
+
+    bench_start();
+    mount_child(false, 16, &stats);
+    bench_end();
+    printf("Warm: %lu hits, %lu misses\n", (unsigned long) stats.hits,
+           (unsigned long) stats.misses);
+    assert(stats.hits >= TEST_BLOCKS + 1);
+
+    mount_child(false, 32, &stats);
+    printf("Resized: %lu hits, %lu misses\n", (unsigned long) stats.hits,
+           (unsigned long) stats.misses);
+    assert(stats.hits < TEST_BLOCKS);
+    printf("Success!\n");
+}
@@ -0,0 +1,85 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+
+#include <unistd.h>
+
+#include "capfs.h"
+#include "capfs_dir.h"
+
+// Renames a file back and forth so that the root log crosses several
+//   checkpoints, then checks the replayed table
+int main(int argc, char *argv[]) {
+    init();
+
+    capfs_dir_t *root;
+    OK(capfs_dir_open_root(&root));
+
+    capfs_file_t *file;
+    OK(capfs_dir_make_file(root, "dir_log_a", S_IFREG | 0640, &file));
+
+    bench_start();
+
+    for (size_t i = 0; i < DIR_CHECKPOINT_INTERVAL; i++) {
+        OK(capfs_dir_rename(root, root, "dir_log_a", "dir_log_b"));
+        OK(capfs_dir_rename(root, root, "dir_log_b", "dir_log_a"));
+    }
+
+    bench_end();
+
+    // Read back from the log rather than the unflushed state
+    OK(capfs_dir_flush(root));
+
+    capfs_dir_entry_t entry;
+    NOTOK(capfs_dir_lookup(root, "dir_log_b", &entry));
+    OK(capfs_dir_lookup(root, "dir_log_a", &entry));
+    assert(!entry.is_dir);
+    assert(entry.mode == (S_IFREG | 0640));
+
+    OK(capfs_dir_remove_file(root, "dir_log_a"));
+
+    // An idle directory is written back by itself once the window passes
+    char record[DIR_CHECKPOINT_SIZE];
+    size_t size = sizeof(record);
+    gdp_recno_t before;
+    gdp_recno_t after;
+    OK(capfs_dir_flush(root));
+    OK(capfs_file_read_record(root->file, -1, record, &size, &before, NULL));
+    OK(capfs_dir_make_file(root, "dir_log_c", 0, &file));
+    sleep(2 * DIR_FLUSH_WINDOW + 1);
+    pthread_rwlock_t *lock = capfs_file_lock(root->file->gob);
+    pthread_rwlock_rdlock(lock);
+    size = sizeof(record);
+    OK(capfs_file_read_record(root->file, -1, record, &size, &after, NULL));
+    pthread_rwlock_unlock(lock);
+    assert(after > before);
+    OK(capfs_dir_remove_file(root, "dir_log_c"));
+    printf("Success!\n");
+}
@@ -0,0 +1,97 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+
+#include <string.h>
+
+#include "capfs_util.h"
+
+#define NUM_HANDLES (3 * FH_CHUNK_SIZE)
+
+static void
+make_gob(size_t i, gdp_name_t gob) {
+    memset(gob, 0, sizeof(gdp_name_t));
+    memcpy(gob, &i, sizeof(size_t));
+}
+
+// Opens more handles than fit in a chunk, finds them by gob, then checks
+//   that freed handles are refused even after their slot is reused
+int main(int argc, char *argv[]) {
+    fh_init();
+
+    static uint64_t handles[NUM_HANDLES];
+    gdp_name_t gob;
+
+    bench_start();
+
+    for (size_t i = 0; i < NUM_HANDLES; i++) {
+        fh_entry_t *fh;
+        make_gob(i, gob);
+        OK(fh_new(gob, &fh));
+        fh_ref(fh);
+        handles[i] = fh->fh;
+    }
+    for (size_t i = 0; i < NUM_HANDLES; i++) {
+        fh_entry_t *fh;
+        make_gob(i, gob);
+        OK(fh_get_by_gob(gob, &fh));
+        assert(fh->fh == handles[i]);
+        OK(fh_get(handles[i], &fh));
+    }
+
+    bench_end();
+
+    // Free every other handle and allocate again, the slots are recycled
+    for (size_t i = 0; i < NUM_HANDLES; i += 2) {
+        fh_entry_t *fh;
+        OK(fh_get(handles[i], &fh));
+        assert(fh_unref(fh) == 0);
+        fh_free(handles[i]);
+        NOTOK(fh_get(handles[i], &fh));
+        make_gob(i, gob);
+        NOTOK(fh_ref_by_gob(gob, &fh));
+    }
+    for (size_t i = 0; i < NUM_HANDLES; i += 2) {
+        fh_entry_t *fh;
+        make_gob(NUM_HANDLES + i, gob);
+        OK(fh_new(gob, &fh));
+        assert(FH_INDEX(fh->fh) < NUM_HANDLES);
+        NOTOK(fh_get(handles[i], &fh));
+    }
+
+    // Live handles are untouched
+    for (size_t i = 1; i < NUM_HANDLES; i += 2) {
+        fh_entry_t *fh;
+        make_gob(i, gob);
+        OK(fh_ref_by_gob(gob, &fh));
+        assert(fh->fh == handles[i]);
+    }
+    printf("Success!\n");
+}
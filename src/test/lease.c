@@ -0,0 +1,244 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "test.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capfs.h"
+#include "capfs_lease.h"
+#include "capfs_rpc.h"
+#include "capfs_server.h"
+#include "capfs_store.h"
+
+#define ADDRESS "unix:/tmp/capfs_test_lease.sock"
+#define DATA "written back on revoke"
+
+static void *
+server_thread(void *arg) {
+    capfs_server_main(ADDRESS);
+    return NULL;
+}
+
+static int
+connect_server(void) {
+    int fd;
+    for (int i = 0; !EP_STAT_ISOK(capfs_rpc_connect(ADDRESS, &fd)); i++) {
+        assert(i < 100);
+        usleep(10000);
+    }
+    return fd;
+}
+
+static void
+send_op(int fd, uint64_t id, Capfs__Op *op) {
+    Capfs__Request request = CAPFS__REQUEST__INIT;
+    request.id = id;
+    request.n_ops = 1;
+    request.ops = &op;
+    OK(capfs_rpc_send(fd, &request.base));
+}
+
+static Capfs__Response *
+recv_response(int fd) {
+    Capfs__Response *response;
+    OK(capfs_rpc_recv(fd, &capfs__response__descriptor,
+                      (ProtobufCMessage **) &response));
+    return response;
+}
+
+// The answer to the op with id, after nothing else
+static Capfs__Result *
+recv_result(int fd, uint64_t id, Capfs__Response **response) {
+    *response = recv_response(fd);
+    assert(!(*response)->has_revoke);
+    assert((*response)->id == id);
+    assert((*response)->n_results == 1);
+    return (*response)->results[0];
+}
+
+// A revoke of gob, before anything else
+static void
+recv_revoke(int fd, const uint8_t *gob) {
+    Capfs__Response *response = recv_response(fd);
+    assert(response->has_revoke);
+    assert(response->n_results == 0);
+    assert(response->revoke.len == sizeof(gdp_name_t));
+    assert(memcmp(response->revoke.data, gob, sizeof(gdp_name_t)) == 0);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+}
+
+// Two mounts on their own connections: the one holding a write lease hears
+//   of the other opening the file, writes back and gives the lease up, and
+//   only then does the other's open return. A change by path revokes the
+//   same way
+int main(int argc, char *argv[]) {
+    OK(capfs_store_select("local", "/tmp/capfs_test_lease"));
+    init();
+    pthread_t thread;
+    pthread_create(&thread, NULL, server_thread, NULL);
+    int fd_a = connect_server();
+    int fd_b = connect_server();
+
+    bench_start();
+
+    char path[64];
+    snprintf(path, sizeof(path), "/lease_%d", getpid());
+
+    // Nobody else has it, so A may keep writes to itself
+    Capfs__Op create = CAPFS__OP__INIT;
+    create.type = CAPFS__OP_TYPE__CREATE;
+    create.path = path;
+    create.has_lease = true;
+    create.lease = LEASE_WRITE;
+    create.has_owner = true;
+    create.owner = 1;
+    send_op(fd_a, 1, &create);
+    Capfs__Response *response;
+    Capfs__Result *result = recv_result(fd_a, 1, &response);
+    assert(result->err == 0);
+    assert(result->has_lease && result->lease == LEASE_WRITE);
+    assert(result->has_gob && result->gob.len == sizeof(gdp_name_t));
+    uint64_t fh_a = result->fh;
+    gdp_name_t gob;
+    memcpy(gob, result->gob.data, sizeof(gdp_name_t));
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    // B opening it waits on A, who is asked for the lease back
+    Capfs__Op open = CAPFS__OP__INIT;
+    open.type = CAPFS__OP_TYPE__OPEN;
+    open.path = path;
+    open.has_flags = true;
+    open.flags = 0;
+    open.has_lease = true;
+    open.lease = LEASE_READ;
+    open.has_owner = true;
+    open.owner = 2;
+    send_op(fd_b, 1, &open);
+    recv_revoke(fd_a, gob);
+
+    // What A kept goes back first, then the file, then the lease
+    Capfs__Op write = CAPFS__OP__INIT;
+    write.type = CAPFS__OP_TYPE__WRITE;
+    write.has_fh = true;
+    write.fh = fh_a;
+    write.has_offset = true;
+    write.has_data = true;
+    write.data.data = (uint8_t *) DATA;
+    write.data.len = strlen(DATA);
+    write.has_owner = true;
+    write.owner = 1;
+    send_op(fd_a, 2, &write);
+    result = recv_result(fd_a, 2, &response);
+    assert(result->err == 0 && result->size == strlen(DATA));
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    Capfs__Op release = CAPFS__OP__INIT;
+    release.type = CAPFS__OP_TYPE__RELEASE;
+    release.path = path;
+    release.has_fh = true;
+    release.fh = fh_a;
+    release.has_owner = true;
+    release.owner = 1;
+    send_op(fd_a, 3, &release);
+    result = recv_result(fd_a, 3, &response);
+    assert(result->err == 0);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    Capfs__Op lease_release = CAPFS__OP__INIT;
+    lease_release.type = CAPFS__OP_TYPE__LEASE_RELEASE;
+    lease_release.has_gob = true;
+    lease_release.gob.data = gob;
+    lease_release.gob.len = sizeof(gdp_name_t);
+    lease_release.has_owner = true;
+    lease_release.owner = 1;
+    send_op(fd_a, 4, &lease_release);
+    result = recv_result(fd_a, 4, &response);
+    assert(result->err == 0);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    // Nobody else has it open, so B may cache it, and sees A's write
+    result = recv_result(fd_b, 1, &response);
+    assert(result->err == 0);
+    assert(result->has_lease && result->lease == LEASE_READ);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    Capfs__Op read_file = CAPFS__OP__INIT;
+    read_file.type = CAPFS__OP_TYPE__READ_FILE;
+    read_file.has_gob = true;
+    read_file.gob.data = gob;
+    read_file.gob.len = sizeof(gdp_name_t);
+    read_file.has_offset = true;
+    read_file.has_size = true;
+    read_file.size = 4096;
+    send_op(fd_b, 2, &read_file);
+    result = recv_result(fd_b, 2, &response);
+    assert(result->err == 0);
+    assert(result->data.len == strlen(DATA));
+    assert(memcmp(result->data.data, DATA, strlen(DATA)) == 0);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    // A truncating it by path takes B's read lease back first
+    Capfs__Op truncate = CAPFS__OP__INIT;
+    truncate.type = CAPFS__OP_TYPE__TRUNCATE;
+    truncate.path = path;
+    truncate.has_size = true;
+    truncate.size = 7;
+    truncate.has_owner = true;
+    truncate.owner = 1;
+    send_op(fd_a, 5, &truncate);
+    recv_revoke(fd_b, gob);
+    lease_release.owner = 2;
+    send_op(fd_b, 3, &lease_release);
+    result = recv_result(fd_b, 3, &response);
+    assert(result->err == 0);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    result = recv_result(fd_a, 5, &response);
+    assert(result->err == 0);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    // Still open on B, so A opening it for writing may cache it but not
+    //   keep writes to itself
+    open.flags = O_RDWR;
+    open.lease = LEASE_WRITE;
+    open.owner = 1;
+    send_op(fd_a, 6, &open);
+    result = recv_result(fd_a, 6, &response);
+    assert(result->err == 0);
+    assert(result->has_lease && result->lease == LEASE_READ);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    bench_end();
+
+    close(fd_a);
+    close(fd_b);
+    printf("Success!\n");
+}
@@ -39,7 +39,7 @@ int main(int argc, char *argv[]) {
     OK(capfs_dir_open_root(&root));
 
     capfs_file_t *file;
-    OK(capfs_dir_make_file(root, "test_file", &file));
+    OK(capfs_dir_make_file(root, "test_file", 0, &file));
 
     printf("Success!\n");
 }
@@ -0,0 +1,69 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+
+#include <string.h>
+
+#include "capfs_util.h"
+
+static void
+check_path(const char *path, const char **expected, size_t num_expected) {
+    const char *cursor = path;
+    path_token_t token;
+    size_t i = 0;
+    while (path_next(&cursor, &token)) {
+        assert(i < num_expected);
+        assert(token.length == strlen(expected[i]));
+        assert(memcmp(token.name, expected[i], token.length) == 0);
+        i++;
+    }
+    assert(i == num_expected);
+}
+
+// Walks paths in place, including ones deeper than the old 32 token limit
+int main(int argc, char *argv[]) {
+    check_path("/", NULL, 0);
+    const char *simple[] = { "a", "bb", "ccc" };
+    check_path("/a/bb/ccc", simple, 3);
+    check_path("//a/bb///ccc/", simple, 3);
+
+    char deep[2 * 64 + 1] = "";
+    const char *deep_expected[64];
+    for (size_t i = 0; i < 64; i++) {
+        strcat(deep, "/d");
+        deep_expected[i] = "d";
+    }
+    check_path(deep, deep_expected, 64);
+
+    assert(strcmp(path_basename("/"), "") == 0);
+    assert(strcmp(path_basename("/a"), "a") == 0);
+    assert(strcmp(path_basename("/a/bb/ccc"), "ccc") == 0);
+    printf("Success!\n");
+}
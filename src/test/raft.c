@@ -0,0 +1,225 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "test.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "capfs.h"
+#include "capfs_rpc.h"
+
+#define REPLICAS 3
+#define STORE "/tmp/capfs_test_raft_store"
+#define STATE "/tmp/capfs_test_raft_state"
+
+static const char *addresses[REPLICAS] = {
+    "unix:/tmp/capfs_test_raft_0.sock",
+    "unix:/tmp/capfs_test_raft_1.sock",
+    "unix:/tmp/capfs_test_raft_2.sock",
+};
+static pid_t pids[REPLICAS];
+
+// Each replica is its own process, they only share the store
+static void
+start_replica(int i) {
+    pids[i] = fork();
+    assert(pids[i] >= 0);
+    if (pids[i] == 0) {
+        char options[1024];
+        snprintf(options, sizeof(options),
+                 "store=local,store_path=%s,replicas=%s+%s+%s,raft_state=%s",
+                 STORE, addresses[0], addresses[1], addresses[2], STATE);
+        char *argv[] = {
+            "capfs_server", "-o", options, (char *) addresses[i], NULL,
+        };
+        exit(run_server(4, argv));
+    }
+}
+
+static void
+kill_replica(int i) {
+    kill(pids[i], SIGKILL);
+    waitpid(pids[i], NULL, 0);
+}
+
+// One op to replica i, NULL if it cannot be reached
+static Capfs__Response *
+call(int i, Capfs__Op *op) {
+    int fd;
+    if (!EP_STAT_ISOK(capfs_rpc_connect(addresses[i], &fd))) {
+        return NULL;
+    }
+    Capfs__Request request = CAPFS__REQUEST__INIT;
+    request.n_ops = 1;
+    request.ops = &op;
+    Capfs__Response *response = NULL;
+    if (!EP_STAT_ISOK(capfs_rpc_send(fd, &request.base))
+        || !EP_STAT_ISOK(capfs_rpc_recv(fd, &capfs__response__descriptor,
+                                        (ProtobufCMessage **) &response))) {
+        response = NULL;
+    }
+    close(fd);
+    return response;
+}
+
+// Runs op on replica i once it agrees to, and returns how it went
+static int
+call_until_served(int i, Capfs__Op *op, Capfs__Response **out) {
+    for (int tries = 0; tries < 500; tries++) {
+        Capfs__Response *response = call(i, op);
+        if (response != NULL && !response->redirect) {
+            assert(response->n_results == 1);
+            int err = response->results[0]->err;
+            if (out != NULL) {
+                *out = response;
+            } else {
+                protobuf_c_message_free_unpacked(&response->base, NULL);
+            }
+            return err;
+        }
+        if (response != NULL) {
+            protobuf_c_message_free_unpacked(&response->base, NULL);
+        }
+        usleep(10000);
+    }
+    assert(false);
+    return -EIO;
+}
+
+// The replica that runs writes, other than dead
+static int
+find_leader(int dead) {
+    Capfs__Op statfs = CAPFS__OP__INIT;
+    statfs.type = CAPFS__OP_TYPE__STATFS;
+    statfs.path = "/";
+    for (int tries = 0; tries < 500; tries++) {
+        for (int i = 0; i < REPLICAS; i++) {
+            if (i == dead) {
+                continue;
+            }
+            Capfs__Response *response = call(i, &statfs);
+            bool leader = response != NULL && !response->redirect;
+            if (response != NULL) {
+                protobuf_c_message_free_unpacked(&response->base, NULL);
+            }
+            if (leader) {
+                return i;
+            }
+        }
+        usleep(10000);
+    }
+    assert(false);
+    return -1;
+}
+
+static mode_t
+mode_on(int i, char *path) {
+    Capfs__Op getattr = CAPFS__OP__INIT;
+    getattr.type = CAPFS__OP_TYPE__GETATTR;
+    getattr.path = path;
+    Capfs__Response *response;
+    assert(call_until_served(i, &getattr, &response) == 0);
+    mode_t mode = response->results[0]->attr->mode;
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return mode;
+}
+
+static int
+mkdir_on(int i, char *path) {
+    Capfs__Op mkdir = CAPFS__OP__INIT;
+    mkdir.type = CAPFS__OP_TYPE__MKDIR;
+    mkdir.path = path;
+    mkdir.has_mode = true;
+    mkdir.mode = 0755;
+    return call_until_served(i, &mkdir, NULL);
+}
+
+int main(int argc, char *argv[]) {
+    mkdir(STORE, 0755);
+    for (int i = 0; i < REPLICAS; i++) {
+        start_replica(i);
+    }
+
+    bench_start();
+
+    int leader = find_leader(-1);
+    char path[64];
+    snprintf(path, sizeof(path), "/raft_%d", getpid());
+    assert(mkdir_on(leader, path) == 0);
+
+    // Followers answer reads, and no longer from their caches once the
+    //   leader said the write is done
+    for (int i = 0; i < REPLICAS; i++) {
+        assert((mode_on(i, path) & 0777) == 0755);
+    }
+    Capfs__Op chmod = CAPFS__OP__INIT;
+    chmod.type = CAPFS__OP_TYPE__CHMOD;
+    chmod.path = path;
+    chmod.has_mode = true;
+    chmod.mode = 0700;
+    assert(call_until_served(leader, &chmod, NULL) == 0);
+    for (int i = 0; i < REPLICAS; i++) {
+        assert((mode_on(i, path) & 0777) == 0700);
+    }
+
+    // Followers send writes on to the leader
+    Capfs__Response *response = call((leader + 1) % REPLICAS, &chmod);
+    assert(response != NULL && response->redirect);
+    assert(response->has_leader && response->leader == (uint32_t) leader);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    // Another leader takes over, with everything written before
+    kill_replica(leader);
+    int dead = leader;
+    leader = find_leader(dead);
+    assert(leader != dead);
+    char second[80];
+    snprintf(second, sizeof(second), "%s/after", path);
+    assert(mkdir_on(leader, second) == 0);
+    assert((mode_on(leader, path) & 0777) == 0700);
+
+    // And the replica that was gone catches up on coming back
+    start_replica(dead);
+    assert(mode_on(dead, second) & S_IFDIR);
+
+    bench_end();
+
+    for (int i = 0; i < REPLICAS; i++) {
+        kill_replica(i);
+    }
+    printf("Success!\n");
+}
@@ -0,0 +1,85 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "test.h"
+
+#include <string.h>
+
+#include "capfs.h"
+#include "capfs_file.h"
+
+#define SIZE (3 * BLOCK_SIZE)
+
+int main(int argc, char *argv[]) {
+    init();
+
+    capfs_file_t *file;
+    OK(capfs_file_create_gob(&file));
+
+    static char buf[SIZE];
+    for (size_t i = 0; i < SIZE; i++) {
+        buf[i] = i % 251;
+    }
+    OK(capfs_file_write(file, buf, SIZE, 0));
+
+    // Unaligned, so the first and last blocks are partial
+    off_t offset = 100;
+    size_t size = SIZE - 200;
+    capfs_block_ref_t refs[FILE_BLOCKS_SPANNED(size, offset)];
+    size_t count;
+
+    bench_start();
+    OK(capfs_file_read_blocks(file, size, offset, refs, &count));
+    bench_end();
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        assert(memcmp(refs[i].data, buf + offset + total, refs[i].size) == 0);
+        total += refs[i].size;
+    }
+    assert(count == 3 && total == size);
+
+    // Second read is served from the same cached blocks
+    capfs_block_ref_t again[FILE_BLOCKS_SPANNED(size, offset)];
+    OK(capfs_file_read_blocks(file, size, offset, again, &count));
+    for (size_t i = 0; i < count; i++) {
+        assert(again[i].block == refs[i].block);
+    }
+    capfs_file_put_blocks(again, count);
+    capfs_file_put_blocks(refs, count);
+
+    // Past the end reads nothing
+    OK(capfs_file_read_blocks(file, BLOCK_SIZE, SIZE, refs, &count));
+    assert(count == 0);
+
+    capfs_file_close(file);
+    capfs_file_free(file);
+    printf("Success!\n");
+}
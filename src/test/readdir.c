@@ -32,21 +32,24 @@
 #include "capfs.h"
 #include "capfs_dir.h"
 
+static bool
+print_entry(void *arg, capfs_dir_entry_t *entry, off_t next) {
+    size_t *length = arg;
+    printf("- %s isdir: %d\n", entry->name, entry->is_dir);
+    (*length)++;
+    return true;
+}
+
 int main(int argc, char *argv[]) {
     init();
 
     capfs_dir_t *root;
     OK(capfs_dir_open_root(&root));
 
-    capfs_dir_table_t table;
-    char names[DIR_ENTRIES][FILE_NAME_MAX_LEN + 1];
-    OK(capfs_dir_readdir(root, &table, names, NULL));
-
-    size_t length = table.length;
-    printf("Length: %lu\n", length);
     printf("ls:\n");
-    for (size_t i = 0; i < length; i++) {
-        printf("- %s isdir: %d\n", names[i], table.entries[i].is_dir);
-    }
+    size_t length = 0;
+    off_t cursor = 0;
+    OK(capfs_dir_readdir(root, &cursor, print_entry, &length));
+    printf("Length: %lu\n", length);
     printf("Success!\n");
 }
@@ -0,0 +1,68 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+
+#include "capfs.h"
+#include "capfs_dir.h"
+#include "capfs_file.h"
+
+// A renamed file keeps the size and mtime hints of its entry, also once the
+//   entry is replayed from the log
+int main(int argc, char *argv[]) {
+    init();
+
+    capfs_dir_t *root;
+    OK(capfs_dir_open_root(&root));
+
+    capfs_file_t *file;
+    OK(capfs_dir_make_file(root, "rename_a", 0, &file));
+    OK(capfs_file_write(file, "hello", 5, 0));
+    OK(capfs_dir_set_attr(root, "rename_a", 5, 1000, 0));
+
+    bench_start();
+
+    OK(capfs_dir_rename(root, root, "rename_a", "rename_b"));
+
+    bench_end();
+
+    // Read back from the log rather than the unflushed state
+    OK(capfs_dir_flush(root));
+
+    capfs_dir_entry_t entry;
+    NOTOK(capfs_dir_lookup(root, "rename_a", &entry));
+    OK(capfs_dir_lookup(root, "rename_b", &entry));
+    assert(entry.size == 5);
+    assert(entry.mtime == 1000);
+
+    OK(capfs_dir_remove_file(root, "rename_b"));
+    capfs_file_close(file);
+    capfs_file_free(file);
+    printf("Success!\n");
+}
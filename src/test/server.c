@@ -0,0 +1,193 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capfs.h"
+#include "capfs_rpc.h"
+#include "capfs_server.h"
+#include "capfs_store.h"
+
+#define ADDRESS "unix:/tmp/capfs_test_server.sock"
+#define DATA "hello over the wire"
+
+static void *
+server_thread(void *arg) {
+    capfs_server_main(ADDRESS);
+    return NULL;
+}
+
+static void
+send_request(int fd, uint64_t id, Capfs__Op **ops, size_t n_ops) {
+    Capfs__Request request = CAPFS__REQUEST__INIT;
+    request.id = id;
+    request.n_ops = n_ops;
+    request.ops = ops;
+    OK(capfs_rpc_send(fd, &request.base));
+}
+
+static Capfs__Response *
+recv_response(int fd) {
+    Capfs__Response *response;
+    OK(capfs_rpc_recv(fd, &capfs__response__descriptor,
+                      (ProtobufCMessage **) &response));
+    return response;
+}
+
+static Capfs__Response *
+call(int fd, Capfs__Op **ops, size_t n_ops) {
+    send_request(fd, 0, ops, n_ops);
+    Capfs__Response *response = recv_response(fd);
+    assert(response->id == 0);
+    assert(response->n_results == n_ops);
+    return response;
+}
+
+// Whole file lifetimes in one request each: the ops after CREATE or OPEN
+//   use the handle it returned
+int main(int argc, char *argv[]) {
+    OK(capfs_store_select("local", "/tmp/capfs_test_store"));
+    init();
+    pthread_t thread;
+    pthread_create(&thread, NULL, server_thread, NULL);
+
+    int fd;
+    for (int i = 0; !EP_STAT_ISOK(capfs_rpc_connect(ADDRESS, &fd)); i++) {
+        assert(i < 100);
+        usleep(10000);
+    }
+
+    bench_start();
+
+    char path[64];
+    snprintf(path, sizeof(path), "/server_%d", getpid());
+
+    Capfs__Op create = CAPFS__OP__INIT;
+    create.type = CAPFS__OP_TYPE__CREATE;
+    create.path = path;
+    Capfs__Op write = CAPFS__OP__INIT;
+    write.type = CAPFS__OP_TYPE__WRITE;
+    write.path = path;
+    write.has_offset = true;
+    write.has_data = true;
+    write.data.data = (uint8_t *) DATA;
+    write.data.len = strlen(DATA);
+    Capfs__Op release = CAPFS__OP__INIT;
+    release.type = CAPFS__OP_TYPE__RELEASE;
+    release.path = path;
+    Capfs__Op *writes[] = { &create, &write, &release };
+    Capfs__Response *response = call(fd, writes, 3);
+    assert(response->results[0]->err == 0);
+    assert(response->results[1]->err == 0);
+    assert(response->results[1]->size == strlen(DATA));
+    assert(response->results[2]->err == 0);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    Capfs__Op open = CAPFS__OP__INIT;
+    open.type = CAPFS__OP_TYPE__OPEN;
+    open.path = path;
+    Capfs__Op read = CAPFS__OP__INIT;
+    read.type = CAPFS__OP_TYPE__READ;
+    read.path = path;
+    read.has_offset = true;
+    read.has_size = true;
+    read.size = 4096;
+    Capfs__Op getattr = CAPFS__OP__INIT;
+    getattr.type = CAPFS__OP_TYPE__GETATTR;
+    getattr.path = path;
+    Capfs__Op *reads[] = { &open, &read, &release, &getattr };
+    response = call(fd, reads, 4);
+    assert(response->results[1]->err == 0);
+    assert(response->results[1]->data.len == strlen(DATA));
+    assert(memcmp(response->results[1]->data.data, DATA, strlen(DATA)) == 0);
+    assert(response->results[3]->attr->size == strlen(DATA));
+    assert(response->results[0]->has_gob);
+    assert(response->results[0]->gob.len == sizeof(gdp_name_t));
+    gdp_name_t gob;
+    memcpy(gob, response->results[0]->gob.data, sizeof(gdp_name_t));
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    // The same bytes by capsule, with no handle open at all
+    Capfs__Op read_file = CAPFS__OP__INIT;
+    read_file.type = CAPFS__OP_TYPE__READ_FILE;
+    read_file.has_gob = true;
+    read_file.gob.data = gob;
+    read_file.gob.len = sizeof(gdp_name_t);
+    read_file.has_offset = true;
+    read_file.offset = 6;
+    read_file.has_size = true;
+    read_file.size = 4096;
+    Capfs__Op *read_files[] = { &read_file };
+    response = call(fd, read_files, 1);
+    assert(response->results[0]->err == 0);
+    assert(response->results[0]->data.len == strlen(DATA) - 6);
+    assert(memcmp(response->results[0]->data.data, DATA + 6,
+                  strlen(DATA) - 6) == 0);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    // Nothing to read from when the open failed
+    open.path = "/server_missing";
+    response = call(fd, reads, 2);
+    assert(response->results[0]->err == -ENOENT);
+    assert(response->results[1]->err == -ENOENT);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    // Many requests outstanding at once, each answered once under its id
+    enum { PIPELINED = 2 * RPC_MAX_IN_FLIGHT };
+    read_file.offset = 0;
+    for (uint64_t id = 1; id <= PIPELINED; id++) {
+        send_request(fd, id, id % 2 ? read_files : &reads[3], 1);
+    }
+    bool answered[PIPELINED + 1] = { false };
+    for (int i = 0; i < PIPELINED; i++) {
+        response = recv_response(fd);
+        assert(response->id >= 1 && response->id <= PIPELINED);
+        assert(!answered[response->id]);
+        answered[response->id] = true;
+        assert(response->results[0]->err == 0);
+        if (response->id % 2) {
+            assert(response->results[0]->data.len == strlen(DATA));
+        } else {
+            assert(response->results[0]->attr->size == strlen(DATA));
+        }
+        protobuf_c_message_free_unpacked(&response->base, NULL);
+    }
+
+    bench_end();
+
+    close(fd);
+    printf("Success!\n");
+}
@@ -0,0 +1,68 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+
+#include <sys/stat.h>
+
+#include "capfs.h"
+#include "capfs_file.h"
+
+int main(int argc, char *argv[]) {
+    init();
+
+    capfs_file_t *file;
+    OK(capfs_file_create_gob(&file));
+    OK(capfs_file_write(file, "hello", 5, 0));
+
+    bench_start();
+
+    struct timespec mtime = { .tv_sec = 1000000000, .tv_nsec = 42 };
+    OK(capfs_file_set_attr(file, S_IFREG | 0640, &mtime));
+
+    bench_end();
+
+    // A fresh handle sees what the inode kept, and the data is untouched
+    capfs_file_t *other = capfs_file_new(file->gob);
+    size_t length;
+    OK(capfs_file_get_length(other, &length));
+    if (length != 5 || other->mode != (S_IFREG | 0640)
+        || other->mtime.tv_sec != mtime.tv_sec
+        || other->mtime.tv_nsec != mtime.tv_nsec
+        || other->ctime.tv_sec <= mtime.tv_sec) {
+        printf("Attributes not kept\n");
+        return 1;
+    }
+
+    capfs_file_close(other);
+    capfs_file_free(other);
+    capfs_file_close(file);
+    capfs_file_free(file);
+    printf("Success!\n");
+}
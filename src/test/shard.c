@@ -0,0 +1,359 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "capfs.h"
+#include "capfs_rpc.h"
+
+#define SHARDS 4
+#define THREADS 8
+#define FILES 200
+#define STORE "/tmp/capfs_test_shard_store"
+#define STATE "/tmp/capfs_test_shard_state"
+
+static const char *addresses[SHARDS] = {
+    "unix:/tmp/capfs_test_shard_0.sock",
+    "unix:/tmp/capfs_test_shard_1.sock",
+    "unix:/tmp/capfs_test_shard_2.sock",
+    "unix:/tmp/capfs_test_shard_3.sock",
+};
+static pid_t pids[SHARDS];
+static int n_shards;
+
+// Each shard is its own process, they only share the store
+static void
+start_shards(int n) {
+    char list[512] = "";
+    for (int i = 0; i < n; i++) {
+        if (i > 0) {
+            strcat(list, "+");
+        }
+        strcat(list, addresses[i]);
+    }
+    n_shards = n;
+    for (int i = 0; i < n; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            char options[1024];
+            snprintf(options, sizeof(options),
+                     "store=local,store_path=%s,shards=%s,shard_state=%s",
+                     STORE, list, STATE);
+            char *argv[] = {
+                "capfs_server", "-o", options, (char *) addresses[i], NULL,
+            };
+            exit(run_server(4, argv));
+        }
+    }
+}
+
+// Directory changes are written back on the way down
+static void
+stop_shards(void) {
+    for (int i = 0; i < n_shards; i++) {
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+    }
+}
+
+static int
+connect_to(int i) {
+    int fd = -1;
+    for (int tries = 0; tries < 500; tries++) {
+        if (EP_STAT_ISOK(capfs_rpc_connect(addresses[i], &fd))) {
+            return fd;
+        }
+        usleep(10000);
+    }
+    assert(false);
+    return -1;
+}
+
+static Capfs__Response *
+send_ops(int fd, Capfs__Op **ops, size_t n_ops) {
+    Capfs__Request request = CAPFS__REQUEST__INIT;
+    request.n_ops = n_ops;
+    request.ops = ops;
+    Capfs__Response *response;
+    OK(capfs_rpc_send(fd, &request.base));
+    OK(capfs_rpc_recv(fd, &capfs__response__descriptor,
+                      (ProtobufCMessage **) &response));
+    return response;
+}
+
+// One op to shard i
+static Capfs__Response *
+call(int i, Capfs__Op *op) {
+    int fd = connect_to(i);
+    Capfs__Response *response = send_ops(fd, &op, 1);
+    close(fd);
+    return response;
+}
+
+// One op to the shard that owns its path, the way a client sends it
+static int
+call_routed(Capfs__Op *op, Capfs__Response **out) {
+    Capfs__Response *response = call(capfs_rpc_shard(&op, 1, n_shards), op);
+    assert(!response->redirect && response->n_results == 1);
+    int err = response->results[0]->err;
+    if (out != NULL) {
+        *out = response;
+    } else {
+        protobuf_c_message_free_unpacked(&response->base, NULL);
+    }
+    return err;
+}
+
+static int
+mkdir_at(char *path) {
+    Capfs__Op op = CAPFS__OP__INIT;
+    op.type = CAPFS__OP_TYPE__MKDIR;
+    op.path = path;
+    op.has_mode = true;
+    op.mode = 0755;
+    return call_routed(&op, NULL);
+}
+
+static int
+create_at(char *path) {
+    Capfs__Op op = CAPFS__OP__INIT;
+    op.type = CAPFS__OP_TYPE__CREATE;
+    op.path = path;
+    op.has_mode = true;
+    op.mode = 0644;
+    return call_routed(&op, NULL);
+}
+
+static int
+rename_at(char *from, char *to) {
+    Capfs__Op op = CAPFS__OP__INIT;
+    op.type = CAPFS__OP_TYPE__RENAME;
+    op.path = from;
+    op.to = to;
+    return call_routed(&op, NULL);
+}
+
+// The mode, or -errno
+static int
+mode_at(char *path) {
+    Capfs__Op op = CAPFS__OP__INIT;
+    op.type = CAPFS__OP_TYPE__GETATTR;
+    op.path = path;
+    Capfs__Response *response;
+    int err = call_routed(&op, &response);
+    int mode = err == 0 ? (int) response->results[0]->attr->mode : err;
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return mode;
+}
+
+static bool
+lists(char *path, const char *name) {
+    Capfs__Op opendir = CAPFS__OP__INIT;
+    opendir.type = CAPFS__OP_TYPE__OPENDIR;
+    opendir.path = path;
+    Capfs__Op readdir = CAPFS__OP__INIT;
+    readdir.type = CAPFS__OP_TYPE__READDIR;
+    readdir.path = path;
+    Capfs__Op releasedir = CAPFS__OP__INIT;
+    releasedir.type = CAPFS__OP_TYPE__RELEASEDIR;
+    releasedir.path = path;
+    Capfs__Op *ops[] = { &opendir, &readdir, &releasedir };
+    int fd = connect_to(capfs_rpc_shard(ops, 3, n_shards));
+    Capfs__Response *response = send_ops(fd, ops, 3);
+    close(fd);
+    assert(!response->redirect && response->results[1]->err == 0);
+    bool found = false;
+    for (size_t i = 0; i < response->results[1]->n_entries; i++) {
+        found |= strcmp(response->results[1]->entries[i]->name, name) == 0;
+    }
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+    return found;
+}
+
+typedef struct bench_arg {
+    char dir[64];
+    int fds[SHARDS];
+} bench_arg_t;
+
+// Creates and unlinks files in a directory of its own, over connections
+//   of its own
+static void *
+bench_thread(void *arg) {
+    bench_arg_t *bench = arg;
+    char path[128];
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "%s/f%d", bench->dir, i);
+        Capfs__Op create = CAPFS__OP__INIT;
+        create.type = CAPFS__OP_TYPE__CREATE;
+        create.path = path;
+        create.has_mode = true;
+        create.mode = 0644;
+        Capfs__Op release = CAPFS__OP__INIT;
+        release.type = CAPFS__OP_TYPE__RELEASE;
+        release.path = path;
+        Capfs__Op *ops[] = { &create, &release };
+        int fd = bench->fds[capfs_rpc_shard(ops, 2, n_shards)];
+        Capfs__Response *response = send_ops(fd, ops, 2);
+        assert(!response->redirect && response->results[0]->err == 0);
+        protobuf_c_message_free_unpacked(&response->base, NULL);
+
+        Capfs__Op unlink = CAPFS__OP__INIT;
+        unlink.type = CAPFS__OP_TYPE__UNLINK;
+        unlink.path = path;
+        Capfs__Op *unlink_ops[] = { &unlink };
+        response = send_ops(fd, unlink_ops, 1);
+        assert(!response->redirect && response->results[0]->err == 0);
+        protobuf_c_message_free_unpacked(&response->base, NULL);
+    }
+    return NULL;
+}
+
+// Metadata ops a second with n shards, from THREADS clients at once
+static double
+bench(int n) {
+    start_shards(n);
+    bench_arg_t args[THREADS];
+    for (int t = 0; t < THREADS; t++) {
+        snprintf(args[t].dir, sizeof(args[t].dir), "/bench_%d_%d_%d", n,
+                 getpid(), t);
+        assert(mkdir_at(args[t].dir) == 0);
+        for (int i = 0; i < n; i++) {
+            args[t].fds[i] = connect_to(i);
+        }
+    }
+
+    struct timeval begin, end;
+    gettimeofday(&begin, NULL);
+    pthread_t threads[THREADS];
+    for (int t = 0; t < THREADS; t++) {
+        pthread_create(&threads[t], NULL, bench_thread, &args[t]);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    gettimeofday(&end, NULL);
+
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < n; i++) {
+            close(args[t].fds[i]);
+        }
+    }
+    stop_shards();
+    double seconds = (end.tv_sec - begin.tv_sec)
+                     + (end.tv_usec - begin.tv_usec) / 1e6;
+    return 2.0 * THREADS * FILES / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    mkdir(STORE, 0755);
+    start_shards(SHARDS);
+
+    bench_start();
+
+    // Directories whose entries two different shards write
+    char base[64];
+    snprintf(base, sizeof(base), "/shard_%d", getpid());
+    assert(mkdir_at(base) == 0);
+    char a[80], b[80];
+    snprintf(a, sizeof(a), "%s/a", base);
+    assert(mkdir_at(a) == 0);
+    for (int i = 0;; i++) {
+        snprintf(b, sizeof(b), "%s/b%d", base, i);
+        if (capfs_rpc_shard_path(b, true, SHARDS)
+            != capfs_rpc_shard_path(a, true, SHARDS)) {
+            break;
+        }
+    }
+    assert(mkdir_at(b) == 0);
+
+    // Only the owner runs ops in a directory, the others say who does
+    char from[128], to[128];
+    snprintf(from, sizeof(from), "%s/file", a);
+    assert(create_at(from) == 0);
+    Capfs__Op getattr = CAPFS__OP__INIT;
+    getattr.type = CAPFS__OP_TYPE__GETATTR;
+    getattr.path = from;
+    int owner = capfs_rpc_shard_path(a, true, SHARDS);
+    Capfs__Response *response = call((owner + 1) % SHARDS, &getattr);
+    assert(response->redirect && response->has_leader);
+    assert(response->leader == (uint32_t) owner);
+    protobuf_c_message_free_unpacked(&response->base, NULL);
+
+    // A file renamed across shards is in one place only
+    snprintf(to, sizeof(to), "%s/moved", b);
+    assert(rename_at(from, to) == 0);
+    assert(S_ISREG(mode_at(to)));
+    assert(mode_at(from) == -ENOENT);
+    assert(lists(b, "moved") && !lists(a, "file"));
+
+    // Onto a name that is taken it does nothing
+    snprintf(from, sizeof(from), "%s/other", a);
+    assert(create_at(from) == 0);
+    assert(rename_at(from, to) == -EEXIST);
+    assert(S_ISREG(mode_at(from)));
+
+    // A directory takes what is in it along, and the shard that owns it
+    //   from now on finds it
+    char sub[128], inner[160];
+    snprintf(sub, sizeof(sub), "%s/sub", a);
+    assert(mkdir_at(sub) == 0);
+    snprintf(inner, sizeof(inner), "%s/inner", sub);
+    assert(mkdir_at(inner) == 0);
+    assert(S_ISDIR(mode_at(inner)));
+    snprintf(to, sizeof(to), "%s/sub", b);
+    assert(rename_at(sub, to) == 0);
+    assert(mode_at(inner) == -ENOENT);
+    snprintf(inner, sizeof(inner), "%s/inner", to);
+    assert(S_ISDIR(mode_at(inner)));
+    assert(lists(to, "inner"));
+    snprintf(sub, sizeof(sub), "%s/file", inner);
+    assert(create_at(sub) == 0);
+
+    bench_end();
+    stop_shards();
+
+    // Spread over more shards, more of them run at once
+    double one = bench(1);
+    double all = bench(SHARDS);
+    printf("1 shard: %.0f ops/s, %d shards: %.0f ops/s\n", one, SHARDS, all);
+    printf("Success!\n");
+}
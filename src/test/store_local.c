@@ -0,0 +1,78 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+
+#include <string.h>
+
+#include "capfs.h"
+#include "capfs_file.h"
+#include "capfs_store.h"
+
+#define TOTAL (3 * BLOCK_SIZE + 100)
+
+// Runs without GDP: the logs are segment files under /tmp
+int main(int argc, char *argv[]) {
+    OK(capfs_store_select("local", "/tmp/capfs_test_store"));
+    init();
+
+    capfs_file_t *file;
+    OK(capfs_file_create_gob(&file));
+    gdp_name_t gob;
+    memcpy(gob, file->gob, sizeof(gdp_name_t));
+
+    static char buf[TOTAL];
+    for (size_t i = 0; i < TOTAL; i++) {
+        buf[i] = i % 251;
+    }
+
+    bench_start();
+
+    OK(capfs_file_write(file, buf, TOTAL, 5));
+
+    bench_end();
+
+    // Closed and opened again, the segment's index is rebuilt from the file
+    OK(capfs_file_close(file));
+    capfs_file_free(file);
+    OK(capfs_file_open_gob(gob, &file));
+
+    size_t length;
+    OK(capfs_file_get_length(file, &length));
+    static char out[TOTAL];
+    OK(capfs_file_read(file, out, TOTAL, 5));
+    if (length != TOTAL + 5 || memcmp(buf, out, TOTAL) != 0) {
+        printf("Mismatch after reopening\n");
+        return 1;
+    }
+
+    capfs_file_close(file);
+    capfs_file_free(file);
+    printf("Success!\n");
+}
@@ -0,0 +1,80 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "test.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "capfs.h"
+#include "capfs_file.h"
+#include "capfs_store.h"
+
+// 20ms round trips, no jitter, 8Mbit/s (1KB per ms), no stalls, no extra
+//   cost for creating a log
+#define PROFILE "20:0:8:0:0:0"
+#define RTT_MS 20
+
+static long
+now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// A local store behind a pretend WAN: calls cost at least their round trip
+//   and their payload's time on the link
+int main(int argc, char *argv[]) {
+    OK(capfs_store_select("local", "/tmp/capfs_test_store"));
+    capfs_store_shape(PROFILE, 1);
+    init();
+
+    capfs_file_t *file;
+    OK(capfs_file_create_gob(&file));
+
+    static char buf[BLOCK_SIZE];
+    memset(buf, 'x', BLOCK_SIZE);
+    long then = now_ms();
+    OK(capfs_file_write(file, buf, BLOCK_SIZE, 0));
+    // BLOCK_SIZE bytes at 1KB per ms on top of the round trip
+    long expect = RTT_MS + BLOCK_SIZE / 1000;
+    long took = now_ms() - then;
+    if (took < expect) {
+        printf("Write took %ldms, expected at least %ldms\n", took, expect);
+        return 1;
+    }
+
+    // Nothing shaped about a bad profile
+    NOTOK(capfs_store_shaped_wrap(&capfs_store_local, "wan", 1));
+
+    capfs_file_close(file);
+    capfs_file_free(file);
+    printf("Success!\n");
+}
@@ -0,0 +1,70 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+
+#include "capfs.h"
+#include "capfs_file.h"
+
+int main(int argc, char *argv[]) {
+    init();
+
+    capfs_file_usage_t before;
+    capfs_file_usage(&before);
+
+    capfs_file_t *file;
+    OK(capfs_file_create_gob(&file));
+    OK(capfs_file_write(file, "hello", 5, BLOCK_SIZE));
+    OK(capfs_file_truncate(file, 3));
+
+    bench_start();
+
+    capfs_file_usage_t after;
+    capfs_file_usage(&after);
+
+    bench_end();
+
+    printf("%lu files, %lu bytes, %lu pooled\n", after.files, after.bytes,
+           after.pool);
+    if (after.files != before.files + 1 || after.bytes != before.bytes + 3) {
+        printf("Usage not counted\n");
+        return 1;
+    }
+
+    capfs_file_close(file);
+    capfs_file_free(file);
+
+    // Unmounting removes the logs created ahead of time
+    capfs_file_pool_drain();
+    if (capfs_file_pool_count() != 0) {
+        printf("Pool not drained\n");
+        return 1;
+    }
+    printf("Success!\n");
+}
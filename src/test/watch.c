@@ -0,0 +1,110 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "test.h"
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "capfs.h"
+#include "capfs_file.h"
+#include "capfs_store.h"
+
+static gdp_recno_t notified = -1;
+
+static void
+notify(const gdp_name_t gob, gdp_recno_t recno, void *arg) {
+    (void) gob;
+    (void) arg;
+    __atomic_store_n(&notified, recno, __ATOMIC_RELEASE);
+}
+
+// Waits up to a second for a notification, returns the recno or -1
+static gdp_recno_t
+wait_notified(void) {
+    for (int i = 0; i < 100; i++) {
+        gdp_recno_t recno = __atomic_load_n(&notified, __ATOMIC_ACQUIRE);
+        if (recno >= 0) {
+            return recno;
+        }
+        usleep(10 * 1000);
+    }
+    return -1;
+}
+
+// Another process appending to a watched log is noticed, our own appends are
+//   not
+int main(int argc, char *argv[]) {
+    OK(capfs_store_select("local", "/tmp/capfs_test_watch"));
+    init();
+
+    capfs_file_t *file;
+    OK(capfs_file_create_gob(&file));
+    gdp_name_t gob;
+    memcpy(gob, file->gob, sizeof(gdp_name_t));
+    char buf[100];
+    memset(buf, 'a', sizeof(buf));
+    OK(capfs_file_write(file, buf, sizeof(buf), 0));
+
+    OK(capfs_log_watch(gob, notify, NULL));
+    OK(capfs_file_write(file, buf, sizeof(buf), 100));
+    if (wait_notified() != -1) {
+        printf("Notified of our own append\n");
+        return 1;
+    }
+
+    // The child shares the segment file, not the index of records
+    pid_t pid = fork();
+    if (pid == 0) {
+        memset(buf, 'b', sizeof(buf));
+        _exit(EP_STAT_ISOK(capfs_file_write(file, buf, sizeof(buf), 200))
+              ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    bench_start();
+    gdp_recno_t recno = wait_notified();
+    bench_end();
+    size_t length;
+    OK(capfs_file_get_length(file, &length));
+    if (recno != (gdp_recno_t) file->recno || length != 300) {
+        printf("Missed the append: recno %ld of %u, length %zu\n",
+               (long) recno, file->recno, length);
+        return 1;
+    }
+
+    OK(capfs_log_unwatch(gob));
+    capfs_file_close(file);
+    capfs_file_free(file);
+    printf("Success!\n");
+}
@@ -0,0 +1,86 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  CapFS: (GDP Data)Capsule File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2019, Regents of the University of California.
+**  Copyright (c) 2019, Sean Luchen, Jie Chen, and SangBin Cho
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+
+#include "test.h"
+
+#include <string.h>
+
+#include "capfs.h"
+#include "capfs_file.h"
+
+#define CHUNK 4096
+#define TOTAL (10 * BLOCK_SIZE + 1000)
+
+int main(int argc, char *argv[]) {
+    init();
+
+    capfs_file_t *file;
+    OK(capfs_file_create_gob(&file));
+
+    static char buf[TOTAL];
+    for (size_t i = 0; i < TOTAL; i++) {
+        buf[i] = i % 251;
+    }
+
+    bench_start();
+
+    // Small sequential writes, as the kernel sends without big_writes
+    for (size_t off = 0; off < TOTAL; off += CHUNK) {
+        size_t size = off + CHUNK > TOTAL ? TOTAL - off : CHUNK;
+        OK(capfs_file_write_buffered(file, buf + off, size, off));
+    }
+    size_t length;
+    OK(capfs_file_get_length(file, &length));
+    printf("%ld\n", length);
+    OK(capfs_file_flush(file));
+
+    bench_end();
+
+    static char out[TOTAL];
+    OK(capfs_file_read(file, out, TOTAL, 0));
+    if (memcmp(buf, out, TOTAL) != 0) {
+        printf("Mismatch after flush\n");
+        return 1;
+    }
+
+    // Writing past the end leaves a hole of zeros
+    OK(capfs_file_write_buffered(file, buf, CHUNK, TOTAL + BLOCK_SIZE));
+    OK(capfs_file_read(file, out, BLOCK_SIZE, TOTAL));
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        if (out[i] != 0) {
+            printf("Hole is not zero at %ld\n", i);
+            return 1;
+        }
+    }
+
+    capfs_file_close(file);
+    capfs_file_free(file);
+    printf("Success!\n");
+}